@@ -199,10 +199,11 @@ void setup()
   theSys.Start();
 
 	// Setp WD and reset the application if no reponds
+	// A batch committed to the journal but not applied is replayed by Recover() at boot
 	ApplicationWatchdog wd(RTE_WATCHDOG_TIMEOUT, System.reset, 256);
 }
 
-// Notes: approximate RTE_DELAY_SELFCHECK ms per loop
+// Notes: runs as soon as there is work, at least every RTE_DELAY_SELFCHECK ms
 /// If you need more accurate and faster timer, do it with sysTimer
 void loop()
 {
@@ -210,12 +211,12 @@ void loop()
   static UC tick = 0;
 
   // Process commands
-  IF_MAINLOOP_TIMER( theSys.ProcessCommands(), "ProcessCommands" );
+  IF_MAINLOOP_TIMER( theSys.ProcessCommands(), PERF_STG_COMMANDS );
 
   // Collect data
 	if( millis() - lastTick >= 1000 ) {
 		lastTick = millis();
-  	IF_MAINLOOP_TIMER( theSys.CollectData(tick++), "CollectData" );
+  	IF_MAINLOOP_TIMER( theSys.CollectData(tick++), PERF_STG_COLLECT );
 
 		// Check Max Base RF network enable duration
 		theSys.CheckRFBaseNetEnableDur();
@@ -227,24 +228,27 @@ void loop()
 		theSys.connectWiFi(false);
 	}*/
 	// Act on new Rules in Rules chain
-	IF_MAINLOOP_TIMER( theSys.ReadNewRules(), "ReadNewRules" );
+	IF_MAINLOOP_TIMER( theSys.ReadNewRules(), PERF_STG_RULES );
 
   // ToDo: transfer data
 
   // ToDo: status synchronize
 
 	// Process Panel input
-  IF_MAINLOOP_TIMER( theSys.ProcessPanel(), "ProcessPanel" );
+  IF_MAINLOOP_TIMER( theSys.ProcessPanel(), PERF_STG_PANEL );
 
-  // Self-test & alarm trigger, also insert delay between each loop
-  IF_MAINLOOP_TIMER( theSys.SelfCheck(RTE_DELAY_SELFCHECK), "SelfCheck" );
+  // Self-test & alarm trigger
+  IF_MAINLOOP_TIMER( theSys.SelfCheck(RTE_DELAY_SELFCHECK), PERF_STG_SELFCHECK );
 	//if( !theConfig.GetDisableWiFi() ) {
 		// Process Could Messages
 	  //if( Particle.connected() == true ) {
-	    IF_MAINLOOP_TIMER( Particle.process(), "ProcessCloud" );
+	    IF_MAINLOOP_TIMER( Particle.process(), PERF_STG_CLOUD );
 	  //}
 	//}
 	//wd.checkin();
+
+	// Wait for the next event, alarm or self-check, then start over at once
+	theSys.WaitForEvent(RTE_DELAY_SELFCHECK);
 }
 
 #endif
@@ -0,0 +1,15 @@
+#!/bin/sh
+# This compiles the photon project via cloud through command line
+# Linux/macOS counterpart of compile.bat
+# Usage: ./compile.sh [platform] [firmware target]
+PLATFORM=${1:-p1}
+TARGET=${2:-0.6.0}
+
+cd "$(dirname "$0")"
+rm -rf ./compile
+mkdir ./compile
+find . -path ./compile -prune -o \( -name '*.h' -o -name '*.cpp' -o -name '*.ino' \) -type f -exec cp "{}" ./compile/ \;
+particle compile "$PLATFORM" ./compile --target "$TARGET" --saveTo xsc.bin
+RC=$?
+rm -rf ./compile
+exit $RC
@@ -50,11 +50,11 @@
 #define MEM_MAC_LIST_OFFSET       (MEM_SCENARIOS_OFFSET + MEM_SCENARIOS_LEN)
 #define MEM_MAC_LIST_LEN          0x010000
 
-// Offline Data Cache
+// Offline Data Cache: sensor history ring, see SensorLogClass
 #define MEM_OFFLINE_DATA_OFFSET   (MEM_MAC_LIST_OFFSET + MEM_MAC_LIST_LEN)
 #define MEM_OFFLINE_DATA_LEN      0x020000
 
-// Statistics
+// Statistics & log
 #define MEM_REPORT_OFFSET         (MEM_OFFLINE_DATA_OFFSET + MEM_OFFLINE_DATA_LEN)
 #define MEM_REPORT_LEN            0x010000
 
@@ -75,6 +75,14 @@
 #define MEM_NODELIST_BACKUP_OFFSET  (MEM_CONFIG_BACKUP_OFFSET + MEM_CONFIG_BACKUP_LEN)
 #define MEM_NODELIST_BACKUP_LEN     0x0300
 
+// Write-back journal: header + staged extent image
+#define MEM_JOURNAL_OFFSET        (MEM_NODELIST_BACKUP_OFFSET + MEM_NODELIST_BACKUP_LEN)
+#define MEM_JOURNAL_LEN           0x0800
+
+// Lamp group membership
+#define MEM_GROUPS_OFFSET         (MEM_JOURNAL_OFFSET + MEM_JOURNAL_LEN)
+#define MEM_GROUPS_LEN            0x0200
+
 //-------------------------------
 
 #endif /* xliMemoryMap_h */
@@ -62,6 +62,7 @@
 // Analog GPIO pins (12-bit A0 - A7), can also be used as digital GPIOs
 #define PIN_RF24_CE		   		      A0
 #define PIN_RF24_CS		   	 	      A2
+//#define PIN_RF24_IRQ              A1          // RF24 IRQ (active low), optional: flags RX without polling the radio over SPI
 //#define PIN_SEN_MIC               A6          // Sensor: ECT MIC, DAC
 //#define PIN_SEN_LIGHT             A7          // Sensor: ALS, may also be PWM
 
@@ -135,6 +135,12 @@ bool ASRInterfaceClass::processCommand()
   return rc;
 }
 
+// Whether processCommand() has anything to do
+bool ASRInterfaceClass::isPending()
+{
+  return( m_sndCmd > 0 || ASRPort.available() > 0 );
+}
+
 bool ASRInterfaceClass::sendCommand(UC _cmd, bool now)
 {
   if( now ) {
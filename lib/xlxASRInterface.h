@@ -19,6 +19,7 @@ public:
 
   void Init(US _speed = SERIALPORT_SPEED_LOW);
   bool processCommand();
+  bool isPending();
   bool sendCommand(UC _cmd, bool now = false);
   UC getLastReceivedCmd();
   UC getLastSentCmd();
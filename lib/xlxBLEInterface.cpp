@@ -450,7 +450,7 @@ BOOL BLEInterfaceClass::exectueCommand(char *inputString)
           }else {
             // serial set command
             strCmd = String::format("set %s", payload);
-            theConsole.ExecuteCloudCommand(strCmd.c_str());
+            theSys.QueueCommand(CMD_SRC_BLE, CMD_REC_CONSOLE, strCmd.c_str(), strCmd.length());
 
             strCmd = String::format("%d;0;3;2;6;1:%s\n", NODEID_SMARTPHONE, payload);
             sendCommand(strCmd);
@@ -462,7 +462,7 @@ BOOL BLEInterfaceClass::exectueCommand(char *inputString)
           sendCommand(strCmd);
 
           strCmd = String::format("sys %s", payload);
-          theConsole.ExecuteCloudCommand(strCmd.c_str());
+          theSys.QueueCommand(CMD_SRC_BLE, CMD_REC_CONSOLE, strCmd.c_str(), strCmd.length());
         }
       }
       break;
@@ -30,17 +30,36 @@
 // Chain Class, inherited from Arduino LinkedList base class
 // Keep all member functions inside of this header file
 //------------------------------------------------------------------
-template <typename T>
-class ChainClass : public LinkedList<T>
+// Storage policy is chosen by Pool: ListHeapPool (default, one heap node per row)
+// or ListStaticPool<T, N> (N rows in a contiguous slab, no heap use).
+// Optional direct index: set Keyed and pass a key function (e.g. node_id of the row)
+// to the constructor, then search_key() is O(1) on an indexable pool. The index maps
+// key to pool slot; adding or removing a row only updates the slot of its key.
+#define CHAIN_KEY_INDEX_SIZE		256
+
+template <typename T, class Pool = ListHeapPool<T>, bool Keyed = false>
+class ChainClass : public LinkedList<T, Pool>
 {
+public:
+	typedef UC (*KeyFunc_t)(const T &);
+
 private:
 	UC max_chain_length;
+	KeyFunc_t m_keyOf;
+	bool m_bIndexed;
+	UC m_keyIndex[Keyed ? CHAIN_KEY_INDEX_SIZE : 1];		// key -> pool slot, LIST_SLOT_NONE if absent
+
+	void indexKey(UC key);
+	void indexAdded(ListNode<T> *pNode);
+	void indexRemoved(UC key, UC slot);
 
 public:
-	ChainClass(UC max);
+	ChainClass(UC max, KeyFunc_t keyOf = NULL);
+	virtual ~ChainClass();
 
 	//child functions
 	ListNode<T>* search(uint8_t uid);	//returns node pointer, given the uid
+	ListNode<T>* search_key(uint8_t key);	//returns node pointer, given the key of index
 	int search_uid(uint8_t uid);		//returns index, given the uid
 	bool delete_one_outdated_row();		//deletes the single most outdated row from the chain passed in, returns false if no such row exists
 	bool isFull();						//checks if the max chain length has been reached (return true), and if a row can be deleted (return false)
@@ -53,25 +72,97 @@ public:
 	virtual bool add(int index, T);
 	virtual bool add(T);
 	virtual bool unshift(T);
+
+	//overload all removing functions to keep the index in sync
+	virtual bool set(int index, T);
+	virtual T remove(int index);
+	virtual T pop();
+	virtual T shift();
+	virtual void clear();
 };
 
 //------------------------------------------------------------------
 // Constructors
 //------------------------------------------------------------------
-template<typename T>
-ChainClass<T>::ChainClass(UC max)
- : LinkedList<T>()
+template<typename T, class Pool, bool Keyed>
+ChainClass<T, Pool, Keyed>::ChainClass(UC max, KeyFunc_t keyOf)
+ : LinkedList<T, Pool>()
 {
 	max_chain_length = max;
+	m_keyOf = keyOf;
+	m_bIndexed = (Keyed && m_keyOf && Pool::Indexable);
+	memset(m_keyIndex, LIST_SLOT_NONE, sizeof(m_keyIndex));
+}
+
+template<typename T, class Pool, bool Keyed>
+ChainClass<T, Pool, Keyed>::~ChainClass()
+{
+}
+
+//------------------------------------------------------------------
+// Key Index
+//------------------------------------------------------------------
+// Point the key at its first row, the same as linear search
+template<typename T, class Pool, bool Keyed>
+void ChainClass<T, Pool, Keyed>::indexKey(UC key)
+{
+	m_keyIndex[key] = LIST_SLOT_NONE;
+	ListNode<T> *tmp = LinkedList<T, Pool>::root;
+	while (tmp != NULL)
+	{
+		if( m_keyOf(tmp->data) == key ) {
+			m_keyIndex[key] = LinkedList<T, Pool>::_pool.slotOf(tmp);
+			return;
+		}
+		tmp = tmp->next;
+	}
+}
+
+// A row was linked in: only a row before the indexed one of its key moves the key
+template<typename T, class Pool, bool Keyed>
+void ChainClass<T, Pool, Keyed>::indexAdded(ListNode<T> *pNode)
+{
+	if( !m_bIndexed || !pNode ) return;
+
+	UC key = m_keyOf(pNode->data);
+	if( m_keyIndex[key] == LIST_SLOT_NONE ) m_keyIndex[key] = LinkedList<T, Pool>::_pool.slotOf(pNode);
+	else if( pNode != LinkedList<T, Pool>::last ) indexKey(key);
+}
+
+// A row was unlinked: its key moves on to the next row of that key, if any
+template<typename T, class Pool, bool Keyed>
+void ChainClass<T, Pool, Keyed>::indexRemoved(UC key, UC slot)
+{
+	if( m_bIndexed && m_keyIndex[key] == slot ) indexKey(key);
+}
+
+template<typename T, class Pool, bool Keyed>
+ListNode<T>* ChainClass<T, Pool, Keyed>::search_key(uint8_t key)
+{
+	if( m_bIndexed ) {
+		UC slot = m_keyIndex[key];
+		return(slot == LIST_SLOT_NONE ? NULL : LinkedList<T, Pool>::_pool.nodeAt(slot));
+	}
+
+	// No index, fall back to linear search
+	ListNode<T> *tmp = LinkedList<T, Pool>::root;
+	while (tmp != NULL && m_keyOf)
+	{
+		if (m_keyOf(tmp->data) == key) {
+			return tmp;
+		}
+		tmp = tmp->next;
+	}
+	return NULL;
 }
 
 //------------------------------------------------------------------
 // Child Functions
 //------------------------------------------------------------------
-template<typename T>
-ListNode<T>* ChainClass<T>::search(uint8_t uid)
+template<typename T, class Pool, bool Keyed>
+ListNode<T>* ChainClass<T, Pool, Keyed>::search(uint8_t uid)
 {
-	ListNode<T> *tmp = LinkedList<T>::root;
+	ListNode<T> *tmp = LinkedList<T, Pool>::root;
 	while (tmp != NULL)
 	{
 		if (tmp->data.uid == uid) {
@@ -82,11 +173,11 @@ ListNode<T>* ChainClass<T>::search(uint8_t uid)
 	return NULL;
 }
 
-template<typename T>
-int ChainClass<T>::search_uid(uint8_t uid)
+template<typename T, class Pool, bool Keyed>
+int ChainClass<T, Pool, Keyed>::search_uid(uint8_t uid)
 {
 	int index = 0;
-	ListNode<T> *tmp = LinkedList<T>::root;
+	ListNode<T> *tmp = LinkedList<T, Pool>::root;
 	while (tmp != NULL)
 	{
 		if (tmp->data.uid == uid)
@@ -99,16 +190,16 @@ int ChainClass<T>::search_uid(uint8_t uid)
 	return -1;
 }
 
-template<typename T>
-bool ChainClass<T>::delete_one_outdated_row()
+template<typename T, class Pool, bool Keyed>
+bool ChainClass<T, Pool, Keyed>::delete_one_outdated_row()
 {
 	int index = 0;
-	ListNode<T> *tmp = LinkedList<T>::root;
+	ListNode<T> *tmp = LinkedList<T, Pool>::root;
 	while (tmp != NULL)
 	{
 		if (tmp->data.flash_flag == SAVED && tmp->data.run_flag == EXECUTED)
 		{
-			LinkedList<T>::remove(index);
+			remove(index);
 			return true;
 		}
 		index++;
@@ -117,53 +208,116 @@ bool ChainClass<T>::delete_one_outdated_row()
 	return false;
 }
 
-template<typename T>
-bool ChainClass<T>::isFull()
+template<typename T, class Pool, bool Keyed>
+bool ChainClass<T, Pool, Keyed>::isFull()
 {
-	return (max_chain_length > 0 && LinkedList<T>::size() >= max_chain_length);
+	return (max_chain_length > 0 && LinkedList<T, Pool>::size() >= max_chain_length);
 }
 
-template<typename T>
-bool ChainClass<T>::add(int index, T _t)
+template<typename T, class Pool, bool Keyed>
+bool ChainClass<T, Pool, Keyed>::add(int index, T _t)
 {
 	if (isFull())
 		return false;
 
-	return LinkedList<T>::add(index, _t);
+	if( !LinkedList<T, Pool>::add(index, _t) ) return false;
+	indexAdded(LinkedList<T, Pool>::getNode(index < LinkedList<T, Pool>::size() ? index : LinkedList<T, Pool>::size() - 1));
+	return true;
 }
 
 //------------------------------------------------------------------
 // Accessor Functions
 //------------------------------------------------------------------
-template<typename T>
-ListNode<T>* ChainClass<T>::getRoot()
+template<typename T, class Pool, bool Keyed>
+ListNode<T>* ChainClass<T, Pool, Keyed>::getRoot()
 {
-	return LinkedList<T>::root;
+	return LinkedList<T, Pool>::root;
 }
 
-template<typename T>
-ListNode<T>* ChainClass<T>::getLast()
+template<typename T, class Pool, bool Keyed>
+ListNode<T>* ChainClass<T, Pool, Keyed>::getLast()
 {
-	return LinkedList<T>::last;
+	return LinkedList<T, Pool>::last;
 }
 
 //------------------------------------------------------------------
 // Overloaded Functions
 //------------------------------------------------------------------
-template<typename T>
-bool ChainClass<T>::add(T _t)
+template<typename T, class Pool, bool Keyed>
+bool ChainClass<T, Pool, Keyed>::add(T _t)
 {
 	if (isFull())
 		return false;
 
-	return LinkedList<T>::add(_t);
+	if( !LinkedList<T, Pool>::add(_t) ) return false;
+	indexAdded(LinkedList<T, Pool>::last);
+	return true;
 }
 
-template<typename T>
-bool ChainClass<T>::unshift(T _t)
+template<typename T, class Pool, bool Keyed>
+bool ChainClass<T, Pool, Keyed>::unshift(T _t)
 {
 	if (isFull())
 		return false;
 
-	return LinkedList<T>::unshift(_t);
+	if( !LinkedList<T, Pool>::unshift(_t) ) return false;
+	indexAdded(LinkedList<T, Pool>::root);
+	return true;
+}
+
+template<typename T, class Pool, bool Keyed>
+bool ChainClass<T, Pool, Keyed>::set(int index, T _t)
+{
+	ListNode<T> *pNode = LinkedList<T, Pool>::getNode(index);
+	if( !pNode ) return false;
+	UC oldKey = (m_bIndexed ? m_keyOf(pNode->data) : 0);
+	if( !LinkedList<T, Pool>::set(index, _t) ) return false;
+	if( m_bIndexed && m_keyOf(_t) != oldKey ) {
+		indexRemoved(oldKey, LinkedList<T, Pool>::_pool.slotOf(pNode));
+		indexAdded(pNode);
+	}
+	return true;
+}
+
+// The base class removes through virtual shift()/pop(), so a row may be
+// reported twice: indexRemoved() is a no-op the second time
+template<typename T, class Pool, bool Keyed>
+T ChainClass<T, Pool, Keyed>::remove(int index)
+{
+	ListNode<T> *pNode = LinkedList<T, Pool>::getNode(index);
+	if( !pNode ) return T();
+	UC slot = LinkedList<T, Pool>::_pool.slotOf(pNode);
+	T ret = LinkedList<T, Pool>::remove(index);
+	if( m_bIndexed ) indexRemoved(m_keyOf(ret), slot);
+	return ret;
+}
+
+template<typename T, class Pool, bool Keyed>
+T ChainClass<T, Pool, Keyed>::pop()
+{
+	ListNode<T> *pNode = LinkedList<T, Pool>::last;
+	if( !pNode ) return T();
+	UC slot = LinkedList<T, Pool>::_pool.slotOf(pNode);
+	T ret = LinkedList<T, Pool>::pop();
+	if( m_bIndexed ) indexRemoved(m_keyOf(ret), slot);
+	return ret;
+}
+
+template<typename T, class Pool, bool Keyed>
+T ChainClass<T, Pool, Keyed>::shift()
+{
+	ListNode<T> *pNode = LinkedList<T, Pool>::root;
+	if( !pNode ) return T();
+	UC slot = LinkedList<T, Pool>::_pool.slotOf(pNode);
+	T ret = LinkedList<T, Pool>::shift();
+	if( m_bIndexed ) indexRemoved(m_keyOf(ret), slot);
+	return ret;
+}
+
+template<typename T, class Pool, bool Keyed>
+void ChainClass<T, Pool, Keyed>::clear()
+{
+	// Emptied first, so the shift() of every row finds nothing to update
+	memset(m_keyIndex, LIST_SLOT_NONE, sizeof(m_keyIndex));
+	LinkedList<T, Pool>::clear();
 }
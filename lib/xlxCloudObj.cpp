@@ -30,59 +30,601 @@
 #include "xlxBLEInterface.h"
 
 //------------------------------------------------------------------
-// Xlight Cloud Object Class
+// Xlight Sensor Publish Aggregator Class
 //------------------------------------------------------------------
-CloudObjClass::CloudObjClass()
+typedef struct
 {
-  m_SysID = "";
-  m_SysVersion = "";
-  m_nAppVersion = VERSION_CONFIG_DATA;
-  m_SysStatus = STATUS_OFF;
+  const char *tag;                  // Key in the event
+  UC decimals;
+  float deadband;                   // 0: any change is published
+  BOOL priority;
+} SensorPubField_t;
+
+static const SensorPubField_t s_spFields[SPF_NUM] = {
+  {"DHTt", 2, 0.2,  false},
+  {"DHTh", 2, 1.0,  false},
+  {"ALS",  0, 2,    false},
+  {"PIR",  0, 0,    true},
+  {"IRK",  0, 0,    true},
+  {"GAS",  0, 10,   false},
+  {"PM25", 0, 2,    false},
+  {"PM10", 0, 2,    false},
+  {"TVOC", 2, 0.05, false},
+  {"CH2O", 2, 0.01, false},
+  {"CO2",  0, 10,   false},
+  {"SMK",  0, 10,   true},
+  {"MIC",  0, 0,    false},
+  {"NOS",  0, 2,    false}
+};
+
+// "{'ms':[" ... "]}"
+#define SP_MULTI_HEAD           7
+#define SP_MULTI_TAIL           2
+
+SensorAggregatorClass::SensorAggregatorClass()
+{
+  m_window = RTE_SENSOR_PUB_WINDOW;
+  Clear();
+}
+
+void SensorAggregatorClass::Clear()
+{
+  memset(m_slots, 0x00, sizeof(m_slots));
+  m_tickWindow = 0;
+  m_nDirty = 0;
+  m_nPriority = 0;
+  m_nUpdates = 0;
+  m_nSuppressed = 0;
+  m_nEvents = 0;
+  m_nFields = 0;
+  m_nOverflow = 0;
+}
+
+// Record the latest value, return false if there is no slot for it
+BOOL SensorAggregatorClass::Add(UC _nid, UC _field, float _value, UL _now)
+{
+  if( _field >= SPF_NUM ) return false;
+  m_nUpdates++;
+
+  SensorPubSlot_t *lv_slot = GetSlot(_nid, _field);
+  if( !lv_slot ) {
+    m_nOverflow++;
+    return false;
+  }
+
+  BOOL lv_moved;
+  float lv_deadband = s_spFields[_field].deadband;
+  lv_slot->value = _value;
+  if( !lv_slot->sent ) {
+    lv_moved = true;
+  } else if( lv_deadband > 0 ) {
+    // Drifting back within deadband cancels a pending publish
+    lv_moved = (fabs(_value - lv_slot->lastSent) >= lv_deadband);
+  } else {
+    // Once changed, a transition is published even if the value returns
+    lv_moved = (_value != lv_slot->lastSent || lv_slot->state == SPS_DIRTY);
+  }
+  if( !lv_moved ) m_nSuppressed++;
+  SetDirty(lv_slot, lv_moved, _now);
+  return true;
+}
+
+// Whether _value replaces a different pending value of a priority field
+BOOL SensorAggregatorClass::IsPriorityChange(UC _nid, UC _field, float _value)
+{
+  if( _field >= SPF_NUM || !s_spFields[_field].priority ) return false;
+  for( UC i = 0; i < SENSOR_PUB_SLOTS; i++ ) {
+    SensorPubSlot_t *lv_slot = &m_slots[i];
+    if( lv_slot->state != SPS_DIRTY || lv_slot->node_id != _nid || lv_slot->field != _field ) continue;
+    return( lv_slot->value != _value );
+  }
+  return false;
+}
+
+BOOL SensorAggregatorClass::IsDue(UL _now)
+{
+  return( m_nDirty > 0 && _now - m_tickWindow >= m_window );
+}
+
+// Pack pending fields into one event, node by node while they fit.
+/// Return the length of the event, 0 if nothing to publish
+US SensorAggregatorClass::Pack(char *_buf, US _size, BOOL _priorityOnly)
+{
+  if( _size <= SP_MULTI_HEAD + SP_MULTI_TAIL ) return 0;
+
+  // Node objects are written behind room for the multi-node head
+  US lv_len = SP_MULTI_HEAD;
+  US lv_first = 0;
+  UC lv_nodes = 0;
+  for( UC i = 0; i < SENSOR_PUB_SLOTS; i++ ) {
+    if( m_slots[i].state != SPS_DIRTY ) continue;
+    if( _priorityOnly && !s_spFields[m_slots[i].field].priority ) continue;
+    US lv_sep = (lv_nodes > 0 ? 1 : 0);
+    US lv_obj = PackNode(_buf + lv_len + lv_sep, _size - lv_len - lv_sep - SP_MULTI_TAIL, m_slots[i].node_id, _priorityOnly);
+    if( lv_obj == 0 ) continue;
+    if( lv_sep ) _buf[lv_len] = ',';
+    if( lv_nodes++ == 0 ) lv_first = lv_obj;
+    lv_len += lv_sep + lv_obj;
+  }
+
+  if( lv_nodes == 0 ) {
+    _buf[0] = '\0';
+    return 0;
+  } else if( lv_nodes == 1 ) {
+    // Single node: plain object
+    memmove(_buf, _buf + SP_MULTI_HEAD, lv_first);
+    _buf[lv_first] = '\0';
+    return lv_first;
+  }
+  memcpy(_buf, "{'ms':[", SP_MULTI_HEAD);
+  memcpy(_buf + lv_len, "]}", SP_MULTI_TAIL);
+  lv_len += SP_MULTI_TAIL;
+  _buf[lv_len] = '\0';
+  return lv_len;
+}
+
+// Pending fields of one node as an object, marked PACKED.
+/// Return 0 if the object doesn't fit _size (incl. terminator)
+US SensorAggregatorClass::PackNode(char *_buf, US _size, UC _nid, BOOL _priorityOnly)
+{
+  int lv_len = snprintf(_buf, _size, "{'nd':%d", _nid);
+  if( lv_len < 0 || lv_len >= _size ) return 0;
+  for( UC i = 0; i < SENSOR_PUB_SLOTS; i++ ) {
+    SensorPubSlot_t *lv_slot = &m_slots[i];
+    if( lv_slot->state != SPS_DIRTY || lv_slot->node_id != _nid ) continue;
+    if( _priorityOnly && !s_spFields[lv_slot->field].priority ) continue;
+    US lv_fld = FormatField(_buf + lv_len, _size - lv_len, lv_slot->field, lv_slot->value);
+    if( lv_fld == 0 ) return 0;
+    lv_len += lv_fld;
+  }
+  if( lv_len + 2 > _size ) return 0;
+  _buf[lv_len++] = '}';
+  _buf[lv_len] = '\0';
+
+  // The object fits, take its fields
+  for( UC i = 0; i < SENSOR_PUB_SLOTS; i++ ) {
+    SensorPubSlot_t *lv_slot = &m_slots[i];
+    if( lv_slot->state != SPS_DIRTY || lv_slot->node_id != _nid ) continue;
+    if( _priorityOnly && !s_spFields[lv_slot->field].priority ) continue;
+    lv_slot->state = SPS_PACKED;
+  }
+  return lv_len;
+}
+
+// Publish result of the last packed event
+void SensorAggregatorClass::Complete(BOOL _ok)
+{
+  for( UC i = 0; i < SENSOR_PUB_SLOTS; i++ ) {
+    SensorPubSlot_t *lv_slot = &m_slots[i];
+    if( lv_slot->state != SPS_PACKED ) continue;
+    lv_slot->state = SPS_DIRTY;
+    if( _ok ) {
+      lv_slot->lastSent = lv_slot->value;
+      lv_slot->sent = 1;
+      SetDirty(lv_slot, false, 0);
+      m_nFields++;
+    }
+  }
+  if( _ok ) m_nEvents++;
+}
+
+// Format ",'tag':value", return 0 if it doesn't fit _size (incl. terminator)
+US SensorAggregatorClass::FormatField(char *_buf, US _size, UC _field, float _value)
+{
+  int lv_len = snprintf(_buf, _size, ",'%s':%.*f", s_spFields[_field].tag, s_spFields[_field].decimals, _value);
+  return( lv_len < 0 || lv_len >= _size ? 0 : lv_len );
+}
+
+void SensorAggregatorClass::showStatistics()
+{
+  SERIAL_LN("sensorPub = \t\t\twindow %lums, pending %d, updates %lu, suppressed %lu, events %lu, fields %lu, overflow %lu",
+      m_window, m_nDirty, m_nUpdates, m_nSuppressed, m_nEvents, m_nFields, m_nOverflow);
+}
+
+SensorPubSlot_t *SensorAggregatorClass::GetSlot(UC _nid, UC _field)
+{
+  SensorPubSlot_t *lv_free = NULL;
+  SensorPubSlot_t *lv_clean = NULL;
+  for( UC i = 0; i < SENSOR_PUB_SLOTS; i++ ) {
+    SensorPubSlot_t *lv_slot = &m_slots[i];
+    if( lv_slot->state == SPS_FREE ) {
+      if( !lv_free ) lv_free = lv_slot;
+    } else if( lv_slot->node_id == _nid && lv_slot->field == _field ) {
+      return lv_slot;
+    } else if( lv_slot->state == SPS_CLEAN && !lv_clean ) {
+      lv_clean = lv_slot;
+    }
+  }
+
+  // Reuse a published slot of another sensor if none is free
+  if( !lv_free ) lv_free = lv_clean;
+  if( lv_free ) {
+    lv_free->node_id = _nid;
+    lv_free->field = _field;
+    lv_free->state = SPS_CLEAN;
+    lv_free->sent = 0;
+  }
+  return lv_free;
+}
+
+void SensorAggregatorClass::SetDirty(SensorPubSlot_t *_slot, BOOL _dirty, UL _now)
+{
+  if( _dirty == (_slot->state == SPS_DIRTY) ) return;
+  BOOL lv_priority = s_spFields[_slot->field].priority;
+  if( _dirty ) {
+    // First pending update opens the window
+    if( m_nDirty++ == 0 ) m_tickWindow = _now;
+    if( lv_priority ) m_nPriority++;
+    _slot->state = SPS_DIRTY;
+  } else {
+    m_nDirty--;
+    if( lv_priority ) m_nPriority--;
+    _slot->state = SPS_CLEAN;
+  }
+}
+
+//------------------------------------------------------------------
+// Xlight Sensor State Table Class
+//------------------------------------------------------------------
+SensorStateClass::SensorStateClass()
+{
+  Clear();
+}
+
+void SensorStateClass::Clear()
+{
+  memset(m_row, SNS_NO_ROW, sizeof(m_row));
+  m_nRows = 0;
+  m_nOverflow = 0;
+  // All cells on the free list
+  for( UC i = 0; i < SENSOR_STATE_CELLS; i++ ) m_next[i] = i + 1;
+  m_next[SENSOR_STATE_CELLS - 1] = SNS_NO_CELL;
+  m_freeCell = 0;
+  m_nFreeCells = SENSOR_STATE_CELLS;
+}
+
+// Record the latest value of a node, return true if it changed or is the first one
+BOOL SensorStateClass::Update(UC _nid, UC _field, float _value, UL _now)
+{
+  if( _field >= SPF_NUM ) return false;
+
+  UC lv_row = m_row[_nid];
+  if( lv_row == SNS_NO_ROW ) {
+    if( m_nRows >= SENSOR_STATE_ROWS || m_freeCell == SNS_NO_CELL ) {
+      m_nOverflow++;
+      return false;
+    }
+    lv_row = m_nRows++;
+    m_row[_nid] = lv_row;
+    m_node[lv_row] = _nid;
+    memset(m_cell[lv_row], SNS_NO_CELL, SPF_NUM);
+  }
+
+  UC lv_cell = m_cell[lv_row][_field];
+  if( lv_cell == SNS_NO_CELL ) {
+    if( m_freeCell == SNS_NO_CELL ) {
+      m_nOverflow++;
+      return false;
+    }
+    lv_cell = m_freeCell;
+    m_freeCell = m_next[lv_cell];
+    m_nFreeCells--;
+    m_cell[lv_row][_field] = lv_cell;
+    m_value[lv_cell] = _value;
+    m_tick[lv_cell] = _now;
+    return true;
+  }
+
+  BOOL lv_changed = (m_value[lv_cell] != _value);
+  m_value[lv_cell] = _value;
+  m_tick[lv_cell] = _now;
+  return lv_changed;
+}
 
-  m_temperature.node_id = 0;
-  m_temperature.data = 0.0;
+BOOL SensorStateClass::Get(UC _nid, UC _field, float *_value, UL *_tick)
+{
+  if( _field >= SPF_NUM ) return false;
+  UC lv_row = m_row[_nid];
+  if( lv_row == SNS_NO_ROW ) return false;
+  UC lv_cell = m_cell[lv_row][_field];
+  if( lv_cell == SNS_NO_CELL ) return false;
+  if( _value ) *_value = m_value[lv_cell];
+  if( _tick ) *_tick = m_tick[lv_cell];
+  return true;
+}
+
+// Most recent value of the field from any node
+BOOL SensorStateClass::GetLatest(UC _field, float *_value, UC *_nid)
+{
+  if( _field >= SPF_NUM ) return false;
+  UC lv_best = SNS_NO_CELL;
+  UC lv_bestRow = SNS_NO_ROW;
+  for( UC lv_row = 0; lv_row < m_nRows; lv_row++ ) {
+    UC lv_cell = m_cell[lv_row][_field];
+    if( lv_cell == SNS_NO_CELL ) continue;
+    if( lv_best == SNS_NO_CELL || (long)(m_tick[lv_cell] - m_tick[lv_best]) > 0 ) {
+      lv_best = lv_cell;
+      lv_bestRow = lv_row;
+    }
+  }
+  if( lv_best == SNS_NO_CELL ) return false;
+  if( _value ) *_value = m_value[lv_best];
+  if( _nid ) *_nid = m_node[lv_bestRow];
+  return true;
+}
 
-  m_humidity.node_id = 0;
-  m_humidity.data = 0.0;
+// Forget a node: its cells go back to the free list, the last row moves
+// into its place to keep rows dense
+void SensorStateClass::Remove(UC _nid)
+{
+  UC lv_row = m_row[_nid];
+  if( lv_row == SNS_NO_ROW ) return;
+
+  for( UC lv_field = 0; lv_field < SPF_NUM; lv_field++ ) {
+    UC lv_cell = m_cell[lv_row][lv_field];
+    if( lv_cell == SNS_NO_CELL ) continue;
+    m_next[lv_cell] = m_freeCell;
+    m_freeCell = lv_cell;
+    m_nFreeCells++;
+  }
 
-  m_brightness.node_id = 0;
-  m_brightness.data = 0;
+  UC lv_last = --m_nRows;
+  if( lv_row != lv_last ) {
+    UC lv_nid = m_node[lv_last];
+    m_node[lv_row] = lv_nid;
+    memcpy(m_cell[lv_row], m_cell[lv_last], SPF_NUM);
+    m_row[lv_nid] = lv_row;
+  }
+  m_row[_nid] = SNS_NO_ROW;
+}
+
+void SensorStateClass::showStatus()
+{
+  UL lv_now = millis();
+  SERIAL_LN("Sensor nodes: %d of %d, cells: %d of %d, overflow %lu", m_nRows, SENSOR_STATE_ROWS,
+      SENSOR_STATE_CELLS - m_nFreeCells, SENSOR_STATE_CELLS, m_nOverflow);
+  for( UC lv_row = 0; lv_row < m_nRows; lv_row++ ) {
+    SERIAL("  Node %3d:", m_node[lv_row]);
+    for( UC lv_field = 0; lv_field < SPF_NUM; lv_field++ ) {
+      UC lv_cell = m_cell[lv_row][lv_field];
+      if( lv_cell == SNS_NO_CELL ) continue;
+      SERIAL(" %s:%.*f(%lus)", s_spFields[lv_field].tag, s_spFields[lv_field].decimals,
+          m_value[lv_cell], (lv_now - m_tick[lv_cell]) / 1000);
+    }
+    SERIAL_LN("");
+  }
+}
+
+// Field of a rule sensor (sensors_t), SPF_NUM if the sensor has no value
+UC SensorStateClass::FieldOfSensor(UC _sr)
+{
+  switch( _sr ) {
+    case sensorDHT:     return SPF_DHT_T;
+    case sensorDHT_h:   return SPF_DHT_H;
+    case sensorALS:     return SPF_ALS;
+    case sensorMIC:     return SPF_NOS;
+    case sensorMIC_b:   return SPF_MIC;
+    case sensorPIR:     return SPF_PIR;
+    case sensorSMOKE:   return SPF_SMK;
+    case sensorGAS:     return SPF_GAS;
+    case sensorDUST:
+    case sensorPM25:    return SPF_PM25;
+    case sensorPM10:    return SPF_PM10;
+    case sensorTVOC:    return SPF_TVOC;
+    case sensorCH2O:    return SPF_CH2O;
+    case sensorCO2:     return SPF_CO2;
+    case sensorIRKey:   return SPF_IRK;
+  }
+  return SPF_NUM;
+}
+
+//------------------------------------------------------------------
+// Xlight Sensor History Class
+//------------------------------------------------------------------
+static UC PutVarint(UC *_buf, UL _value)
+{
+  UC lv_len = 0;
+  while( _value >= 0x80 ) {
+    _buf[lv_len++] = (UC)(_value | 0x80);
+    _value >>= 7;
+  }
+  _buf[lv_len++] = (UC)_value;
+  return lv_len;
+}
 
-  m_motion.node_id = 0;
-  m_motion.data = false;
+// Return bytes taken, 0 if the varint runs beyond _len
+static UC GetVarint(const UC *_buf, UC _len, UL *_value)
+{
+  *_value = 0;
+  for( UC i = 0; i < _len && i < 5; i++ ) {
+    *_value |= (UL)(_buf[i] & 0x7F) << (7 * i);
+    if( !(_buf[i] & 0x80) ) return i + 1;
+  }
+  return 0;
+}
 
-  m_irKey.node_id = 0;
-  m_irKey.data = false;
+SensorLogClass::SensorLogClass()
+{
+  memset(&m_batchEnd, 0x00, sizeof(m_batchEnd));
+  m_nPacked = 0;
+  m_nEvents = 0;
+  m_nSamples = 0;
+  m_nUndated = 0;
+  m_bootSeq = 0;
+}
 
-  m_sound.node_id = 0;
-  m_sound.data = false;
+BOOL SensorLogClass::Init(Flashee::FlashDevice *_device, UL _addr, UL _len)
+{
+  m_nPacked = 0;
+  m_nEvents = 0;
+  m_nSamples = 0;
+  m_nUndated = 0;
+  if( !m_ring.Init(_device, _addr, _len) ) return false;
+  // Uptime of an earlier boot doesn't go on in this one
+  if( m_ring.GetHeadTag() & SNSLOG_UPTIME ) m_ring.Seal();
+  m_bootSeq = m_ring.GetNextSeq();
+  return true;
+}
 
-  m_gas.node_id = 0;
-  m_gas.data = 0;
+// UTC once the clock is set, seconds since boot with SNSLOG_UPTIME before
+UL SensorLogClass::GetStamp()
+{
+  if( Time.isValid() ) return Time.now();
+  return( SNSLOG_UPTIME | (millis() / 1000) );
+}
 
+BOOL SensorLogClass::Append(UC _nid, UC _field, float _value, UL _stamp)
+{
+  if( !m_ring.IsReady() || _field >= SPF_NUM ) return false;
+
+  // A page starts with the time of its first sample, the others are stored as offset.
+  /// Uptime and UTC samples don't share a page
+  UL lv_base = m_ring.GetHeadTag();
+  if( !m_ring.Fits(SNSLOG_MAX_RECORD) || _stamp < lv_base || ((_stamp ^ lv_base) & SNSLOG_UPTIME) ) {
+    m_ring.Seal();
+    lv_base = _stamp;
+  }
+  UC lv_rec[SNSLOG_MAX_RECORD];
+  UC lv_len = EncodeRecord(lv_rec, _nid, _field, _value, _stamp - lv_base);
+  return m_ring.Append(lv_rec, lv_len, lv_base);
+}
 
-  m_smoke.node_id = 0;
-  m_smoke.data = 0;
+UC SensorLogClass::EncodeRecord(UC *_buf, UC _nid, UC _field, float _value, UL _delta)
+{
+  float lv_scaled = _value;
+  for( UC i = 0; i < s_spFields[_field].decimals; i++ ) lv_scaled *= 10;
+  lv_scaled = constrain(lv_scaled, -2.0e9, 2.0e9);
+  int32_t lv_int = (int32_t)lround(lv_scaled);
+
+  UC lv_len = 0;
+  _buf[lv_len++] = _nid;
+  _buf[lv_len++] = _field;
+  lv_len += PutVarint(_buf + lv_len, _delta);
+  lv_len += PutVarint(_buf + lv_len, ((uint32_t)lv_int << 1) ^ (uint32_t)(lv_int >> 31));
+  return lv_len;
+}
 
-  m_noise.node_id = 0;
-  m_noise.data = 0;
+BOOL SensorLogClass::DecodeRecord(const UC *_buf, UC _len, UC *_nid, UC *_field, float *_value, UL *_delta)
+{
+  if( _len < 4 || _buf[1] >= SPF_NUM ) return false;
+  *_nid = _buf[0];
+  *_field = _buf[1];
+  UC lv_pos = 2;
+  UC lv_n = GetVarint(_buf + lv_pos, _len - lv_pos, _delta);
+  if( !lv_n ) return false;
+  lv_pos += lv_n;
+  UL lv_zigzag;
+  if( !GetVarint(_buf + lv_pos, _len - lv_pos, &lv_zigzag) ) return false;
+  *_value = (float)((int32_t)(lv_zigzag >> 1) ^ -(int32_t)(lv_zigzag & 1));
+  for( UC i = 0; i < s_spFields[*_field].decimals; i++ ) *_value /= 10;
+  return true;
+}
 
-  m_pm25.node_id = 0;
-  m_pm25.data = 0;
+// Pack the oldest samples without sequence gap into one event.
+/// Return the length of the event, 0 if nothing to publish
+US SensorLogClass::PackBatch(char *_buf, US _size)
+{
+  m_nPacked = 0;
+  if( !m_ring.IsPending() ) return 0;
+
+  FlashRingPos_t lv_pos = m_ring.GetReadPos();
+  FlashRingPos_t lv_next = lv_pos;
+  UC lv_rec[SNSLOG_MAX_RECORD];
+  UC lv_recLen;
+  uint32_t lv_base;
+  UL lv_first = 0;
+  US lv_len = 0;
+  char lv_item[48];
+  // UTC of boot, 0 until the clock is set
+  UL lv_bootUtc = (Time.isValid() ? Time.now() - millis() / 1000 : 0);
+  while( m_ring.Read(lv_next, lv_rec, sizeof(lv_rec), &lv_recLen, &lv_base) ) {
+    UC lv_nid, lv_field;
+    float lv_value;
+    UL lv_delta;
+    UL lv_seq = lv_next.seq - 1;
+    BOOL lv_ok = DecodeRecord(lv_rec, lv_recLen, &lv_nid, &lv_field, &lv_value, &lv_delta);
+    UL lv_utc = lv_base + lv_delta;
+    if( lv_ok && (lv_base & SNSLOG_UPTIME) ) {
+      if( lv_seq >= m_bootSeq ) {
+        // Dated once the clock is set, until then the batch ends here
+        if( !lv_bootUtc ) break;
+        lv_utc = lv_bootUtc + ((lv_base & ~SNSLOG_UPTIME) + lv_delta);
+      } else {
+        lv_ok = false;
+        if( !m_nPacked ) m_nUndated++;
+      }
+    }
+    if( !lv_ok ) {
+      // Drop what can't be decoded or dated, it also ends the batch
+      if( m_nPacked ) break;
+      lv_pos = lv_next;
+      continue;
+    }
+    if( m_nPacked && lv_seq != lv_first + m_nPacked ) break;
+
+    int lv_n = snprintf(lv_item, sizeof(lv_item), "%s[%lu,%d,'%s',%.*f]", (m_nPacked ? "," : ""),
+        lv_utc, lv_nid, s_spFields[lv_field].tag, s_spFields[lv_field].decimals, lv_value);
+    if( lv_n < 0 || lv_n >= (int)sizeof(lv_item) ) break;
+    if( !m_nPacked ) {
+      lv_first = lv_seq;
+      lv_len = snprintf(_buf, _size, "{'sq':%lu,'bf':[", lv_first);
+    }
+    // Room for "]}" and terminator
+    if( lv_len + lv_n + 3 > _size || m_nPacked == 0xFF ) break;
+    memcpy(_buf + lv_len, lv_item, lv_n);
+    lv_len += lv_n;
+    m_nPacked++;
+    lv_pos = lv_next;
+  }
 
-  m_pm10.node_id = 0;
-  m_pm10.data = 0;
+  m_batchEnd = lv_pos;
+  if( !m_nPacked ) {
+    m_ring.Consume(lv_pos);
+    _buf[0] = '\0';
+    return 0;
+  }
+  memcpy(_buf + lv_len, "]}", 2);
+  lv_len += 2;
+  _buf[lv_len] = '\0';
+  return lv_len;
+}
 
-  m_tvoc.node_id = 0;
-  m_tvoc.data = 0;
+// Publish result of the last packed event, samples are released on success
+void SensorLogClass::Complete(BOOL _ok)
+{
+  if( m_nPacked && _ok ) {
+    m_ring.Consume(m_batchEnd);
+    m_nEvents++;
+    m_nSamples += m_nPacked;
+  }
+  m_nPacked = 0;
+}
 
-  m_ch2o.node_id = 0;
-  m_ch2o.data = 0;
+void SensorLogClass::showStatus()
+{
+  if( !m_ring.IsReady() ) {
+    SERIAL_LN("Sensor history: not available");
+    return;
+  }
+  SERIAL_LN("Sensor history: next sq %lu, pending %lu, appended %lu, lost %lu, errors %lu, events %lu, samples %lu, undated %lu",
+      m_ring.GetNextSeq(), m_ring.GetPendingCount(), m_ring.GetAppendCount(), m_ring.GetLostCount(),
+      m_ring.GetErrorCount(), m_nEvents, m_nSamples, m_nUndated);
+}
 
-  m_co2.node_id = 0;
-  m_co2.data = 0;
+//------------------------------------------------------------------
+// Xlight Cloud Object Class
+//------------------------------------------------------------------
+CloudObjClass::CloudObjClass()
+{
+  m_SysID = "";
+  m_SysVersion = "";
+  m_nAppVersion = VERSION_CONFIG_DATA;
+  m_SysStatus = STATUS_OFF;
 
   m_strCldCmd = "";
+  m_tickSensorPub = 0;
+  memset(m_nCmdAccepted, 0x00, sizeof(m_nCmdAccepted));
+  memset(m_nCmdRejected, 0x00, sizeof(m_nCmdRejected));
 }
 
 // Initialize Cloud Variables & Functions
@@ -94,6 +636,7 @@ void CloudObjClass::InitCloudObj()
     Particle.variable(CLV_TimeZone, &m_tzString, STRING);
     Particle.variable(CLV_SysStatus, &m_SysStatus, INT);
     Particle.variable(CLV_LastMessage, &m_lastMsg, STRING);
+    Particle.variable(CLV_PerfStat, &m_perfStat, STRING);
 
     Particle.function(CLF_SetTimeZone, &CloudObjClass::CldSetTimeZone, this);
     Particle.function(CLF_PowerSwitch, &CloudObjClass::CldPowerSwitch, this);
@@ -115,92 +658,82 @@ String CloudObjClass::GetSysVersion()
 
 int CloudObjClass::CldJSONCommand(String jsonCmd)
 {
-  if( m_cmdList.size() > MQ_MAX_CLOUD_MSG ) {
-    LOGW(LOGTAG_MSG, "JSON commands exceeded queue size");
-    return 0;
-  }
-
-  m_cmdList.add(jsonCmd);
-  return 1;
+  return QueueCommand(CMD_SRC_CLOUD, CMD_REC_JSON, jsonCmd.c_str(), jsonCmd.length());
 }
 
 int CloudObjClass::CldJSONConfig(String jsonData)
 {
-  if( m_configList.size() > MQ_MAX_CLOUD_MSG ) {
-    LOGW(LOGTAG_MSG, "JSON config exceeded queue size");
-    return 0;
+  return QueueCommand(CMD_SRC_CLOUD, CMD_REC_CONFIG, jsonData.c_str(), jsonData.length());
+}
+
+// Copy a command into the ring, it will be executed in the main loop
+/// Return value:
+/// 1 - queued
+/// CMD_RC_QUEUE_FULL - ring is full, the sender should retry later
+/// CMD_RC_TOO_LONG - command exceeds MQ_CLOUD_MSG_MAX_LEN
+int CloudObjClass::QueueCommand(UC _src, UC _type, const char *_data, US _len)
+{
+  int rc = 1;
+  if( _len > MQ_CLOUD_MSG_MAX_LEN ) {
+    rc = CMD_RC_TOO_LONG;
+  } else if( m_cmdRing.Count() >= MQ_MAX_CLOUD_MSG || !m_cmdRing.Push((const UC *)_data, _len, (_src << 4) | _type) ) {
+    rc = CMD_RC_QUEUE_FULL;
   }
 
-  m_configList.add(jsonData);
-  return 1;
+  if( _src < CMD_SRC_NUM ) {
+    if( rc > 0 ) m_nCmdAccepted[_src]++;
+    else m_nCmdRejected[_src]++;
+  }
+  if( rc < 0 ) LOGW(LOGTAG_MSG, "Command from src %d rejected: %d", _src, rc);
+  return rc;
 }
 
-BOOL CloudObjClass::UpdateDHT(uint8_t nid, float _temp, float _humi)
+void CloudObjClass::showCommandQueue()
 {
-  static float preTemp = 255;
-  static float preHumi = 255;
+  SERIAL_LN("cmdQueue = \t\t\t%d msg, %d of %d bytes, peak %d", m_cmdRing.Count(), m_cmdRing.Length(),
+      m_cmdRing.GetMaxLength(), m_cmdRing.GetHighWater());
+  SERIAL_LN("cmdSource = \t\t\tcloud %lu/%lu, ble %lu/%lu, serial %lu/%lu (accepted/rejected)",
+      m_nCmdAccepted[CMD_SRC_CLOUD], m_nCmdRejected[CMD_SRC_CLOUD], m_nCmdAccepted[CMD_SRC_BLE], m_nCmdRejected[CMD_SRC_BLE],
+      m_nCmdAccepted[CMD_SRC_SERIAL], m_nCmdRejected[CMD_SRC_SERIAL]);
+}
 
+BOOL CloudObjClass::UpdateDHT(uint8_t nid, float _temp, float _humi)
+{
   if( _temp > 100 && (_humi > 100 || _humi < 0) ) return false;
 
   BOOL temp_ok = false;
   BOOL humi_ok = false;
+  UL lv_now = millis();
   if( nid > 0 ) {
     if( _humi >= 0 && _humi <= 100 ) {
-      if( m_humidity.data != _humi || m_humidity.node_id != nid ) {
-        m_humidity.node_id = nid;
-        m_humidity.data = _humi;
-        humi_ok = true;
-      }
+      humi_ok = m_sensorState.Update(nid, SPF_DHT_H, _humi, lv_now);
     }
     if( _temp <= 100 ) {
-      if( m_temperature.data != _temp || m_temperature.node_id != nid )
-      {
-        m_temperature.node_id = nid;
-        m_temperature.data = _temp;
-        temp_ok = true;
-      }
+      temp_ok = m_sensorState.Update(nid, SPF_DHT_T, _temp, lv_now);
     }
   } else {
+    // Controller's own sensor is smoothed by moving average
     if( _humi >= 0 && _humi <= 100 ) {
       if( m_sysHumi.AddData(_humi) ) {
         _humi = m_sysHumi.GetValue();
-        if( _humi != preHumi ) {
-          preHumi = _humi;
-          humi_ok = true;
-        }
+        humi_ok = m_sensorState.Update(nid, SPF_DHT_H, _humi, lv_now);
       }
     }
     if( _temp <= 100 ) {
       if( m_sysTemp.AddData(_temp) ) {
         _temp = m_sysTemp.GetValue();
-        if( _temp != preTemp ) {
-          preTemp = _temp;
-          temp_ok = true;
-        }
+        temp_ok = m_sensorState.Update(nid, SPF_DHT_T, _temp, lv_now);
       }
     }
   }
 
-  if( temp_ok ) OnSensorDataChanged(sensorDHT, nid);
-  if( humi_ok ) OnSensorDataChanged(sensorDHT_h, nid);
-
-  if( !theConfig.GetDisableWiFi() ) {
-    // Publis right away
-    if( Particle.connected() && (temp_ok || humi_ok) ) {
-      String strTemp;
-
-      // Temperature Message
-      if( humi_ok && _temp < 100 ) temp_ok = true;
-
-      if( temp_ok && humi_ok ) {
-        strTemp = String::format("{'nd':%d,'DHTt':%.2f,'DHTh':%.2f}", nid, _temp, _humi);
-      } else if( temp_ok ) {
-        strTemp = String::format("{'nd':%d,'DHTt':%.2f}", nid, _temp);
-      } else {
-        strTemp = String::format("{'nd':%d,'DHTh':%.2f}", nid, _humi);
-      }
-      Particle.publish(CLT_NAME_SensorData, strTemp, CLT_TTL_SensorData, PRIVATE);
-    }
+  if( temp_ok ) {
+    OnSensorDataChanged(sensorDHT, nid);
+    PostSensorData(nid, SPF_DHT_T, _temp);
+  }
+  if( humi_ok ) {
+    OnSensorDataChanged(sensorDHT_h, nid);
+    PostSensorData(nid, SPF_DHT_H, _humi);
   }
 
   return true;
@@ -208,17 +741,9 @@ BOOL CloudObjClass::UpdateDHT(uint8_t nid, float _temp, float _humi)
 
 BOOL CloudObjClass::UpdateBrightness(uint8_t nid, uint8_t value)
 {
-  if( m_brightness.data != value || m_brightness.node_id != nid ) {
-    m_brightness.node_id = nid;
-    m_brightness.data = value;
+  if( m_sensorState.Update(nid, SPF_ALS, value, millis()) ) {
     OnSensorDataChanged(sensorALS, nid);
-    if( !theConfig.GetDisableWiFi() ) {
-      // Publis right away
-      if( Particle.connected() ) {
-        String strTemp = String::format("{'nd':%d,'ALS':%d}", nid, value);
-        Particle.publish(CLT_NAME_SensorData, strTemp, CLT_TTL_MotionData, PRIVATE);
-      }
-    }
+    PostSensorData(nid, SPF_ALS, value);
     return true;
   }
   return false;
@@ -228,26 +753,16 @@ BOOL CloudObjClass::UpdateMotion(uint8_t nid, uint8_t sensor, uint8_t value)
 {
   if( sensor == S_MOTION || sensor == S_IR ) {
     if( sensor == S_MOTION ) {
-      if( m_motion.data != value || m_motion.node_id != nid ) {
-        m_motion.node_id = nid;
-        m_motion.data = value;
+      if( m_sensorState.Update(nid, SPF_PIR, value, millis()) ) {
         OnSensorDataChanged(sensorPIR, nid);
       }
     } else if( sensor == S_IR ) {
-      if( m_irKey.data != value || m_irKey.node_id != nid ) {
-        m_irKey.node_id = nid;
-        m_irKey.data = value;
+      if( m_sensorState.Update(nid, SPF_IRK, value, millis()) ) {
         OnSensorDataChanged(sensorIRKey, nid);
       }
     }
 
-    if( !theConfig.GetDisableWiFi() ) {
-      // Publis right away
-      if( Particle.connected() ) {
-        String strTemp = String::format("{'nd':%d,'%s':%d}", nid, (sensor == S_MOTION ? "PIR" : "IRK"), value);
-        Particle.publish(CLT_NAME_SensorData, strTemp, CLT_TTL_MotionData, PRIVATE);
-      }
-    }
+    PostSensorData(nid, (sensor == S_MOTION ? SPF_PIR : SPF_IRK), value);
     return true;
   }
   return false;
@@ -255,17 +770,9 @@ BOOL CloudObjClass::UpdateMotion(uint8_t nid, uint8_t sensor, uint8_t value)
 
 BOOL CloudObjClass::UpdateGas(uint8_t nid, uint16_t value)
 {
-  if( m_gas.data != value || m_gas.node_id != nid ) {
-    m_gas.node_id = nid;
-    m_gas.data = value;
+  if( m_sensorState.Update(nid, SPF_GAS, value, millis()) ) {
     OnSensorDataChanged(sensorGAS, nid);
-    if( !theConfig.GetDisableWiFi() ) {
-      // Publis right away
-      if( Particle.connected() ) {
-        String strTemp = String::format("{'nd':%d,'GAS':%d}", nid, value);
-        Particle.publish(CLT_NAME_SensorData, strTemp, CLT_TTL_MotionData, PRIVATE);
-      }
-    }
+    PostSensorData(nid, SPF_GAS, value);
     return true;
   }
   return false;
@@ -273,67 +780,40 @@ BOOL CloudObjClass::UpdateGas(uint8_t nid, uint16_t value)
 
 BOOL CloudObjClass::UpdateAirQuality(uint8_t nid, uint16_t pm25,uint16_t pm10,float tvoc,float ch2o,uint16_t co2)
 {
-	BOOL bNeedSendMsg = false;
-	if( m_pm25.data != pm25 || m_pm25.node_id != nid )
+	UL lv_now = millis();
+	if( m_sensorState.Update(nid, SPF_PM25, pm25, lv_now) )
 		{
-			m_pm25.node_id = nid;
-			m_pm25.data = pm25;
 			OnSensorDataChanged(sensorPM25, nid);
-			bNeedSendMsg = true;
+			PostSensorData(nid, SPF_PM25, pm25);
 		}
-		if( m_pm10.data != pm10 || m_pm10.node_id != nid )
+		if( m_sensorState.Update(nid, SPF_PM10, pm10, lv_now) )
 		{
-			m_pm10.node_id = nid;
-			m_pm10.data = pm10;
 			OnSensorDataChanged(sensorPM10, nid);
-			bNeedSendMsg = true;
+			PostSensorData(nid, SPF_PM10, pm10);
 		}
-		if( m_tvoc.data != tvoc || m_tvoc.node_id != nid )
+		if( m_sensorState.Update(nid, SPF_TVOC, tvoc, lv_now) )
 		{
-			m_tvoc.node_id = nid;
-			m_tvoc.data = tvoc;
 			OnSensorDataChanged(sensorTVOC, nid);
-			bNeedSendMsg = true;
+			PostSensorData(nid, SPF_TVOC, tvoc);
 		}
-		if( m_ch2o.data != ch2o || m_ch2o.node_id != nid )
+		if( m_sensorState.Update(nid, SPF_CH2O, ch2o, lv_now) )
 		{
-			m_ch2o.node_id = nid;
-			m_ch2o.data = ch2o;
 			OnSensorDataChanged(sensorCH2O, nid);
-			bNeedSendMsg = true;
+			PostSensorData(nid, SPF_CH2O, ch2o);
 		}
-		if( m_co2.data != co2 || m_co2.node_id != nid )
+		if( m_sensorState.Update(nid, SPF_CO2, co2, lv_now) )
 		{
-			m_co2.node_id = nid;
-			m_co2.data = co2;
 			OnSensorDataChanged(sensorCO2, nid);
-			bNeedSendMsg = true;
-		}
-
-
-		if( !theConfig.GetDisableWiFi() && bNeedSendMsg ) {
-			// Publis right away
-			if( Particle.connected() ) {
-				String strTemp = String::format("{'nd':%d,'PM25':%d,'PM10':%d,'TVOC':%.2f,'CH2O':%.2f,'CO2':%d}", nid,pm25,pm10,tvoc,ch2o,co2 );
-				Particle.publish(CLT_NAME_SensorData, strTemp, CLT_TTL_MotionData, PRIVATE);
-			}
+			PostSensorData(nid, SPF_CO2, co2);
 		}
 		return true;
 }
 
 BOOL CloudObjClass::UpdateDust(uint8_t nid, uint16_t value)
 {
-  if( m_pm25.data != value || m_pm25.node_id != nid ) {
-    m_pm25.node_id = nid;
-    m_pm25.data = value;
+  if( m_sensorState.Update(nid, SPF_PM25, value, millis()) ) {
     OnSensorDataChanged(sensorPM25, nid);
-    if( !theConfig.GetDisableWiFi() ) {
-      // Publis right away
-      if( Particle.connected() ) {
-        String strTemp = String::format("{'nd':%d,'PM25':%d}", nid, value);
-        Particle.publish(CLT_NAME_SensorData, strTemp, CLT_TTL_MotionData, PRIVATE);
-      }
-    }
+    PostSensorData(nid, SPF_PM25, value);
     return true;
   }
   return false;
@@ -341,17 +821,9 @@ BOOL CloudObjClass::UpdateDust(uint8_t nid, uint16_t value)
 
 BOOL CloudObjClass::UpdateSmoke(uint8_t nid, uint16_t value)
 {
-  if( m_smoke.data != value || m_smoke.node_id != nid ) {
-    m_smoke.node_id = nid;
-    m_smoke.data = value;
+  if( m_sensorState.Update(nid, SPF_SMK, value, millis()) ) {
     OnSensorDataChanged(sensorSMOKE, nid);
-    if( !theConfig.GetDisableWiFi() ) {
-      // Publis right away
-      if( Particle.connected() ) {
-        String strTemp = String::format("{'nd':%d,'SMK':%d}", nid, value);
-        Particle.publish(CLT_NAME_SensorData, strTemp, CLT_TTL_MotionData, PRIVATE);
-      }
-    }
+    PostSensorData(nid, SPF_SMK, value);
     return true;
   }
   return false;
@@ -359,17 +831,9 @@ BOOL CloudObjClass::UpdateSmoke(uint8_t nid, uint16_t value)
 
 BOOL CloudObjClass::UpdateSound(uint8_t nid, uint8_t value)
 {
-  if( m_sound.data != value || m_sound.node_id != nid ) {
-    m_sound.node_id = nid;
-    m_sound.data = value;
+  if( m_sensorState.Update(nid, SPF_MIC, value, millis()) ) {
     OnSensorDataChanged(sensorMIC_b, nid);
-    if( !theConfig.GetDisableWiFi() ) {
-      // Publis right away
-      if( Particle.connected() ) {
-        String strTemp = String::format("{'nd':%d,'MIC':%d}", nid, value);
-        Particle.publish(CLT_NAME_SensorData, strTemp, CLT_TTL_MotionData, PRIVATE);
-      }
-    }
+    PostSensorData(nid, SPF_MIC, value);
     return true;
   }
   return false;
@@ -377,22 +841,69 @@ BOOL CloudObjClass::UpdateSound(uint8_t nid, uint8_t value)
 
 BOOL CloudObjClass::UpdateNoise(uint8_t nid, uint16_t value)
 {
-  if( m_noise.data != value || m_noise.node_id != nid ) {
-    m_noise.node_id = nid;
-    m_noise.data = value;
+  if( m_sensorState.Update(nid, SPF_NOS, value, millis()) ) {
     OnSensorDataChanged(sensorMIC, nid);
-    if( !theConfig.GetDisableWiFi() ) {
-      // Publis right away
-      if( Particle.connected() ) {
-        String strTemp = String::format("{'nd':%d,'NOS':%d}", nid, value);
-        Particle.publish(CLT_NAME_SensorData, strTemp, CLT_TTL_MotionData, PRIVATE);
-      }
-    }
+    PostSensorData(nid, SPF_NOS, value);
     return true;
   }
   return false;
 }
 
+// Hand a sensor value to the aggregator, it is published by FlushSensorData()
+BOOL CloudObjClass::PostSensorData(uint8_t nid, UC field, float value)
+{
+  // Keep the history while the cloud is unreachable, it is uploaded later
+  if( !theConfig.GetDisableWiFi() && !Particle.connected() ) {
+    m_sensorLog.Append(nid, field, value, SensorLogClass::GetStamp());
+  }
+
+  // Motion 0->1->0 within one interval: publish the pending 1 before it is overwritten
+  if( m_sensorAgg.IsPriorityChange(nid, field, value) ) FlushSensorData(true);
+
+  if( m_sensorAgg.Add(nid, field, value, millis()) ) return true;
+
+  // All slots are pending, publish this one right away
+  if( !theConfig.GetDisableWiFi() && Particle.connected() ) {
+    char strTemp[SENSORDATA_JSON_SIZE];
+    int len = snprintf(strTemp, sizeof(strTemp), "{'nd':%d", nid);
+    len += SensorAggregatorClass::FormatField(strTemp + len, sizeof(strTemp) - len - 1, field, value);
+    strTemp[len++] = '}';
+    strTemp[len] = '\0';
+    return Particle.publish(CLT_NAME_SensorData, strTemp, CLT_TTL_MotionData, PRIVATE);
+  }
+  return false;
+}
+
+// Publish aggregated sensor data, at most one event per RTE_SENSOR_PUB_INTERVAL.
+/// Priority fields go out as soon as the interval allows, the rest when the window expires.
+/// _force skips the interval, for a priority value about to be overwritten.
+/// History recorded while offline is uploaded in the intervals left by live data
+void CloudObjClass::FlushSensorData(BOOL _force)
+{
+  if( !m_sensorAgg.GetDirtyCount() && !m_sensorLog.IsPending() ) return;
+  // Latest values are kept while offline
+  if( theConfig.GetDisableWiFi() || !Particle.connected() ) return;
+
+  UL lv_now = millis();
+  if( !_force && lv_now - m_tickSensorPub < RTE_SENSOR_PUB_INTERVAL ) return;
+
+  char lv_buf[CLT_MAX_PAYLOAD + 1];
+  if( m_sensorAgg.GetDirtyCount() ) {
+    BOOL lv_priority = m_sensorAgg.HasPriority();
+    if( (lv_priority || m_sensorAgg.IsDue(lv_now)) && m_sensorAgg.Pack(lv_buf, sizeof(lv_buf), lv_priority) > 0 ) {
+      m_sensorAgg.Complete(Particle.publish(CLT_NAME_SensorData, lv_buf,
+          (lv_priority ? CLT_TTL_MotionData : CLT_TTL_SensorData), PRIVATE));
+      m_tickSensorPub = lv_now;
+      return;
+    }
+  }
+
+  if( m_sensorLog.PackBatch(lv_buf, sizeof(lv_buf)) > 0 ) {
+    m_sensorLog.Complete(Particle.publish(CLT_NAME_Backfill, lv_buf, CLT_TTL_Backfill, PRIVATE));
+    m_tickSensorPub = lv_now;
+  }
+}
+
 // Publish LOG message and update cloud variable
 BOOL CloudObjClass::PublishLog(const char *msg)
 {
@@ -491,58 +1002,30 @@ BOOL CloudObjClass::PublishAction(const char *msg)
 
 // Concatenate string with regard to the length limitation of cloud API
 /// Return value:
-/// 0 - string is intact, can be executed
+/// 0 - strJson is intact, can be parsed
 /// 1 - waiting for more input
-/// -1 - error
-int CloudObjClass::ProcessJSONString(const String& inStr)
-{
-  String strTemp = inStr;
-  StaticJsonBuffer<COMMAND_JSON_SIZE * 8> lv_jBuf;
-  m_jpCldCmd = &(lv_jBuf.parseObject(const_cast<char*>(inStr.c_str())));
-  /*char* tst = const_cast<char*>(inStr.c_str());
-  SERIAL("ptr addr = %p",tst);
-  //SERIAL(tst);
-  SERIAL(" ,index = ");
-  Serial.println(inStr.indexOf("cmd"));*/
-  if (!m_jpCldCmd->success())
-  {
-		if( m_strCldCmd.length() > 0 ) {
-
-			m_strCldCmd.concat(inStr);
-			String debugstr = m_strCldCmd;
-			StaticJsonBuffer<COMMAND_JSON_SIZE*3 * 8> lv_jBuf2; //buffer size must be larger than COMMAND_JSON_SIZE
-			m_jpCldCmd = &(lv_jBuf2.parseObject(const_cast<char*>(m_strCldCmd.c_str())));
-			m_strCldCmd = "";		// Already concatenated
-			if (!m_jpCldCmd->success()) {
-				SERIAL_LN("Could not parse the concatenated string: %s", debugstr.c_str());
-				return -1;
-			}
-		} else {
-			return -1;
-		}
+/// Note: commands are decoded chunk by chunk by m_cmdParser, only config messages are assembled here
+int CloudObjClass::ProcessJSONString(const char *inStr, String& strJson)
+{
+  US lv_start, lv_end;
+  UC lv_chunk = JsonCmdParserClass::ParseChunk(inStr, strlen(inStr), &lv_start, &lv_end);
+  if( lv_chunk != JCMD_CHUNK_NONE ) {
+    // Begin of a new string
+    if( lv_chunk == JCMD_CHUNK_FIRST ) m_strCldCmd = "";
+    for( US i = lv_start; i < lv_end; i++ ) {
+      char c = inStr[i];
+      if( c == '\\' ) c = JsonCmdParserClass::Unescape(inStr[++i]);
+      m_strCldCmd.concat(c);
+    }
+    return 1;
   }
 
-	if (m_jpCldCmd->containsKey("x0") ) {
-		// Begin of a new string
-		m_strCldCmd = (*m_jpCldCmd)["x0"];
-		return 1;
-	}
-	else if (m_jpCldCmd->containsKey("x1")) {
-		// Concatenate
-		strTemp = (*m_jpCldCmd)["x1"];
-		m_strCldCmd.concat(strTemp);
-		return 1;
-  } else if( m_strCldCmd.length() > 0 ) {
-		m_strCldCmd.concat(inStr);
-		String debugstr = m_strCldCmd;
-		StaticJsonBuffer<COMMAND_JSON_SIZE * 8> lv_jBuf3;
-		m_jpCldCmd = &(lv_jBuf3.parseObject(const_cast<char*>(m_strCldCmd.c_str())));
-
-		m_strCldCmd = "";		// Already concatenated
-		if (!m_jpCldCmd->success()) {
-			SERIAL_LN("Could not parse the string: %s", debugstr.c_str());
-			return -1;
-		}
+  if( m_strCldCmd.length() > 0 ) {
+    strJson = m_strCldCmd;
+    strJson.concat(inStr);
+    m_strCldCmd = "";		// Already concatenated
+  } else {
+    strJson = inStr;
   }
 
   return 0;
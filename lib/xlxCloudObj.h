@@ -5,13 +5,30 @@
 
 #include "xliCommon.h"
 #include "ArduinoJson.h"
-#include "LinkedList.h"
+#include "DataQueue.h"
 #include "MoveAverage.h"
+#include "FlashRing.h"
+#include "xlxJsonCmd.h"
 
 // Comment it off if we don't use Particle public cloud
 /// Notes:
 /// Currently, Particle public cloud supports up to 20 variables and 15 functions.
 
+// Command sources
+#define CMD_SRC_CLOUD           0
+#define CMD_SRC_BLE             1
+#define CMD_SRC_SERIAL          2
+#define CMD_SRC_NUM             3
+
+// Command record types
+#define CMD_REC_JSON            0         // JSON command
+#define CMD_REC_CONFIG          1         // JSON config
+#define CMD_REC_CONSOLE         2         // Console command line
+
+// Reject codes returned when a command is not queued
+#define CMD_RC_QUEUE_FULL       -1
+#define CMD_RC_TOO_LONG         -2
+
 // Notes: Variable name max length is 12 characters long.
 // Cloud variables
 #define CLV_SysID               "sysID"           // Can also be a Particle Object
@@ -19,6 +36,7 @@
 #define CLV_TimeZone            "timeZone"        // Can also be a Particle Object
 #define CLV_SysStatus           "sysStatus"       // Can also be a Particle Object
 #define CLV_LastMessage         "lastMsg"         // Can also be a Particle Object
+#define CLV_PerfStat            "perfStat"        // Stage percentiles and queue counters, see UpdatePerfVariable()
 
 // Notes: The length of the funcKey is limited to a max of 12 characters.
 // Cloud functions
@@ -54,28 +72,189 @@
 #define CLT_NAME_DeviceConfig   "xlc-config-device"
 #define CLT_TTL_DeviceConfig    30
 
+/// Sensor data recorded while offline
+#define CLT_ID_Backfill         6
+#define CLT_NAME_Backfill       "xlc-data-backfill"
+#define CLT_TTL_Backfill        RTE_DELAY_PUBLISH
+
 /// action
 #define CLT_ID_ACTION           7
 #define CLT_NAME_ACTION         "xlc-action"
 #define CLT_TTL_ACStatus        30
 
+#define CLT_MAX_PAYLOAD         255
+
+// Fields of aggregated sensor events
+#define SPF_DHT_T               0
+#define SPF_DHT_H               1
+#define SPF_ALS                 2
+#define SPF_PIR                 3
+#define SPF_IRK                 4
+#define SPF_GAS                 5
+#define SPF_PM25                6
+#define SPF_PM10                7
+#define SPF_TVOC                8
+#define SPF_CH2O                9
+#define SPF_CO2                 10
+#define SPF_SMK                 11
+#define SPF_MIC                 12
+#define SPF_NOS                 13
+#define SPF_NUM                 14
+
+// Sensor slot state
+#define SPS_FREE                0
+#define SPS_CLEAN               1         // Published value is current
+#define SPS_DIRTY               2         // Moved beyond deadband, waiting for publish
+#define SPS_PACKED              3         // In the event being published
+
 typedef struct
 {
-  UC node_id;                       // RF nodeID
-  float data;
-} nd_float_t;
+  UC node_id;
+  UC field;                         // SPF_*
+  UC state;                         // SPS_*
+  UC sent                     :1;   // lastSent is valid
+  float value;                      // Latest value
+  float lastSent;                   // Value in the last published event
+} SensorPubSlot_t;
 
-typedef struct
+//------------------------------------------------------------------
+// Xlight Sensor Publish Aggregator Class
+//------------------------------------------------------------------
+// Collects sensor updates of all nodes and packs those that moved beyond
+// the field deadband into as few events as fit the payload limit. An event
+// carries changed fields only: {'nd':1,'DHTt':22.50,'ALS':40} for one node,
+// {'ms':[{'nd':1,...},{'nd':2,...}]} for several. Motion, IR key and smoke
+// are priority fields, they are packed on their own without waiting for
+// the window, and a pending priority value is published before it is
+// overwritten by a different one.
+class SensorAggregatorClass
 {
-  UC node_id;                       // RF nodeID
-  US data;
-} nd_us_t;
+public:
+  SensorAggregatorClass();
 
-typedef struct
+  void Clear();
+  BOOL Add(UC _nid, UC _field, float _value, UL _now);
+  BOOL IsDue(UL _now);
+  BOOL HasPriority() { return m_nPriority > 0; }
+  BOOL IsPriorityChange(UC _nid, UC _field, float _value);
+  US Pack(char *_buf, US _size, BOOL _priorityOnly);
+  void Complete(BOOL _ok);
+
+  void SetWindow(UL _ms) { m_window = _ms; }
+  UL GetWindow() { return m_window; }
+  UC GetDirtyCount() { return m_nDirty; }
+  void showStatistics();
+  static US FormatField(char *_buf, US _size, UC _field, float _value);
+
+  // Statistics
+  UL m_nUpdates;
+  UL m_nSuppressed;                 // Updates within deadband
+  UL m_nEvents;
+  UL m_nFields;                     // Fields carried by events
+  UL m_nOverflow;                   // Updates published directly for lack of slot
+
+protected:
+  SensorPubSlot_t m_slots[SENSOR_PUB_SLOTS];
+  UL m_window;
+  UL m_tickWindow;                  // When the first pending update arrived
+  UC m_nDirty;
+  UC m_nPriority;
+
+  SensorPubSlot_t *GetSlot(UC _nid, UC _field);
+  void SetDirty(SensorPubSlot_t *_slot, BOOL _dirty, UL _now);
+  US PackNode(char *_buf, US _size, UC _nid, BOOL _priorityOnly);
+};
+
+//------------------------------------------------------------------
+// Xlight Sensor State Table Class
+//------------------------------------------------------------------
+// Latest value and update time of every sensor field (SPF_*) of every
+// node, so rules see each node's own reading instead of whichever node
+// reported last. A node is mapped to its row by a direct index, the row
+// maps each field to a cell taken from a shared pool: lookup is O(1), and
+// as nodes report a few fields of SPF_NUM, values are sized by
+// SENSOR_STATE_CELLS, not rows * fields.
+#define SNS_NO_ROW              0xFF
+#define SNS_NO_CELL             0xFF
+
+#if SENSOR_STATE_CELLS > 255
+#error "SensorStateClass cell index is one byte"
+#endif
+
+class SensorStateClass
 {
-  UC node_id;                       // RF nodeID
-  UC data;
-} nd_uc_t;
+public:
+  SensorStateClass();
+
+  void Clear();
+  BOOL Update(UC _nid, UC _field, float _value, UL _now);
+  BOOL Get(UC _nid, UC _field, float *_value, UL *_tick = NULL);
+  BOOL GetLatest(UC _field, float *_value, UC *_nid = NULL);
+  void Remove(UC _nid);
+  UC GetRowCount() { return m_nRows; }
+  UC GetFreeCells() { return m_nFreeCells; }
+  void showStatus();
+  static UC FieldOfSensor(UC _sr);
+
+  // Statistics
+  UL m_nOverflow;                   // Updates dropped for lack of row or cell
+
+protected:
+  UC m_row[256];                    // NodeID -> row, SNS_NO_ROW if none
+  UC m_node[SENSOR_STATE_ROWS];     // Row -> NodeID
+  UC m_cell[SENSOR_STATE_ROWS][SPF_NUM];  // Row, field -> cell, SNS_NO_CELL if none
+  float m_value[SENSOR_STATE_CELLS];
+  UL m_tick[SENSOR_STATE_CELLS];    // millis() of the last update
+  UC m_next[SENSOR_STATE_CELLS];    // Free list
+  UC m_nRows;
+  UC m_freeCell;
+  UC m_nFreeCells;
+};
+
+//------------------------------------------------------------------
+// Xlight Sensor History Class
+//------------------------------------------------------------------
+// Sensor values recorded while the cloud is unreachable. They are kept in a
+// flash ring (MEM_OFFLINE_DATA), so they survive resets, and uploaded once
+// the cloud is back: {'sq':120,'bf':[[1500000000,1,'DHTt',22.50],...]}, where
+// 'sq' is the sequence number of the first sample and the others follow
+// without gap. Samples are released from flash only after their event was
+// published, a sample may be sent twice (same 'sq') but is never skipped.
+// Record: node, field, seconds since the page base time (varint) and value
+// scaled by the field decimals (zigzag varint).
+// Before the clock is set, a page base is seconds since boot with
+// SNSLOG_UPTIME set. Such samples are dated on upload once the clock is
+// set; those left by an earlier boot can't be dated and are dropped.
+#define SNSLOG_MAX_RECORD       12
+#define SNSLOG_UPTIME           0x80000000UL
+
+class SensorLogClass
+{
+public:
+  SensorLogClass();
+
+  BOOL Init(Flashee::FlashDevice *_device, UL _addr, UL _len);
+  BOOL Append(UC _nid, UC _field, float _value, UL _stamp);
+  BOOL IsPending() { return m_ring.IsPending(); }
+  UL GetPendingCount() { return m_ring.GetPendingCount(); }
+  US PackBatch(char *_buf, US _size);
+  void Complete(BOOL _ok);
+  void showStatus();
+  static UC EncodeRecord(UC *_buf, UC _nid, UC _field, float _value, UL _delta);
+  static BOOL DecodeRecord(const UC *_buf, UC _len, UC *_nid, UC *_field, float *_value, UL *_delta);
+  static UL GetStamp();
+
+  // Statistics
+  UL m_nEvents;
+  UL m_nSamples;                    // Samples carried by events
+  UL m_nUndated;                    // Samples of an earlier boot dropped before the clock was set
+
+protected:
+  CFlashRing m_ring;
+  UL m_bootSeq;                     // First sequence number of this boot
+  FlashRingPos_t m_batchEnd;        // Read position behind the packed batch
+  UC m_nPacked;                     // Samples in the event being published
+};
 
 //------------------------------------------------------------------
 // Xlight CloudObj Class
@@ -90,27 +269,15 @@ public:
   int m_SysStatus;
   String m_tzString;
   String m_lastMsg;
+  String m_perfStat;
   String m_strCldCmd;
 
   // Sensor Data from Controller
   CMoveAverage m_sysTemp;
   CMoveAverage m_sysHumi;
 
-  // Sensor Data from Node
-  nd_float_t m_temperature;
-  nd_float_t m_humidity;
-  nd_us_t m_brightness;
-  nd_uc_t m_motion;
-  nd_uc_t m_irKey;
-  nd_us_t m_gas;
-  nd_us_t m_smoke;
-  nd_uc_t m_sound;
-  nd_us_t m_noise;
-  nd_us_t m_pm25;
-  nd_us_t m_pm10;
-  nd_float_t m_tvoc;
-  nd_float_t m_ch2o;
-  nd_us_t m_co2;
+  // Sensor Data from Controller (node 0) and Nodes
+  SensorStateClass m_sensorState;
 
 public:
   CloudObjClass();
@@ -124,7 +291,9 @@ public:
   virtual int CldPowerSwitch(String swStr) = 0;
   virtual int CldSetCurrentTime(String tmStr) = 0;
   virtual void OnSensorDataChanged(const UC _sr, const UC _nd) = 0;
-  int ProcessJSONString(const String& inStr);
+  int ProcessJSONString(const char *inStr, String& strJson);
+  int QueueCommand(UC _src, UC _type, const char *_data, US _len);
+  void showCommandQueue();
 
   BOOL UpdateDHT(uint8_t nid, float _temp, float _humi);
   BOOL UpdateBrightness(uint8_t nid, uint8_t value);
@@ -136,6 +305,11 @@ public:
   BOOL UpdateNoise(uint8_t nid, uint16_t value);
   BOOL UpdateAirQuality(uint8_t nid, uint16_t pm25,uint16_t pm10,float tvoc,float ch2o,uint16_t co2);
 
+  BOOL PostSensorData(uint8_t nid, UC field, float value);
+  void FlushSensorData(BOOL _force = false);
+  SensorAggregatorClass m_sensorAgg;
+  SensorLogClass m_sensorLog;
+
   BOOL PublishLog(const char *msg);
   BOOL PublishDeviceStatus(const char *msg);
   BOOL PublishDeviceConfig(const char *msg);
@@ -146,10 +320,14 @@ public:
 protected:
   void InitCloudObj();
 
-  JsonObject *m_jpCldCmd;
+  JsonCmdParserClass m_cmdParser;
+
+  UL m_tickSensorPub;
 
-  LinkedList<String> m_cmdList;
-  LinkedList<String> m_configList;
+  // Queued command records, tag is (source << 4) | type
+  CRecordQueue<MQ_CLOUD_RING_SIZE> m_cmdRing;
+  UL m_nCmdAccepted[CMD_SRC_NUM];
+  UL m_nCmdRejected[CMD_SRC_NUM];
 };
 
 #endif /* xliCloudObj_h */
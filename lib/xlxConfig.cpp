@@ -61,6 +61,58 @@ int NodeListClass::getFlashSize()
 	return(min(sizeof(NodeIdRow_t) * _size, MEM_NODELIST_LEN));
 }
 
+// Rebuild position index, called after items are inserted or removed
+void NodeListClass::reindex()
+{
+	memset(m_posIndex, NODELIST_INDEX_NONE, sizeof(m_posIndex));
+	for(int i = 0; i < _count; i++) {
+		m_posIndex[_pItems[i].nid] = i;
+	}
+}
+
+int NodeListClass::search(NodeIdRow_t *_pT, bool bReplace)
+{
+	if( !_pT ) return -1;
+	// Insert position still comes from binary search
+	if( bReplace ) return OrderdList::search(_pT, bReplace);
+
+	UC pos = m_posIndex[_pT->nid];
+	return(pos == NODELIST_INDEX_NONE ? -1 : pos);
+}
+
+int NodeListClass::update(NodeIdRow_t *_pT)
+{
+	int pos = OrderdList::update(_pT);
+	if( pos >= 0 ) markRows(pos, pos + 1);
+	return pos;
+}
+
+int NodeListClass::add(NodeIdRow_t *_pT)
+{
+	UC oldCnt = _count;
+	int pos = OrderdList::add(_pT);
+	reindex();
+	// Rows behind an inserted item shift
+	if( pos >= 0 ) markRows(pos, _count > oldCnt ? _count : pos + 1);
+	return pos;
+}
+
+bool NodeListClass::remove(NodeIdRow_t *_pT)
+{
+	int pos = search(_pT);
+	bool rc = OrderdList::remove(_pT);
+	reindex();
+	// Rows behind the removed item shift, the last one is cleared
+	if( rc ) markRows(pos, _count + 1);
+	return rc;
+}
+
+void NodeListClass::removeAll()
+{
+	OrderdList::removeAll();
+	reindex();
+}
+
 // Load node list from EEPROM
 bool NodeListClass::loadList()
 {
@@ -106,43 +158,86 @@ bool NodeListClass::loadList()
 		}
 	}
 	//saveList();
+	// Rows match EEPROM, m_isChanged tells if presets were restored
+	markClean();
 	return bEEPROMLoadRet;
 }
 
+// Stage changed rows to EEPROM and the P1 backup through the journal.
+/// Rows the journal can't take now stay marked for the next call
 bool NodeListClass::saveList()
 {
-	bool ret = false;
 	if( m_isChanged ) {
 		m_isChanged = false;
-		/*
-		for(int i = 0; i < count(); i++) {
-			int offset = MEM_NODELIST_OFFSET + i * sizeof(NodeIdRow_t);
-			if( offset > MEM_NODELIST_OFFSET + MEM_NODELIST_LEN - sizeof(NodeIdRow_t) ) break;
-			EEPROM.put(offset, _pItems[i]);
-		}*/
-		NodeIdRow_t lv_buf[MAX_NODE_PER_CONTROLLER];
-		memset(lv_buf, 0x00, sizeof(lv_buf));
-		memcpy(lv_buf, _pItems, sizeof(NodeIdRow_t) * count());
-		EEPROM.put(MEM_NODELIST_OFFSET, lv_buf);
-		uint8_t attemps = 0;
-		while(++attemps <=3 )
-		{
-			if(theConfig.getP1Flash()->write<NodeIdRow_t[MAX_NODE_PER_CONTROLLER]>(lv_buf, MEM_NODELIST_BACKUP_OFFSET))
-			{
-				LOGN(LOGTAG_MSG, "write nodelist backup success!");
-				ret = true;
-				break;
-			}
-			else
-			{
-				LOGW(LOGTAG_MSG,"write nodelist backup failed! tried=%d",attemps);
-			}
+		markRows(0, MAX_NODE_PER_CONTROLLER);
+	}
+
+	bool ret = true;
+	NodeIdRow_t lv_Node;
+	for( int i = 0; i < MAX_NODE_PER_CONTROLLER && m_dirtyRows; i++ ) {
+		if( !(m_dirtyRows & (1ULL << i)) ) continue;
+		// Rows beyond the list are cleared, loading stops there
+		if( i < _count ) {
+			lv_Node = _pItems[i];
+		} else {
+			memset(&lv_Node, 0x00, sizeof(NodeIdRow_t));
 		}
-		theConfig.SetNumNodes(count());
+		if( !theConfig.getJournal().Stage(JOURNAL_TARGET_EEPROM, MEM_NODELIST_OFFSET + i * sizeof(NodeIdRow_t), &lv_Node, sizeof(NodeIdRow_t)) ) {
+			ret = false;
+			break;
+		}
+#ifdef MCU_TYPE_P1
+		if( !theConfig.getJournal().Stage(JOURNAL_TARGET_P1FLASH, MEM_NODELIST_BACKUP_OFFSET + i * sizeof(NodeIdRow_t), &lv_Node, sizeof(NodeIdRow_t)) ) {
+			ret = false;
+			break;
+		}
+#endif
+		m_dirtyRows &= ~(1ULL << i);
 	}
+	theConfig.SetNumNodes(count());
 	return ret;
 }
 
+// Update node liveness in RAM only, saved by the next checkpoint
+BOOL NodeListClass::touchNode(UC nid, UL now)
+{
+	UC pos = m_posIndex[nid];
+	if( pos == NODELIST_INDEX_NONE ) return false;
+	_pItems[pos].recentActive = now;
+	m_activeFlags[nid / 8] |= (1 << (nid % 8));
+	return true;
+}
+
+// Mark rows of nodes active since the last checkpoint to be saved, once per
+// RTE_TM_NODE_CHECKPOINT unless forced
+void NodeListClass::checkpoint(UL now, BOOL force)
+{
+	if( m_lastCheckpoint == 0 ) m_lastCheckpoint = now;
+	if( !force && now - m_lastCheckpoint < RTE_TM_NODE_CHECKPOINT ) return;
+	m_lastCheckpoint = now;
+
+	for( int i = 0; i < _count; i++ ) {
+		UC nid = _pItems[i].nid;
+		if( m_activeFlags[nid / 8] & (1 << (nid % 8)) ) markRows(i, i + 1);
+	}
+	memset(m_activeFlags, 0x00, sizeof(m_activeFlags));
+}
+
+void NodeListClass::markRows(int first, int last)
+{
+	if( last > MAX_NODE_PER_CONTROLLER ) last = MAX_NODE_PER_CONTROLLER;
+	for( int i = first; i < last; i++ ) m_dirtyRows |= (1ULL << i);
+}
+
+UC NodeListClass::getDirtyCount()
+{
+	UC lv_cnt = 0;
+	for( int i = 0; i < MAX_NODE_PER_CONTROLLER; i++ ) {
+		if( m_dirtyRows & (1ULL << i) ) lv_cnt++;
+	}
+	return lv_cnt;
+}
+
 void NodeListClass::publishNode(NodeIdRow_t _node)
 {
 	String strTemp;
@@ -246,7 +341,6 @@ UC NodeListClass::requestNodeID(UC preferID, char type, uint64_t identity)
 			theConfig.SetNumDevices(theConfig.GetNumDevices() + 1);
 		}
 		theConfig.SetNumNodes(count());
-		m_isChanged = true;
 
 		if( type == NODE_TYP_LAMP ) {
 			if( theConfig.InitDevStatus(nodeID) ) {
@@ -348,7 +442,6 @@ BOOL NodeListClass::clearNodeId(UC nodeID)
 		theConfig.SetNumNodes(count());
 	}
 
-	m_isChanged = true;
 	LOGN(LOGTAG_EVENT, "NodeID:%d is cleared", nodeID);
 	return true;
 }
@@ -359,6 +452,9 @@ BOOL NodeListClass::clearNodeId(UC nodeID)
 ConfigClass::ConfigClass()
 {
 	P1Flash = Devices::createWearLevelErase();
+	m_journal.SetTarget(JOURNAL_TARGET_EEPROM, &m_eepromDevice);
+	m_journal.SetTarget(JOURNAL_TARGET_P1FLASH, P1Flash);
+	m_journal.SetIdleWindow(JOURNAL_IDLE_WINDOW);
 
   m_isLoaded = false;
   m_isChanged = false;
@@ -366,6 +462,8 @@ ConfigClass::ConfigClass()
   m_isSCTChanged = false;
   m_isRTChanged = false;
   m_isSNTChanged = false;
+	memset(m_groups, 0x00, sizeof(m_groups));
+	m_grpDirty = 0;
 	m_lastTimeSync = millis();
   InitConfig();
 }
@@ -453,21 +551,37 @@ BOOL ConfigClass::InitDevStatus(UC nodeID)
 BOOL ConfigClass::MemWriteScenarioRow(ScenarioRow_t row, uint32_t address)
 {
 #ifdef MCU_TYPE_P1
-	return P1Flash->write<ScenarioRow_t>(row, address);
+	return m_journal.Stage(JOURNAL_TARGET_P1FLASH, address, &row, sizeof(row));
 #else
 	return false;
 #endif
 }
 
+// Rows may still be held by the journal, read through it
 BOOL ConfigClass::MemReadScenarioRow(ScenarioRow_t &row, uint32_t address)
 {
 #ifdef MCU_TYPE_P1
-	return P1Flash->read<ScenarioRow_t>(row, address);
+	if( !P1Flash->read<ScenarioRow_t>(row, address) ) return false;
+	m_journal.Overlay(JOURNAL_TARGET_P1FLASH, address, &row, sizeof(row));
+	return true;
 #else
 	return false;
 #endif
 }
 
+BOOL ConfigClass::MemReadScheduleRow(ScheduleRow_t &row, uint32_t address)
+{
+	EEPROM.get(address, row);
+	m_journal.Overlay(JOURNAL_TARGET_EEPROM, address, &row, sizeof(row));
+	return true;
+}
+
+// Commit staged rows when table edits paused and apply them within the loop budget
+BOOL ConfigClass::FlushJournal(BOOL force)
+{
+	return m_journal.Flush(JOURNAL_FLUSH_BUDGET, force);
+}
+
 BOOL ConfigClass::IsValidConfig()
 {
 	LOGW(LOGTAG_MSG, "v=%d,typeMainDevice=%d,maindev=%d",m_config.version,m_config.typeMainDevice, m_config.mainDevID);
@@ -525,6 +639,16 @@ BOOL ConfigClass::LoadConfig()
     LOGE(LOGTAG_MSG, "Failed to load Sysconfig, too large.");
   }
 
+	// Finish a table write-back interrupted by reset before loading tables
+	if( m_journal.Init(P1Flash, MEM_JOURNAL_OFFSET, MEM_JOURNAL_LEN) ) {
+		UC lv_replayed = m_journal.Recover();
+		if( lv_replayed > 0 ) {
+			LOGW(LOGTAG_MSG, "Replayed %d journal extents.", lv_replayed);
+		}
+	} else {
+		LOGE(LOGTAG_MSG, "Failed to init flash journal.");
+	}
+
 	// Load Device Status
 	LoadDeviceStatus();
 
@@ -537,6 +661,9 @@ BOOL ConfigClass::LoadConfig()
 	// Load NodeID List
 	LoadNodeIDList();
 
+	// Load Lamp Groups
+	LoadGroupTable();
+
   return m_isLoaded;
 }
 
@@ -580,6 +707,9 @@ BOOL ConfigClass::SaveConfig()
 	// Save NodeID List
 	SaveNodeIDList();
 
+	// Save Lamp Groups
+	SaveGroupTable();
+
   return true;
 }
 
@@ -640,7 +770,7 @@ void ConfigClass::SetSNTChanged(BOOL flag)
 
 BOOL ConfigClass::IsNIDChanged()
 {
-	return lstNodes.m_isChanged;
+	return lstNodes.isDirty();
 }
 
 void ConfigClass::SetNIDChanged(BOOL flag)
@@ -1028,7 +1158,6 @@ BOOL ConfigClass::SetRemoteNodeDevice(UC remoteID, US devID)
 			if( lv_Node.device != devID ) {
 				lv_Node.device = devID % 256;
 				lstNodes.update(&lv_Node);
-				lstNodes.m_isChanged = true;
 			}
 			// Notify Remote Node anyway
 			return theRadio.SendNodeConfig(remoteID, NCF_DEV_ASSOCIATE, devID);
@@ -1629,8 +1758,11 @@ BOOL ConfigClass::SaveDeviceStatus()
 				int row_index = rowptr->data.uid;
 				if ((row_index) < MAX_DEVICE_PER_CONTROLLER)
 				{
-					EEPROM.put(MEM_DEVICE_STATUS_OFFSET + row_index*DST_ROW_SIZE, tmpRow);
-					rowptr->data.flash_flag = SAVED;
+					if( m_journal.Stage(JOURNAL_TARGET_EEPROM, MEM_DEVICE_STATUS_OFFSET + row_index*DST_ROW_SIZE, &tmpRow, sizeof(tmpRow)) ) {
+						rowptr->data.flash_flag = SAVED;
+					} else {
+						success_flag = false;
+					}
 				}
 				else
 				{
@@ -1689,9 +1821,12 @@ BOOL ConfigClass::SaveScheduleTable()
 			  int row_index = rowptr->data.uid;
 			  if (row_index < MAX_SCT_ROWS)
 			  {
-				  EEPROM.put(MEM_SCHEDULE_OFFSET + row_index*SCT_ROW_SIZE, tmpRow); //write to flash
-
-				  rowptr->data.flash_flag = SAVED; //toggle flash flag
+				  //stage to journal, written back to flash in batch
+				  if( m_journal.Stage(JOURNAL_TARGET_EEPROM, MEM_SCHEDULE_OFFSET + row_index*SCT_ROW_SIZE, &tmpRow, sizeof(tmpRow)) ) {
+					  rowptr->data.flash_flag = SAVED; //toggle flash flag
+				  } else {
+					  success_flag = false;
+				  }
 			  }
 			  else
 			  {
@@ -1753,10 +1888,12 @@ BOOL ConfigClass::SaveScenarioTable()
 			  int row_index = rowptr->data.uid;
 			  if (row_index < MAX_SNT_ROWS)
 			  {
+				  BOOL lv_staged = true;
 #ifdef MCU_TYPE_P1
-				  P1Flash->write<ScenarioRow_t>(tmpRow, MEM_SCENARIOS_OFFSET + row_index*SNT_ROW_SIZE);
+				  lv_staged = m_journal.Stage(JOURNAL_TARGET_P1FLASH, MEM_SCENARIOS_OFFSET + row_index*SNT_ROW_SIZE, &tmpRow, sizeof(tmpRow));
 #endif
-				  rowptr->data.flash_flag = SAVED; //toggle flash flag
+				  if( lv_staged ) rowptr->data.flash_flag = SAVED; //toggle flash flag
+				  else success_flag = false;
 			  }
 			  else
 			  {
@@ -1810,6 +1947,7 @@ BOOL ConfigClass::LoadRuleTable()
 				}
 				//else: row is either empty or trash; do nothing
 			}
+			theSys.RebuildRuleIndex();
 			m_isRTChanged = false; //since we are not calling SaveConfig(), change flag to false again
 		}
 		else
@@ -1864,10 +2002,12 @@ BOOL ConfigClass::SaveRuleTable()
 				int row_index = rowptr->data.uid;
 				if (row_index < MAX_RT_ROWS)
 				{
+					BOOL lv_staged = true;
 	#ifdef MCU_TYPE_P1
-					P1Flash->write<RuleRow_t>(tmpRow, MEM_RULES_OFFSET + row_index*RT_ROW_SIZE);
+					lv_staged = m_journal.Stage(JOURNAL_TARGET_P1FLASH, MEM_RULES_OFFSET + row_index*RT_ROW_SIZE, &tmpRow, sizeof(tmpRow));
 	#endif
-					rowptr->data.flash_flag = SAVED; //toggle flash flag
+					if( lv_staged ) rowptr->data.flash_flag = SAVED; //toggle flash flag
+					else success_flag = false;
 				}
 				else
 				{
@@ -1911,6 +2051,7 @@ BOOL ConfigClass::LoadNodeIDList()
 // Save NodeID List
 BOOL ConfigClass::SaveNodeIDList()
 {
+	lstNodes.checkpoint(Time.now());
 	if( !IsNIDChanged() ) return true;
 
 	BOOL rc = lstNodes.saveList();
@@ -1921,3 +2062,99 @@ BOOL ConfigClass::SaveNodeIDList()
 	}
 	return rc;
 }
+
+// Load lamp group membership
+BOOL ConfigClass::LoadGroupTable()
+{
+	memset(m_groups, 0x00, sizeof(m_groups));
+	m_grpDirty = 0;
+#ifdef MCU_TYPE_P1
+	if( GRP_ROW_SIZE * MAX_GROUP_NUM > MEM_GROUPS_LEN ) {
+		LOGW(LOGTAG_MSG, "Failed to load group table, too large.");
+		return false;
+	}
+	if( !P1Flash->read<GroupRow_t[MAX_GROUP_NUM]>(m_groups, MEM_GROUPS_OFFSET) ) {
+		memset(m_groups, 0x00, sizeof(m_groups));
+		LOGW(LOGTAG_MSG, "Failed to read the group table from flash.");
+		return false;
+	}
+	m_journal.Overlay(JOURNAL_TARGET_P1FLASH, MEM_GROUPS_OFFSET, m_groups, sizeof(m_groups));
+	for( UC i = 0; i < MAX_GROUP_NUM; i++ ) {
+		// Erased or trash row
+		if( m_groups[i].flag != GROUP_ROW_VALID ) memset(m_groups + i, 0x00, GRP_ROW_SIZE);
+	}
+#endif
+	return true;
+}
+
+// Save changed group rows
+BOOL ConfigClass::SaveGroupTable()
+{
+	if( !m_grpDirty ) return true;
+
+	BOOL rc = true;
+	for( UC i = 0; i < MAX_GROUP_NUM; i++ ) {
+		if( !(m_grpDirty & (1UL << i)) ) continue;
+#ifdef MCU_TYPE_P1
+		if( !m_journal.Stage(JOURNAL_TARGET_P1FLASH, MEM_GROUPS_OFFSET + i * GRP_ROW_SIZE, m_groups + i, GRP_ROW_SIZE) ) {
+			LOGE(LOGTAG_MSG, "Unable to write group %d to flash", NODEID_MIN_GROUP + i);
+			rc = false;
+			continue;
+		}
+#endif
+		m_grpDirty &= ~(1UL << i);
+	}
+	if( rc ) LOGD(LOGTAG_MSG, "Group table saved.");
+	return rc;
+}
+
+BOOL ConfigClass::IsGroupMember(const UC _gid, const UC _nid)
+{
+	if( !IS_GROUP_NODEID(_gid) || _nid > NODEID_MAX_DEVCIE ) return false;
+	return( (m_groups[_gid - NODEID_MIN_GROUP].members[_nid / 8] & (1 << (_nid % 8))) > 0 );
+}
+
+BOOL ConfigClass::SetGroupMember(const UC _gid, const UC _nid, const BOOL _on)
+{
+	if( !IS_GROUP_NODEID(_gid) || IS_NOT_DEVICE_NODEID(_nid) ) return false;
+	if( IsGroupMember(_gid, _nid) == _on ) return true;
+
+	UC _index = _gid - NODEID_MIN_GROUP;
+	if( _on ) {
+		m_groups[_index].members[_nid / 8] |= (1 << (_nid % 8));
+	} else {
+		m_groups[_index].members[_nid / 8] &= ~(1 << (_nid % 8));
+	}
+	m_groups[_index].flag = (GetGroupSize(_gid) > 0 ? GROUP_ROW_VALID : 0x00);
+	m_grpDirty |= (1UL << _index);
+	return true;
+}
+
+const UC *ConfigClass::GetGroupMembers(const UC _gid)
+{
+	if( !IS_GROUP_NODEID(_gid) ) return NULL;
+	return m_groups[_gid - NODEID_MIN_GROUP].members;
+}
+
+UC ConfigClass::GetGroupSize(const UC _gid)
+{
+	if( !IS_GROUP_NODEID(_gid) ) return 0;
+	UC _count = 0;
+	for( UC _nid = 0; _nid <= NODEID_MAX_DEVCIE; _nid++ ) {
+		if( IsGroupMember(_gid, _nid) ) _count++;
+	}
+	return _count;
+}
+
+void ConfigClass::showGroups()
+{
+	SERIAL_LN("\n\r**Lamp Groups**");
+	for( UC _gid = NODEID_MIN_GROUP; _gid <= NODEID_MAX_GROUP; _gid++ ) {
+		if( GetGroupSize(_gid) == 0 ) continue;
+		SERIAL("Group%d:", _gid);
+		for( UC _nid = 0; _nid <= NODEID_MAX_DEVCIE; _nid++ ) {
+			if( IsGroupMember(_gid, _nid) ) SERIAL(" %d", _nid);
+		}
+		SERIAL_LN("");
+	}
+}
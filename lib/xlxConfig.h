@@ -8,6 +8,7 @@
 #include "TimeAlarms.h"
 #include "OrderedList.h"
 #include "flashee-eeprom.h"
+#include "FlashJournal.h"
 
 /*Note: if any of these structures are modified, the following print functions may need updating:
  - ConfigClass::print_config()
@@ -217,6 +218,9 @@ typedef struct
 #define SCT_ROW_SIZE	sizeof(ScheduleRow_t)
 #define MAX_SCT_ROWS	(int)(MEM_SCHEDULE_LEN / SCT_ROW_SIZE)
 
+// Every schedule row may hold an alarm, the rest is left for timers
+static_assert(MAX_SCT_ROWS < dtNBR_ALARMS, "dtNBR_ALARMS must cover MAX_SCT_ROWS");
+
 //------------------------------------------------------------------
 // Xlight NodeID List
 //------------------------------------------------------------------
@@ -349,14 +353,36 @@ typedef struct
 #define NCT_ROW_SIZE	    sizeof(NodeConfig_t)
 #define MAX_NCT_ROWS	    (int)(MEM_NODECONFIG_LEN / NCT_ROW_SIZE)
 
+//------------------------------------------------------------------
+// Xlight Lamp Group Table Structures
+//------------------------------------------------------------------
+#define GROUP_ROW_VALID       0x5A
+
+typedef struct
+#ifdef PACK
+	__attribute__((packed))
+#endif
+{
+  UC flag;                              // GROUP_ROW_VALID if row is in use
+  UC members[GROUP_MEMBER_BYTES];       // Bitmap of lamp NodeIDs
+} GroupRow_t;
+
+#define GRP_ROW_SIZE	    sizeof(GroupRow_t)
+
 // Node List Class
+#define NODELIST_INDEX_NONE     0xFF
+
+#if MAX_NODE_PER_CONTROLLER > 64
+#error "NodeListClass::m_dirtyRows holds 64 rows"
+#endif
+
 class NodeListClass : public OrderdList<NodeIdRow_t>
 {
 public:
-  bool m_isChanged;
+  bool m_isChanged;         // Whole list to be saved
 
   NodeListClass(uint8_t maxl = 64, bool desc = false, uint8_t initlen = 8) : OrderdList(maxl, desc, initlen) {
-    m_isChanged = false; };
+    m_isChanged = false; m_lastCheckpoint = 0; markClean(); reindex(); };
   virtual int compare(NodeIdRow_t _first, NodeIdRow_t _second) {
     if( _first.nid > _second.nid ) {
       return 1;
@@ -370,12 +396,35 @@ public:
   int getFlashSize();
   bool loadList();
   bool saveList();
+  BOOL touchNode(UC nid, UL now);
+  void checkpoint(UL now, BOOL force = false);
+  void markClean() { m_dirtyRows = 0; memset(m_activeFlags, 0x00, sizeof(m_activeFlags)); }
+  BOOL isDirty() { return( m_isChanged || m_dirtyRows != 0 ); }
+  UC getDirtyCount();
   void showList(BOOL toCloud = false, UC nid = 0);
   void publishNode(NodeIdRow_t _node);
   UC requestNodeID(UC preferID, char type, uint64_t identity);
   BOOL clearNodeId(UC nodeID);
 
+  // Keep position index in sync, rows that moved or changed are marked to be saved
+  virtual int update(NodeIdRow_t *_pT);
+  virtual int add(NodeIdRow_t *_pT);
+  virtual bool remove(NodeIdRow_t *_pT);
+  virtual void removeAll();
+
 protected:
+  // NodeID -> position in _pItems, NODELIST_INDEX_NONE if absent
+  UC m_posIndex[256];
+  uint64_t m_dirtyRows;     // Bitmap of rows (positions) to be saved
+  UC m_activeFlags[32];     // Bitmap of NodeIDs active since the last checkpoint
+  UL m_lastCheckpoint;
+
+  void markRows(int first, int last);
+
+  // O(1) lookup via position index
+  virtual int search(NodeIdRow_t *_pT, bool bReplace = false);
+  void reindex();
+
   UC getAvailableNodeId(UC preferID, UC defaultID, UC minID, UC maxID, uint64_t identity);
 };
 
@@ -395,6 +444,10 @@ private:
 
   Config_t m_config;
   Flashee::FlashDevice* P1Flash;
+  Flashee::EepromFlashDevice m_eepromDevice;
+  CFlashJournal m_journal;    // Write-back journal of table rows
+  GroupRow_t m_groups[MAX_GROUP_NUM];
+  UL m_grpDirty;              // Bitmap of group rows to be saved
 
   void UpdateTimeZone();
   void DoTimeSync();
@@ -408,9 +461,17 @@ public:
 	  return P1Flash;
   }
 
+  CFlashJournal& getJournal()
+  {
+	  return m_journal;
+  }
+
   // write to P1 using spark-flashee-eeprom
   BOOL MemWriteScenarioRow(ScenarioRow_t row, uint32_t address);
   BOOL MemReadScenarioRow(ScenarioRow_t &row, uint32_t address);
+  BOOL MemReadScheduleRow(ScheduleRow_t &row, uint32_t address);
+
+  BOOL FlushJournal(BOOL force = false);
 
   BOOL LoadConfig();
   BOOL SaveConfig();
@@ -433,6 +494,14 @@ public:
   BOOL SaveNodeIDList();
   BOOL LoadBackupNodeList();
 
+  BOOL LoadGroupTable();
+  BOOL SaveGroupTable();
+  BOOL IsGroupMember(const UC _gid, const UC _nid);
+  BOOL SetGroupMember(const UC _gid, const UC _nid, const BOOL _on = true);
+  const UC *GetGroupMembers(const UC _gid);
+  UC GetGroupSize(const UC _gid);
+  void showGroups();
+
   BOOL IsConfigChanged();
   void SetConfigChanged(BOOL flag);
 
@@ -0,0 +1,367 @@
+/**
+ * xlxJsonCmd.cpp - Xlight streaming JSON command parser
+ *
+ * DESCRIPTION
+ * 1. Decode cloud JSON commands character by character into JsonCmd_t
+ * 2. Keys are case sensitive, strings may be enclosed in single or double quotes
+ * 3. Integer keys accept numbers, numeric strings and true/false
+ * 4. Chunked input ({'x0':...}, {'x1':...}, tail) is decoded as it arrives
+**/
+
+#include "xlxJsonCmd.h"
+
+// Parser states
+#define JPS_VALUE                   0       // Expect a value
+#define JPS_ELEMENT                 1       // Expect the first element or ']'
+#define JPS_KEY                     2       // Expect a key or '}'
+#define JPS_COLON                   3
+#define JPS_NEXT                    4       // Expect ',' or closing bracket
+#define JPS_STRING                  5
+#define JPS_ESCAPE                  6
+#define JPS_NUMBER                  7
+#define JPS_LITERAL                 8
+#define JPS_DONE                    9
+#define JPS_ERROR                   10
+
+// Key names, indexed by JCMD_KEY_*
+static const char *s_jcmdKeys[] = {
+  "cmd", "nd", "sid", "state", "hw", "value", "SNT_id", "reset", "Ring",
+  "filter", "msg", "ack", "tag", "ring", "dt", "data", "pl"
+};
+
+#define JCMD_NUM_KEYS               (sizeof(s_jcmdKeys) / sizeof(s_jcmdKeys[0]))
+
+//------------------------------------------------------------------
+// Xlight JSON Command Parser Class
+//------------------------------------------------------------------
+JsonCmdParserClass::JsonCmdParserClass()
+{
+  Reset();
+}
+
+void JsonCmdParserClass::Reset()
+{
+  // Members are valid only when flagged in keys
+  m_cmd.keys = 0;
+  m_cmd.ringLen = 0;
+  m_cmd.dtLen = 0;
+  m_cmd.text[0] = '\0';
+  m_state = JPS_VALUE;
+  m_depth = 0;
+  m_objects = 0;
+  m_key = JCMD_KEY_NONE;
+  m_index = 0;
+  m_quote = '"';
+  m_isKey = false;
+  m_chunked = false;
+  m_tokLen = 0;
+  m_textLen = 0;
+}
+
+// Decode one cloud message
+/// Return value:
+/// JCMD_RC_DONE - command is complete, can be executed
+/// JCMD_RC_MORE - waiting for more chunks
+/// JCMD_RC_ERROR - error
+int JsonCmdParserClass::Feed(const char *f_in, US f_len)
+{
+  US lv_start, lv_end;
+  UC lv_chunk = ParseChunk(f_in, f_len, &lv_start, &lv_end);
+  if( lv_chunk != JCMD_CHUNK_NONE ) {
+    if( lv_chunk == JCMD_CHUNK_FIRST ) {
+      Reset();
+      m_chunked = true;
+    } else if( !m_chunked ) {
+      return JCMD_RC_ERROR;
+    }
+
+    // Envelope value is part of the command, decode it in place
+    for( US i = lv_start; i < lv_end; i++ ) {
+      char c = f_in[i];
+      if( c == '\\' ) c = Unescape(f_in[++i]);
+      if( !Push(c) ) {
+        m_chunked = false;
+        return JCMD_RC_ERROR;
+      }
+    }
+    return JCMD_RC_MORE;
+  }
+
+  // Whole command, or the tail of a chunked one
+  if( !m_chunked ) Reset();
+  m_chunked = false;
+  for( US i = 0; i < f_len; i++ ) {
+    if( !Push(f_in[i]) ) return JCMD_RC_ERROR;
+  }
+  return( m_state == JPS_DONE ? JCMD_RC_DONE : JCMD_RC_ERROR );
+}
+
+// Advance the state machine by one character
+bool JsonCmdParserClass::Push(char c)
+{
+  switch( m_state ) {
+  case JPS_STRING:
+    if( c == m_quote ) return EndString();
+    if( c == '\\' ) {
+      m_state = JPS_ESCAPE;
+      return true;
+    }
+    return PutChar(c);
+
+  case JPS_ESCAPE:
+    m_state = JPS_STRING;
+    return PutChar(Unescape(c));
+
+  case JPS_NUMBER:
+  case JPS_LITERAL:
+    if( isalnum(c) || c == '.' || c == '+' || c == '-' ) return PutChar(c);
+    // Delimiter ends the token and is processed below
+    if( !EndScalar(false) ) return false;
+    break;
+
+  case JPS_ERROR:
+    return false;
+  }
+
+  if( c == ' ' || c == '\t' || c == '\r' || c == '\n' ) return true;
+
+  switch( m_state ) {
+  case JPS_ELEMENT:
+    if( c == ']' ) return Close(c);
+    // Fall through
+  case JPS_VALUE:
+    if( c == '{' || c == '[' ) return Open(c);
+    if( m_depth == 0 ) break;
+    m_tokLen = 0;
+    m_isKey = false;
+    if( c == '"' || c == '\'' ) {
+      m_quote = c;
+      if( m_depth == 1 && (m_key == JCMD_KEY_DATA || m_key == JCMD_KEY_PL) ) m_textLen = 0;
+      m_state = JPS_STRING;
+      return true;
+    }
+    if( c == '-' || isdigit(c) ) {
+      m_state = JPS_NUMBER;
+      return PutChar(c);
+    }
+    if( isalpha(c) ) {
+      m_state = JPS_LITERAL;
+      return PutChar(c);
+    }
+    break;
+
+  case JPS_KEY:
+    if( c == '}' ) return Close(c);
+    if( c == '"' || c == '\'' ) {
+      m_quote = c;
+      m_tokLen = 0;
+      m_isKey = true;
+      m_state = JPS_STRING;
+      return true;
+    }
+    break;
+
+  case JPS_COLON:
+    if( c == ':' ) {
+      m_state = JPS_VALUE;
+      return true;
+    }
+    break;
+
+  case JPS_NEXT:
+    if( c == ',' ) {
+      if( InObject() ) {
+        m_state = JPS_KEY;
+      } else {
+        if( m_depth == 2 ) m_index++;
+        m_state = JPS_VALUE;
+      }
+      return true;
+    }
+    if( c == '}' || c == ']' ) return Close(c);
+    break;
+  }
+
+  m_state = JPS_ERROR;
+  return false;
+}
+
+bool JsonCmdParserClass::Open(char c)
+{
+  if( m_depth >= JCMD_MAX_DEPTH || (m_depth == 0 && c != '{') ) {
+    m_state = JPS_ERROR;
+    return false;
+  }
+
+  if( c == '{' ) {
+    m_objects |= (1 << m_depth);
+    m_state = JPS_KEY;
+  } else {
+    m_objects &= ~(1 << m_depth);
+    m_state = JPS_ELEMENT;
+  }
+  m_depth++;
+
+  if( m_depth == 1 ) {
+    m_key = JCMD_KEY_NONE;
+  } else if( m_depth == 2 && c == '[' ) {
+    m_index = 0;
+    UC *lv_pLen, lv_size;
+    if( ArrayTarget(&lv_pLen, &lv_size) ) {
+      *lv_pLen = 0;
+      m_cmd.keys |= (1UL << m_key);
+    }
+  }
+  return true;
+}
+
+bool JsonCmdParserClass::Close(char c)
+{
+  if( m_depth == 0 || (c == '}') != InObject() ) {
+    m_state = JPS_ERROR;
+    return false;
+  }
+
+  m_depth--;
+  m_state = (m_depth == 0 ? JPS_DONE : JPS_NEXT);
+  return true;
+}
+
+bool JsonCmdParserClass::PutChar(char c)
+{
+  if( !m_isKey && m_state == JPS_STRING && m_depth == 1 && (m_key == JCMD_KEY_DATA || m_key == JCMD_KEY_PL) ) {
+    // Keep room for the terminator, reject rather than truncate
+    if( m_textLen >= JCMD_TEXT_SIZE - 1 ) {
+      m_state = JPS_ERROR;
+      return false;
+    }
+    m_cmd.text[m_textLen++] = c;
+  } else if( m_tokLen < JCMD_TOKEN_SIZE - 1 ) {
+    // A longer token can't match any key nor fit into a byte or long
+    m_token[m_tokLen++] = c;
+  }
+  return true;
+}
+
+bool JsonCmdParserClass::EndString()
+{
+  if( m_isKey ) {
+    m_token[m_tokLen] = '\0';
+    if( m_depth == 1 ) m_key = LookupKey();
+    m_isKey = false;
+    m_state = JPS_COLON;
+    return true;
+  }
+  return EndScalar(true);
+}
+
+bool JsonCmdParserClass::EndScalar(bool f_isString)
+{
+  m_token[m_tokLen] = '\0';
+  if( !f_isString && m_state == JPS_LITERAL ) {
+    if( strcmp(m_token, "true") && strcmp(m_token, "false") && strcmp(m_token, "null") ) {
+      m_state = JPS_ERROR;
+      return false;
+    }
+  }
+  m_state = JPS_NEXT;
+
+  if( m_depth == 1 ) {
+    if( m_key < JCMD_NUM_VALUES ) {
+      m_cmd.value[m_key] = TokenValue();
+      m_cmd.keys |= (1UL << m_key);
+    } else if( f_isString && (m_key == JCMD_KEY_DATA || m_key == JCMD_KEY_PL) ) {
+      m_cmd.text[m_textLen] = '\0';
+      m_cmd.keys |= (1UL << m_key);
+    }
+  } else if( m_depth == 2 && !InObject() ) {
+    UC *lv_pLen, lv_size;
+    UC *lv_pArray = ArrayTarget(&lv_pLen, &lv_size);
+    if( lv_pArray && m_index < lv_size ) {
+      lv_pArray[m_index] = (UC)TokenValue();
+      *lv_pLen = m_index + 1;
+    }
+  }
+  return true;
+}
+
+UC JsonCmdParserClass::LookupKey()
+{
+  for( UC i = 0; i < JCMD_NUM_KEYS; i++ ) {
+    if( m_token[0] == s_jcmdKeys[i][0] && strcmp(m_token, s_jcmdKeys[i]) == 0 ) return i;
+  }
+  return JCMD_KEY_NONE;
+}
+
+long JsonCmdParserClass::TokenValue()
+{
+  if( strcmp(m_token, "true") == 0 ) return 1;
+  return strtol(m_token, NULL, 10);
+}
+
+// Destination of the root member array being decoded
+UC *JsonCmdParserClass::ArrayTarget(UC **f_ppLen, UC *f_pSize)
+{
+  if( m_key == JCMD_KEY_RING ) {
+    *f_ppLen = &m_cmd.ringLen;
+    *f_pSize = JCMD_RING_SIZE;
+    return m_cmd.ring;
+  } else if( m_key == JCMD_KEY_DT ) {
+    *f_ppLen = &m_cmd.dtLen;
+    *f_pSize = MAX_PAYLOAD;
+    return m_cmd.dt;
+  }
+  return NULL;
+}
+
+// Recognize a chunk envelope, i.e. {'x0':'...'} or {'x1':'...'}
+/// f_pStart and f_pEnd delimit the raw (still escaped) envelope value
+UC JsonCmdParserClass::ParseChunk(const char *f_in, US f_len, US *f_pStart, US *f_pEnd)
+{
+  US i = 0;
+  UC lv_chunk;
+  char lv_quote;
+
+  while( i < f_len && isspace(f_in[i]) ) i++;
+  if( i >= f_len || f_in[i++] != '{' ) return JCMD_CHUNK_NONE;
+  while( i < f_len && isspace(f_in[i]) ) i++;
+  if( i + 4 > f_len ) return JCMD_CHUNK_NONE;
+  lv_quote = f_in[i];
+  if( (lv_quote != '"' && lv_quote != '\'') || f_in[i + 1] != 'x' || f_in[i + 3] != lv_quote ) return JCMD_CHUNK_NONE;
+  if( f_in[i + 2] == '0' ) {
+    lv_chunk = JCMD_CHUNK_FIRST;
+  } else if( f_in[i + 2] == '1' ) {
+    lv_chunk = JCMD_CHUNK_NEXT;
+  } else {
+    return JCMD_CHUNK_NONE;
+  }
+  i += 4;
+  while( i < f_len && isspace(f_in[i]) ) i++;
+  if( i >= f_len || f_in[i++] != ':' ) return JCMD_CHUNK_NONE;
+  while( i < f_len && isspace(f_in[i]) ) i++;
+  if( i >= f_len || (f_in[i] != '"' && f_in[i] != '\'') ) return JCMD_CHUNK_NONE;
+  lv_quote = f_in[i++];
+  *f_pStart = i;
+  while( i < f_len && f_in[i] != lv_quote ) {
+    if( f_in[i] == '\\' ) i++;
+    i++;
+  }
+  if( i >= f_len ) return JCMD_CHUNK_NONE;
+  *f_pEnd = i++;
+  while( i < f_len && isspace(f_in[i]) ) i++;
+  if( i >= f_len || f_in[i++] != '}' ) return JCMD_CHUNK_NONE;
+  while( i < f_len && isspace(f_in[i]) ) i++;
+  return( i == f_len ? lv_chunk : JCMD_CHUNK_NONE );
+}
+
+char JsonCmdParserClass::Unescape(char c)
+{
+  switch( c ) {
+  case 'b': return '\b';
+  case 'f': return '\f';
+  case 'n': return '\n';
+  case 'r': return '\r';
+  case 't': return '\t';
+  }
+  return c;
+}
@@ -0,0 +1,106 @@
+//  xlxJsonCmd.h - Xlight streaming JSON command parser
+
+#ifndef xlxJsonCmd_h
+#define xlxJsonCmd_h
+
+#include "xliCommon.h"
+#include "MyMessage.h"
+
+// Keys of the command schema. Keys below JCMD_NUM_VALUES carry an integer
+#define JCMD_KEY_CMD                0
+#define JCMD_KEY_ND                 1
+#define JCMD_KEY_SID                2
+#define JCMD_KEY_STATE              3
+#define JCMD_KEY_HW                 4
+#define JCMD_KEY_VALUE              5
+#define JCMD_KEY_SNT_ID             6
+#define JCMD_KEY_RESET              7
+#define JCMD_KEY_RING_ID            8
+#define JCMD_KEY_FILTER             9
+#define JCMD_KEY_MSG                10
+#define JCMD_KEY_ACK                11
+#define JCMD_KEY_TAG                12
+#define JCMD_NUM_VALUES             13
+#define JCMD_KEY_RING               13      // byte array
+#define JCMD_KEY_DT                 14      // byte array
+#define JCMD_KEY_DATA               15      // string
+#define JCMD_KEY_PL                 16      // string
+#define JCMD_KEY_NONE               0xFF
+
+#define JCMD_RING_SIZE              7
+#define JCMD_TEXT_SIZE              128
+#define JCMD_MAX_DEPTH              8
+#define JCMD_TOKEN_SIZE             12
+
+// Return value of Feed()
+#define JCMD_RC_ERROR               -1
+#define JCMD_RC_DONE                0
+#define JCMD_RC_MORE                1
+
+typedef struct
+{
+  UL keys;                                  // Bitmap of keys present
+  long value[JCMD_NUM_VALUES];
+  UC ring[JCMD_RING_SIZE];
+  UC ringLen;
+  UC dt[MAX_PAYLOAD];
+  UC dtLen;
+  char text[JCMD_TEXT_SIZE];                // "data" or "pl", whichever comes last
+} JsonCmd_t;
+
+//------------------------------------------------------------------
+// Xlight JSON Command Parser Class
+//------------------------------------------------------------------
+// Single pass pull parser that decodes a command object straight into
+// JsonCmd_t without building a DOM. Values of unknown keys and nested
+// containers are skipped. Input split into {'x0':'...'}, {'x1':'...'} and a
+// tail message is decoded chunk by chunk, nothing is concatenated or reparsed.
+class JsonCmdParserClass
+{
+public:
+  JsonCmdParserClass();
+
+  void Reset();
+  int Feed(const char *f_in, US f_len);
+  bool Push(char c);
+  bool IsPending() { return m_chunked; }
+
+  const JsonCmd_t &GetCommand() { return m_cmd; }
+  bool Has(UC f_key) { return( (m_cmd.keys & (1UL << f_key)) != 0 ); }
+  long Get(UC f_key, long f_def = 0) { return( Has(f_key) && f_key < JCMD_NUM_VALUES ? m_cmd.value[f_key] : f_def ); }
+  const char *GetText() { return m_cmd.text; }
+
+  static UC ParseChunk(const char *f_in, US f_len, US *f_pStart, US *f_pEnd);
+  static char Unescape(char c);
+
+protected:
+  JsonCmd_t m_cmd;
+  UC m_state;
+  UC m_depth;
+  UC m_objects;                             // Bit n set: container at depth n is an object
+  UC m_key;                                 // Current key of the root object
+  UC m_index;                               // Element index of a root member array
+  char m_quote;
+  bool m_isKey;
+  bool m_chunked;
+  UC m_tokLen;
+  US m_textLen;
+  char m_token[JCMD_TOKEN_SIZE];
+
+  bool Open(char c);
+  bool Close(char c);
+  bool PutChar(char c);
+  bool EndString();
+  bool EndScalar(bool f_isString);
+  UC LookupKey();
+  long TokenValue();
+  bool InObject() { return( (m_objects & (1 << (m_depth - 1))) != 0 ); }
+  UC *ArrayTarget(UC **f_ppLen, UC *f_pSize);
+};
+
+// ParseChunk() result
+#define JCMD_CHUNK_NONE             0
+#define JCMD_CHUNK_FIRST            1       // {'x0':'...'}
+#define JCMD_CHUNK_NEXT             2       // {'x1':'...'}
+
+#endif /* xlxJsonCmd_h */
@@ -20,17 +20,93 @@
  * DESCRIPTION
  * 1. Define basic interfaces
  * 2. Serial logging
+ * 3. Flash logging: binary records (format id + raw arguments) in a ring
+ *    that overwrites the oldest page, formatted only on read-out
  *
  * ToDo:
  * 1. syslog, refer to psyslog.cpp
  * 2. http/cloud
- * 3. Flash
- * 4. Offline Data Cache in Flash (loop overwrite)
 **/
 
 #include "xlxLogger.h"
+#include "xlxConfig.h"
 #include "xlSmartController.h"
 
+// Format strings in the firmware image are referred to by address
+#define LOGF_ROM_START        0x08000000
+#define LOGF_ROM_END          0x08100000
+
+// User firmware module: module_info_t (start and end address first) at its
+// start; the suffix with the SHA-256 of the image just before its end and
+// the CRC-32 at its end, both written by the build tools
+#define LOGF_MODULE_START     0x080A0000
+#define LOGF_MODULE_SIZE      0x00020000
+#define LOGF_MODULE_SUFFIX    36          // SHA-256 and its size field, before the end
+
+// Argument kinds of a conversion
+#define LOGF_ARG_NONE         0         // %% or unknown, no argument
+#define LOGF_ARG_INT          1
+#define LOGF_ARG_LONG         2
+#define LOGF_ARG_LLONG        3
+#define LOGF_ARG_SIZE         4
+#define LOGF_ARG_DOUBLE       5
+#define LOGF_ARG_STR          6
+#define LOGF_ARG_PTR          7
+
+typedef struct
+{
+  UC len;                   // Characters of the conversion incl. '%'
+  UC stars;                 // '*' width / precision, each takes an int
+  UC kind;                  // LOGF_ARG_*
+} LogSpec_t;
+
+// Parse the conversion starting with '%' at _p
+static void ParseLogSpec(const char *_p, LogSpec_t *_spec)
+{
+  const char *lv_p = _p + 1;
+  UC lv_long = 0;
+  BOOL lv_size = false;
+  _spec->stars = 0;
+  while( *lv_p && strchr("-+ #0", *lv_p) ) lv_p++;
+  if( *lv_p == '*' ) { _spec->stars++; lv_p++; }
+  while( *lv_p >= '0' && *lv_p <= '9' ) lv_p++;
+  if( *lv_p == '.' ) {
+    lv_p++;
+    if( *lv_p == '*' ) { _spec->stars++; lv_p++; }
+    while( *lv_p >= '0' && *lv_p <= '9' ) lv_p++;
+  }
+  while( *lv_p && strchr("hlLjzt", *lv_p) ) {
+    if( *lv_p == 'l' ) lv_long++;
+    else if( *lv_p == 'j' ) lv_long = 2;
+    else if( *lv_p == 'z' || *lv_p == 't' ) lv_size = true;
+    lv_p++;
+  }
+
+  switch( *lv_p ) {
+  case 'd': case 'i': case 'u': case 'x': case 'X': case 'o':
+    _spec->kind = (lv_long >= 2 ? LOGF_ARG_LLONG : (lv_long ? LOGF_ARG_LONG : (lv_size ? LOGF_ARG_SIZE : LOGF_ARG_INT)));
+    break;
+  case 'c':
+    _spec->kind = LOGF_ARG_INT;
+    break;
+  case 'f': case 'F': case 'e': case 'E': case 'g': case 'G':
+    _spec->kind = LOGF_ARG_DOUBLE;
+    break;
+  case 's':
+    _spec->kind = LOGF_ARG_STR;
+    break;
+  case 'p':
+    _spec->kind = LOGF_ARG_PTR;
+    break;
+  default:
+    _spec->kind = LOGF_ARG_NONE;
+    _spec->stars = 0;
+    break;
+  }
+  if( *lv_p ) lv_p++;
+  _spec->len = lv_p - _p;
+}
+
 // the one and only instance of LoggerClass
 LoggerClass theLog = LoggerClass();
 char strDestNames[][7] = {"serial", "flash", "syslog", "cloud", "all"};
@@ -45,6 +121,30 @@ LoggerClass::LoggerClass()
   m_level[LOGDEST_FLASH] = LEVEL_WARNING;
   m_level[LOGDEST_SYSLOG] = LEVEL_INFO;
   m_level[LOGDEST_CLOUD] = LEVEL_NOTICE;
+  UpdateMaxLevel();
+  m_buildId = 0;
+}
+
+// FNV-1a step
+static UL HashBytes(UL _hash, const UC *_data, UL _len)
+{
+  while( _len-- ) _hash = (_hash ^ *_data++) * 16777619UL;
+  return _hash;
+}
+
+// Identity of the running binary: system firmware version, then the SHA-256 and
+/// CRC-32 of the user module, or the whole module slot if its header is unusual
+UL LoggerClass::GetImageId()
+{
+  UL lv_version = System.versionNumber();
+  UL lv_id = HashBytes(2166136261UL, (const UC *)&lv_version, sizeof(lv_version));
+  const UL *lv_info = (const UL *)LOGF_MODULE_START;
+  UL lv_end = lv_info[1];
+  if( lv_info[0] == LOGF_MODULE_START && lv_end >= LOGF_MODULE_START + LOGF_MODULE_SUFFIX
+      && lv_end <= LOGF_MODULE_START + LOGF_MODULE_SIZE - 4 ) {
+    return HashBytes(lv_id, (const UC *)(lv_end - LOGF_MODULE_SUFFIX), LOGF_MODULE_SUFFIX + 4);
+  }
+  return HashBytes(lv_id, (const UC *)LOGF_MODULE_START, LOGF_MODULE_SIZE);
 }
 
 void LoggerClass::Init(String sysid)
@@ -52,9 +152,13 @@ void LoggerClass::Init(String sysid)
   m_SysID = sysid;
 }
 
+// Flash log ring on P1 external flash
 BOOL LoggerClass::InitFlash(UL addr, UL size)
 {
-  //ToDo:
+  if( !m_buildId ) m_buildId = GetImageId();
+  if( !m_flashRing.Init(theConfig.getP1Flash(), addr, size) ) return false;
+  // Format ids of an older build don't apply, new records start a page of their own
+  if( m_flashRing.GetHeadTag() != m_buildId ) m_flashRing.Seal();
   return true;
 }
 
@@ -82,39 +186,291 @@ void LoggerClass::SetLevel(UC logDest, UC logLevel)
 {
   if( logDest < LOGDEST_DUMMY)
   {
-    if( m_level[logDest] != logLevel )
+    if( m_level[logDest] != logLevel ) {
       m_level[logDest] = logLevel;
+      UpdateMaxLevel();
+    }
   }
 }
 
+// Destinations served by WriteLog()
+void LoggerClass::UpdateMaxLevel()
+{
+  m_maxLevel = max(m_level[LOGDEST_SERIAL], max(m_level[LOGDEST_FLASH], m_level[LOGDEST_CLOUD]));
+}
+
 void LoggerClass::WriteLog(UC level, const char *tag, const char *msg, ...)
 {
-  int nSize = 0;
+  // Resolve destinations before touching the arguments
+  BOOL lv_toSerial = (level <= m_level[LOGDEST_SERIAL]);
+  BOOL lv_toCloud = (level <= m_level[LOGDEST_CLOUD]);
+  BOOL lv_toFlash = (level <= m_level[LOGDEST_FLASH] && m_flashRing.IsReady());
+  if( !lv_toSerial && !lv_toCloud && !lv_toFlash ) return;
+
+  va_list args;
+  // Flash gets the raw arguments, they are formatted on read-out
+  if( lv_toFlash ) {
+    va_start(args, msg);
+    WriteFlash(level, tag, msg, args);
+    va_end(args);
+  }
+  if( !lv_toSerial && !lv_toCloud ) return;
+
   char buf[MAX_MESSAGE_LEN];
 
   // Prepare message
   int nPos = snprintf(buf, MAX_MESSAGE_LEN, "%02d:%02d:%02d %d %s ",
       Time.hour(), Time.minute(), Time.second(), level, tag);
-  va_list args;
   va_start(args, msg);
-  nSize = vsnprintf(buf + nPos, MAX_MESSAGE_LEN - nPos, msg, args);
+  vsnprintf(buf + nPos, MAX_MESSAGE_LEN - nPos, msg, args);
+  va_end(args);
 
   // Send message to serial port
-  if( level <= m_level[LOGDEST_SERIAL] )
+  if( lv_toSerial )
   {
     TheSerial.println(buf);
   }
 
   // Output Log to Particle cloud variable
-  if( level <= m_level[LOGDEST_CLOUD] ) {
+  if( lv_toCloud ) {
     theSys.PublishLog(buf);
   }
 
   // ToDo: send log to other destinations
   //if( level <= m_level[LOGDEST_SYSLOG] ) {
   //;}
-  //if( level <= m_level[LOGDEST_FLASH] ) {
-  //}
+}
+
+void LoggerClass::WriteFlash(UC level, const char *tag, const char *msg, va_list args)
+{
+  UC lv_rec[LOGF_MAX_RECORD];
+  uint32_t lv_utc = Time.now();
+  US lv_ms = millis() % 1000;
+  uint32_t lv_fmtId = (uint32_t)(uintptr_t)msg;
+  UC lv_len = LOGF_HEADER_LEN;
+
+  lv_rec[0] = level;
+  for( UC i = 0; i < 3; i++ ) lv_rec[1 + i] = (tag && i < strlen(tag) ? tag[i] : ' ');
+  memcpy(lv_rec + 4, &lv_utc, 4);
+  memcpy(lv_rec + 8, &lv_ms, 2);
+  if( lv_fmtId < LOGF_ROM_START || lv_fmtId >= LOGF_ROM_END ) {
+    // Not in the firmware image, keep the format itself
+    UC lv_fmtLen = min(strlen(msg), (size_t)(LOGF_MAX_RECORD - LOGF_HEADER_LEN - 1));
+    lv_fmtId = 0;
+    lv_rec[lv_len++] = lv_fmtLen;
+    memcpy(lv_rec + lv_len, msg, lv_fmtLen);
+    lv_len += lv_fmtLen;
+  }
+  memcpy(lv_rec + 10, &lv_fmtId, 4);
+  lv_len += PackArgs(lv_rec + lv_len, sizeof(lv_rec) - lv_len, msg, args);
+  m_flashRing.Append(lv_rec, lv_len, m_buildId);
+}
+
+// Raw arguments of fmt in the order of the conversions, strings as length +
+// chars (at most LOGF_MAX_STR). Return the bytes packed, arguments that
+// don't fit are dropped
+UC LoggerClass::PackArgs(UC *buf, UC size, const char *fmt, va_list args)
+{
+  UC lv_len = 0;
+  LogSpec_t lv_spec;
+  for( const char *p = strchr(fmt, '%'); p != NULL; p = strchr(p, '%') ) {
+    ParseLogSpec(p, &lv_spec);
+    p += lv_spec.len;
+
+    union {
+      int i;
+      long l;
+      long long ll;
+      size_t z;
+      double d;
+      void *ptr;
+    } lv_arg;
+    UC lv_argLen = 0;
+    for( UC i = 0; i < lv_spec.stars; i++ ) {
+      lv_arg.i = va_arg(args, int);
+      if( lv_len + sizeof(int) > size ) return lv_len;
+      memcpy(buf + lv_len, &lv_arg.i, sizeof(int));
+      lv_len += sizeof(int);
+    }
+    switch( lv_spec.kind ) {
+    case LOGF_ARG_INT:    lv_arg.i = va_arg(args, int); lv_argLen = sizeof(int); break;
+    case LOGF_ARG_LONG:   lv_arg.l = va_arg(args, long); lv_argLen = sizeof(long); break;
+    case LOGF_ARG_LLONG:  lv_arg.ll = va_arg(args, long long); lv_argLen = sizeof(long long); break;
+    case LOGF_ARG_SIZE:   lv_arg.z = va_arg(args, size_t); lv_argLen = sizeof(size_t); break;
+    case LOGF_ARG_DOUBLE: lv_arg.d = va_arg(args, double); lv_argLen = sizeof(double); break;
+    case LOGF_ARG_PTR:    lv_arg.ptr = va_arg(args, void *); lv_argLen = sizeof(void *); break;
+    case LOGF_ARG_STR: {
+      const char *lv_str = va_arg(args, const char *);
+      if( !lv_str ) lv_str = "(null)";
+      UC lv_strLen = min(strlen(lv_str), (size_t)LOGF_MAX_STR);
+      if( lv_len + 1 + lv_strLen > size ) return lv_len;
+      buf[lv_len++] = lv_strLen;
+      memcpy(buf + lv_len, lv_str, lv_strLen);
+      lv_len += lv_strLen;
+      continue;
+    }
+    default:
+      continue;
+    }
+    if( lv_len + lv_argLen > size ) return lv_len;
+    memcpy(buf + lv_len, &lv_arg, lv_argLen);
+    lv_len += lv_argLen;
+  }
+  return lv_len;
+}
+
+// Format packed arguments with fmt, conversion by conversion.
+// Return the length of the text, missing arguments show as <?>
+US LoggerClass::FormatArgs(char *buf, US size, const char *fmt, const UC *args, UC len)
+{
+  if( size == 0 ) return 0;
+
+  US lv_pos = 0;
+  UC lv_arg = 0;
+  LogSpec_t lv_spec;
+  const char *p = fmt;
+  while( *p && lv_pos + 1 < size ) {
+    if( *p != '%' ) {
+      buf[lv_pos++] = *p++;
+      continue;
+    }
+    ParseLogSpec(p, &lv_spec);
+    char lv_conv[16];
+    if( lv_spec.kind == LOGF_ARG_NONE || lv_spec.len >= sizeof(lv_conv) ) {
+      // %% and conversions not understood are copied as they are
+      if( p[1] == '%' ) {
+        buf[lv_pos++] = '%';
+        p += 2;
+      } else {
+        buf[lv_pos++] = *p++;
+      }
+      continue;
+    }
+    memcpy(lv_conv, p, lv_spec.len);
+    lv_conv[lv_spec.len] = '\0';
+    p += lv_spec.len;
+
+    int lv_star[2] = {0, 0};
+    BOOL lv_ok = true;
+    for( UC i = 0; i < lv_spec.stars && lv_ok; i++ ) {
+      if( (lv_ok = (lv_arg + sizeof(int) <= len)) ) {
+        memcpy(&lv_star[i], args + lv_arg, sizeof(int));
+        lv_arg += sizeof(int);
+      }
+    }
+
+    union {
+      int i;
+      long l;
+      long long ll;
+      size_t z;
+      double d;
+      void *ptr;
+    } lv_val;
+    char lv_str[LOGF_MAX_STR + 1];
+    UC lv_argLen;
+    switch( lv_spec.kind ) {
+    case LOGF_ARG_INT:    lv_argLen = sizeof(int); break;
+    case LOGF_ARG_LONG:   lv_argLen = sizeof(long); break;
+    case LOGF_ARG_LLONG:  lv_argLen = sizeof(long long); break;
+    case LOGF_ARG_SIZE:   lv_argLen = sizeof(size_t); break;
+    case LOGF_ARG_DOUBLE: lv_argLen = sizeof(double); break;
+    case LOGF_ARG_PTR:    lv_argLen = sizeof(void *); break;
+    default:              lv_argLen = (lv_arg < len ? args[lv_arg] + 1 : 1); break;
+    }
+    if( !lv_ok || lv_arg + lv_argLen > len ) {
+      int n = snprintf(buf + lv_pos, size - lv_pos, "<?>");
+      lv_pos += (n < size - lv_pos ? n : size - lv_pos - 1);
+      break;
+    }
+    if( lv_spec.kind == LOGF_ARG_STR ) {
+      memcpy(lv_str, args + lv_arg + 1, lv_argLen - 1);
+      lv_str[lv_argLen - 1] = '\0';
+    } else {
+      memcpy(&lv_val, args + lv_arg, lv_argLen);
+    }
+    lv_arg += lv_argLen;
+
+    char *lv_out = buf + lv_pos;
+    US lv_room = size - lv_pos;
+#define LOGF_PRINT(v)   (lv_spec.stars == 0 ? snprintf(lv_out, lv_room, lv_conv, v) : \
+      (lv_spec.stars == 1 ? snprintf(lv_out, lv_room, lv_conv, lv_star[0], v) : \
+      snprintf(lv_out, lv_room, lv_conv, lv_star[0], lv_star[1], v)))
+    int n;
+    switch( lv_spec.kind ) {
+    case LOGF_ARG_INT:    n = LOGF_PRINT(lv_val.i); break;
+    case LOGF_ARG_LONG:   n = LOGF_PRINT(lv_val.l); break;
+    case LOGF_ARG_LLONG:  n = LOGF_PRINT(lv_val.ll); break;
+    case LOGF_ARG_SIZE:   n = LOGF_PRINT(lv_val.z); break;
+    case LOGF_ARG_DOUBLE: n = LOGF_PRINT(lv_val.d); break;
+    case LOGF_ARG_PTR:    n = LOGF_PRINT(lv_val.ptr); break;
+    default:              n = LOGF_PRINT(lv_str); break;
+    }
+#undef LOGF_PRINT
+    if( n < 0 ) break;
+    lv_pos += (n < lv_room ? n : lv_room - 1);
+  }
+  buf[lv_pos] = '\0';
+  return lv_pos;
+}
+
+// One flash log record as text line
+US LoggerClass::FormatRecord(char *buf, US size, const UC *rec, UC len, UL buildId)
+{
+  uint32_t lv_utc, lv_fmtId;
+  US lv_ms;
+  memcpy(&lv_utc, rec + 4, 4);
+  memcpy(&lv_ms, rec + 8, 2);
+  memcpy(&lv_fmtId, rec + 10, 4);
+  int lv_pos = snprintf(buf, size, "%02d-%02d %02d:%02d:%02d.%03d %d %.3s ", Time.month(lv_utc), Time.day(lv_utc),
+      Time.hour(lv_utc), Time.minute(lv_utc), Time.second(lv_utc), lv_ms, rec[0], (const char *)rec + 1);
+  if( lv_pos < 0 || lv_pos >= size ) return 0;
+
+  UC lv_args = LOGF_HEADER_LEN;
+  const char *lv_fmt = (const char *)(uintptr_t)lv_fmtId;
+  char lv_inline[LOGF_MAX_RECORD];
+  if( lv_fmtId == 0 ) {
+    UC lv_fmtLen = (lv_args < len ? rec[lv_args] : 0);
+    if( lv_args + 1 + lv_fmtLen > len ) lv_fmtLen = 0;
+    memcpy(lv_inline, rec + lv_args + 1, lv_fmtLen);
+    lv_inline[lv_fmtLen] = '\0';
+    lv_fmt = lv_inline;
+    lv_args += 1 + lv_fmtLen;
+  } else if( buildId != m_buildId || lv_fmtId < LOGF_ROM_START || lv_fmtId >= LOGF_ROM_END ) {
+    // Written by another build, the format id can't be resolved here
+    return lv_pos + snprintf(buf + lv_pos, size - lv_pos, "fmt@%08lX, %d bytes of arguments (build %08lX)",
+        (UL)lv_fmtId, len - lv_args, buildId);
+  }
+  return lv_pos + FormatArgs(buf + lv_pos, size - lv_pos, lv_fmt, rec + lv_args, len - lv_args);
+}
+
+// Print the latest count records of the flash log, oldest first
+void LoggerClass::showFlashLog(US count)
+{
+  if( !m_flashRing.IsReady() ) {
+    SERIAL_LN("Flash log: not available");
+    return;
+  }
+  UL lv_total = m_flashRing.GetPendingCount();
+  SERIAL_LN("Flash log: %lu records, %lu overwritten, level %s, build %08lX", lv_total, m_flashRing.GetLostCount(),
+      strLevelNames[m_level[LOGDEST_FLASH]], m_buildId);
+
+  FlashRingPos_t lv_pos = m_flashRing.GetReadPos();
+  UL lv_skip = (lv_total > count ? lv_total - count : 0);
+  UC lv_rec[LOGF_MAX_RECORD];
+  UC lv_len;
+  uint32_t lv_buildId;
+  char buf[MAX_MESSAGE_LEN];
+  while( m_flashRing.Read(lv_pos, lv_rec, sizeof(lv_rec), &lv_len, &lv_buildId) ) {
+    if( lv_skip > 0 ) {
+      lv_skip--;
+      continue;
+    }
+    if( lv_len < LOGF_HEADER_LEN ) continue;
+    FormatRecord(buf, sizeof(buf), lv_rec, lv_len, lv_buildId);
+    TheSerial.println(buf);
+  }
+  SERIAL_LN("");
 }
 
 bool LoggerClass::ChangeLogLevel(String &strMsg)
@@ -4,9 +4,17 @@
 #define xlxLogger_h
 
 #include "xliCommon.h"
+#include "FlashRing.h"
 
 #define MAX_MESSAGE_LEN     480
 
+// Flash log record: level, tag (3), utc (4), ms (2), format id (4), packed arguments.
+// The format id is the address of the format string in the firmware image, or 0
+// when the format is stored in front of the arguments
+#define LOGF_HEADER_LEN     14
+#define LOGF_MAX_RECORD     128
+#define LOGF_MAX_STR        48          // Longest %s argument kept
+
 // Log Destination
 enum {
     LOGDEST_SERIAL = 0,
@@ -28,6 +36,15 @@ enum {
     LEVEL_DEBUG,
 };
 
+// Log calls above this level are compiled out
+#ifndef LOG_LEVEL_FLOOR
+#ifdef SYS_RELEASE
+#define LOG_LEVEL_FLOOR       LEVEL_INFO
+#else
+#define LOG_LEVEL_FLOOR       LEVEL_DEBUG
+#endif
+#endif
+
 // Log tags: 3 bytes
 #define LOGTAG_STATUS         "STA"
 #define LOGTAG_EVENT          "EVT"
@@ -43,6 +60,15 @@ class LoggerClass
 private:
   UC m_level[LOGDEST_DUMMY];
   String m_SysID;
+  CFlashRing m_flashRing;
+  UL m_buildId;                 // Tag of flash log pages, format ids are valid within one image
+  UC m_maxLevel;                // Highest level any destination takes
+
+  void UpdateMaxLevel();
+  static UL GetImageId();
+
+  void WriteFlash(UC level, const char *tag, const char *msg, va_list args);
+  US FormatRecord(char *buf, US size, const UC *rec, UC len, UL buildId);
 
 public:
   LoggerClass();
@@ -54,21 +80,32 @@ public:
 
   UC GetLevel(UC logDest);
   void SetLevel(UC logDest, UC logLevel);
+  BOOL IsEnabled(UC level) { return level <= m_maxLevel; }
   void WriteLog(UC level, const char *tag, const char *msg, ...);
   bool ChangeLogLevel(String &strMsg);
   String PrintDestInfo();
+  void showFlashLog(US count);
+  UL GetFlashLogCount() { return m_flashRing.GetNextSeq(); }      // Records ever written
+
+  static UC PackArgs(UC *buf, UC size, const char *fmt, va_list args);
+  static US FormatArgs(char *buf, US size, const char *fmt, const UC *args, UC len);
 };
 
 //------------------------------------------------------------------
 // Function & Class Helper
 //------------------------------------------------------------------
 extern LoggerClass theLog;
-#define LOGA(tag, fmt, ...)       theLog.WriteLog(LEVEL_ALERT, tag, fmt, ##__VA_ARGS__)
-#define LOGC(tag, fmt, ...)       theLog.WriteLog(LEVEL_CRITICAL, tag, fmt, ##__VA_ARGS__)
-#define LOGE(tag, fmt, ...)       theLog.WriteLog(LEVEL_ERROR, tag, fmt, ##__VA_ARGS__)
-#define LOGW(tag, fmt, ...)       theLog.WriteLog(LEVEL_WARNING, tag, fmt, ##__VA_ARGS__)
-#define LOGN(tag, fmt, ...)       theLog.WriteLog(LEVEL_NOTICE, tag, fmt, ##__VA_ARGS__)
-#define LOGI(tag, fmt, ...)       theLog.WriteLog(LEVEL_INFO, tag, fmt, ##__VA_ARGS__)
-#define LOGD(tag, fmt, ...)       theLog.WriteLog(LEVEL_DEBUG, tag, fmt, ##__VA_ARGS__)
+// Arguments are only evaluated when some destination takes the level
+#define LOG_WRITE(level, tag, fmt, ...)   do { \
+    if( (level) <= LOG_LEVEL_FLOOR && theLog.IsEnabled(level) ) theLog.WriteLog(level, tag, fmt, ##__VA_ARGS__); \
+  } while(0)
+
+#define LOGA(tag, fmt, ...)       LOG_WRITE(LEVEL_ALERT, tag, fmt, ##__VA_ARGS__)
+#define LOGC(tag, fmt, ...)       LOG_WRITE(LEVEL_CRITICAL, tag, fmt, ##__VA_ARGS__)
+#define LOGE(tag, fmt, ...)       LOG_WRITE(LEVEL_ERROR, tag, fmt, ##__VA_ARGS__)
+#define LOGW(tag, fmt, ...)       LOG_WRITE(LEVEL_WARNING, tag, fmt, ##__VA_ARGS__)
+#define LOGN(tag, fmt, ...)       LOG_WRITE(LEVEL_NOTICE, tag, fmt, ##__VA_ARGS__)
+#define LOGI(tag, fmt, ...)       LOG_WRITE(LEVEL_INFO, tag, fmt, ##__VA_ARGS__)
+#define LOGD(tag, fmt, ...)       LOG_WRITE(LEVEL_DEBUG, tag, fmt, ##__VA_ARGS__)
 
 #endif /* xlxLogger_h */
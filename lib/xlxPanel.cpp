@@ -30,6 +30,8 @@
  *      if >= 15 seconds, the enter Wi-Fi setup mode
  *      if >= 10 seconds, then reset the controller
  *      if >= 5 seconds, enable base network
+ * 5. Knob spin is streamed at RTE_STREAM_FRAME_RATE: only the latest dimmer / CCT value
+ *      is sent per frame, followed by a settle frame once the knob stops
  *
 **/
 #include "xliPinMap.h"
@@ -51,6 +53,86 @@ uint8_t CWTipLight595 [] = {0x00,0x00,0x00,0x08,0x00,0x0c,0x00,0x0e,0x00,0x0f,0x
 // LED#: 9, 10, 11, 12, 1, 2, 3, 4, 5
 uint8_t CCTIdxLight595 [] = {0x00,0x01, 0x00,0x02, 0x00,0x04, 0x00,0x08, 0x01,0x00, 0x02,0x00, 0x04,0x00, 0x08,0x00, 0x10,0x00};
 
+//------------------------------------------------------------------
+// Panel Control Stream
+//------------------------------------------------------------------
+CPanelStream::CPanelStream()
+{
+  memset(m_slots, 0x00, sizeof(m_slots));
+  m_nFrames = 0;
+  m_nDropped = 0;
+  SetRate(RTE_STREAM_FRAME_RATE, RTE_STREAM_SETTLE_MS);
+}
+
+// f_fps = 0: streaming disabled, send on every change
+void CPanelStream::SetRate(uint8_t f_fps, uint16_t f_settleMs)
+{
+  m_frameMs = (f_fps > 0 ? 1000 / f_fps : 0);
+  m_settleMs = f_settleMs;
+}
+
+// Replace the pending target of the channel and node
+void CPanelStream::Post(uint8_t f_channel, uint8_t f_nodeID, uint8_t f_subID, uint16_t f_value, uint32_t f_now)
+{
+  PanelStreamSlot_t *pSlot = NULL;
+  PanelStreamSlot_t *pOldest = &m_slots[0];
+  bool bIdleOldest = false;
+  for( uint8_t i = 0; i < PANEL_STREAM_SLOTS; i++ ) {
+    PanelStreamSlot_t *pTmp = &m_slots[i];
+    if( pTmp->channel == f_channel && pTmp->nodeID == f_nodeID && pTmp->subID == f_subID ) {
+      pSlot = pTmp;
+      break;
+    }
+    // Prefer recycling an idle slot
+    bool bIdle = !pTmp->pending && !pTmp->settle;
+    if( (bIdle && !bIdleOldest) || (bIdle == bIdleOldest && pTmp->tickChanged - pOldest->tickChanged > 0x80000000UL) ) {
+      pOldest = pTmp;
+      bIdleOldest = bIdle;
+    }
+  }
+
+  if( !pSlot ) {
+    pSlot = pOldest;
+    if( pSlot->pending ) m_nDropped++;
+    pSlot->channel = f_channel;
+    pSlot->nodeID = f_nodeID;
+    pSlot->subID = f_subID;
+    // First change of a new target goes out at once
+    pSlot->tickSent = f_now - m_frameMs;
+  } else if( pSlot->pending ) {
+    m_nDropped++;
+  }
+  pSlot->target = f_value;
+  pSlot->pending = true;
+  pSlot->settle = false;
+  pSlot->tickChanged = f_now;
+}
+
+// Next frame due at f_now, NULL if none. The slot is marked as sent.
+PanelStreamSlot_t *CPanelStream::Poll(uint32_t f_now)
+{
+  for( uint8_t i = 0; i < PANEL_STREAM_SLOTS; i++ ) {
+    PanelStreamSlot_t *pSlot = &m_slots[i];
+    if( !pSlot->pending && !pSlot->settle ) continue;
+    if( f_now - pSlot->tickSent < m_frameMs ) continue;
+    if( pSlot->pending ) {
+      pSlot->pending = false;
+      pSlot->settle = (m_settleMs > 0);
+    } else if( f_now - pSlot->tickChanged >= m_settleMs ) {
+      pSlot->settle = false;
+    } else {
+      continue;
+    }
+    pSlot->tickSent = f_now;
+    m_nFrames++;
+    return pSlot;
+  }
+  return NULL;
+}
+
+//------------------------------------------------------------------
+// Panel Class
+//------------------------------------------------------------------
 xlPanelClass::xlPanelClass()
 {
   m_pEncoder = NULL;
@@ -135,6 +217,8 @@ bool xlPanelClass::ProcessEncoder()
 		  SetDimmerValue(_dimValue);
 	  }
   }
+  SendStream();
+
 	// Read button input
 	ButtonType b = m_pEncoder->getButton();
   if (b != BUTTON_OPEN) {
@@ -180,6 +264,20 @@ bool xlPanelClass::ProcessEncoder()
 
 }
 
+// Send due frames of the control stream
+void xlPanelClass::SendStream()
+{
+  PanelStreamSlot_t *pSlot;
+  uint32_t now = millis();
+  while( (pSlot = m_stream.Poll(now)) != NULL ) {
+    if( pSlot->channel == PANEL_STREAM_CCT ) {
+      theSys.ChangeLampCCT(pSlot->nodeID, pSlot->target, pSlot->subID);
+    } else {
+      theSys.ChangeLampBrightness(pSlot->nodeID, pSlot->target, pSlot->subID);
+    }
+  }
+}
+
 int16_t xlPanelClass::GetDimmerValue()
 {
 	return m_nDimmerValue;
@@ -194,8 +292,12 @@ void xlPanelClass::SetDimmerValue(int16_t _value)
 		m_nDimmerValue = _value;
 		m_nLastOpPast = millis();
     SetHC595();
-    // Send Light Percentage message
-    theSys.ChangeLampBrightness(CURRENT_DEVICE, _value, CURRENT_SUBDEVICE);
+    // Send Light Percentage message, or leave it to the stream
+    if( m_stream.IsEnabled() ) {
+      m_stream.Post(PANEL_STREAM_BR, CURRENT_DEVICE, CURRENT_SUBDEVICE, _value, m_nLastOpPast);
+    } else {
+      theSys.ChangeLampBrightness(CURRENT_DEVICE, _value, CURRENT_SUBDEVICE);
+    }
 		//LOGD(LOGTAG_EVENT, "Dimmer-BR changed to %d", _value);
     bBRNeedsend = true;
 	}
@@ -241,7 +343,11 @@ void xlPanelClass::SetCCTValue(int16_t _value)
     SetHC595();
     // Send CCT message
     US cctValue = map(_value, 0, 100, CT_MIN_VALUE, CT_MAX_VALUE);
-    theSys.ChangeLampCCT(CURRENT_DEVICE, cctValue);
+    if( m_stream.IsEnabled() ) {
+      m_stream.Post(PANEL_STREAM_CCT, CURRENT_DEVICE, 0, cctValue, m_nLastOpPast);
+    } else {
+      theSys.ChangeLampCCT(CURRENT_DEVICE, cctValue);
+    }
 		//LOGD(LOGTAG_EVENT, "Dimmer-CCT changed to %d", cctValue);
     bCctNeedsend = true;
 	}
@@ -403,9 +509,11 @@ void xlPanelClass::CheckHeldTimeout(const uint8_t nHeldDur)
 {
   if( nHeldDur >= RTE_TM_HELD_TO_DFU ) {
     LOGE(LOGTAG_ACTION, "System is about to enter DFU mode");
+    theSys.PrepareReset();
     System.dfu();
   } else if( nHeldDur >= RTE_TM_HELD_TO_WIFI ) {
     LOGW(LOGTAG_ACTION, "System is about to enter safe mode");
+    theSys.PrepareReset();
     System.enterSafeMode();
   } else if( nHeldDur >= RTE_TM_HELD_TO_RESET ) {
     LOGW(LOGTAG_ACTION, "System is about to reset");
@@ -5,6 +5,48 @@
 #include "ClickEncoder.h"
 #include "ShiftRegister74HC595.h"
 
+// Panel stream channels
+#define PANEL_STREAM_BR         0
+#define PANEL_STREAM_CCT        1
+
+// Number of (channel, node) targets tracked at a time
+#define PANEL_STREAM_SLOTS      4
+
+typedef struct
+{
+  uint8_t channel;
+  uint8_t nodeID;
+  uint8_t subID;
+  bool pending;               // Target changed since last frame
+  bool settle;                // Final frame still owed
+  uint16_t target;
+  uint32_t tickSent;
+  uint32_t tickChanged;
+} PanelStreamSlot_t;
+
+// Latest-value-wins control stream: keeps one pending target per channel and node,
+// sends it at most once per frame interval, plus one settle frame after the knob stops
+class CPanelStream
+{
+public:
+  CPanelStream();
+  void SetRate(uint8_t f_fps, uint16_t f_settleMs);
+  bool IsEnabled() { return m_frameMs > 0; }
+  uint8_t GetFrameRate() { return(m_frameMs > 0 ? 1000 / m_frameMs : 0); }
+  uint16_t GetSettleMs() { return m_settleMs; }
+  void Post(uint8_t f_channel, uint8_t f_nodeID, uint8_t f_subID, uint16_t f_value, uint32_t f_now);
+  PanelStreamSlot_t *Poll(uint32_t f_now);
+  uint32_t GetFrameCount() { return m_nFrames; }
+  uint32_t GetDroppedCount() { return m_nDropped; }
+
+private:
+  PanelStreamSlot_t m_slots[PANEL_STREAM_SLOTS];
+  uint16_t m_frameMs;
+  uint16_t m_settleMs;
+  uint32_t m_nFrames;
+  uint32_t m_nDropped;        // Stale values replaced before being sent
+};
+
 class xlPanelClass
 {
 private:
@@ -16,9 +58,11 @@ private:
   bool m_bCCTFlag;
   uint32_t m_nCCTick;
   uint32_t m_nLastOpPast;
+  CPanelStream m_stream;
 
 protected:
   bool SetHC595();
+  void SendStream();
   void CheckHeldTimeout(const uint8_t nHeldDur);
 
 public:
@@ -31,6 +75,7 @@ public:
   bool EncoderAvailable();
   bool HC595Available();
   bool ProcessEncoder();
+  CPanelStream& GetStream() { return m_stream; }
   bool CheckLEDRing(uint8_t _testno = 0);
   void SetRingPos(uint8_t _pos);
   bool GetRingOnOff();
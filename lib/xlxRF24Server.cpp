@@ -49,17 +49,20 @@
 //------------------------------------------------------------------
 // the one and only instance of RF24ServerClass
 RF24ServerClass theRadio(PIN_RF24_CE, PIN_RF24_CS);
-MyMessage msg;
-UC *msgData = (UC *)&(msg.msg);
 
 RF24ServerClass::RF24ServerClass(uint8_t ce, uint8_t cs, uint8_t paLevel)
 	:	MyTransportNRF24(ce, cs, paLevel)
-	, CDataQueue(MAX_MESSAGE_LENGTH * MQ_MAX_RF_RCVMSG)
-	, CFastMessageQ(MQ_MAX_RF_SNDMSG, MAX_MESSAGE_LENGTH)
 {
 	_times = 0;
 	_succ = 0;
 	_received = 0;
+	memset(_prioSent, 0x00, sizeof(_prioSent));
+	memset(_prioMaxWait, 0x00, sizeof(_prioMaxWait));
+	_txBursts = 0;
+	_txBurstFrames = 0;
+	_txMaxUs = 0;
+	_sndHighWater = 0;
+	_sndDropped = 0;
 }
 
 bool RF24ServerClass::ServerBegin(uint8_t channel, uint8_t paLevel, uint8_t dataRate)
@@ -121,15 +124,119 @@ bool RF24ServerClass::ProcessMQ()
 	return true;
 }
 
+//------------------------------------------------------------------
+// Typed command builders, one per message ID of ProcessSend()
+//------------------------------------------------------------------
+// 1: Assign new NodeID to node
+void RF24ServerClass::BuildNodeIDMsg(MyMessage &my_msg, const UC _node, const UC _newID, const UC _replyTo)
+{
+	my_msg.build(_replyTo, _node, _newID, C_INTERNAL, I_ID_RESPONSE, false, false);
+	my_msg.set(getMyNetworkID());
+}
+
+// 1: Reboot node, requires its token
+bool RF24ServerClass::BuildRebootMsg(MyMessage &my_msg, const UC _node, const UC _replyTo, const UC _sensor)
+{
+	ListNode<DevStatusRow_t> *DevStatusRowPtr = theSys.SearchDevStatus(_node);
+	if( !DevStatusRowPtr ) return false;
+	my_msg.build(_replyTo, _node, _sensor, C_INTERNAL, I_REBOOT, false);
+	my_msg.set((unsigned int)DevStatusRowPtr->data.token);
+	return true;
+}
+
+// 2: Node config
+void RF24ServerClass::BuildNodeConfigMsg(MyMessage &my_msg, const UC _node, const UC _ncf, const unsigned int _value, const UC _replyTo)
+{
+	my_msg.build(_replyTo, _node, _ncf, C_INTERNAL, I_CONFIG, true);
+	my_msg.set(_value);
+}
+
+// 3: Temperature sensor present, req no ack
+void RF24ServerClass::BuildTempPresentMsg(MyMessage &my_msg, const UC _node, const UC _replyTo, const UC _sensor)
+{
+	my_msg.build(_replyTo, _node, _sensor, C_PRESENTATION, S_TEMP, false);
+	my_msg.set("");
+}
+
+// 6, 8, 10: Get power (V_STATUS), dimmer (V_PERCENTAGE) or CCT (V_LEVEL), ack
+void RF24ServerClass::BuildQueryMsg(MyMessage &my_msg, const UC _node, const UC _type, const UC _replyTo, const UC _sensor)
+{
+	my_msg.build(_replyTo, _node, _sensor, C_REQ, _type, true);
+}
+
+// 7: Set power on/off/toggle, ack
+void RF24ServerClass::BuildSwitchMsg(MyMessage &my_msg, const UC _node, const UC _sw, const UC _replyTo, const UC _sensor)
+{
+	my_msg.build(_replyTo, _node, _sensor, C_SET, V_STATUS, true);
+	my_msg.set((uint8_t)constrain(_sw, DEVICE_SW_OFF, DEVICE_SW_TOGGLE));
+}
+
+// 9: Set dimmer percentage, ack
+void RF24ServerClass::BuildBrightnessMsg(MyMessage &my_msg, const UC _node, const UC _br, const UC _replyTo, const UC _sensor)
+{
+	my_msg.build(_replyTo, _node, _sensor, C_SET, V_PERCENTAGE, true);
+	my_msg.set((uint8_t)OPERATOR_SET, (uint8_t)constrain(_br, 0, 100));
+}
+
+// 11: Set color temperature, ack
+void RF24ServerClass::BuildCCTMsg(MyMessage &my_msg, const UC _node, const US _cct, const UC _replyTo, const UC _sensor)
+{
+	my_msg.build(_replyTo, _node, _sensor, C_SET, V_LEVEL, true);
+	my_msg.set((uint8_t)OPERATOR_SET, (unsigned int)constrain(_cct, CT_MIN_VALUE, CT_MAX_VALUE));
+}
+
+// 12: Request lamp status in one
+void RF24ServerClass::BuildStatusReqMsg(MyMessage &my_msg, const UC _node, const UC _replyTo, const UC _sensor)
+{
+	my_msg.build(_replyTo, _node, _sensor, C_REQ, V_RGBW, true);
+	my_msg.set((uint8_t)RING_ID_ALL);		// RING_ID_1 is also workable currently
+}
+
+// 13: Set status in one with brightness and WRGB, ack
+void RF24ServerClass::BuildBrWRGBMsg(MyMessage &my_msg, const UC _node, const UC _br, const UC _w, const UC _r, const UC _g, const UC _b, const UC _replyTo, const UC _sensor)
+{
+	uint8_t payload[7];
+	payload[0] = RING_ID_ALL;
+	payload[1] = 1;
+	payload[2] = _br;
+	payload[3] = _w;
+	payload[4] = _r;
+	payload[5] = _g;
+	payload[6] = _b;
+	my_msg.build(_replyTo, _node, _sensor, C_SET, V_RGBW, true);
+	my_msg.set((void*)payload, 7);
+}
+
+// 13: Set status in one with brightness and CCT, ack
+void RF24ServerClass::BuildBrCCTMsg(MyMessage &my_msg, const UC _node, const UC _br, const US _cct, const UC _replyTo, const UC _sensor)
+{
+	uint8_t payload[5];
+	US lv_cct = constrain(_cct, CT_MIN_VALUE, CT_MAX_VALUE);
+	payload[0] = RING_ID_ALL;
+	payload[1] = 1;
+	payload[2] = _br;
+	payload[3] = lv_cct % 256;
+	payload[4] = lv_cct / 256;
+	my_msg.build(_replyTo, _node, _sensor, C_SET, V_RGBW, true);
+	my_msg.set((void*)payload, 5);
+}
+
+// 17: Set special effect, ack
+void RF24ServerClass::BuildEffectMsg(MyMessage &my_msg, const UC _node, const UC _filter, const UC _replyTo, const UC _sensor)
+{
+	my_msg.build(_replyTo, _node, _sensor, C_SET, V_VAR1, true);
+	my_msg.set(_filter);
+}
+
+// Text command adapter for console, BLE and cloud serial: parse payload and call typed builders
 bool RF24ServerClass::ProcessSend(const UC _node, const UC _msgID, String &strPayl, MyMessage &my_msg, const UC _replyTo, const UC _sensor)
 {
 	bool sentOK = false;
 	bool bMsgReady = false;
 	uint8_t bytValue;
 	int iValue;
-	float fValue;
 	char strBuffer[64];
-	uint8_t payload[MAX_PAYLOAD];
+	uint8_t payload[7];
 	MyMessage lv_msg;
 	int nPos;
 
@@ -157,19 +264,13 @@ bool RF24ServerClass::ProcessSend(const UC _node, const UC _msgID, String &strPa
 				newID = (UC)strPayl.toInt();
 			}
 			if( newID > 0 ) {
-				lv_msg.build(_replyTo, _node, newID, C_INTERNAL, I_ID_RESPONSE, false, false);
-				lv_msg.set(getMyNetworkID());
+				BuildNodeIDMsg(lv_msg, _node, newID, _replyTo);
 				//theConfig.lstNodes.clearNodeId(_node);
 				SERIAL("Now sending new id:%d to node:%d...", newID, _node);
 				bMsgReady = true;
 			} else {
 				// Reboot node
-				ListNode<DevStatusRow_t> *DevStatusRowPtr = theSys.SearchDevStatus(_node);
-				if( DevStatusRowPtr ) {
-					lv_msg.build(_replyTo, _node, _sensor, C_INTERNAL, I_REBOOT, false);
-					lv_msg.set((unsigned int)DevStatusRowPtr->data.token);
-					bMsgReady = true;
-				}
+				bMsgReady = BuildRebootMsg(lv_msg, _node, _replyTo, _sensor);
 			}
 		}
 		break;
@@ -180,8 +281,7 @@ bool RF24ServerClass::ProcessSend(const UC _node, const UC _msgID, String &strPa
 			if (nPos > 0) {
 				bytValue = (uint8_t)(strPayl.substring(0, nPos).toInt());
 				iValue = strPayl.substring(nPos + 1).toInt();
-				lv_msg.build(_replyTo, _node, bytValue, C_INTERNAL, I_CONFIG, true);
-				lv_msg.set((unsigned int)iValue);
+				BuildNodeConfigMsg(lv_msg, _node, bytValue, (unsigned int)iValue, _replyTo);
 				bMsgReady = true;
 				SERIAL("Now sending node:%d config:%d value:%d...", _node, bytValue, iValue);
 			}
@@ -189,74 +289,67 @@ bool RF24ServerClass::ProcessSend(const UC _node, const UC _msgID, String &strPa
 		break;
 
 	case 3:   // Temperature sensor present with sensor id 1, req no ack
-		lv_msg.build(_replyTo, _node, _sensor, C_PRESENTATION, S_TEMP, false);
-		lv_msg.set("");
+		BuildTempPresentMsg(lv_msg, _node, _replyTo, _sensor);
 		bMsgReady = true;
 		SERIAL("Now sending DHT11 present message...");
 		break;
 
 	case 6:   // Get main lamp(ID:1) power(V_STATUS:2) on/off, ack
-		lv_msg.build(_replyTo, _node, _sensor, C_REQ, V_STATUS, true);
+		BuildQueryMsg(lv_msg, _node, V_STATUS, _replyTo, _sensor);
 		bMsgReady = true;
 		SERIAL("Now sending get V_STATUS message...");
 		break;
 
 	case 7:   // Set main lamp(ID:1) power(V_STATUS:2) on/off, ack
-		lv_msg.build(_replyTo, _node, _sensor, C_SET, V_STATUS, true);
 		bytValue = constrain(strPayl.toInt(), DEVICE_SW_OFF, DEVICE_SW_TOGGLE);
-		lv_msg.set(bytValue);
+		BuildSwitchMsg(lv_msg, _node, bytValue, _replyTo, _sensor);
 		bMsgReady = true;
 		SERIAL("Now sending set V_STATUS %s message...", (bytValue ? "on" : "off"));
 		break;
 
 	case 8:   // Get main lamp(ID:1) dimmer (V_PERCENTAGE:3), ack
-		lv_msg.build(_replyTo, _node, _sensor, C_REQ, V_PERCENTAGE, true);
+		BuildQueryMsg(lv_msg, _node, V_PERCENTAGE, _replyTo, _sensor);
 		bMsgReady = true;
 		SERIAL("Now sending get V_PERCENTAGE message...");
 		break;
 
 	case 9:   // Set main lamp(ID:1) dimmer (V_PERCENTAGE:3), ack
-		lv_msg.build(_replyTo, _node, _sensor, C_SET, V_PERCENTAGE, true);
 		bytValue = constrain(strPayl.toInt(), 0, 100);
-		lv_msg.set((uint8_t)OPERATOR_SET, bytValue);
+		BuildBrightnessMsg(lv_msg, _node, bytValue, _replyTo, _sensor);
 		bMsgReady = true;
 		SERIAL("Now sending set V_PERCENTAGE:%d message...", bytValue);
 		break;
 
 	case 10:  // Get main lamp(ID:1) color temperature (V_LEVEL), ack
-		lv_msg.build(_replyTo, _node, _sensor, C_REQ, V_LEVEL, true);
+		BuildQueryMsg(lv_msg, _node, V_LEVEL, _replyTo, _sensor);
 		bMsgReady = true;
 		SERIAL("Now sending get CCT V_LEVEL message...");
 		break;
 
 	case 11:  // Set main lamp(ID:1) color temperature (V_LEVEL), ack
-		lv_msg.build(_replyTo, _node, _sensor, C_SET, V_LEVEL, true);
 		iValue = constrain(strPayl.toInt(), CT_MIN_VALUE, CT_MAX_VALUE);
-		lv_msg.set((uint8_t)OPERATOR_SET, (unsigned int)iValue);
+		BuildCCTMsg(lv_msg, _node, iValue, _replyTo, _sensor);
 		bMsgReady = true;
 		SERIAL("Now sending set CCT V_LEVEL %d message...", iValue);
 		break;
 
 	case 12:  // Request lamp status in one
-		lv_msg.build(_replyTo, _node, _sensor, C_REQ, V_RGBW, true);
-		lv_msg.set((uint8_t)RING_ID_ALL);		// RING_ID_1 is also workable currently
+		BuildStatusReqMsg(lv_msg, _node, _replyTo, _sensor);
 		bMsgReady = true;
 		SERIAL("Now sending get dev-status (V_RGBW) message...");
 		break;
 
 	case 13:  // Set main lamp(ID:1) status in one, ack
-		lv_msg.build(_replyTo, _node, _sensor, C_SET, V_RGBW, true);
-		payload[0] = RING_ID_ALL;
-		payload[1] = 1;
-		payload[2] = 65;
+		bytValue = 65;
+		iValue = 3000;
 		nPos = strPayl.indexOf(':');
 		if (nPos > 0) {
 			// Extract brightness, cct or WRGB
 			bytValue = (uint8_t)(strPayl.substring(0, nPos).toInt());
-			payload[2] = bytValue;
 			iValue = strPayl.substring(nPos + 1).toInt();
 			if( iValue < 256 ) {
 				// WRGB
+				payload[2] = bytValue;
 				payload[3] = iValue;	// W
 				payload[4] = 0;	// R
 				payload[5] = 0;	// G
@@ -265,31 +358,22 @@ bool RF24ServerClass::ProcessSend(const UC _node, const UC _msgID, String &strPa
 					strPayl = strPayl.substring(nPos + 1);
 					nPos = strPayl.indexOf(':');
 					if (nPos <= 0) {
-						bytValue = (uint8_t)(strPayl.toInt());
-						payload[cindex] = bytValue;
+						payload[cindex] = (uint8_t)(strPayl.toInt());
 						break;
 					}
-					bytValue = (uint8_t)(strPayl.substring(0, nPos).toInt());
-					payload[cindex] = bytValue;
+					payload[cindex] = (uint8_t)(strPayl.substring(0, nPos).toInt());
 				}
-				lv_msg.set((void*)payload, 7);
+				BuildBrWRGBMsg(lv_msg, _node, payload[2], payload[3], payload[4], payload[5], payload[6], _replyTo, _sensor);
 				SERIAL("Now sending set BR=%d WRGB=(%d,%d,%d,%d)...",
 						payload[2], payload[3], payload[4], payload[5], payload[6]);
-			} else {
-				// CCT
-				iValue = constrain(iValue, CT_MIN_VALUE, CT_MAX_VALUE);
-				payload[3] = iValue % 256;
-			  payload[4] = iValue / 256;
-				lv_msg.set((void*)payload, 5);
-				SERIAL("Now sending set BR=%d CCT=%d...", bytValue, iValue);
+				bMsgReady = true;
+				break;
 			}
-		} else {
-			iValue = 3000;
-			payload[3] = iValue % 256;
-		  payload[4] = iValue / 256;
-			lv_msg.set((void*)payload, 5);
-			SERIAL("Now sending set BR=%d CCT=%d...", bytValue, iValue);
 		}
+		// CCT
+		iValue = constrain(iValue, CT_MIN_VALUE, CT_MAX_VALUE);
+		BuildBrCCTMsg(lv_msg, _node, bytValue, iValue, _replyTo, _sensor);
+		SERIAL("Now sending set BR=%d CCT=%d...", bytValue, iValue);
 		bMsgReady = true;
 		break;
 
@@ -303,9 +387,8 @@ bool RF24ServerClass::ProcessSend(const UC _node, const UC _msgID, String &strPa
 		break;
 
 	case 17:	// Set special effect
-		lv_msg.build(_replyTo, _node, _sensor, C_SET, V_VAR1, true);
 		bytValue = (UC)(strPayl.toInt());
-		lv_msg.set(bytValue);
+		BuildEffectMsg(lv_msg, _node, bytValue, _replyTo, _sensor);
 		bMsgReady = true;
 		SERIAL("Now setting special effect %d...", bytValue);
 		break;
@@ -382,7 +465,7 @@ bool RF24ServerClass::ProcessSend(String &strMsg, const UC _replyTo, const UC _s
 // ToDo: add message to queue instead of sending out directly
 bool RF24ServerClass::ProcessSend(MyMessage *pMsg)
 {
-	if( !pMsg ) { pMsg = &msg; }
+	if( !pMsg ) return false;
 
 	// Convent message if necessary
 	bool _bConvert = false;
@@ -401,16 +484,42 @@ bool RF24ServerClass::ProcessSend(MyMessage *pMsg)
 	uint32_t flag = 0;
 	flag = ((uint32_t)pMsg->getSensor()<<24) | ((uint32_t)pMsg->getCommand()<<16) | ((uint32_t)pMsg->getType()<<8) | (pMsg->getDestination());
 	//LOGD(LOGTAG_MSG, "flag=%d,d=%d,cmd=%d,type=%d,sensor=%d",flag,pMsg->getDestination(),pMsg->getCommand(),pMsg->getType(),pMsg->getSensor());
-	if( AddMessage((UC *)&(pMsg->msg), MAX_MESSAGE_LENGTH, GetMQLength(), flag) > 0 ) {
+	if( AddMessage((UC *)&(pMsg->msg), MAX_MESSAGE_LENGTH, GetMQLength(), flag, GetSendPriority(pMsg)) > 0 ) {
 		_times++;
+		if( GetMQLength() > _sndHighWater ) _sndHighWater = GetMQLength();
 		//LOGD(LOGTAG_MSG, "Add sendMQ len:%d", GetMQLength());
 		return true;
 	}
 
+	_sndDropped++;
 	LOGW(LOGTAG_MSG, "Failed to add sendMQ");
 	return false;
 }
 
+// Classify outgoing message into send queue priority class
+UC RF24ServerClass::GetSendPriority(MyMessage *pMsg)
+{
+	UC _dest = pMsg->getDestination();
+	UC _cmd = pMsg->getCommand();
+	if( _cmd == C_INTERNAL || _cmd == C_PRESENTATION ) return RF_PRIO_ACK;
+	if( _dest == BROADCAST_ADDRESS || IS_GROUP_NODEID(_dest) ) {
+		// e.g. 255:8 self-test probe is a broadcast request
+		return( _cmd == C_REQ && !pMsg->isAck() ? RF_PRIO_PROBE : RF_PRIO_SCENARIO );
+	}
+	if( _cmd == C_SET ) return RF_PRIO_CONTROL;
+	if( pMsg->isAck() ) return RF_PRIO_ACK;
+	return RF_PRIO_KEEPALIVE;
+}
+
+// Exponential backoff. Broadcasts are repeated blindly, so keep them spaced
+UL RF24ServerClass::GetRetryDelay(const UC _prio, const UC _repeat)
+{
+	UL _delay = RTE_RF_RETRY_BASE_MS;
+	if( _prio >= RF_PRIO_SCENARIO ) _delay *= 4;
+	for( UC i = 1; i < _repeat && _delay < RTE_RF_RETRY_MAX_MS; i++ ) _delay <<= 1;
+	return(_delay < RTE_RF_RETRY_MAX_MS ? _delay : RTE_RF_RETRY_MAX_MS);
+}
+
 void RF24ServerClass::ConvertRepeatMsg(MyMessage *pMsg)
 {
 	// Note: change relative value to absolute value
@@ -482,6 +591,7 @@ bool RF24ServerClass::SendNodeConfig(UC _node, UC _ncf, UC *_data, const UC _len
 }
 
 // Get messages from RF buffer and store them in MQ
+// Frames are received straight into free slots of the receive queue
 bool RF24ServerClass::PeekMessage()
 {
 	if( !isValid() ) return false;
@@ -489,14 +599,15 @@ bool RF24ServerClass::PeekMessage()
 	UC to = 0;
   UC pipe;
 	UC len;
-	MyMessage lv_msg;
-	UC *lv_pData = (UC *)&(lv_msg.msg);
+	MyMessage *pMsg;
 
 	while (available(&to, &pipe)) {
-		len = receive(lv_pData);
+		// Leave frames in RF FIFO until ProcessReceiveMQ() frees a slot, nothing is dropped
+		if( !(pMsg = m_rcvMQ.GetWriteSlot()) ) return false;
+		len = receive((UC *)&(pMsg->msg));
 		if( to == BASESERVICE_ADDRESS && !isBaseNetworkEnabled() ) {
 			// Discard device message due to disabled BaseNetwork expect rfscanner
-			if( lv_msg.getSender() != NODEID_RF_SCANNER ) continue;
+			if( pMsg->getSender() != NODEID_RF_SCANNER ) continue;
 		}
 
 		// rough check
@@ -512,32 +623,48 @@ bool RF24ServerClass::PeekMessage()
 
 	  _received++;
 	  LOGD(LOGTAG_MSG, "Received from pipe %d msg-len=%d, from:%d to:%d dest:%d cmd:%d type:%d sensor:%d payl-len:%d",
-	        pipe, len, lv_msg.getSender(), to, lv_msg.getDestination(), lv_msg.getCommand(),
-	        lv_msg.getType(), lv_msg.getSensor(), lv_msg.getLength());
-		if( Append(lv_pData, len) <= 0 ) return false;
+	        pipe, len, pMsg->getSender(), to, pMsg->getDestination(), pMsg->getCommand(),
+	        pMsg->getType(), pMsg->getSensor(), pMsg->getLength());
+		m_rcvMQ.Commit();
 	}
 	return true;
 }
 
+// Whether ProcessMQ() has work: received frames, or a queued message due to be sent.
+// The RF FIFO is checked too unless its IRQ is wired
+bool RF24ServerClass::IsPending(bool _pollFIFO)
+{
+	if( !isValid() ) return false;
+	if( m_rcvMQ.Length() > 0 ) return true;
+	if( GetMQLength() > 0 && GetNextMessage(millis()) ) return true;
+	UC to;
+	return( _pollFIFO && available(&to) );
+}
+
 // Parse and process message in MQ
 bool RF24ServerClass::ProcessReceiveMQ()
 {
 	bool msgReady;
-	UC len, payl_len;
-	UC replyTo, _sensor, msgType, transTo;
+	UC payl_len;
+	UC replyTo, _sensor, msgCmd, msgType, transTo;
 	bool _bIsAck, _needAck;
 	UC *payload;
 	UC _bValue;
 	US _iValue;
 	char strDisplay[SENSORDATA_JSON_SIZE];
 	String strTemp;
+	MyMessage *pMsg;
+	UL lv_tick;
 
-  while (Length() > 0) {
+  while ((pMsg = m_rcvMQ.Peek()) != NULL) {
+		lv_tick = micros();
 
+		// Work on the queued frame in place, the slot is released after dispatch
+		MyMessage &msg = *pMsg;
 		msgReady = false;
-	  len = Remove(MAX_MESSAGE_LENGTH, msgData);
 		payl_len = msg.getLength();
 		_sensor = msg.getSensor();
+		msgCmd = msg.getCommand();
 		msgType = msg.getType();
 		replyTo = msg.getSender();
 		_bIsAck = msg.isAck();
@@ -552,9 +679,9 @@ bool RF24ServerClass::ProcessReceiveMQ()
 	  SERIAL_LN("  Serial: %s, len: %d", msg.getSerialString(strDisplay), strlen(strDisplay));
 		*/
 		LOGD(LOGTAG_MSG, "Will process cmd:%d from:%d type:%d sensor:%d",
-					msg.getCommand(), replyTo, msgType, _sensor);
+					msgCmd, replyTo, msgType, _sensor);
 
-	  switch( msg.getCommand() )
+	  switch( msgCmd )
 	  {
 	    case C_INTERNAL:
 	      if( msgType == I_ID_REQUEST ) {
@@ -698,6 +825,10 @@ bool RF24ServerClass::ProcessReceiveMQ()
 					transTo = msg.getDestination();
 					BOOL bDataChanged = false;
 					if( _bIsAck ) {
+						// Member reached by a group command
+						if( msgType == V_STATUS || msgType == V_PERCENTAGE || msgType == V_LEVEL || msgType == V_RGBW ) {
+							theSys.Group_cmds.confirm(replyTo);
+						}
 						//SERIAL_LN("REQ ack:%d to: %d 0x%x-0x%x-0x%x-0x%x-0x%x-0x%x-0x%x", msgType, transTo, payload[0],payload[1], payload[2], payload[3], payload[4],payload[5],payload[6]);
 						if( msgType == V_STATUS ||  msgType == V_PERCENTAGE ) {
 							if( IS_SPECIAL_NODEID(replyTo) ) {
@@ -832,56 +963,109 @@ bool RF24ServerClass::ProcessReceiveMQ()
 		if( msgReady ) {
 			ProcessSend(&msg);
 		}
+		m_rcvMQ.Pop();
+		// Handler time by the received command/type, msg may hold the reply by now
+		theSys.m_perf.addMessage(msgCmd, msgType, micros() - lv_tick);
 	}
 
   return true;
 }
 
-// Scan sendMQ and send messages, repeat if necessary
+// Send due messages from sendMQ by priority class and deadline, repeat if necessary.
+// Due messages of the same command to the leader's destination follow it in one TX burst
 bool RF24ServerClass::ProcessSendMQ()
 {
-	MyMessage lv_msg;
-	UC *pData = (UC *)&(lv_msg.msg);
-	CFastMessageNode *pNode = NULL, *pOld;
-	UC pipe, _repeat;
+	MyMessage lv_msg[RF_BURST_MAX_FRAMES];
+	MyMessage *lv_pMsg[RF_BURST_MAX_FRAMES];
+	CFastMessageNode *lv_pNode[RF_BURST_MAX_FRAMES];
+	UC lv_repeat[RF_BURST_MAX_FRAMES];
+	bool lv_ok[RF_BURST_MAX_FRAMES];
+	CFastMessageNode *pNode;
+	UC pipe, _prio, _count, _dest;
 	UC _tag = 0;
 	uint32_t _flag = 0;
 	bool _remove = false;
-
-	if( GetMQLength() > 0 ) {
-		while( pNode = GetMessage(pNode) ) {
-			pOld = pNode;
-			// Next node
-			pNode = pOld->m_pNext;
+	UL _now, _wait, _txUs;
+
+	// Each queued message gets at most one attempt per call
+	UC _budget = GetMQLength();
+	while( _budget > 0 ) {
+		_now = millis();
+		_count = 0;
+		_dest = 0;
+		pipe = PRIVATE_NET_PIPE;
+		while( _count < RF_BURST_MAX_FRAMES && _budget > 0 ) {
+			if( _count == 0 ) {
+				pNode = GetNextMessage(_now);
+			} else {
+				// Same command and destination as the leader, so the pipe is the same too
+				pNode = GetNextMessage(_now, 0x00FF00FF, (_flag & 0x00FF0000) | _dest);
+			}
+			if( !pNode ) break;
+			_budget--;
 			// Get message data
-			if( pOld->ReadMessage(pData, &_repeat, &_tag, &_flag,15) > 0 )
-			{
-				// Determine pipe
-				if( lv_msg.getCommand() == C_INTERNAL && lv_msg.getType() == I_ID_RESPONSE && lv_msg.isAck() ) {
-					pipe = CURRENT_NODE_PIPE;
-				} else if(lv_msg.getType() == I_GET_NONCE_RESPONSE && lv_msg.getDestination() == NODEID_RF_SCANNER)	{
-					pipe = CURRENT_NODE_PIPE;
-				} else {
-					pipe = PRIVATE_NET_PIPE;
-				}
+			if( pNode->ReadMessage((UC *)&(lv_msg[_count].msg), &lv_repeat[_count], &_tag, &_flag) == 0 ) {
+				pNode->SetNextTry(_now + RTE_RF_RETRY_BASE_MS);
+				continue;
+			}
+			// Keep it out of this round until the result is known
+			pNode->SetNextTry(_now + RTE_RF_RETRY_MAX_MS);
+
+			_prio = pNode->m_nPriority;
+			if( lv_repeat[_count] == 1 && _prio < RF_PRIO_NUM ) {
+				_prioSent[_prio]++;
+				_wait = _now - pNode->m_tickEnqueued;
+				if( _wait > _prioMaxWait[_prio] ) _prioMaxWait[_prio] = _wait;
+			}
+			lv_pNode[_count] = pNode;
+			lv_pMsg[_count] = &lv_msg[_count];
+			_count++;
+			if( _count > 1 ) continue;
+
+			// Determine pipe
+			_dest = lv_msg[0].getDestination();
+			if( lv_msg[0].getCommand() == C_INTERNAL && lv_msg[0].getType() == I_ID_RESPONSE && lv_msg[0].isAck() ) {
+				pipe = CURRENT_NODE_PIPE;
+			} else if(lv_msg[0].getType() == I_GET_NONCE_RESPONSE && _dest == NODEID_RF_SCANNER)	{
+				pipe = CURRENT_NODE_PIPE;
+			} else {
+				pipe = PRIVATE_NET_PIPE;
+			}
+			// Internal messages are sent alone
+			if( lv_msg[0].getCommand() == C_INTERNAL ) break;
+		}
+		if( _count == 0 ) break;
 
-				// Send message
-				_remove = send(lv_msg.getDestination(), lv_msg, pipe);
-				LOGD(LOGTAG_MSG, "RF-send msg %d-%d tag %d to %d pipe %d tried %d %s", lv_msg.getCommand(), lv_msg.getType(), _tag, lv_msg.getDestination(), pipe, _repeat, _remove ? "OK" : "Failed");
+		// Send messages
+		_txUs = micros();
+		if( _count == 1 ) {
+			lv_ok[0] = send(_dest, lv_msg[0], pipe);
+		} else {
+			sendBurst(_dest, lv_pMsg, _count, lv_ok, pipe);
+			_txBursts++;
+			_txBurstFrames += _count;
+		}
+		_txUs = micros() - _txUs;
+		if( _txUs > _txMaxUs ) _txMaxUs = _txUs;
 
-				// Determine whether requires retry
-				if( lv_msg.getDestination() == BROADCAST_ADDRESS || IS_GROUP_NODEID(lv_msg.getDestination()) ) {
-					if( _remove && _repeat == 1 ) _succ++;
-					_remove = (_repeat > theConfig.GetBcMsgRptTimes());
-				} else {
-					if( _remove ) _succ++;
-					if( _repeat > theConfig.GetNdMsgRptTimes() ) 	_remove = true;
-				}
+		for( UC i = 0; i < _count; i++ ) {
+			_remove = lv_ok[i];
+			LOGD(LOGTAG_MSG, "RF-send msg %d-%d prio %d to %d pipe %d tried %d %s", lv_msg[i].getCommand(), lv_msg[i].getType(), lv_pNode[i]->m_nPriority, _dest, pipe, lv_repeat[i], _remove ? "OK" : "Failed");
 
-				// Remove message if succeeded or retried enough times
-				if( _remove ) {
-					RemoveMessage(pOld);
-				}
+			// Determine whether requires retry
+			if( _dest == BROADCAST_ADDRESS || IS_GROUP_NODEID(_dest) ) {
+				if( _remove && lv_repeat[i] == 1 ) _succ++;
+				_remove = (lv_repeat[i] > theConfig.GetBcMsgRptTimes());
+			} else {
+				if( _remove ) _succ++;
+				if( lv_repeat[i] > theConfig.GetNdMsgRptTimes() ) 	_remove = true;
+			}
+
+			// Remove message if succeeded or retried enough times, otherwise back off
+			if( _remove ) {
+				RemoveMessage(lv_pNode[i]);
+			} else {
+				lv_pNode[i]->SetNextTry(millis() + GetRetryDelay(lv_pNode[i]->m_nPriority, lv_repeat[i]));
 			}
 		}
 	}
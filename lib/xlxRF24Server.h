@@ -3,12 +3,21 @@
 #ifndef xlxRF24Server_h
 #define xlxRF24Server_h
 
+#include "xliConfig.h"
 #include "DataQueue.h"
 #include "MessageQ.h"
 #include "MyTransportNRF24.h"
 
+// Send queue priority classes, lower value is served first
+#define RF_PRIO_CONTROL           0       // Interactive control to specific node
+#define RF_PRIO_ACK               1       // Acks and NodeID responses
+#define RF_PRIO_SCENARIO          2       // Broadcast or group fan-out
+#define RF_PRIO_KEEPALIVE         3       // Status queries
+#define RF_PRIO_PROBE             4       // Self-test probe
+#define RF_PRIO_NUM               5
+
 // RF24 Server class
-class RF24ServerClass : public MyTransportNRF24, public CDataQueue, public CFastMessageQ
+class RF24ServerClass : public MyTransportNRF24, public CStaticMessageQ<MQ_MAX_RF_SNDMSG>
 {
 public:
   RF24ServerClass(uint8_t ce=RF24_CE_PIN, uint8_t cs=RF24_CS_PIN, uint8_t paLevel=RF24_PA_LEVEL_GW);
@@ -17,6 +26,20 @@ public:
   uint64_t GetNetworkID(bool _full = false);
   void SetRole_Gateway();
   bool ChangeNodeID(const uint8_t bNodeID);
+  // Typed command builders, allocation-free counterparts of ProcessSend(String) message IDs
+  void BuildNodeIDMsg(MyMessage &my_msg, const UC _node, const UC _newID, const UC _replyTo = 0);
+  bool BuildRebootMsg(MyMessage &my_msg, const UC _node, const UC _replyTo = 0, const UC _sensor = 0);
+  void BuildNodeConfigMsg(MyMessage &my_msg, const UC _node, const UC _ncf, const unsigned int _value, const UC _replyTo = 0);
+  void BuildTempPresentMsg(MyMessage &my_msg, const UC _node, const UC _replyTo = 0, const UC _sensor = 0);
+  void BuildQueryMsg(MyMessage &my_msg, const UC _node, const UC _type, const UC _replyTo = 0, const UC _sensor = 0);
+  void BuildSwitchMsg(MyMessage &my_msg, const UC _node, const UC _sw, const UC _replyTo = 0, const UC _sensor = 0);
+  void BuildBrightnessMsg(MyMessage &my_msg, const UC _node, const UC _br, const UC _replyTo = 0, const UC _sensor = 0);
+  void BuildCCTMsg(MyMessage &my_msg, const UC _node, const US _cct, const UC _replyTo = 0, const UC _sensor = 0);
+  void BuildStatusReqMsg(MyMessage &my_msg, const UC _node, const UC _replyTo = 0, const UC _sensor = 0);
+  void BuildBrWRGBMsg(MyMessage &my_msg, const UC _node, const UC _br, const UC _w, const UC _r, const UC _g, const UC _b, const UC _replyTo = 0, const UC _sensor = 0);
+  void BuildBrCCTMsg(MyMessage &my_msg, const UC _node, const UC _br, const US _cct, const UC _replyTo = 0, const UC _sensor = 0);
+  void BuildEffectMsg(MyMessage &my_msg, const UC _node, const UC _filter, const UC _replyTo = 0, const UC _sensor = 0);
+
   bool ProcessSend(const UC _node, const UC _msgID, String &strPayl, MyMessage &my_msg, const UC _replyTo, const UC _sensor = 0);
   bool ProcessSend(String &strMsg, MyMessage &my_msg, const UC _replyTo = 0, const UC _sensor = 0);
   bool ProcessSend(String &strMsg, const UC _replyTo = 0, const UC _sensor = 0); //overloaded
@@ -34,12 +57,35 @@ public:
   bool ProcessReceiveMQ();
 
   bool PeekMessage();
+  bool IsPending(bool _pollFIFO = true);
 
   unsigned long _times;
   unsigned long _succ;
   unsigned long _received;
 
+  // Per priority class: sent frames and max wait from enqueue to first attempt
+  UL _prioSent[RF_PRIO_NUM];
+  UL _prioMaxWait[RF_PRIO_NUM];
+
+  // TX bursts, frames sent in bursts and longest blocking of one send round
+  UL _txBursts;
+  UL _txBurstFrames;
+  UL _txMaxUs;
+
+  // Send queue peak and messages dropped for lack of room
+  UC _sndHighWater;
+  UL _sndDropped;
+
+  UC GetRcvMQLength() { return m_rcvMQ.Length(); }
+  UC GetRcvMQHighWater() { return m_rcvMQ.GetHighWater(); }
+  UL GetRcvMQOverflow() { return m_rcvMQ.GetOverflow(); }
+
 private:
+  UC GetSendPriority(MyMessage *pMsg);
+  UL GetRetryDelay(const UC _prio, const UC _repeat);
+
+  CFrameQueue<MyMessage, MQ_MAX_RF_RCVMSG> m_rcvMQ;
+
   void ConvertRepeatMsg(MyMessage *pMsg);
 };
 
@@ -227,6 +227,7 @@ bool SerialConsoleClass::showThisHelp(String &strTopic)
     SERIAL_LN("   button:  show button (knob) status");
     SERIAL_LN("   nlist:   show NodeID list");
     SERIAL_LN("   rf:      print RF details");
+    SERIAL_LN("   sensor:  show latest sensor data of each node and offline history");
     SERIAL_LN("   time:    show current time and time zone");
     SERIAL_LN("   var:     show system variables");
     SERIAL_LN("   table:   show working memory tables");
@@ -235,6 +236,10 @@ bool SerialConsoleClass::showThisHelp(String &strTopic)
     SERIAL_LN("   asrsnt:  show ASR command scenario table");
     SERIAL_LN("   keymap:  show hardware key map table");
     SERIAL_LN("   extbtn:  show extended button table");
+    SERIAL_LN("   group:   show lamp groups and group commands");
+    SERIAL_LN("   loop:    show main loop wakeups and latency");
+    SERIAL_LN("   log:     show latest [n] lines of flash log, default 20");
+    SERIAL_LN("   perf:    show stage and RF handler profile, queue counters");
     SERIAL_LN("   version: show firmware version");
     SERIAL_LN("e.g. show rf\n\r");
     //CloudOutput("show ble|debug|dev|flag|net|node|rf|time|var|table|version");
@@ -253,7 +258,8 @@ bool SerialConsoleClass::showThisHelp(String &strTopic)
     SERIAL_LN("To execute action, e.g. turn on the lamp");
     SERIAL_LN("e.g. do on");
     SERIAL_LN("e.g. do off");
-    SERIAL_LN("e.g. do color R,G,B\n\r");
+    SERIAL_LN("e.g. do color R,G,B");
+    SERIAL_LN("e.g. do json {'cmd':1,'nd':1,'state':1}\n\r");
     //CloudOutput("do on|off|color");
   } else if(strTopic.equals("test")) {
     SERIAL_LN("--- Command: test <action parameters> ---");
@@ -341,6 +347,8 @@ bool SerialConsoleClass::showThisHelp(String &strTopic)
       SERIAL_LN("     , cloud option disable|enable|must");
       SERIAL_LN("e.g. set maindev <nodeid>");
       SERIAL_LN("     , to change the main device");
+      SERIAL_LN("e.g. set group <groupid nodeid> [0|1]");
+      SERIAL_LN("     , to remove or add lamp to group");
       SERIAL_LN("e.g. set subid <subNID>");
       SERIAL_LN("     , to change the sub NID");
       SERIAL_LN("e.g. set remote <nodeid device>");
@@ -353,6 +361,10 @@ bool SerialConsoleClass::showThisHelp(String &strTopic)
       SERIAL_LN("     , to set button loop keycode");
       SERIAL_LN("e.g. set kcto [0..255]");
       SERIAL_LN("     , to set loop keycode timeout");
+      SERIAL_LN("e.g. set pubwin <ms>");
+      SERIAL_LN("     , to set sensor publish window");
+      SERIAL_LN("e.g. set stream <fps> [settle_ms]");
+      SERIAL_LN("     , to set knob control stream rate, fps 0 sends on every detent");
       SERIAL_LN("e.g. set hwsobj [0|1|2]");
       SERIAL_LN("     , to set hardware switch object type");
       SERIAL_LN("e.g. set pptpin <PPTPin>");
@@ -433,11 +445,17 @@ bool SerialConsoleClass::doCheck(const char *cmd)
   if( sTopic ) {
     if (wal_strnicmp(sTopic, "rf", 2) == 0) {
       SERIAL_LN("**RF module is %s Received %lu", theRadio.isValid() ? "available." : "not available!", theRadio._received);
+      SERIAL_LN("  RcvMQ high-water %d of %d, overflow %lu", theRadio.GetRcvMQHighWater(), MQ_MAX_RF_RCVMSG, theRadio.GetRcvMQOverflow());
       float succ_r = 0;
       if( theRadio._times > 0 ) {
         succ_r = (float)theRadio._succ * 100 / theRadio._times;
         SERIAL_LN("  Sent %lu out of %lu, Succ-rate %.2f%%",
             theRadio._succ, theRadio._times, succ_r);
+        SERIAL_LN("  SendMQ %d of %d, coalesced %lu", theRadio.GetMQLength(), theRadio.GetMQMaxLength(), theRadio.GetCoalescedCount());
+        SERIAL_LN("  TX bursts %lu, burst frames %lu, max blocking %luus", theRadio._txBursts, theRadio._txBurstFrames, theRadio._txMaxUs);
+        for( UC _prio = 0; _prio < RF_PRIO_NUM; _prio++ ) {
+          SERIAL_LN("  Prio %d sent %lu, max wait %lums", _prio, theRadio._prioSent[_prio], theRadio._prioMaxWait[_prio]);
+        }
       }
       CloudOutput("c_rf:%d, succ_r:%.2f", theRadio.isValid(), succ_r);
     } else if (wal_strnicmp(sTopic, "wifi", 4) == 0) {
@@ -534,6 +552,9 @@ bool SerialConsoleClass::doShow(const char *cmd)
     } else if (wal_strnicmp(sTopic, "button", 6) == 0) {
       SERIAL_LN("Knob status - Dimmer:%d, Button:%d, CCT Flag:%d\n\r",  thePanel.GetDimmerValue(), thePanel.GetButtonStatus(), thePanel.GetCCTFlag());
       CloudOutput("s_button:%d-%d-%d", thePanel.GetDimmerValue(), thePanel.GetButtonStatus(), thePanel.GetCCTFlag());
+      SERIAL_LN("Ext. button events:%d, peak:%d/%d, overflow:%lu", theSys.m_btnEvents.Length(), theSys.m_btnEvents.GetHighWater(),
+          theSys.m_btnEvents.GetMaxLength(), theSys.m_btnEvents.GetOverflow());
+      SERIAL_LN("Timer ISR last:%uus, max:%uus, count:%lu\n\r", theSys.m_isrLastUs, theSys.m_isrMaxUs, theSys.m_isrCount);
     } else if (wal_strnicmp(sTopic, "nlist", 5) == 0) {
       SERIAL_LN("**Node List count:%d, size:%d", theConfig.lstNodes.count(), theConfig.lstNodes.size());
       theConfig.lstNodes.showList();
@@ -545,6 +566,22 @@ bool SerialConsoleClass::doShow(const char *cmd)
       theConfig.showKeyMap();
     } else if (wal_strnicmp(sTopic, "extbtn", 6) == 0) {
       theConfig.showButtonActions();
+    } else if (wal_strnicmp(sTopic, "group", 5) == 0) {
+      theConfig.showGroups();
+      SERIAL_LN("Group cmds active:%d, started:%lu, completed:%lu, retried:%lu, failed:%lu\n\r", theSys.Group_cmds.active(),
+          theSys.Group_cmds.m_nStarted, theSys.Group_cmds.m_nCompleted, theSys.Group_cmds.m_nRetried, theSys.Group_cmds.m_nFailed);
+    } else if (wal_strnicmp(sTopic, "loop", 4) == 0) {
+      theSys.showLoopStatistics();
+    } else if (wal_strnicmp(sTopic, "log", 3) == 0) {
+      char *sParam = next();
+      theLog.showFlashLog(sParam ? atoi(sParam) : 20);
+    } else if (wal_strnicmp(sTopic, "sensor", 6) == 0) {
+      theSys.m_sensorState.showStatus();
+      theSys.m_sensorLog.showStatus();
+    } else if (wal_strnicmp(sTopic, "perf", 4) == 0) {
+      theSys.showPerformance();
+      theSys.UpdatePerfVariable();
+      CloudOutput("%s", theSys.m_perfStat.c_str());
   	} else if (wal_strnicmp(sTopic, "rf", 2) == 0) {
       theRadio.PrintRFDetails();
       SERIAL_LN("");
@@ -568,17 +605,14 @@ bool SerialConsoleClass::doShow(const char *cmd)
       SERIAL_LN("useCloud = \t\t\t%d", theConfig.GetUseCloud());
   		SERIAL_LN("m_tzString = \t\t\t%s", theSys.m_tzString.c_str());
       SERIAL_LN("m_strCldCmd = \t\t%s\n\r", theSys.m_strCldCmd.c_str());
+      theSys.showCommandQueue();
+      theSys.m_sensorAgg.showStatistics();
   		SERIAL_LN("m_lastMsg = \t\t\t%s", theSys.m_lastMsg.c_str());
       SERIAL_LN("");
       SERIAL_LN("sensorBitmap = \t\t\t0x%04X", theConfig.GetSensorBitmap());
       SERIAL_LN("indBrightness = \t\t%d", theConfig.GetBrightIndicator());
       SERIAL_LN("relay_keys = \t\t\t0x%02X", theConfig.GetRelayKeys());
   		//SERIAL_LN("rfPowerLevel = \t\t\t%d", theConfig.GetRFPowerLevel());
-      //SERIAL_LN("m_temperature = \t\t%.2f", theSys.m_temperature);
-  		//SERIAL_LN("m_humidity = \t\t\t%.2f", theSys.m_humidity);
-  		//SERIAL_LN("m_brightness = \t\t\t%u", theSys.m_brightness);
-      //SERIAL_LN("m_dust = \t\t\t%d", theSys.m_dust);
-  		//SERIAL_LN("m_motion = \t\t\t%s", (theSys.m_motion ? "true" : "false"));
       SERIAL_LN("");
       SERIAL_LN("Main DeviceID = \t\t%d-%d", CURRENT_DEVICE, CURRENT_SUBDEVICE);
       SERIAL_LN("typeMainDevice = \t\t%d", theConfig.GetMainDeviceType());
@@ -620,7 +654,17 @@ bool SerialConsoleClass::doShow(const char *cmd)
   		SERIAL_LN("RT_ROW_SIZE: \t\t\t\t%u", RT_ROW_SIZE);
   		SERIAL_LN("SCT_ROW_SIZE: \t\t\t\t%u", SCT_ROW_SIZE);
   		SERIAL_LN("MAX_SCT_ROWS: \t\t\t\t%d", MAX_SCT_ROWS);
+  		SERIAL_LN("Alarms used/max: %d/%d, next in %lu ms", Alarm.count(), dtNBR_ALARMS, Alarm.msUntilNextTrigger());
   		SERIAL_LN("SNT_ROW_SIZE: \t\t\t\t%u", SNT_ROW_SIZE);
+      SERIAL_LN("Pool used/peak/max: DST %d/%d/%d, RT %d/%d/%d, SCT %d/%d/%d, SNT %d/%d/%d",
+          theSys.DevStatus_table.pool().used(), theSys.DevStatus_table.pool().highWater(), theSys.DevStatus_table.pool().capacity(),
+          theSys.Rule_table.pool().used(), theSys.Rule_table.pool().highWater(), theSys.Rule_table.pool().capacity(),
+          theSys.Schedule_table.pool().used(), theSys.Schedule_table.pool().highWater(), theSys.Schedule_table.pool().capacity(),
+          theSys.Scenario_table.pool().used(), theSys.Scenario_table.pool().highWater(), theSys.Scenario_table.pool().capacity());
+      SERIAL_LN("Journal staged/pending: %d/%d, commits: %lu, merged: %lu, flash ops: %lu, blocked ms: %lu (max %u)",
+          theConfig.getJournal().GetStagedCount(), theConfig.getJournal().GetPendingCount(),
+          theConfig.getJournal().GetCommitCount(), theConfig.getJournal().GetMergedCount(),
+          theConfig.getJournal().GetFlashOps(), theConfig.getJournal().GetBlockedMs(), theConfig.getJournal().GetMaxBlockedMs());
 
   		SERIAL_LN("");
       SERIAL_LN("DevStatus_table %d items:", theSys.DevStatus_table.size());
@@ -697,6 +741,12 @@ bool SerialConsoleClass::doAction(const char *cmd)
       // ToDo:
       SERIAL_LN("**Color changed\n\r");
       retVal = true;
+    } else if (wal_strnicmp(sTopic, "json", 4) == 0) {
+      // JSON command without spaces, executed in the main loop like cloud commands
+      char *sParam = next();
+      if( sParam ) {
+        retVal = (theSys.QueueCommand(CMD_SRC_SERIAL, CMD_REC_JSON, sParam, strlen(sParam)) > 0);
+      }
     }
   }
 
@@ -986,6 +1036,26 @@ bool SerialConsoleClass::doSet(const char *cmd)
         SERIAL_LN("Require a valid nodeID\n\r");
         retVal = true;
       }
+    } else if (wal_strnicmp(sTopic, "group", 5) == 0) {
+      // Lamp group membership
+      sParam1 = next();
+      sParam2 = next();
+      if( sParam1 && sParam2 ) {
+        sParam3 = next();
+        UC _gid = atoi(sParam1);
+        UC _nid = atoi(sParam2);
+        BOOL _on = (sParam3 ? atoi(sParam3) > 0 : true);
+        if( theConfig.SetGroupMember(_gid, _nid, _on) ) {
+          SERIAL_LN("Node %d %s group %d, size:%d\n\r", _nid, _on ? "added to" : "removed from", _gid, theConfig.GetGroupSize(_gid));
+          CloudOutput("group:%d-%d-%d", _gid, _nid, _on);
+        } else {
+          SERIAL_LN("Invalid groupID [%d..%d] or nodeID\n\r", NODEID_MIN_GROUP, NODEID_MAX_GROUP);
+        }
+        retVal = true;
+      } else {
+        SERIAL_LN("Require groupID and nodeID, use '? set' for detail\n\r");
+        retVal = true;
+      }
     } else if (wal_strnicmp(sTopic, "subid", 5) == 0) {
       // Sub device id
       sParam1 = next();
@@ -1065,6 +1135,26 @@ bool SerialConsoleClass::doSet(const char *cmd)
         CloudOutput("kcto:%d", theConfig.GetTimeLoopKC());
         retVal = true;
       }
+    } else if (wal_strnicmp(sTopic, "pubwin", 6) == 0) {
+      // Sensor publish window
+      sParam1 = next();
+      if( sParam1) {
+        theSys.m_sensorAgg.SetWindow(atol(sParam1));
+        SERIAL_LN("Set sensor publish window: %lums\n\r", theSys.m_sensorAgg.GetWindow());
+        CloudOutput("pubwin:%lu", theSys.m_sensorAgg.GetWindow());
+        retVal = true;
+      }
+    } else if (wal_strnicmp(sTopic, "stream", 6) == 0) {
+      // Knob control stream rate
+      sParam1 = next();
+      if( sParam1) {
+        sParam2 = next();
+        CPanelStream &lv_stream = thePanel.GetStream();
+        lv_stream.SetRate((UC)atoi(sParam1), sParam2 ? (US)atoi(sParam2) : lv_stream.GetSettleMs());
+        SERIAL_LN("Set control stream: %d fps, settle %ums\n\r", lv_stream.GetFrameRate(), lv_stream.GetSettleMs());
+        CloudOutput("stream:%d-%u", lv_stream.GetFrameRate(), lv_stream.GetSettleMs());
+        retVal = true;
+      }
     } else if (wal_strnicmp(sTopic, "pptpin", 6) == 0) {
       // PPT Access Code
       sParam1 = next();
@@ -1193,12 +1283,14 @@ bool SerialConsoleClass::doSysSub(const char *cmd)
     else if (wal_strnicmp(sTopic, "safe", 4) == 0) {
       SERIAL_LN("System is about to enter safe mode...");
       CloudOutput("Will enter safe mode");
+      theSys.PrepareReset();
       delay(1000);
       System.enterSafeMode();
     }
     else if (wal_strnicmp(sTopic, "dfu", 3) == 0) {
       SERIAL_LN("System is about to enter DFU mode...");
       CloudOutput("Will enter DFU mode");
+      theSys.PrepareReset();
       delay(1000);
       System.dfu();
     }
@@ -1246,6 +1338,8 @@ bool SerialConsoleClass::doSysSub(const char *cmd)
             if( !theConfig.lstNodes.clearNodeId((UC)atoi(sParam1)) ) {
               SERIAL_LN("Failed to clear NodeID:%s\n\r", sParam1);
               CloudOutput("Failed to clear NodeID:%s", sParam1);
+            } else {
+              theSys.m_sensorState.Remove((UC)atoi(sParam1));
             }
           }
         }else if( wal_stricmp(sParam1, "config") == 0 )
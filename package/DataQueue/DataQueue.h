@@ -52,6 +52,150 @@ private:
 	US		m_pWrite;
 };
 
+//	Fixed-slot, single-producer/single-consumer frame queue
+//	- Producer: GetWriteSlot() -> fill in place -> Commit(), or Drop() if no slot
+//	- Consumer: Peek() -> use in place -> Pop()
+//	No lock is needed: only the producer moves m_head and only the consumer moves m_tail,
+//	so either side may run in ISR context. N must not exceed 127.
+template <typename T, UC N>
+class CFrameQueue
+{
+public:
+	CFrameQueue() { ClearBuffer(); }
+
+	// Slot to be filled by producer, NULL if queue is full
+	T *GetWriteSlot() {
+		if( Length() >= N ) return NULL;
+		return &m_slots[m_head % N];
+	}
+
+	// Count a frame the producer discarded for lack of a slot
+	void Drop() { m_overflow++; }
+
+	// Publish the slot returned by GetWriteSlot()
+	void Commit() {
+		__asm__ __volatile__("" ::: "memory");
+		m_head = NextIndex(m_head);
+		UC lv_len = Length();
+		if( lv_len > m_highWater ) m_highWater = lv_len;
+	}
+
+	// Oldest frame, NULL if queue is empty
+	T *Peek() {
+		if( m_head == m_tail ) return NULL;
+		__asm__ __volatile__("" ::: "memory");
+		return &m_slots[m_tail % N];
+	}
+
+	// Release the slot returned by Peek()
+	void Pop() {
+		__asm__ __volatile__("" ::: "memory");
+		if( m_head != m_tail ) m_tail = NextIndex(m_tail);
+	}
+
+	UC Length() { return (UC)((m_head + 2 * N - m_tail) % (2 * N)); }
+	UC GetMaxLength() { return N; }
+	bool IsFull() { return( Length() >= N ); }
+	UC GetHighWater() { return m_highWater; }
+	UL GetOverflow() { return m_overflow; }
+	void ClearBuffer() { m_head = m_tail = 0; m_highWater = 0; m_overflow = 0; }
+
+protected:
+	T		m_slots[N];
+	// Indices run over [0, 2N) so that full and empty can be told apart
+	volatile UC	m_head;
+	volatile UC	m_tail;
+	UC		m_highWater;
+	UL		m_overflow;
+
+	UC NextIndex(UC idx) { return( idx + 1 >= 2 * N ? 0 : idx + 1 ); }
+};
+
+#define RECORDQ_HEADER_SIZE		3		// Length (2 bytes) and tag
+
+//	Fixed-capacity byte ring of variable length records
+//	- Each record is stored as a header (length, tag) followed by its data
+//	- Records wrap around the end of the buffer, no space is lost to padding
+//	- Push() fails without side effects (overflow counted) if the record doesn't fit
+//	Producer and consumer must run in the same context.
+template <US N>
+class CRecordQueue
+{
+public:
+	CRecordQueue() { ClearBuffer(); }
+
+	bool Push(const UC *f_data, US f_len, UC f_tag = 0) {
+		if( f_len > N - RECORDQ_HEADER_SIZE || m_used + RECORDQ_HEADER_SIZE + f_len > N ) {
+			m_overflow++;
+			return false;
+		}
+		UC lv_header[RECORDQ_HEADER_SIZE] = { (UC)(f_len & 0xFF), (UC)(f_len >> 8), f_tag };
+		Write(lv_header, RECORDQ_HEADER_SIZE);
+		Write(f_data, f_len);
+		m_count++;
+		if( m_used > m_highWater ) m_highWater = m_used;
+		return true;
+	}
+
+	// Length of the oldest record, -1 if queue is empty
+	int PeekLength(UC *f_tag = NULL) {
+		if( !m_count ) return -1;
+		UC lv_header[RECORDQ_HEADER_SIZE];
+		Read(lv_header, RECORDQ_HEADER_SIZE, false);
+		if( f_tag ) *f_tag = lv_header[2];
+		return( lv_header[0] | ((US)lv_header[1] << 8) );
+	}
+
+	// Copy out and release the oldest record, bytes beyond f_size are dropped.
+	// Returns the number of bytes copied, -1 if queue is empty
+	int Pop(UC *f_data, US f_size, UC *f_tag = NULL) {
+		int lv_len = PeekLength(f_tag);
+		if( lv_len < 0 ) return -1;
+		Skip(RECORDQ_HEADER_SIZE);
+		US lv_copy = (lv_len < f_size ? lv_len : f_size);
+		Read(f_data, lv_copy, true);
+		Skip(lv_len - lv_copy);
+		m_count--;
+		return lv_copy;
+	}
+
+	UC Count() { return m_count; }
+	US Length() { return m_used; }
+	US GetFree() { return N - m_used; }
+	US GetMaxLength() { return N; }
+	US GetHighWater() { return m_highWater; }
+	UL GetOverflow() { return m_overflow; }
+	void ClearBuffer() { m_read = m_used = 0; m_count = 0; m_highWater = 0; m_overflow = 0; }
+
+protected:
+	UC		m_buffer[N];
+	US		m_read;
+	US		m_used;
+	UC		m_count;
+	US		m_highWater;
+	UL		m_overflow;
+
+	void Write(const UC *f_data, US f_len) {
+		US lv_pos = (m_read + m_used) % N;
+		US lv_first = (f_len < N - lv_pos ? f_len : N - lv_pos);
+		memcpy(m_buffer + lv_pos, f_data, lv_first);
+		memcpy(m_buffer, f_data + lv_first, f_len - lv_first);
+		m_used += f_len;
+	}
+
+	void Read(UC *f_data, US f_len, bool f_release) {
+		US lv_first = (f_len < N - m_read ? f_len : N - m_read);
+		memcpy(f_data, m_buffer + m_read, lv_first);
+		memcpy(f_data + lv_first, m_buffer, f_len - lv_first);
+		if( f_release ) Skip(f_len);
+	}
+
+	void Skip(US f_len) {
+		m_read = (m_read + f_len) % N;
+		m_used -= f_len;
+	}
+};
+
 #endif // PCS_DATAQUEUE_INCLUDED_
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,361 @@
+/**
+ * FlashJournal.cpp - Write-back journal that stages row writes in RAM,
+ * coalesces adjacent rows and flushes them to flash devices in batches
+ *
+ * Created by Baoshi Sun <bs.sun@datatellit.com>
+ * Copyright (C) 2015-2017 DTIT
+ * Full contributor list:
+ *
+ * Documentation:
+ * Support Forum:
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ *******************************
+ *
+ * REVISION HISTORY
+ * Version 1.0 - Created by Baoshi Sun <bs.sun@datatellit.com>
+ *
+ * Dependancy
+ * 1. Flashee::FlashDevice
+ *
+ * DESCRIPTION
+ * 1. Stage() copies a row into a RAM extent, merging it with a staged extent
+ *    of the same target when the two are overlapping or adjacent, and trims
+ *    it off any other staged extent, so staged extents never overlap
+ * 2. Flush() commits staged extents once the writer has been idle for a while,
+ *    then applies them to their home addresses within a time budget
+ * 3. Commit order: extent image -> header (commit marker) -> home writes -> APPLIED
+ * 4. Recover() replays a committed batch that was interrupted by a reset
+ *
+ * ToDo:
+ *
+**/
+
+#include <stddef.h>
+#include "FlashJournal.h"
+
+using namespace Flashee;
+
+////////////////////////////////////////////////////////////////
+// Flash Journal
+////////////////////////////////////////////////////////////////
+CFlashJournal::CFlashJournal()
+{
+	m_pJournal = NULL;
+	for( uint8_t i = 0; i < FLASHJ_MAX_TARGETS; i++ ) m_pTargets[i] = NULL;
+	m_addr = 0;
+	m_seq = 0;
+	m_tickLastStage = 0;
+	m_idleMs = 0;
+	memset(m_ext, 0x00, sizeof(m_ext));
+	ResetStatistics();
+}
+
+bool CFlashJournal::Init(FlashDevice *f_pJournal, uint32_t f_addr, uint32_t f_len)
+{
+	if( !f_pJournal || f_len < FLASHJ_IMAGE_SIZE ) return false;
+
+	m_pJournal = f_pJournal;
+	m_addr = f_addr;
+
+	// Continue the sequence of the last batch
+	FlashJournalHeader_t lv_hdr;
+	if( m_pJournal->read(lv_hdr, m_addr) && lv_hdr.magic == FLASHJ_MAGIC ) {
+		m_seq = lv_hdr.seq;
+	}
+	return true;
+}
+
+void CFlashJournal::SetTarget(uint8_t f_target, FlashDevice *f_pDevice)
+{
+	if( f_target < FLASHJ_MAX_TARGETS ) m_pTargets[f_target] = f_pDevice;
+}
+
+void CFlashJournal::ResetStatistics()
+{
+	m_nFlashOps = 0;
+	m_nMerged = 0;
+	m_nCommits = 0;
+	m_nBlockedMs = 0;
+	m_nMaxBlockedMs = 0;
+}
+
+uint8_t CFlashJournal::GetStagedCount()
+{
+	return ImageCount(FLASHJ_EXT_STAGED);
+}
+
+uint8_t CFlashJournal::GetPendingCount()
+{
+	return ImageCount(FLASHJ_EXT_COMMITTED);
+}
+
+bool CFlashJournal::IsIdle()
+{
+	return( millis() - m_tickLastStage >= m_idleMs );
+}
+
+uint8_t CFlashJournal::ImageCount(uint8_t f_state)
+{
+	uint8_t lv_count = 0;
+	for( uint8_t i = 0; i < FLASHJ_MAX_EXTENTS; i++ ) {
+		if( m_ext[i].state == f_state ) lv_count++;
+	}
+	return lv_count;
+}
+
+// Stage a write, rows larger than one extent are split.
+// If no extent is available the journal is flushed synchronously first.
+bool CFlashJournal::Stage(uint8_t f_target, uint32_t f_addr, const void *f_data, uint16_t f_len)
+{
+	if( f_target >= FLASHJ_MAX_TARGETS ) return false;
+
+	const uint8_t *lv_data = (const uint8_t *)f_data;
+	while( f_len > 0 ) {
+		uint16_t lv_len = (f_len > FLASHJ_EXTENT_SIZE ? FLASHJ_EXTENT_SIZE : f_len);
+		if( !StageExtent(f_target, f_addr, lv_data, lv_len) ) {
+			if( !Flush(0, true) || !StageExtent(f_target, f_addr, lv_data, lv_len) ) return false;
+		}
+		f_addr += lv_len;
+		lv_data += lv_len;
+		f_len -= lv_len;
+	}
+	m_tickLastStage = millis();
+	return true;
+}
+
+// Staged extents of a target never overlap, so Flush() and Overlay() may apply
+// them in any order: the write is merged into one extent it overlaps or adjoins,
+// or takes a slot of its own, and every other extent is trimmed off its range.
+bool CFlashJournal::StageExtent(uint8_t f_target, uint32_t f_addr, const uint8_t *f_data, uint16_t f_len)
+{
+	FlashJournalExtent_t *pFree = NULL;
+	FlashJournalExtent_t *pMerge = NULL;
+	uint32_t lv_end = f_addr + f_len;
+
+	for( uint8_t i = 0; i < FLASHJ_MAX_EXTENTS; i++ ) {
+		FlashJournalExtent_t *pExt = &m_ext[i];
+		if( pExt->state == FLASHJ_EXT_FREE ) {
+			if( !pFree ) pFree = pExt;
+			continue;
+		}
+		// Committed extents are immutable until applied
+		if( pExt->state != FLASHJ_EXT_STAGED || pExt->target != f_target ) continue;
+
+		uint32_t lv_extEnd = pExt->addr + pExt->len;
+		if( f_addr > lv_extEnd || lv_end < pExt->addr ) continue;
+
+		uint32_t lv_start = (f_addr < pExt->addr ? f_addr : pExt->addr);
+		uint32_t lv_stop = (lv_end > lv_extEnd ? lv_end : lv_extEnd);
+		if( !pMerge && lv_stop - lv_start <= FLASHJ_EXTENT_SIZE ) pMerge = pExt;
+		// An extent the write hides completely can take the write
+		if( !pFree && f_addr <= pExt->addr && lv_extEnd <= lv_end ) pFree = pExt;
+	}
+
+	FlashJournalExtent_t *pNew = (pMerge ? pMerge : pFree);
+	if( !pNew ) return false;
+
+	if( pMerge ) {
+		uint32_t lv_start = (f_addr < pMerge->addr ? f_addr : pMerge->addr);
+		uint32_t lv_stop = (lv_end > pMerge->addr + pMerge->len ? lv_end : pMerge->addr + pMerge->len);
+		if( lv_start < pMerge->addr ) {
+			memmove(pMerge->data + (pMerge->addr - lv_start), pMerge->data, pMerge->len);
+		}
+		memcpy(pMerge->data + (f_addr - lv_start), f_data, f_len);
+		pMerge->addr = lv_start;
+		pMerge->len = lv_stop - lv_start;
+		m_nMerged++;
+	} else {
+		pFree->addr = f_addr;
+		pFree->len = f_len;
+		pFree->target = f_target;
+		memcpy(pFree->data, f_data, f_len);
+		pFree->state = FLASHJ_EXT_STAGED;
+	}
+
+	// Trim older bytes of the range from the other extents
+	for( uint8_t i = 0; i < FLASHJ_MAX_EXTENTS; i++ ) {
+		FlashJournalExtent_t *pExt = &m_ext[i];
+		if( pExt == pNew || pExt->state != FLASHJ_EXT_STAGED || pExt->target != f_target ) continue;
+
+		uint32_t lv_extEnd = pExt->addr + pExt->len;
+		if( f_addr >= lv_extEnd || lv_end <= pExt->addr ) continue;
+
+		if( f_addr <= pExt->addr && lv_extEnd <= lv_end ) {
+			pExt->state = FLASHJ_EXT_FREE;
+		} else if( f_addr <= pExt->addr ) {
+			memmove(pExt->data, pExt->data + (lv_end - pExt->addr), lv_extEnd - lv_end);
+			pExt->len = lv_extEnd - lv_end;
+			pExt->addr = lv_end;
+		} else if( lv_extEnd <= lv_end ) {
+			pExt->len = f_addr - pExt->addr;
+		} else {
+			// Write inside the extent: update it in place
+			memcpy(pExt->data + (f_addr - pExt->addr), f_data, f_len);
+		}
+	}
+	return true;
+}
+
+// Patch f_data, read from the home address, with bytes not yet applied
+void CFlashJournal::Overlay(uint8_t f_target, uint32_t f_addr, void *f_data, uint16_t f_len)
+{
+	uint32_t lv_end = f_addr + f_len;
+	uint8_t lv_state = FLASHJ_EXT_COMMITTED;
+
+	// Committed extents are older than staged ones
+	for( uint8_t pass = 0; pass < 2; pass++ ) {
+		for( uint8_t i = 0; i < FLASHJ_MAX_EXTENTS; i++ ) {
+			FlashJournalExtent_t *pExt = &m_ext[i];
+			if( pExt->state != lv_state || pExt->target != f_target ) continue;
+			uint32_t lv_start = (f_addr > pExt->addr ? f_addr : pExt->addr);
+			uint32_t lv_stop = (lv_end < pExt->addr + pExt->len ? lv_end : pExt->addr + pExt->len);
+			if( lv_start >= lv_stop ) continue;
+			memcpy((uint8_t *)f_data + (lv_start - f_addr), pExt->data + (lv_start - pExt->addr), lv_stop - lv_start);
+		}
+		lv_state = FLASHJ_EXT_STAGED;
+	}
+}
+
+// Write the extent image, then the header as commit marker
+bool CFlashJournal::Commit()
+{
+	uint8_t lv_count = 0;
+	for( uint8_t i = 0; i < FLASHJ_MAX_EXTENTS; i++ ) {
+		if( m_ext[i].state == FLASHJ_EXT_STAGED ) {
+			m_ext[i].state = FLASHJ_EXT_COMMITTED;
+			lv_count = i + 1;
+		}
+	}
+	if( !lv_count ) return true;
+
+	FlashJournalHeader_t lv_hdr;
+	memset(&lv_hdr, 0x00, sizeof(lv_hdr));
+	lv_hdr.magic = FLASHJ_MAGIC;
+	lv_hdr.seq = m_seq + 1;
+	lv_hdr.count = lv_count;
+	lv_hdr.crc = Crc16((const uint8_t *)m_ext, lv_count * sizeof(FlashJournalExtent_t));
+	lv_hdr.state = FLASHJ_HDR_COMMITTED;
+
+	bool lv_ok;
+	m_nFlashOps++;
+	lv_ok = m_pJournal->write(m_ext, m_addr + sizeof(lv_hdr), lv_count * sizeof(FlashJournalExtent_t));
+	if( lv_ok ) {
+		m_nFlashOps++;
+		lv_ok = m_pJournal->write(lv_hdr, m_addr);
+	}
+	if( !lv_ok ) {
+		// Nothing reached the home addresses yet, keep the batch staged
+		for( uint8_t i = 0; i < lv_count; i++ ) {
+			if( m_ext[i].state == FLASHJ_EXT_COMMITTED ) m_ext[i].state = FLASHJ_EXT_STAGED;
+		}
+		return false;
+	}
+	m_seq = lv_hdr.seq;
+	m_nCommits++;
+	return true;
+}
+
+bool CFlashJournal::ApplyExtent(FlashJournalExtent_t *pExt)
+{
+	FlashDevice *pDevice = m_pTargets[pExt->target];
+	if( pDevice ) {
+		m_nFlashOps++;
+		if( !pDevice->write(pExt->data, pExt->addr, pExt->len) ) return false;
+	}
+	pExt->state = FLASHJ_EXT_FREE;
+	return true;
+}
+
+bool CFlashJournal::MarkApplied()
+{
+	uint8_t lv_state = FLASHJ_HDR_APPLIED;
+	m_nFlashOps++;
+	return m_pJournal->write(&lv_state, m_addr + offsetof(FlashJournalHeader_t, state), 1);
+}
+
+// Commit staged extents when the writer is idle (or staging is full, or f_force),
+// then apply committed extents for up to f_budgetMs, at least one per call.
+// f_force drains the journal completely.
+bool CFlashJournal::Flush(uint16_t f_budgetMs, bool f_force)
+{
+	if( !m_pJournal ) return false;
+
+	uint32_t lv_start = millis();
+	bool lv_ok = true;
+	bool lv_worked = false;
+
+	do {
+		if( !GetPendingCount() ) {
+			uint8_t lv_staged = GetStagedCount();
+			if( !lv_staged ) break;
+			if( !f_force && lv_staged < FLASHJ_MAX_EXTENTS && !IsIdle() ) break;
+			lv_worked = true;
+			if( !(lv_ok = Commit()) ) break;
+		}
+
+		bool lv_applied = false;
+		for( uint8_t i = 0; i < FLASHJ_MAX_EXTENTS; i++ ) {
+			if( m_ext[i].state != FLASHJ_EXT_COMMITTED ) continue;
+			if( !f_force && lv_applied && millis() - lv_start >= f_budgetMs ) break;
+			lv_worked = lv_applied = true;
+			if( !(lv_ok = ApplyExtent(&m_ext[i])) ) break;
+		}
+		if( lv_ok && !GetPendingCount() ) lv_ok = MarkApplied();
+	} while( lv_ok && f_force && (GetStagedCount() || GetPendingCount()) );
+
+	if( lv_worked ) {
+		uint32_t lv_elapsed = millis() - lv_start;
+		m_nBlockedMs += lv_elapsed;
+		if( lv_elapsed > m_nMaxBlockedMs ) m_nMaxBlockedMs = (lv_elapsed > 0xFFFF ? 0xFFFF : lv_elapsed);
+	}
+	return lv_ok;
+}
+
+// Replay a committed but not applied batch, must be called before any Stage().
+// Returns the number of extents replayed.
+uint8_t CFlashJournal::Recover()
+{
+	if( !m_pJournal ) return 0;
+
+	FlashJournalHeader_t lv_hdr;
+	if( !m_pJournal->read(lv_hdr, m_addr) ) return 0;
+	if( lv_hdr.magic != FLASHJ_MAGIC || lv_hdr.state != FLASHJ_HDR_COMMITTED ) return 0;
+	if( lv_hdr.count == 0 || lv_hdr.count > FLASHJ_MAX_EXTENTS ) return 0;
+
+	uint32_t lv_size = lv_hdr.count * sizeof(FlashJournalExtent_t);
+	memset(m_ext, 0x00, sizeof(m_ext));
+	if( !m_pJournal->read(m_ext, m_addr + sizeof(lv_hdr), lv_size)
+			|| Crc16((const uint8_t *)m_ext, lv_size) != lv_hdr.crc ) {
+		memset(m_ext, 0x00, sizeof(m_ext));
+		return 0;
+	}
+
+	for( uint8_t i = 0; i < lv_hdr.count; i++ ) {
+		FlashJournalExtent_t *pExt = &m_ext[i];
+		if( pExt->state != FLASHJ_EXT_COMMITTED || pExt->target >= FLASHJ_MAX_TARGETS
+				|| pExt->len > FLASHJ_EXTENT_SIZE ) {
+			pExt->state = FLASHJ_EXT_FREE;
+		}
+	}
+	m_seq = lv_hdr.seq;
+
+	uint8_t lv_count = GetPendingCount();
+	Flush(0, true);
+	return lv_count;
+}
+
+// CRC-16/CCITT
+uint16_t CFlashJournal::Crc16(const uint8_t *f_data, uint32_t f_len, uint16_t f_crc)
+{
+	while( f_len-- ) {
+		f_crc ^= (uint16_t)(*f_data++) << 8;
+		for( uint8_t i = 0; i < 8; i++ ) {
+			f_crc = (f_crc & 0x8000 ? (f_crc << 1) ^ 0x1021 : f_crc << 1);
+		}
+	}
+	return f_crc;
+}
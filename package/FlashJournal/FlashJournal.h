@@ -0,0 +1,114 @@
+//  FlashJournal.h - Write-back journal that batches row writes to flash devices
+
+#ifndef DTIT_FLASHJOURNAL_INCLUDED_
+#define DTIT_FLASHJOURNAL_INCLUDED_
+
+#include "application.h"
+#include "flashee-eeprom.h"
+
+// Number of RAM extents staged between two commits
+#ifndef FLASHJ_MAX_EXTENTS
+#define FLASHJ_MAX_EXTENTS          8
+#endif
+
+// Max bytes held by one extent, i.e. the largest single write to a target device
+#ifndef FLASHJ_EXTENT_SIZE
+#define FLASHJ_EXTENT_SIZE          128
+#endif
+
+// Number of target devices
+#ifndef FLASHJ_MAX_TARGETS
+#define FLASHJ_MAX_TARGETS          2
+#endif
+
+#define FLASHJ_MAGIC                0x4A4C5846      // "FXLJ"
+
+// Extent state
+#define FLASHJ_EXT_FREE             0
+#define FLASHJ_EXT_STAGED           1
+#define FLASHJ_EXT_COMMITTED        2
+
+// Header state. APPLIED only clears bits of COMMITTED, so the marker
+// update never requires an erase on raw flash
+#define FLASHJ_HDR_COMMITTED        0x5A
+#define FLASHJ_HDR_APPLIED          0x00
+
+typedef struct
+{
+  uint32_t addr;              // Home address on target device
+  uint16_t len;
+  uint8_t target;
+  uint8_t state;
+  uint8_t data[FLASHJ_EXTENT_SIZE];
+} FlashJournalExtent_t;
+
+typedef struct
+{
+  uint32_t magic;
+  uint32_t seq;
+  uint16_t crc;               // CRC16 over the extent image
+  uint8_t count;              // Extents in image
+  uint8_t state;              // Commit marker
+  uint8_t reserved[4];
+} FlashJournalHeader_t;
+
+#define FLASHJ_IMAGE_SIZE           (sizeof(FlashJournalHeader_t) + FLASHJ_MAX_EXTENTS * sizeof(FlashJournalExtent_t))
+
+// Row writes are staged in RAM extents; overlapping or adjacent writes to the
+// same target are merged into one extent, and trimmed off the others so the
+// newest bytes win whatever order extents are applied in. A batch is committed by writing the
+// extent image and then the header (the commit marker) to the journal area,
+// after which extents are applied to their home addresses within a time budget.
+// Once all are applied the header is marked APPLIED. Recover() replays a batch
+// that was committed but not completely applied before a reset.
+class CFlashJournal
+{
+public:
+  CFlashJournal();
+
+  bool Init(Flashee::FlashDevice *f_pJournal, uint32_t f_addr, uint32_t f_len);
+  void SetTarget(uint8_t f_target, Flashee::FlashDevice *f_pDevice);
+  void SetIdleWindow(uint16_t f_ms) { m_idleMs = f_ms; }
+
+  bool Stage(uint8_t f_target, uint32_t f_addr, const void *f_data, uint16_t f_len);
+  bool Flush(uint16_t f_budgetMs, bool f_force = false);
+  uint8_t Recover();
+  void Overlay(uint8_t f_target, uint32_t f_addr, void *f_data, uint16_t f_len);
+
+  uint8_t GetStagedCount();
+  uint8_t GetPendingCount();
+  bool IsIdle();
+
+  // Statistics
+  uint32_t GetFlashOps() { return m_nFlashOps; }
+  uint32_t GetMergedCount() { return m_nMerged; }
+  uint32_t GetCommitCount() { return m_nCommits; }
+  uint32_t GetBlockedMs() { return m_nBlockedMs; }
+  uint16_t GetMaxBlockedMs() { return m_nMaxBlockedMs; }
+  void ResetStatistics();
+
+protected:
+  Flashee::FlashDevice *m_pJournal;
+  Flashee::FlashDevice *m_pTargets[FLASHJ_MAX_TARGETS];
+  uint32_t m_addr;
+  uint32_t m_seq;
+  uint32_t m_tickLastStage;
+  uint16_t m_idleMs;
+
+  FlashJournalExtent_t m_ext[FLASHJ_MAX_EXTENTS];
+
+  uint32_t m_nFlashOps;
+  uint32_t m_nMerged;
+  uint32_t m_nCommits;
+  uint32_t m_nBlockedMs;
+  uint16_t m_nMaxBlockedMs;
+
+  bool StageExtent(uint8_t f_target, uint32_t f_addr, const uint8_t *f_data, uint16_t f_len);
+  bool Commit();
+  bool ApplyExtent(FlashJournalExtent_t *pExt);
+  bool MarkApplied();
+  uint8_t ImageCount(uint8_t f_state);
+  static uint16_t Crc16(const uint8_t *f_data, uint32_t f_len, uint16_t f_crc = 0xFFFF);
+};
+
+#endif
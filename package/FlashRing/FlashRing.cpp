@@ -0,0 +1,371 @@
+/**
+ * FlashRing.cpp - Append-only ring of variable length records that keeps
+ * its write position, sequence numbers and read position across resets
+ *
+ * Created by Baoshi Sun <bs.sun@datatellit.com>
+ * Copyright (C) 2015-2017 DTIT
+ * Full contributor list:
+ *
+ * Documentation:
+ * Support Forum:
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ *******************************
+ *
+ * REVISION HISTORY
+ * Version 1.0 - Created by Baoshi Sun <bs.sun@datatellit.com>
+ *
+ * Dependancy
+ * 1. Flashee::FlashDevice, erasePage() / writePage() / readPage() are used
+ *    directly, writes only clear bits
+ *
+ * DESCRIPTION
+ * 1. The region is cut into whole device pages, each starting with a header
+ *    (magic, CRC8, state, sequence of its first record, tag)
+ * 2. Record layout: mark, length, CRC8, body. Append order: length & CRC ->
+ *    body -> mark, a record without VALID mark is torn and seals its page
+ * 3. Consume() clears the marks of records read and the state of pages left
+ *    behind, so the read position is found again after reset
+ * 4. Flashee CircularBuffer keeps its pointers in RAM only, that is why this
+ *    ring is used for data that has to outlive a reset
+ *
+ * ToDo:
+ *
+**/
+
+#include <stddef.h>
+#include "FlashRing.h"
+
+using namespace Flashee;
+
+// Largest record body, the length byte of a written record is never 0xFF
+#define FLASHR_MAX_RECORD           254
+
+// Record classes found by ReadRecord()
+#define FLASHR_SCAN_END             0       // Erased space or end of page
+#define FLASHR_SCAN_VALID           1
+#define FLASHR_SCAN_CONSUMED        2
+#define FLASHR_SCAN_TORN            3       // Interrupted append
+
+////////////////////////////////////////////////////////////////
+// Flash Ring
+////////////////////////////////////////////////////////////////
+CFlashRing::CFlashRing()
+{
+	m_pDevice = NULL;
+	m_base = 0;
+	m_pageSize = 0;
+	m_nPages = 0;
+	m_head = 0;
+	m_offset = 0;
+	m_headTag = 0;
+	m_nextSeq = 0;
+	memset(&m_read, 0x00, sizeof(m_read));
+	m_nAppends = 0;
+	m_nLost = 0;
+	m_nErrors = 0;
+}
+
+// Use the whole device pages within [f_addr, f_addr + f_len), at least two,
+// and recover head and read position from them
+bool CFlashRing::Init(FlashDevice *f_pDevice, uint32_t f_addr, uint32_t f_len)
+{
+	m_pDevice = NULL;
+	m_nAppends = 0;
+	m_nLost = 0;
+	m_nErrors = 0;
+	if( !f_pDevice ) return false;
+
+	uint32_t lv_pageSize = f_pDevice->pageSize();
+	if( lv_pageSize <= sizeof(FlashRingPage_t) + FLASHR_REC_HEADER || lv_pageSize > 0xFFFF ) return false;
+	uint32_t lv_first = (f_addr + lv_pageSize - 1) / lv_pageSize;
+	uint32_t lv_last = (f_addr + f_len) / lv_pageSize;
+	if( lv_last < lv_first + 2 || lv_last - lv_first > 0xFFFF ) return false;
+
+	m_pageSize = lv_pageSize;
+	m_base = lv_first * lv_pageSize;
+	m_nPages = lv_last - lv_first;
+	m_pDevice = f_pDevice;
+
+	// Head is the newest page, reading starts in the oldest page not consumed
+	FlashRingPage_t lv_hdr, lv_headHdr;
+	bool lv_found = false, lv_unread = false;
+	uint16_t lv_oldest = 0;
+	uint32_t lv_oldestSeq = 0;
+	for( uint16_t i = 0; i < m_nPages; i++ ) {
+		if( !ReadPage(i, &lv_hdr) ) continue;
+		if( !lv_found || (int32_t)(lv_hdr.seq - lv_headHdr.seq) > 0 ) {
+			m_head = i;
+			lv_headHdr = lv_hdr;
+			lv_found = true;
+		}
+		if( lv_hdr.state == FLASHR_PAGE_OPEN && (!lv_unread || (int32_t)(lv_hdr.seq - lv_oldestSeq) < 0) ) {
+			lv_oldest = i;
+			lv_oldestSeq = lv_hdr.seq;
+			lv_unread = true;
+		}
+	}
+
+	if( !lv_found ) {
+		// Blank ring, the first append opens page 0
+		m_head = m_nPages - 1;
+		m_offset = m_pageSize;
+		m_headTag = 0;
+		m_nextSeq = 0;
+		m_read.page = 0;
+		m_read.offset = sizeof(FlashRingPage_t);
+		m_read.seq = 0;
+		return true;
+	}
+
+	// A torn record takes its sequence number, nothing follows it in the page
+	uint32_t lv_count;
+	bool lv_torn;
+	m_offset = ScanPage(m_head, &lv_count, &lv_torn);
+	m_nextSeq = lv_headHdr.seq + lv_count;
+	if( lv_torn ) {
+		m_nextSeq++;
+		Seal();
+	}
+	m_headTag = lv_headHdr.tag;
+
+	if( lv_unread ) {
+		m_read.page = lv_oldest;
+		m_read.offset = sizeof(FlashRingPage_t);
+		m_read.seq = lv_oldestSeq;
+	} else {
+		m_read.page = m_head;
+		m_read.offset = m_offset;
+		m_read.seq = m_nextSeq;
+	}
+
+	// Skip records consumed before reset
+	uint8_t lv_len;
+	while( Locate(m_read, &lv_len) == FLASHR_SCAN_CONSUMED ) {
+		Advance(m_read, lv_len);
+	}
+	return true;
+}
+
+// Whether a record of f_len fits the open page
+bool CFlashRing::Fits(uint8_t f_len)
+{
+	return( m_pDevice && (uint32_t)m_offset + FLASHR_REC_HEADER + f_len <= m_pageSize );
+}
+
+// Append a record, opening a new page with f_tag if it doesn't fit the head page
+bool CFlashRing::Append(const void *f_data, uint8_t f_len, uint32_t f_tag)
+{
+	if( !m_pDevice || f_len == 0 || f_len > FLASHR_MAX_RECORD ) return false;
+	if( !Fits(f_len) ) {
+		if( !OpenPage(f_tag) || !Fits(f_len) ) return false;
+	}
+
+	uint32_t lv_addr = PageAddress(m_head) + m_offset;
+	uint8_t lv_lenCrc[2] = { f_len, Crc8((const uint8_t *)f_data, f_len) };
+	uint8_t lv_mark = FLASHR_REC_VALID;
+	bool lv_ok = m_pDevice->writePage(lv_lenCrc, lv_addr + 1, sizeof(lv_lenCrc))
+			&& m_pDevice->writePage(f_data, lv_addr + FLASHR_REC_HEADER, f_len)
+			&& m_pDevice->writePage(&lv_mark, lv_addr, 1);
+
+	// Either way the record takes a sequence number, as Init() would count it
+	m_nextSeq++;
+	if( !lv_ok ) {
+		m_nErrors++;
+		Seal();
+		return false;
+	}
+	m_offset += FLASHR_REC_HEADER + f_len;
+	m_nAppends++;
+	return true;
+}
+
+// Read the record at or after f_pos and move f_pos past it.
+/// Returns false if there is no more record. Body beyond f_size is dropped
+bool CFlashRing::Read(FlashRingPos_t &f_pos, void *f_data, uint8_t f_size, uint8_t *f_len, uint32_t *f_tag)
+{
+	if( !m_pDevice ) return false;
+
+	uint8_t lv_body[FLASHR_MAX_RECORD];
+	uint8_t lv_len;
+	uint8_t lv_type;
+	while( (lv_type = Locate(f_pos, &lv_len)) != FLASHR_SCAN_END ) {
+		uint32_t lv_addr = PageAddress(f_pos.page) + f_pos.offset;
+		uint16_t lv_page = f_pos.page;
+		Advance(f_pos, lv_len);
+		if( lv_type != FLASHR_SCAN_VALID ) continue;
+
+		uint8_t lv_crc;
+		if( !m_pDevice->readPage(&lv_crc, lv_addr + 2, 1)
+				|| !m_pDevice->readPage(lv_body, lv_addr + FLASHR_REC_HEADER, lv_len)
+				|| Crc8(lv_body, lv_len) != lv_crc ) {
+			m_nErrors++;
+			continue;
+		}
+		if( f_tag ) {
+			FlashRingPage_t lv_hdr;
+			*f_tag = (ReadPage(lv_page, &lv_hdr) ? lv_hdr.tag : 0);
+		}
+		*f_len = (lv_len < f_size ? lv_len : f_size);
+		memcpy(f_data, lv_body, *f_len);
+		return true;
+	}
+	return false;
+}
+
+// Release records before f_pos, a position returned by Read()
+bool CFlashRing::Consume(const FlashRingPos_t &f_pos)
+{
+	if( !m_pDevice ) return false;
+
+	uint8_t lv_mark = FLASHR_REC_CONSUMED;
+	uint8_t lv_len;
+	uint8_t lv_type;
+	bool lv_ok = true;
+	while( (int32_t)(f_pos.seq - m_read.seq) > 0 ) {
+		uint16_t lv_page = m_read.page;
+		if( (lv_type = Locate(m_read, &lv_len)) == FLASHR_SCAN_END ) break;
+		if( m_read.page != lv_page ) {
+			FlashRingPage_t lv_hdr;
+			lv_hdr.state = FLASHR_PAGE_CONSUMED;
+			lv_ok &= m_pDevice->writePage(&lv_hdr.state, PageAddress(lv_page) + offsetof(FlashRingPage_t, state), 1);
+		}
+		if( lv_type == FLASHR_SCAN_VALID ) {
+			lv_ok &= m_pDevice->writePage(&lv_mark, PageAddress(m_read.page) + m_read.offset, 1);
+		}
+		Advance(m_read, lv_len);
+	}
+	if( !lv_ok ) m_nErrors++;
+	return lv_ok;
+}
+
+bool CFlashRing::ReadPage(uint16_t f_page, FlashRingPage_t *f_pHdr)
+{
+	if( !m_pDevice->readPage(f_pHdr, PageAddress(f_page), sizeof(FlashRingPage_t)) ) return false;
+	if( f_pHdr->magic != FLASHR_MAGIC ) return false;
+	return( Crc8((const uint8_t *)&f_pHdr->seq, sizeof(f_pHdr->seq) + sizeof(f_pHdr->tag)) == f_pHdr->crc );
+}
+
+// Classify the record at f_offset of f_page
+uint8_t CFlashRing::ReadRecord(uint16_t f_page, uint16_t f_offset, uint8_t *f_len)
+{
+	if( (uint32_t)f_offset + FLASHR_REC_HEADER > m_pageSize ) return FLASHR_SCAN_END;
+	uint8_t lv_hdr[FLASHR_REC_HEADER];
+	if( !m_pDevice->readPage(lv_hdr, PageAddress(f_page) + f_offset, FLASHR_REC_HEADER) ) return FLASHR_SCAN_END;
+
+	*f_len = lv_hdr[1];
+	if( lv_hdr[1] == 0xFF ) {
+		return( lv_hdr[0] == FLASHR_REC_FREE ? FLASHR_SCAN_END : FLASHR_SCAN_TORN );
+	}
+	if( lv_hdr[1] == 0 || (uint32_t)f_offset + FLASHR_REC_HEADER + lv_hdr[1] > m_pageSize ) return FLASHR_SCAN_TORN;
+	if( lv_hdr[0] == FLASHR_REC_VALID ) return FLASHR_SCAN_VALID;
+	// Consumed, or a mark interrupted on its way from FREE to VALID or VALID to CONSUMED
+	if( (lv_hdr[0] & ~FLASHR_REC_VALID) == 0 ) return FLASHR_SCAN_CONSUMED;
+	return FLASHR_SCAN_TORN;
+}
+
+// Count records of f_page, return the offset behind the last one
+uint16_t CFlashRing::ScanPage(uint16_t f_page, uint32_t *f_count, bool *f_torn)
+{
+	uint16_t lv_offset = sizeof(FlashRingPage_t);
+	uint8_t lv_len;
+	uint8_t lv_type;
+	*f_count = 0;
+	*f_torn = false;
+	while( (lv_type = ReadRecord(f_page, lv_offset, &lv_len)) != FLASHR_SCAN_END ) {
+		if( lv_type == FLASHR_SCAN_TORN ) {
+			*f_torn = true;
+			break;
+		}
+		(*f_count)++;
+		lv_offset += FLASHR_REC_HEADER + lv_len;
+	}
+	return lv_offset;
+}
+
+// Move f_pos to the next record (valid or consumed) at or after it, across
+// page ends. Return its class, or END with f_pos.seq set to the next sequence
+uint8_t CFlashRing::Locate(FlashRingPos_t &f_pos, uint8_t *f_len)
+{
+	for( uint16_t lv_hops = 0; lv_hops <= m_nPages && f_pos.seq != m_nextSeq; ) {
+		uint8_t lv_type = ReadRecord(f_pos.page, f_pos.offset, f_len);
+		if( lv_type == FLASHR_SCAN_VALID || lv_type == FLASHR_SCAN_CONSUMED ) return lv_type;
+		if( f_pos.page == m_head ) break;
+
+		f_pos.page = NextPage(f_pos.page);
+		lv_hops++;
+		FlashRingPage_t lv_hdr;
+		if( ReadPage(f_pos.page, &lv_hdr) ) {
+			f_pos.offset = sizeof(FlashRingPage_t);
+			f_pos.seq = lv_hdr.seq;
+		} else {
+			f_pos.offset = m_pageSize;
+		}
+	}
+	f_pos.seq = m_nextSeq;
+	return FLASHR_SCAN_END;
+}
+
+void CFlashRing::Advance(FlashRingPos_t &f_pos, uint8_t f_len)
+{
+	f_pos.offset += FLASHR_REC_HEADER + f_len;
+	f_pos.seq++;
+}
+
+// Erase the page after head and make it the head. If the reader has not
+// got through it yet, reading goes on with the oldest page left
+bool CFlashRing::OpenPage(uint32_t f_tag)
+{
+	uint16_t lv_page = NextPage(m_head);
+	FlashRingPage_t lv_hdr;
+
+	if( m_read.page == lv_page ) {
+		uint32_t lv_seq = m_nextSeq;
+		m_read.offset = sizeof(FlashRingPage_t);
+		if( m_read.seq != m_nextSeq ) {
+			for( uint16_t i = NextPage(lv_page); i != lv_page; i = NextPage(i) ) {
+				if( ReadPage(i, &lv_hdr) ) {
+					m_read.page = i;
+					lv_seq = lv_hdr.seq;
+					break;
+				}
+			}
+		}
+		m_nLost += lv_seq - m_read.seq;
+		m_read.seq = lv_seq;
+	}
+
+	Seal();
+	if( !m_pDevice->erasePage(PageAddress(lv_page)) ) {
+		m_nErrors++;
+		return false;
+	}
+	lv_hdr.magic = FLASHR_MAGIC;
+	lv_hdr.state = FLASHR_PAGE_OPEN;
+	lv_hdr.seq = m_nextSeq;
+	lv_hdr.tag = f_tag;
+	lv_hdr.crc = Crc8((const uint8_t *)&lv_hdr.seq, sizeof(lv_hdr.seq) + sizeof(lv_hdr.tag));
+	m_head = lv_page;
+	if( !m_pDevice->writePage(&lv_hdr, PageAddress(lv_page), sizeof(lv_hdr)) ) {
+		m_nErrors++;
+		return false;
+	}
+	m_offset = sizeof(FlashRingPage_t);
+	m_headTag = f_tag;
+	return true;
+}
+
+// CRC-8, polynomial 0x07
+uint8_t CFlashRing::Crc8(const uint8_t *f_data, uint16_t f_len, uint8_t f_crc)
+{
+	while( f_len-- ) {
+		f_crc ^= *f_data++;
+		for( uint8_t i = 0; i < 8; i++ ) {
+			f_crc = (f_crc & 0x80 ? (f_crc << 1) ^ 0x07 : f_crc << 1);
+		}
+	}
+	return f_crc;
+}
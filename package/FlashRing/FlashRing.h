@@ -0,0 +1,99 @@
+//  FlashRing.h - Append-only record ring over erasable flash pages
+
+#ifndef DTIT_FLASHRING_INCLUDED_
+#define DTIT_FLASHRING_INCLUDED_
+
+#include "application.h"
+#include "flashee-eeprom.h"
+
+#define FLASHR_MAGIC                0x5246          // "FR"
+
+// Page state. CONSUMED only clears bits of OPEN
+#define FLASHR_PAGE_OPEN            0xFF
+#define FLASHR_PAGE_CONSUMED        0x00
+
+// Record mark, written after the record body. CONSUMED only clears bits of VALID
+#define FLASHR_REC_FREE             0xFF
+#define FLASHR_REC_VALID            0x5A
+#define FLASHR_REC_CONSUMED         0x00
+
+// Mark, length and CRC8 of the body
+#define FLASHR_REC_HEADER           3
+
+typedef struct
+{
+  uint16_t magic;
+  uint8_t crc;                // CRC8 over seq and tag
+  uint8_t state;              // FLASHR_PAGE_*
+  uint32_t seq;               // Sequence number of the first record in page
+  uint32_t tag;               // Set by the writer when the page is opened
+} FlashRingPage_t;
+
+// Position of a record, as handed out by GetReadPos() and Read()
+typedef struct
+{
+  uint16_t page;
+  uint16_t offset;
+  uint32_t seq;
+} FlashRingPos_t;
+
+// Records are appended to the open (head) page; a record never spans pages.
+// Opening a page erases the oldest one, unread records in it are counted as
+// lost. Each record is written body first and then its mark, so a reset during
+// an append leaves either a complete record or a page that Init() seals.
+// Init() finds the head as the valid page with the highest sequence and the
+// read position as the first record not yet consumed. Every appended record
+// takes the next sequence number, which survives resets.
+class CFlashRing
+{
+public:
+  CFlashRing();
+
+  bool Init(Flashee::FlashDevice *f_pDevice, uint32_t f_addr, uint32_t f_len);
+  bool IsReady() { return m_pDevice != NULL; }
+
+  bool Append(const void *f_data, uint8_t f_len, uint32_t f_tag = 0);
+  bool Fits(uint8_t f_len);
+  void Seal() { m_offset = m_pageSize; }
+  uint32_t GetHeadTag() { return m_headTag; }
+
+  FlashRingPos_t GetReadPos() { return m_read; }
+  bool Read(FlashRingPos_t &f_pos, void *f_data, uint8_t f_size, uint8_t *f_len, uint32_t *f_tag = NULL);
+  bool Consume(const FlashRingPos_t &f_pos);
+  bool IsPending() { return m_read.seq != m_nextSeq; }
+  uint32_t GetPendingCount() { return m_nextSeq - m_read.seq; }
+  uint32_t GetNextSeq() { return m_nextSeq; }
+  uint16_t GetPageCount() { return m_nPages; }
+
+  // Statistics
+  uint32_t GetAppendCount() { return m_nAppends; }
+  uint32_t GetLostCount() { return m_nLost; }
+  uint32_t GetErrorCount() { return m_nErrors; }
+
+protected:
+  Flashee::FlashDevice *m_pDevice;
+  uint32_t m_base;            // Address of the first whole page
+  uint16_t m_pageSize;
+  uint16_t m_nPages;
+  uint16_t m_head;            // Page being written
+  uint16_t m_offset;          // Write offset in head page, m_pageSize if sealed
+  uint32_t m_headTag;
+  uint32_t m_nextSeq;
+  FlashRingPos_t m_read;
+
+  uint32_t m_nAppends;
+  uint32_t m_nLost;
+  uint32_t m_nErrors;
+
+  uint32_t PageAddress(uint16_t f_page) { return m_base + (uint32_t)f_page * m_pageSize; }
+  uint16_t NextPage(uint16_t f_page) { return( f_page + 1 >= m_nPages ? 0 : f_page + 1 ); }
+  bool ReadPage(uint16_t f_page, FlashRingPage_t *f_pHdr);
+  uint8_t ReadRecord(uint16_t f_page, uint16_t f_offset, uint8_t *f_len);
+  uint16_t ScanPage(uint16_t f_page, uint32_t *f_count, bool *f_torn);
+  uint8_t Locate(FlashRingPos_t &f_pos, uint8_t *f_len);
+  void Advance(FlashRingPos_t &f_pos, uint8_t f_len);
+  bool OpenPage(uint32_t f_tag);
+  static uint8_t Crc8(const uint8_t *f_data, uint16_t f_len, uint8_t f_crc = 0);
+};
+
+#endif
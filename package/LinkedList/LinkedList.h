@@ -18,7 +18,83 @@ struct ListNode
 	ListNode<T> *next;
 };
 
+// Slot number of a node that doesn't belong to a slot pool
+#define LIST_SLOT_NONE		0xFF
+
+/*
+	Storage policy: one heap node per item (default)
+*/
 template <typename T>
+class ListHeapPool{
+public:
+	// Node numbers are not available, key index can't be built on it
+	static const bool Indexable = false;
+
+	ListHeapPool() : _used(0), _highWater(0) {}
+
+	ListNode<T> *alloc(){
+		ListNode<T> *tmp = new ListNode<T>();
+		if(tmp && ++_used > _highWater) _highWater = _used;
+		return tmp;
+	}
+	void release(ListNode<T> *p){ delete p; _used--; }
+
+	uint8_t slotOf(const ListNode<T> *p){ return LIST_SLOT_NONE; }
+	ListNode<T> *nodeAt(uint8_t slot){ return 0; }
+	int used(){ return _used; }
+	int highWater(){ return _highWater; }
+	int capacity(){ return -1; }
+
+private:
+	int _used;
+	int _highWater;
+};
+
+/*
+	Storage policy: N nodes in one contiguous array, free nodes are
+	linked through their 'next' pointer (intrusive free list).
+	No heap allocation, and alloc()/release() are O(1)
+*/
+template <typename T, int N>
+class ListStaticPool{
+public:
+	// Node numbers fit in uint8_t, except LIST_SLOT_NONE
+	static const bool Indexable = (N < LIST_SLOT_NONE);
+
+	ListStaticPool() : _used(0), _highWater(0){
+		for(int i = 0; i < N - 1; i++) _nodes[i].next = &_nodes[i + 1];
+		_nodes[N - 1].next = 0;
+		_free = _nodes;
+	}
+
+	ListNode<T> *alloc(){
+		ListNode<T> *tmp = _free;
+		if(!tmp) return 0;
+		_free = tmp->next;
+		tmp->next = 0;
+		if(++_used > _highWater) _highWater = _used;
+		return tmp;
+	}
+	void release(ListNode<T> *p){
+		p->next = _free;
+		_free = p;
+		_used--;
+	}
+
+	uint8_t slotOf(const ListNode<T> *p){ return (uint8_t)(p - _nodes); }
+	ListNode<T> *nodeAt(uint8_t slot){ return &_nodes[slot]; }
+	int used(){ return _used; }
+	int highWater(){ return _highWater; }
+	int capacity(){ return N; }
+
+private:
+	ListNode<T> _nodes[N];
+	ListNode<T> *_free;
+	int _used;
+	int _highWater;
+};
+
+template <typename T, class Pool = ListHeapPool<T> >
 class LinkedList{
 
 protected:
@@ -33,6 +109,9 @@ protected:
 	// everytime the list suffer changes
 	bool isCached;
 
+	// Node storage
+	Pool _pool;
+
 	ListNode<T>* getNode(int index);
 
 public:
@@ -90,11 +169,16 @@ public:
 	*/
 	virtual void clear();
 
+	/*
+		Node storage usage
+	*/
+	Pool& pool() { return _pool; }
+
 };
 
 // Initialize LinkedList with false values
-template<typename T>
-LinkedList<T>::LinkedList()
+template<typename T, class Pool>
+LinkedList<T, Pool>::LinkedList()
 {
 	root=0;
 	last=0;
@@ -106,15 +190,15 @@ LinkedList<T>::LinkedList()
 }
 
 // Clear Nodes and free Memory
-template<typename T>
-LinkedList<T>::~LinkedList()
+template<typename T, class Pool>
+LinkedList<T, Pool>::~LinkedList()
 {
 	ListNode<T>* tmp;
 	while(root!=0)
 	{
 		tmp=root;
 		root=root->next;
-		delete tmp;
+		_pool.release(tmp);
 	}
 	last = 0;
 	_size=0;
@@ -125,8 +209,8 @@ LinkedList<T>::~LinkedList()
 	Actualy "logic" coding
 */
 
-template<typename T>
-ListNode<T>* LinkedList<T>::getNode(int index){
+template<typename T, class Pool>
+ListNode<T>* LinkedList<T, Pool>::getNode(int index){
 
 	int _pos = 0;
 	ListNode<T>* current = root;
@@ -156,13 +240,13 @@ ListNode<T>* LinkedList<T>::getNode(int index){
 	return 0;
 }
 
-template<typename T>
-int LinkedList<T>::size(){
+template<typename T, class Pool>
+int LinkedList<T, Pool>::size(){
 	return _size;
 }
 
-template<typename T>
-bool LinkedList<T>::add(int index, T _t){
+template<typename T, class Pool>
+bool LinkedList<T, Pool>::add(int index, T _t){
 
 	if(index >= _size)
 		return add(_t);
@@ -170,8 +254,9 @@ bool LinkedList<T>::add(int index, T _t){
 	if(index == 0)
 		return unshift(_t);
 
-	ListNode<T> *tmp = new ListNode<T>(),
+	ListNode<T> *tmp = _pool.alloc(),
 				 *_prev = getNode(index-1);
+	if(!tmp) return false;
 	tmp->data = _t;
 	tmp->next = _prev->next;
 	_prev->next = tmp;
@@ -182,10 +267,11 @@ bool LinkedList<T>::add(int index, T _t){
 	return true;
 }
 
-template<typename T>
-bool LinkedList<T>::add(T _t){
+template<typename T, class Pool>
+bool LinkedList<T, Pool>::add(T _t){
 
-	ListNode<T> *tmp = new ListNode<T>();
+	ListNode<T> *tmp = _pool.alloc();
+	if(!tmp) return false;
 	tmp->data = _t;
 	tmp->next = 0;
 
@@ -205,13 +291,14 @@ bool LinkedList<T>::add(T _t){
 	return true;
 }
 
-template<typename T>
-bool LinkedList<T>::unshift(T _t){
+template<typename T, class Pool>
+bool LinkedList<T, Pool>::unshift(T _t){
 
 	if(_size == 0)
 		return add(_t);
 
-	ListNode<T> *tmp = new ListNode<T>();
+	ListNode<T> *tmp = _pool.alloc();
+	if(!tmp) return false;
 	tmp->next = root;
 	tmp->data = _t;
 	root = tmp;
@@ -222,8 +309,8 @@ bool LinkedList<T>::unshift(T _t){
 	return true;
 }
 
-template<typename T>
-bool LinkedList<T>::set(int index, T _t){
+template<typename T, class Pool>
+bool LinkedList<T, Pool>::set(int index, T _t){
 	// Check if index position is in bounds
 	if(index < 0 || index >= _size)
 		return false;
@@ -232,8 +319,8 @@ bool LinkedList<T>::set(int index, T _t){
 	return true;
 }
 
-template<typename T>
-T LinkedList<T>::pop(){
+template<typename T, class Pool>
+T LinkedList<T, Pool>::pop(){
 	if(_size <= 0)
 		return T();
 
@@ -242,7 +329,7 @@ T LinkedList<T>::pop(){
 	if(_size >= 2){
 		ListNode<T> *tmp = getNode(_size - 2);
 		T ret = tmp->next->data;
-		delete(tmp->next);
+		_pool.release(tmp->next);
 		tmp->next = 0;
 		last = tmp;
 		_size--;
@@ -250,7 +337,7 @@ T LinkedList<T>::pop(){
 	}else{
 		// Only one element left on the list
 		T ret = root->data;
-		delete(root);
+		_pool.release(root);
 		root = 0;
 		last = 0;
 		_size = 0;
@@ -258,15 +345,15 @@ T LinkedList<T>::pop(){
 	}
 }
 
-template<typename T>
-T LinkedList<T>::shift(){
+template<typename T, class Pool>
+T LinkedList<T, Pool>::shift(){
 	if(_size <= 0)
 		return T();
 
 	if(_size > 1){
 		ListNode<T> *_next = root->next;
 		T ret = root->data;
-		delete(root);
+		_pool.release(root);
 		root = _next;
 		_size --;
 		isCached = false;
@@ -279,8 +366,8 @@ T LinkedList<T>::shift(){
 
 }
 
-template<typename T>
-T LinkedList<T>::remove(int index){
+template<typename T, class Pool>
+T LinkedList<T, Pool>::remove(int index){
 	if (index < 0 || index >= _size)
 	{
 		return T();
@@ -298,22 +385,22 @@ T LinkedList<T>::remove(int index){
 	ListNode<T> *toDelete = tmp->next;
 	T ret = toDelete->data;
 	tmp->next = tmp->next->next;
-	delete(toDelete);
+	_pool.release(toDelete);
 	_size--;
 	isCached = false;
 	return ret;
 }
 
 
-template<typename T>
-T LinkedList<T>::get(int index){
+template<typename T, class Pool>
+T LinkedList<T, Pool>::get(int index){
 	ListNode<T> *tmp = getNode(index);
 
 	return (tmp ? tmp->data : T());
 }
 
-template<typename T>
-void LinkedList<T>::clear(){
+template<typename T, class Pool>
+void LinkedList<T, Pool>::clear(){
 	while(size() > 0)
 		shift();
 }
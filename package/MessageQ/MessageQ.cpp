@@ -32,43 +32,34 @@
 ////////////////////////////////////////////////////////////////
 // Fast Message Queue
 ////////////////////////////////////////////////////////////////
-CFastMessageNode::CFastMessageNode(uint8_t f_iSize)
- : m_iRepeatTimes(0)
+CFastMessageNode::CFastMessageNode()
 {
-	m_pData = new uint8_t[f_iSize];
-	if( m_pData )
-	{
-		m_nSize = f_iSize;
-		memset(m_pData, 0x00, m_nSize);
-	}
-	else
-		m_nSize = 0;
-
+	memset(m_pData, 0x00, sizeof(m_pData));
 	m_nLen = 0;
 	m_pPrev = NULL;
 	m_pNext = NULL;
 	m_Tag = 0;
 	m_iFlag = 0;
+	m_nPriority = 0;
+	m_tickNextTry = 0;
+	m_tickEnqueued = 0;
   m_iRepeatTimes = 0;
   m_tickLastRead = 0;
 }
 
-CFastMessageNode::~CFastMessageNode()
+void CFastMessageNode::WriteMessage(const uint8_t *f_data, uint8_t f_len, uint8_t f_Tag, uint32_t f_flag, uint8_t f_prio)
 {
-	if( m_pData )
-		delete[] m_pData;
-}
-
-void CFastMessageNode::WriteMessage(const uint8_t *f_data, uint8_t f_len, uint8_t f_Tag, uint32_t f_flag)
-{
-	uint8_t lv_len = min(f_len, m_nSize);
+	uint8_t lv_len = (f_len < FASTMQ_NODE_SIZE ? f_len : FASTMQ_NODE_SIZE);
 	if( lv_len > 0 )
 		memcpy( m_pData, f_data, lv_len );
 	m_nLen = lv_len;
 	m_Tag = f_Tag;
   m_iFlag = f_flag;
+  m_nPriority = f_prio;
   m_iRepeatTimes = 0;
   m_tickLastRead = 0;
+  // Due immediately
+  m_tickEnqueued = m_tickNextTry = millis();
 }
 
 uint8_t CFastMessageNode::ReadMessage(uint8_t *f_data, uint8_t *f_repeat, uint8_t *f_Tag,uint32_t *f_flag, uint8_t f_10ms)
@@ -103,111 +94,152 @@ void CFastMessageNode::ClearMessage()
   m_nLen = 0;
 }
 
-CFastMessageQ::CFastMessageQ(uint8_t f_iMaxLen, uint8_t f_iNodeSize)
+bool CFastMessageNode::IsDue(uint32_t f_now)
+{
+  return((int32_t)(f_now - m_tickNextTry) >= 0);
+}
+
+void CFastMessageNode::SetNextTry(uint32_t f_tick)
+{
+  m_tickNextTry = f_tick;
+}
+
+CFastMessageQ::CFastMessageQ()
 	: m_iQLength(0),
+	  m_iMaxQLength(0),
 	  m_pQHead(NULL),
 	  m_pQTail(NULL),
     m_bDupMsg(false),
-    m_bLock(false)
+    m_bLock(false),
+    m_nCoalesced(0),
+    m_pNodes(NULL),
+    m_pIndex(NULL),
+    m_iIndexMask(0)
 {
-	// Get maxium length
-	m_iMaxQLength = f_iMaxLen;
-
-	// Get node size
-	m_iNodeSize = f_iNodeSize;
-
-	// Create queue
-	CFastMessageNode *lv_new, *lv_old = NULL;
-	for( uint8_t lv_loop = 0; lv_loop < m_iMaxQLength; lv_loop++ )
-	{
-		lv_new = new CFastMessageNode(f_iNodeSize);
-		if( lv_new == NULL )
-		{
-			m_iMaxQLength = lv_loop;
-			break;
-		}
-
-		/// Link Nodes
-		if( lv_old != NULL )
-		{
-			lv_old->m_pNext = lv_new;
-			lv_new->m_pPrev = lv_old;
-		}
-		else
-			m_pQHead = m_pQTail = lv_new; // First node
-		lv_old = lv_new;
-	}
-
-	if( m_pQHead )
-	{
-		m_pQHead->m_pPrev = lv_old;
-		lv_old->m_pNext = m_pQHead;
-	}
 }
 
 CFastMessageQ::~CFastMessageQ()
 {
-	CFastMessageNode *lv_pNode;
+	// Nodes are owned by derived class
+}
+
+// Link nodes into a circular queue, f_iIndexSize must be power of two and larger than f_iMaxLen
+void CFastMessageQ::InitQueue(CFastMessageNode *f_pNodes, uint8_t f_iMaxLen, uint8_t *f_pIndex, uint16_t f_iIndexSize)
+{
+	m_pNodes = f_pNodes;
+	m_iMaxQLength = f_iMaxLen;
+	m_pIndex = f_pIndex;
+	m_iIndexMask = f_iIndexSize - 1;
+	memset(m_pIndex, FASTMQ_INDEX_EMPTY, f_iIndexSize);
+
 	for( uint8_t lv_loop = 0; lv_loop < m_iMaxQLength; lv_loop++ )
 	{
-		lv_pNode = m_pQHead;
-		m_pQHead = m_pQHead->m_pNext;
-		delete(lv_pNode);
+		m_pNodes[lv_loop].m_pNext = &m_pNodes[(lv_loop + 1) % m_iMaxQLength];
+		m_pNodes[lv_loop].m_pPrev = &m_pNodes[(lv_loop + m_iMaxQLength - 1) % m_iMaxQLength];
 	}
+	m_pQHead = m_pQTail = (m_iMaxQLength > 0 ? m_pNodes : NULL);
+	m_iQLength = 0;
 }
 
-
 uint8_t CFastMessageQ::GetMQLength()
 {
 	return m_iQLength;
 }
 
-
 uint8_t CFastMessageQ::GetMQMaxLength()
 {
 	return m_iMaxQLength;
 }
 
+uint32_t CFastMessageQ::GetCoalescedCount()
+{
+	return m_nCoalesced;
+}
+
+//------------------------------------------------------------------
+// Flag index, open addressing with linear probing
+//------------------------------------------------------------------
+uint16_t CFastMessageQ::IndexHash(uint32_t f_flag)
+{
+	f_flag *= 2654435761UL;
+	return (uint16_t)((f_flag ^ (f_flag >> 16)) & m_iIndexMask);
+}
+
+CFastMessageNode *CFastMessageQ::IndexFind(uint32_t f_flag)
+{
+	uint16_t lv_pos = IndexHash(f_flag);
+	while( m_pIndex[lv_pos] != FASTMQ_INDEX_EMPTY ) {
+		if( m_pNodes[m_pIndex[lv_pos]].m_iFlag == f_flag ) return &m_pNodes[m_pIndex[lv_pos]];
+		lv_pos = (lv_pos + 1) & m_iIndexMask;
+	}
+	return NULL;
+}
+
+void CFastMessageQ::IndexInsert(CFastMessageNode *pNode)
+{
+	uint16_t lv_pos = IndexHash(pNode->m_iFlag);
+	while( m_pIndex[lv_pos] != FASTMQ_INDEX_EMPTY ) {
+		lv_pos = (lv_pos + 1) & m_iIndexMask;
+	}
+	m_pIndex[lv_pos] = (uint8_t)(pNode - m_pNodes);
+}
+
+// Backward-shift deletion, no tombstones left behind
+void CFastMessageQ::IndexRemove(CFastMessageNode *pNode)
+{
+	uint8_t lv_slot = (uint8_t)(pNode - m_pNodes);
+	uint16_t lv_pos = IndexHash(pNode->m_iFlag);
+	while( m_pIndex[lv_pos] != lv_slot ) {
+		if( m_pIndex[lv_pos] == FASTMQ_INDEX_EMPTY ) return;
+		lv_pos = (lv_pos + 1) & m_iIndexMask;
+	}
+
+	uint16_t lv_hole = lv_pos, lv_home;
+	while( true ) {
+		m_pIndex[lv_hole] = FASTMQ_INDEX_EMPTY;
+		lv_pos = lv_hole;
+		while( true ) {
+			lv_pos = (lv_pos + 1) & m_iIndexMask;
+			if( m_pIndex[lv_pos] == FASTMQ_INDEX_EMPTY ) return;
+			lv_home = IndexHash(m_pNodes[m_pIndex[lv_pos]].m_iFlag);
+			// Move entry back unless its home lies cyclically in (hole, pos]
+			if( ((lv_pos - lv_home) & m_iIndexMask) >= ((lv_pos - lv_hole) & m_iIndexMask) ) break;
+		}
+		m_pIndex[lv_hole] = m_pIndex[lv_pos];
+		lv_hole = lv_pos;
+	}
+}
+
 // Add message at the end of queue
-uint8_t CFastMessageQ::AddMessage(const uint8_t *f_data, uint8_t f_len, uint8_t f_Tag, uint32_t f_flag)
+uint8_t CFastMessageQ::AddMessage(const uint8_t *f_data, uint8_t f_len, uint8_t f_Tag, uint32_t f_flag, uint8_t f_prio)
 {
   if( GetLock(20) ) return 0;
 
   uint8_t lv_retVal = 0;
-  uint8_t cmpRet = 0;
   // Lock Queue
 	LockQueue();
-	
 
   if( !m_bDupMsg ) {
-    // Skip duplicated message
-    CFastMessageNode *lv_pNode = m_pQHead;
-    while( lv_pNode != NULL && lv_pNode != m_pQTail )
-    {
-	  cmpRet  = lv_pNode->CompareMessage(f_data, f_len, f_flag);
-      if( cmpRet > 0)
-      {
-		    Serial.printlnf("same type message %d",f_flag);
-        // Same type message
-        lv_retVal = m_iQLength;
-		    if(cmpRet == 2)
-		    { // need update message content
-          lv_pNode->WriteMessage(f_data, f_len, lv_pNode->m_Tag,f_flag);
-		    }
-        break;
+    // Coalesce with the queued message of same type
+    CFastMessageNode *lv_pNode = IndexFind(f_flag);
+    if( lv_pNode ) {
+      m_nCoalesced++;
+      lv_retVal = m_iQLength;
+      if( lv_pNode->CompareMessage(f_data, f_len, f_flag) == 2 ) {
+        // need update message content, latest value is sent without waiting for backoff
+        lv_pNode->WriteMessage(f_data, f_len, lv_pNode->m_Tag, f_flag, f_prio);
       }
-      lv_pNode = lv_pNode->m_pNext;
     }
   }
 
-	if( m_iQLength < m_iMaxQLength && lv_retVal == 0 && cmpRet == 0)
+	if( m_iQLength < m_iMaxQLength && lv_retVal == 0 )
 	{
 		// Set Data
-		m_pQTail->WriteMessage(f_data, f_len, f_Tag,f_flag);
+		m_pQTail->WriteMessage(f_data, f_len, f_Tag, f_flag, f_prio);
+		IndexInsert(m_pQTail);
 		m_pQTail = m_pQTail->m_pNext;
 		m_iQLength++;
 		lv_retVal = m_iQLength;
-    //SERIAL_LN("Messgae Queue len:%d", m_iQLength);
 	}
 
 	// Unlock
@@ -233,6 +265,35 @@ CFastMessageNode *CFastMessageQ::GetMessage(CFastMessageNode *pNode)
 	return pNode;
 }
 
+// Pick the due message of the highest priority class, earliest deadline first.
+// Only messages with (flag & f_mask) == f_match are considered.
+// Return NULL if nothing is due
+CFastMessageNode *CFastMessageQ::GetNextMessage(uint32_t f_now, uint32_t f_mask, uint32_t f_match)
+{
+  if( GetLock(10) ) return NULL;
+
+	// Lock Queue
+	LockQueue();
+
+  CFastMessageNode *lv_pBest = NULL;
+  CFastMessageNode *lv_pNode = m_pQHead;
+  for( uint8_t lv_loop = 0; lv_loop < m_iQLength; lv_loop++ ) {
+    if( lv_pNode->IsDue(f_now) && (lv_pNode->m_iFlag & f_mask) == f_match ) {
+      if( !lv_pBest || lv_pNode->m_nPriority < lv_pBest->m_nPriority
+          || (lv_pNode->m_nPriority == lv_pBest->m_nPriority
+              && (int32_t)(lv_pNode->m_tickNextTry - lv_pBest->m_tickNextTry) < 0) ) {
+        lv_pBest = lv_pNode;
+      }
+    }
+    lv_pNode = lv_pNode->m_pNext;
+  }
+
+	// Unlock
+	UnlockQueue();
+
+	return lv_pBest;
+}
+
 // Remove member
 bool CFastMessageQ::RemoveMessage(CFastMessageNode *pNode)
 {
@@ -244,20 +305,25 @@ bool CFastMessageQ::RemoveMessage(CFastMessageNode *pNode)
 	LockQueue();
 
 	if( pNode == NULL ) pNode = m_pQHead;
-  if( pNode != m_pQTail && m_iQLength > 0 ) {
+  if( m_iQLength > 0 && (pNode != m_pQTail || m_iQLength == m_iMaxQLength) ) {
+    IndexRemove(pNode);
     pNode->ClearMessage();
-	if(pNode == m_pQHead)
-	{
-		m_pQHead = pNode->m_pNext;
-	}
-    // Rearrange node chain
-    pNode->m_pPrev->m_pNext = pNode->m_pNext;
-    pNode->m_pNext->m_pPrev = pNode->m_pPrev;
-    pNode->m_pNext = m_pQTail->m_pNext;
-    pNode->m_pPrev = m_pQTail;
-    m_pQTail->m_pNext->m_pPrev = pNode;
-    m_pQTail->m_pNext = pNode;
+    bool lv_full = (m_iQLength == m_iMaxQLength);
+    if( pNode == m_pQHead ) m_pQHead = pNode->m_pNext;
+    if( m_iMaxQLength > 1 ) {
+      // Rearrange node chain: the removed node becomes the first free node
+      pNode->m_pPrev->m_pNext = pNode->m_pNext;
+      pNode->m_pNext->m_pPrev = pNode->m_pPrev;
+      CFastMessageNode *lv_pAfter = (lv_full ? m_pQHead : m_pQTail->m_pNext);
+      CFastMessageNode *lv_pBefore = lv_pAfter->m_pPrev;
+      pNode->m_pNext = lv_pAfter;
+      pNode->m_pPrev = lv_pBefore;
+      lv_pBefore->m_pNext = pNode;
+      lv_pAfter->m_pPrev = pNode;
+    }
+    if( lv_full ) m_pQTail = pNode;
 		m_iQLength--;
+    lv_retVal = true;
   }
 
 	// Unlock
@@ -273,6 +339,7 @@ void CFastMessageQ::RemoveAllMessage()
 	LockQueue();
 	m_iQLength = 0;
 	m_pQHead = m_pQTail;
+	if( m_pIndex ) memset(m_pIndex, FASTMQ_INDEX_EMPTY, m_iIndexMask + 1);
 	// Unlock
 	UnlockQueue();
 }
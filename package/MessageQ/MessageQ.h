@@ -5,41 +5,61 @@
 
 #include "application.h"
 
+// Max message length held by a queue node
+#ifndef FASTMQ_NODE_SIZE
+#define FASTMQ_NODE_SIZE            32
+#endif
+
+// Empty slot in flag index
+#define FASTMQ_INDEX_EMPTY          0xFF
+
 class CFastMessageNode
 {
 public:
-  CFastMessageNode(uint8_t f_iSize);
-  ~CFastMessageNode();
+  CFastMessageNode();
 
   CFastMessageNode *m_pNext;
   CFastMessageNode *m_pPrev;
   uint8_t m_Tag;
   uint32_t m_iFlag;           // Message flag
+  uint8_t m_nPriority;        // Priority class, lower value is served first
+  uint32_t m_tickNextTry;     // Deadline of next attempt
+  uint32_t m_tickEnqueued;    // When the message content was written
 
-  void WriteMessage(const uint8_t *f_data, uint8_t f_len, uint8_t f_Tag = 0,  uint32_t f_flag = 0);
+  void WriteMessage(const uint8_t *f_data, uint8_t f_len, uint8_t f_Tag = 0,  uint32_t f_flag = 0, uint8_t f_prio = 0);
   uint8_t ReadMessage(uint8_t *f_data, uint8_t *f_repeat, uint8_t *f_Tag = NULL, uint32_t *f_flag = NULL, uint8_t f_10ms = 0);
   uint8_t CompareMessage(const uint8_t *f_data, uint8_t f_len, uint32_t f_flag = 0);
   void ClearMessage();
+  bool IsDue(uint32_t f_now);
+  void SetNextTry(uint32_t f_tick);
 
 private:
-  uint8_t *m_pData;					  // Message Data
+  uint8_t m_pData[FASTMQ_NODE_SIZE];	// Message Data
   uint8_t m_nLen;							// Message Length
-  uint8_t m_nSize;						// Buffer size
   uint8_t m_iRepeatTimes;
   uint32_t m_tickLastRead;
 };
 
+// Circular message queue over caller provided nodes.
+// Messages of the same flag are coalesced through an open-addressed flag index,
+// so AddMessage() costs O(1) regardless of queue depth. The index holds every
+// queued node, also while duplicates are allowed, so it stays valid across
+// SetDuplicateMsg() toggles.
+// GetNextMessage() serves due messages by priority class, then by earliest deadline,
+// optionally only those whose flag matches under a mask.
 class CFastMessageQ
 {
 public:
 	void RemoveAllMessage();
 	bool RemoveMessage(CFastMessageNode *pNode = NULL);
 	CFastMessageNode *GetMessage(CFastMessageNode *pNode = NULL);
-	uint8_t AddMessage(const uint8_t *f_data, uint8_t f_len, uint8_t f_Tag = 0,  uint32_t f_flag = 0);
+	CFastMessageNode *GetNextMessage(uint32_t f_now, uint32_t f_mask = 0, uint32_t f_match = 0);
+	uint8_t AddMessage(const uint8_t *f_data, uint8_t f_len, uint8_t f_Tag = 0,  uint32_t f_flag = 0, uint8_t f_prio = 0);
 	uint8_t GetMQLength();
 	uint8_t GetMQMaxLength();
+  uint32_t GetCoalescedCount();
 
-	CFastMessageQ(uint8_t f_iMaxLen = 8, uint8_t f_iNodeSize = 32);
+	CFastMessageQ();
 	virtual ~CFastMessageQ();
 
   uint8_t GetRepeatInterval();
@@ -56,11 +76,41 @@ protected:
 	CFastMessageNode *m_pQTail;
 	uint8_t m_iQLength;
 	uint8_t m_iMaxQLength;
-	uint8_t m_iNodeSize;
+
+  void InitQueue(CFastMessageNode *f_pNodes, uint8_t f_iMaxLen, uint8_t *f_pIndex, uint16_t f_iIndexSize);
 
 private:
 	bool m_bLock;
   bool m_bDupMsg;
+  uint32_t m_nCoalesced;
+
+  // Flag index: node position in m_pNodes, or FASTMQ_INDEX_EMPTY
+  CFastMessageNode *m_pNodes;
+  uint8_t *m_pIndex;
+  uint16_t m_iIndexMask;
+
+  uint16_t IndexHash(uint32_t f_flag);
+  CFastMessageNode *IndexFind(uint32_t f_flag);
+  void IndexInsert(CFastMessageNode *pNode);
+  void IndexRemove(CFastMessageNode *pNode);
+};
+
+// Flag index size: power of two, at least twice of the capacity to keep probe sequences short
+constexpr uint16_t FastMQIndexSize(uint16_t f_iMaxLen, uint16_t f_size = 4)
+{
+  return( f_size >= 2 * f_iMaxLen ? f_size : FastMQIndexSize(f_iMaxLen, f_size * 2) );
+}
+
+// Fixed capacity message queue, N (< 255) nodes are allocated statically
+template <uint8_t N>
+class CStaticMessageQ : public CFastMessageQ
+{
+public:
+  CStaticMessageQ() { InitQueue(m_nodes, N, m_index, FastMQIndexSize(N)); }
+
+private:
+  CFastMessageNode m_nodes[N];
+  uint8_t m_index[FastMQIndexSize(N)];
 };
 
 #endif
@@ -59,5 +59,9 @@
 #define RF24_DATARATE 	   	RF24_250KBPS
 // This is also act as base value for sensor nodeId addresses.
 #define RF24_BASE_RADIO_ID ((uint64_t)0x4454495400LL)
+// Payloads held by the nRF24 TX FIFO
+#define RF24_TX_FIFO_DEPTH  3
+// Abort a burst transmit if no frame completes within this time (ms)
+#define RF24_BURST_TIMEOUT  100
 
 #endif
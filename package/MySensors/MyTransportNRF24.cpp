@@ -162,29 +162,112 @@ uint16_t MyTransportNRF24::getBaseNetworkDuration() {
 	return (millis() - _baseStartTick) / 1000;
 }
 
-bool MyTransportNRF24::send(uint8_t to, const void* data, uint8_t len, uint8_t pipe) {
-	// Make sure radio has powered up
-	rf24.powerUp();
-	rf24.stopListening();
+// Select writing pipe, return false if the base network is not allowed
+bool MyTransportNRF24::openTxPipe(uint8_t to, uint8_t pipe) {
 	if( _address == GATEWAY_ADDRESS && pipe == CURRENT_NODE_PIPE ) {
 		if( !_bBaseNetworkEnabled && to != NODEID_RF_SCANNER) {
-			rf24.startListening();
 			return false;
 		}
 		rf24.openWritingPipe(TO_ADDR(RF24_BASE_RADIO_ID, to));
 	} else {
 		rf24.openWritingPipe(TO_ADDR(_currentNetworkID, to));
 	}
+	return true;
+}
+
+bool MyTransportNRF24::send(uint8_t to, const void* data, uint8_t len, uint8_t pipe) {
+	// Make sure radio has powered up
+	rf24.powerUp();
+	rf24.stopListening();
+	if( !openTxPipe(to, pipe) ) {
+		rf24.startListening();
+		return false;
+	}
 	bool ok = rf24.write(data, len, to == BROADCAST_ADDRESS);
 	rf24.startListening();
 	return ok;
 }
 
-bool MyTransportNRF24::send(uint8_t to, MyMessage &message, uint8_t pipe) {
+// Fill in header fields, return the frame length
+uint8_t MyTransportNRF24::prepareMessage(MyMessage &message) {
 	message.setVersion(PROTOCOL_VERSION);
 	message.setLast(_address);
 	uint8_t length = message.getSigned() ? MAX_MESSAGE_LENGTH : message.getLength();
-	return send(to, (void *)&(message.msg), min(MAX_MESSAGE_LENGTH, HEADER_SIZE + length), pipe);
+	return min(MAX_MESSAGE_LENGTH, HEADER_SIZE + length);
+}
+
+bool MyTransportNRF24::send(uint8_t to, MyMessage &message, uint8_t pipe) {
+	uint8_t length = prepareMessage(message);
+	return send(to, (void *)&(message.msg), length, pipe);
+}
+
+// SBS added: Keep the TX FIFO loaded with frames to one destination and collect
+// completions from the FIFO occupancy, so the listen/transmit turnaround and
+// the power-up delay are paid once per burst instead of once per frame.
+// A frame that hits MAX_RT is dropped from the FIFO and the frames behind it are reloaded.
+// RX_DR is not cleared, a frame received during the burst is read once listening again.
+// Return number of frames acknowledged, results[i] tells each frame
+uint8_t MyTransportNRF24::sendBurst(uint8_t to, MyMessage **messages, uint8_t count, bool *results, uint8_t pipe) {
+	uint8_t loaded = 0, done = 0, acked = 0;
+	for( uint8_t i = 0; i < count; i++ ) results[i] = false;
+	if( count == 0 ) return 0;
+
+	rf24.stopListening();
+	rf24.startTxBurst();
+	if( !openTxPipe(to, pipe) ) {
+		rf24.startListening();
+		return 0;
+	}
+
+	bool multicast = (to == BROADCAST_ADDRESS);
+	bool tx_fail;
+	uint8_t queued;
+	uint32_t tickProgress = millis();
+	while( done < count ) {
+		// Keep the TX FIFO loaded, CE stays high between frames
+		while( loaded < count && loaded - done < RF24_TX_FIFO_DEPTH ) {
+			uint8_t length = prepareMessage(*messages[loaded]);
+			rf24.startFastWrite((void *)&(messages[loaded]->msg), length, multicast);
+			loaded++;
+		}
+
+		// Frames no longer in the FIFO are completed. The FIFO flags only bound
+		// how many are queued, the exact count is taken on failure
+		queued = rf24.pollTxBurst(tx_fail);
+		if( tx_fail ) {
+			// The failed frame heads the FIFO and the radio holds it: top the FIFO
+			// up with fillers to learn how many frames are still queued
+			uint8_t filler = 0;
+			queued = RF24_TX_FIFO_DEPTH;
+			while( queued > 0 && !rf24.isTxFifoFull() ) {
+				rf24.startFastWrite(&filler, 1, false, false);
+				queued--;
+			}
+			rf24.flush_tx();
+			rf24.clearMaxRetries();
+			// Frames before the failed one are delivered, the ones behind it are loaded again
+			uint8_t failed = loaded - queued;
+			while( done < failed ) { results[done++] = true; acked++; }
+			done++;
+			loaded = done;
+			tickProgress = millis();
+			continue;
+		}
+		if( queued > loaded - done ) queued = loaded - done;
+		if( done < loaded - queued ) {
+			while( done < loaded - queued ) { results[done++] = true; acked++; }
+			tickProgress = millis();
+		}
+		if( millis() - tickProgress > RF24_BURST_TIMEOUT ) {
+			rf24.flush_tx();
+			rf24.clearMaxRetries();
+			break;
+		}
+	}
+
+	rf24.txStandBy();
+	rf24.startListening();
+	return acked;
 }
 
 bool MyTransportNRF24::available(uint8_t *to, uint8_t *pipe) {
@@ -46,6 +46,8 @@ public:
 	uint8_t getAddress();
 	bool send(uint8_t to, const void* data, uint8_t len, uint8_t pipe = 255);
 	bool send(uint8_t to, MyMessage &message, uint8_t pipe = 255);
+	// SBS added: several frames to one destination per listen/transmit turnaround
+	uint8_t sendBurst(uint8_t to, MyMessage **messages, uint8_t count, bool *results, uint8_t pipe = 255);
 	bool available(uint8_t *to, uint8_t *pipe = NULL);
 	uint8_t receive(void* data);
 	void powerDown();
@@ -72,6 +74,9 @@ public:
 	uint16_t getBaseNetworkDuration();
 
 private:
+	bool openTxPipe(uint8_t to, uint8_t pipe);
+	uint8_t prepareMessage(MyMessage &message);
+
 	RF24 rf24;
 	uint8_t _address;
 	uint8_t _channel;
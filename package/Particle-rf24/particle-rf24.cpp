@@ -766,6 +766,53 @@ bool RF24::txStandBy(){
 
 /****************************************************************************/
 
+void RF24::startTxBurst()
+{
+  uint8_t cfg = read_register(CONFIG);
+  ce(LOW);
+  write_register(CONFIG, ( cfg | _BV(PWR_UP) ) & ~_BV(PRIM_RX) );
+  write_register(NRF_STATUS, _BV(TX_DS) | _BV(MAX_RT) );
+  flush_tx();
+
+  // Tpd2stby only when leaving power down, TX settling is done by the radio once CE is high
+  if( !(cfg & _BV(PWR_UP)) ) delay(5);
+}
+
+/****************************************************************************/
+
+bool RF24::isTxFifoEmpty()
+{
+  return( read_register(FIFO_STATUS) & _BV(TX_EMPTY) );
+}
+
+/****************************************************************************/
+
+bool RF24::isTxFifoFull()
+{
+  return( read_register(FIFO_STATUS) & _BV(TX_FULL) );
+}
+
+/****************************************************************************/
+
+uint8_t RF24::pollTxBurst(bool& tx_fail)
+{
+  uint8_t status = write_register(NRF_STATUS, _BV(TX_DS));
+  tx_fail = status & _BV(MAX_RT);
+
+  uint8_t fifo = read_register(FIFO_STATUS);
+  if( fifo & _BV(TX_EMPTY) ) return 0;
+  return( (fifo & _BV(TX_FULL)) ? 3 : 2 );
+}
+
+/****************************************************************************/
+
+void RF24::clearMaxRetries()
+{
+  write_register(NRF_STATUS, _BV(MAX_RT));
+}
+
+/****************************************************************************/
+
 bool RF24::txStandBy(uint32_t timeout, bool startTx){
 
   if(startTx){
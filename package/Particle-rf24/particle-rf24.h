@@ -455,6 +455,54 @@ s   *
    */
    bool txStandBy(uint32_t timeout, bool startTx = 0);
 
+  /**
+   * Enter TX mode for a burst of startFastWrite() calls. Clears PRIM_RX, the TX
+   * interrupt flags and the TX FIFO. Waits for power-up only if the radio was
+   * powered down, so back-to-back bursts skip the 5ms Tpd2stby delay.
+   * @code
+   *			radio.startTxBurst();
+   *			radio.startFastWrite(&buf,32,0);
+   *			radio.startFastWrite(&buf,32,0);
+   *			// poll pollTxBurst() for completions
+   *			radio.txStandBy();
+   * @endcode
+   */
+  void startTxBurst();
+
+  /**
+   * Check whether all payloads in the TX FIFO have been sent
+   *
+   * @return True if TX FIFO is empty
+   */
+  bool isTxFifoEmpty();
+
+  /**
+   * Check whether the TX FIFO can take no more payloads
+   *
+   * @return True if TX FIFO is full
+   */
+  bool isTxFifoFull();
+
+  /**
+   * Poll a burst started by startTxBurst(). TX_DS is cleared, RX_DR is left
+   * alone so a payload received meanwhile is still reported. MAX_RT is left
+   * set: the failed payload stays at the head of the TX FIFO and nothing is
+   * sent until clearMaxRetries().
+   *
+   * TX_DS merges all payloads sent since the last poll, so completions have
+   * to be counted from the FIFO occupancy instead.
+   *
+   * @param[out] tx_fail The head payload exhausted its retries (MAX_RT)
+   * @return Most payloads that may still be queued: 0 if the FIFO is empty,
+   * 3 if full, otherwise 2
+   */
+  uint8_t pollTxBurst(bool& tx_fail);
+
+  /**
+   * Clear MAX_RT, so the radio goes on with the TX FIFO
+   */
+  void clearMaxRetries();
+
   /**
    * Write an ack payload for the specified pipe
    *
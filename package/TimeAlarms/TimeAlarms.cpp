@@ -40,17 +40,18 @@ AlarmClass::AlarmClass()
   value = nextTrigger = 0;
   onTickHandler = NULL;  // prevent a callback until this pointer is explicitly set
   tag = NULL;
+  heapPos = dtINVALID_ALARM_ID;
 }
 
 //**************************************************************
 //* Private Methods
 
 
-void AlarmClass::updateNextTrigger()
+void AlarmClass::updateNextTrigger(time_t time)
 {
-  if( (value != 0) && Mode.isEnabled )
+  // value 0 is midnight for daily and weekly alarms, only a timer needs a non zero value
+  if( (value != 0 || dtIsAlarm(Mode.alarmType)) && Mode.isEnabled )
   {
-    time_t time = now_tz();
     if( dtIsAlarm(Mode.alarmType) && nextTrigger <= time )   // update alarm if next trigger is not yet in the future
     {
       if(Mode.alarmType == dtExplicitAlarm ) // is the value a specific date and time in the future
@@ -102,8 +103,14 @@ void AlarmClass::updateNextTrigger()
 TimeAlarmsClass::TimeAlarmsClass()
 {
   isServicing = false;
-  for(uint8_t id = 0; id < dtNBR_ALARMS; id++)
-     free(id);   // ensure  all Alarms are cleared and available for allocation
+  heapSize = 0;
+  zoneCache = 0;
+  lastSecond = 0;
+  secondStart = 0;
+  simulatedTime = simulatedZone = 0;
+  // ids are handed out lowest first
+  for(freeCount = 0; freeCount < dtNBR_ALARMS; freeCount++)
+     freeIds[freeCount] = dtNBR_ALARMS - 1 - freeCount;
 }
 
 // this method creates a trigger at the given absolute time_t
@@ -166,15 +173,19 @@ AlarmID_t TimeAlarmsClass::alarmRepeat(time_t value, OnTick_t onTickHandler){ //
     void TimeAlarmsClass::enable(AlarmID_t ID)
     {
       if(isAllocated(ID)) {
-        Alarm[ID].Mode.isEnabled = (Alarm[ID].value != 0) && (Alarm[ID].onTickHandler != 0) ;  // only enable if value is non zero and a tick handler has been set
-        Alarm[ID].updateNextTrigger(); // trigger is updated whenever  this is called, even if already enabled
+        // only enable if a tick handler has been set, and value is non zero for a timer
+        Alarm[ID].Mode.isEnabled = (Alarm[ID].value != 0 || dtIsAlarm(Alarm[ID].Mode.alarmType)) && (Alarm[ID].onTickHandler != 0) ;
+        Alarm[ID].updateNextTrigger(nowLocal()); // trigger is updated whenever  this is called, even if already enabled
+        schedule(ID);
       }
     }
 
     void TimeAlarmsClass::disable(AlarmID_t ID)
     {
-      if(isAllocated(ID))
+      if(isAllocated(ID)) {
         Alarm[ID].Mode.isEnabled = false;
+        unschedule(ID);
+      }
     }
 
     // write the given value to the given alarm
@@ -183,6 +194,7 @@ AlarmID_t TimeAlarmsClass::alarmRepeat(time_t value, OnTick_t onTickHandler){ //
       if(isAllocated(ID))
       {
         Alarm[ID].value = value;
+        Alarm[ID].nextTrigger = 0;  // a pending trigger belongs to the old value
         enable(ID);  // update trigger time
       }
     }
@@ -209,24 +221,20 @@ AlarmID_t TimeAlarmsClass::alarmRepeat(time_t value, OnTick_t onTickHandler){ //
     {
       if(isAllocated(ID))
       {
+        unschedule(ID);
         Alarm[ID].Mode.isEnabled = false;
         Alarm[ID].Mode.alarmType = dtNotAllocated;
         Alarm[ID].onTickHandler = 0;
         Alarm[ID].value = 0;
         Alarm[ID].nextTrigger = 0;
+        freeIds[freeCount++] = ID;
       }
     }
 
     // returns the number of allocated timers
     uint8_t TimeAlarmsClass::count()
     {
-       uint8_t c = 0;
-       for(uint8_t id = 0; id < dtNBR_ALARMS; id++)
-       {
-          if(isAllocated(id))
-            c++;
-       }
-       return c;
+       return dtNBR_ALARMS - freeCount;
     }
 
     // returns true only if id is allocated and the type is a time based alarm, returns false if not allocated or if its a timer
@@ -255,8 +263,37 @@ AlarmID_t TimeAlarmsClass::alarmRepeat(time_t value, OnTick_t onTickHandler){ //
     void TimeAlarmsClass::delay(unsigned long ms)
     {
       unsigned long start = millis();
-      while( millis() - start  <= ms)
-        serviceAlarms();
+      serviceAlarms();
+      // Wait on millis() for the next trigger instead of reading the clock on every pass
+      unsigned long wait = msUntilNextTrigger();
+      unsigned long mark = millis();
+      while( millis() - start  <= ms) {
+        if( millis() - mark >= wait ) {
+          serviceAlarms();
+          wait = msUntilNextTrigger();
+          mark = millis();
+        }
+      }
+    }
+
+    // returns how long the caller may sleep before the next alarm is due
+    unsigned long TimeAlarmsClass::msUntilNextTrigger()
+    {
+      time_t time = nowLocal();
+      if( heapSize == 0 )
+        return dtNO_TRIGGER;
+      time_t next = Alarm[heap[0]].nextTrigger;
+      if( next <= time )
+        return 0;
+      if( next - time >= (time_t)(dtNO_TRIGGER / 1000) )
+        return dtNO_TRIGGER;
+      unsigned long ms = (unsigned long)(next - time) * 1000;
+      if( !simulatedTime ) {
+        // the clock counts seconds, take off the part of this second that has gone
+        unsigned long gone = millis() - secondStart;
+        ms -= (gone < 1000 ? gone : 999);
+      }
+      return ms;
     }
 
     void TimeAlarmsClass::waitForDigits( uint8_t Digits, dtUnits_t Units)
@@ -276,7 +313,7 @@ AlarmID_t TimeAlarmsClass::alarmRepeat(time_t value, OnTick_t onTickHandler){ //
 
     uint8_t TimeAlarmsClass::getDigitsNow( dtUnits_t Units)
     {
-      time_t time = now_tz();
+      time_t time = nowLocal();
       if(Units == dtSecond) return numberOfSeconds(time);
       if(Units == dtMinute) return numberOfMinutes(time);
       if(Units == dtHour) return numberOfHours(time);
@@ -290,7 +327,7 @@ AlarmID_t TimeAlarmsClass::alarmRepeat(time_t value, OnTick_t onTickHandler){ //
       int retval = 0;
       if( isAllocated(ID) )
       {
-        retval = Alarm[ID].nextTrigger - now_tz();
+        retval = Alarm[ID].nextTrigger - nowLocal();
       }
 
       return retval;
@@ -305,6 +342,18 @@ AlarmID_t TimeAlarmsClass::alarmRepeat(time_t value, OnTick_t onTickHandler){ //
       return false;
     }
 
+    // use a simulated clock, e.g. to replay days of schedules in a test
+    void TimeAlarmsClass::simulateClock(time_t utc, time_t zone)
+    {
+      simulatedTime = utc;
+      simulatedZone = zone;
+    }
+
+    void TimeAlarmsClass::tick()
+    {
+      serviceAlarms();
+    }
+
     //***********************************************************
     //* Private Methods
 
@@ -313,19 +362,41 @@ AlarmID_t TimeAlarmsClass::alarmRepeat(time_t value, OnTick_t onTickHandler){ //
       if(! isServicing)
       {
         isServicing = true;
-        for( servicedAlarmId = 0; servicedAlarmId < dtNBR_ALARMS; servicedAlarmId++)
+        time_t time = nowLocal();
+        // snapshot the alarms due on entry, in trigger order: each fires at most once per call
+        // even if its next trigger is still not in the future. Handlers may create or free alarms
+        AlarmID_t due[dtNBR_ALARMS];
+        uint8_t dueCount = 0;
+        // nothing is due unless the root is
+        uint8_t scan = ( heapSize > 0 && Alarm[heap[0]].nextTrigger <= time ? heapSize : 0 );
+        for( uint8_t i = 0; i < scan; i++ )
         {
-          if( Alarm[servicedAlarmId].Mode.isEnabled && (now_tz() >= Alarm[servicedAlarmId].nextTrigger)  )
-          {
-            OnTick_t TickHandler = Alarm[servicedAlarmId].onTickHandler;
-            uint32_t tag = Alarm[servicedAlarmId].tag;
-            if(Alarm[servicedAlarmId].Mode.isOneShot)
-               free(servicedAlarmId);  // free the ID if mode is OnShot
-            else
-               Alarm[servicedAlarmId].updateNextTrigger();
-            if( TickHandler != NULL) {
-              (*TickHandler)(tag);     // call the handler
-            }
+          AlarmID_t ID = heap[i];
+          if( Alarm[ID].nextTrigger > time )
+            continue;
+          uint8_t pos = dueCount++;
+          while( pos > 0 && Alarm[due[pos - 1]].nextTrigger > Alarm[ID].nextTrigger ) {
+            due[pos] = due[pos - 1];
+            pos--;
+          }
+          due[pos] = ID;
+        }
+        for( uint8_t i = 0; i < dueCount; i++ )
+        {
+          servicedAlarmId = due[i];
+          // freed, disabled or rescheduled by an earlier handler
+          if( Alarm[servicedAlarmId].heapPos == dtINVALID_ALARM_ID || Alarm[servicedAlarmId].nextTrigger > time )
+            continue;
+          OnTick_t TickHandler = Alarm[servicedAlarmId].onTickHandler;
+          uint32_t tag = Alarm[servicedAlarmId].tag;
+          if(Alarm[servicedAlarmId].Mode.isOneShot)
+             free(servicedAlarmId);  // free the ID if mode is OnShot
+          else {
+             Alarm[servicedAlarmId].updateNextTrigger(time);
+             schedule(servicedAlarmId);
+          }
+          if( TickHandler != NULL) {
+            (*TickHandler)(tag);     // call the handler
           }
         }
         isServicing = false;
@@ -335,41 +406,132 @@ AlarmID_t TimeAlarmsClass::alarmRepeat(time_t value, OnTick_t onTickHandler){ //
     // returns the absolute time of the next scheduled alarm, or 0 if none
     time_t TimeAlarmsClass::getNextTrigger()
     {
-      time_t nextTrigger = 0;
-      for(uint8_t id = 0; id < dtNBR_ALARMS; id++)
-      {
-        if(isAllocated(id) )
-        {
-          if(Alarm[id].nextTrigger < nextTrigger || nextTrigger == 0) {
-            nextTrigger = Alarm[id].nextTrigger;
-          }
-        }
-      }
-      return (nextTrigger > 0 ? nextTrigger - time_zone_cache : 0);
+      nowLocal();
+      return (heapSize > 0 ? Alarm[heap[0]].nextTrigger - zoneCache : 0);
     }
 
     // attempt to create an alarm and return true if successful
     AlarmID_t TimeAlarmsClass::create( time_t value, OnTick_t onTickHandler, uint8_t isOneShot, dtAlarmPeriod_t alarmType, uint8_t isEnabled)
     {
-      if( ! (dtIsAlarm(alarmType) && now_tz() < SECS_PER_YEAR)) // only create alarm ids if the time is at least Jan 1 1971
+      if( ! (dtIsAlarm(alarmType) && nowLocal() < SECS_PER_YEAR)) // only create alarm ids if the time is at least Jan 1 1971
       {
-    	for(uint8_t id = 0; id < dtNBR_ALARMS; id++)
+        if( freeCount > 0 )
         {
-          if( Alarm[id].Mode.alarmType == dtNotAllocated )
-    	  {
-    	  // here if there is an Alarm id that is not allocated
-      	    Alarm[id].onTickHandler = onTickHandler;
-    	    Alarm[id].Mode.isOneShot = isOneShot;
-    	    Alarm[id].Mode.alarmType = alarmType;
-    	    Alarm[id].value = value;
-    	    isEnabled ?  enable(id) : disable(id);
-            return id;  // alarm created ok
-    	  }
+          AlarmID_t id = freeIds[--freeCount];
+          Alarm[id].onTickHandler = onTickHandler;
+          Alarm[id].Mode.isOneShot = isOneShot;
+          Alarm[id].Mode.alarmType = alarmType;
+          Alarm[id].value = value;
+          Alarm[id].nextTrigger = 0;
+          isEnabled ?  enable(id) : disable(id);
+          return id;  // alarm created ok
         }
       }
       return dtINVALID_ALARM_ID; // no IDs available or time is invalid
     }
 
+    // local time of the system or simulated clock
+    time_t TimeAlarmsClass::nowLocal()
+    {
+      time_t time;
+      if( simulatedTime ) {
+        checkZone(simulatedZone);
+        time = simulatedTime + simulatedZone;
+      } else {
+        checkZone(time_zone_cache);
+        time = now_tz();
+        if( time != lastSecond ) {
+          lastSecond = time;
+          secondStart = millis();
+        }
+      }
+      return time;
+    }
+
+    // Time zone or DST changed: alarms stay on the wall clock, timers keep their elapsed time.
+    // Local time skipped at DST start makes its alarms due at once, local time repeated at
+    // DST end doesn't trigger them again since nextTrigger has already moved on.
+    void TimeAlarmsClass::checkZone(time_t zone)
+    {
+      if( zone == zoneCache )
+        return;
+      time_t delta = zone - zoneCache;
+      zoneCache = zone;
+      lastSecond += delta;
+      for(uint8_t pos = 0; pos < heapSize; pos++)
+      {
+        if( Alarm[heap[pos]].Mode.alarmType == dtTimer )
+          Alarm[heap[pos]].nextTrigger += delta;
+      }
+      for(uint8_t pos = heapSize / 2; pos > 0; pos--)
+        siftDown(pos - 1);
+    }
+
+    // insert the alarm into the heap, or move it after its nextTrigger changed
+    void TimeAlarmsClass::schedule(AlarmID_t ID)
+    {
+      if( !Alarm[ID].Mode.isEnabled ) {
+        unschedule(ID);
+        return;
+      }
+      if( Alarm[ID].heapPos == dtINVALID_ALARM_ID )
+        placeAt(heapSize++, ID);
+      siftUp(Alarm[ID].heapPos);
+      siftDown(Alarm[ID].heapPos);
+    }
+
+    void TimeAlarmsClass::unschedule(AlarmID_t ID)
+    {
+      uint8_t pos = Alarm[ID].heapPos;
+      if( pos == dtINVALID_ALARM_ID )
+        return;
+      Alarm[ID].heapPos = dtINVALID_ALARM_ID;
+      if( pos != --heapSize ) {
+        AlarmID_t last = heap[heapSize];
+        placeAt(pos, last);
+        siftUp(pos);
+        siftDown(Alarm[last].heapPos);
+      }
+    }
+
+    void TimeAlarmsClass::placeAt(uint8_t pos, AlarmID_t ID)
+    {
+      heap[pos] = ID;
+      Alarm[ID].heapPos = pos;
+    }
+
+    void TimeAlarmsClass::siftUp(uint8_t pos)
+    {
+      AlarmID_t ID = heap[pos];
+      while( pos > 0 )
+      {
+        uint8_t parent = (pos - 1) / 2;
+        if( Alarm[heap[parent]].nextTrigger <= Alarm[ID].nextTrigger )
+          break;
+        placeAt(pos, heap[parent]);
+        pos = parent;
+      }
+      placeAt(pos, ID);
+    }
+
+    void TimeAlarmsClass::siftDown(uint8_t pos)
+    {
+      AlarmID_t ID = heap[pos];
+      while( true )
+      {
+        uint16_t child = 2 * pos + 1;
+        if( child >= heapSize )
+          break;
+        if( child + 1 < heapSize && Alarm[heap[child + 1]].nextTrigger < Alarm[heap[child]].nextTrigger )
+          child++;
+        if( Alarm[ID].nextTrigger <= Alarm[heap[child]].nextTrigger )
+          break;
+        placeAt(pos, heap[child]);
+        pos = child;
+      }
+      placeAt(pos, ID);
+    }
+
     // make one instance for the user to use
     TimeAlarmsClass Alarm = TimeAlarmsClass() ;
 
@@ -56,7 +56,10 @@ extern time_t time_zone_cache;  // from spark_wiring_time.cpp
 
 //-------------------------------------
 
-#define dtNBR_ALARMS 6   // max is 255
+// Schedule table rows plus spare ids for timers, max is 254 (255 is dtINVALID_ALARM_ID)
+#ifndef dtNBR_ALARMS
+#define dtNBR_ALARMS 64
+#endif
 
 #define USE_SPECIALIST_METHODS  // define this for testing
 
@@ -84,6 +87,7 @@ typedef AlarmID_t AlarmId;  // Arduino friendly name
 
 #define dtINVALID_ALARM_ID 255
 #define dtINVALID_TIME     0L
+#define dtNO_TRIGGER       0xFFFFFFFFUL
 
 class AlarmClass;  // forward reference
 typedef void (*OnTick_t)(uint32_t);  // alarm callback function typedef
@@ -96,22 +100,43 @@ private:
 public:
   AlarmClass();
   OnTick_t onTickHandler;
-  void updateNextTrigger();
+  void updateNextTrigger(time_t time);
   time_t value;
   time_t nextTrigger;
   AlarmMode_t Mode;
 	uint32_t tag;
+  uint8_t heapPos;    // position in the trigger heap, dtINVALID_ALARM_ID if not scheduled
 };
 
 // class containing the collection of alarms
+// Enabled alarms are kept in a binary min-heap ordered by nextTrigger, so servicing
+// only looks at the root, and create/enable/disable/free are O(log n).
+// Triggers are kept in local time: alarms stick to the wall clock across time zone
+// and DST changes, timers are shifted so that they keep their elapsed time.
 class TimeAlarmsClass
 {
 private:
    AlarmClass Alarm[dtNBR_ALARMS];
+   AlarmID_t heap[dtNBR_ALARMS];      // enabled alarms, earliest nextTrigger at heap[0]
+   uint8_t heapSize;
+   AlarmID_t freeIds[dtNBR_ALARMS];   // stack of unallocated ids
+   uint8_t freeCount;
+   time_t zoneCache;                  // time zone the triggers were computed in
+   time_t lastSecond;                 // local second seen last, and when it started
+   unsigned long secondStart;
+   time_t simulatedTime;              // UTC of the simulated clock, 0 for system clock
+   time_t simulatedZone;
    void serviceAlarms();
    uint8_t isServicing;
    uint8_t servicedAlarmId; // the alarm currently being serviced
    AlarmID_t create( time_t value, OnTick_t onTickHandler, uint8_t isOneShot, dtAlarmPeriod_t alarmType, uint8_t isEnabled=true);
+   time_t nowLocal();
+   void checkZone(time_t zone);
+   void schedule(AlarmID_t ID);
+   void unschedule(AlarmID_t ID);
+   void placeAt(uint8_t pos, AlarmID_t ID);
+   void siftUp(uint8_t pos);
+   void siftDown(uint8_t pos);
 
 public:
   TimeAlarmsClass();
@@ -134,6 +159,8 @@ public:
   AlarmID_t timerRepeat(const int H,  const int M,  const int S, OnTick_t onTickHandler);   // As above with HMS arguments
 
   void delay(unsigned long ms);
+  void tick();                          // service due alarms once, without waiting
+  unsigned long msUntilNextTrigger();   // time the caller may sleep before an alarm is due, dtNO_TRIGGER if none
 
   // utility methods
   uint8_t getDigitsNow( dtUnits_t Units);         // returns the current digit value for the given time unit
@@ -162,6 +189,7 @@ private:  // the following methods are for testing and are not documented as par
   time_t getNextTrigger();                  // returns the time of the next scheduled alarm
   bool isAllocated(AlarmID_t ID);           // returns true if this id is allocated
   bool isAlarm(AlarmID_t ID);               // returns true if id is for a time based alarm, false if its a timer or not allocated
+  void simulateClock(time_t utc, time_t zone); // drive alarms from a simulated clock, utc 0 returns to the system clock
 };
 
 extern TimeAlarmsClass Alarm;  // make an instance for the user
@@ -15,6 +15,11 @@
 #include "xlxConfig.h"
 #include "xlxLogger.h"
 #include "xlxSerialConsole.h"
+#include "xlxRF24Server.h"
+#include "xlxJsonCmd.h"
+#include "ArduinoJson.h"
+#include "DataQueue.h"
+#include "LinkedList.h"
 
 //><><><><><><><><><><><><><><><><><><><><><><><><><><><><><><>
 // Intergration Tests
@@ -217,6 +222,1528 @@ test(alarm_all_red)
   theSys.CldJSONConfig("\"nd\":1, \"SCT_uid\":1, \"SNT_uid\":0, \"notif_uid\":0}");
 }
 
+test(rf_rcvqueue)
+{
+  // Synthetic bursts of 12 frames against an 8-slot receive queue,
+  // consumer drains 4 frames between bursts
+  CFrameQueue<MyMessage, 8> lv_rcvQ;
+  MyMessage *pMsg;
+  UL lv_in = 0, lv_out = 0, lv_dropped = 0;
+  UL lv_start = micros();
+  for( int burst = 0; burst < 1000; burst++ ) {
+    for( int i = 0; i < 12; i++ ) {
+      if( (pMsg = lv_rcvQ.GetWriteSlot()) ) {
+        pMsg->build(NODEID_MIN_REMOTE, NODEID_GATEWAY, 0, C_SET, V_STATUS, false);
+        pMsg->set((uint8_t)(lv_in & 0xFF));
+        lv_rcvQ.Commit();
+        lv_in++;
+      } else {
+        lv_rcvQ.Drop();
+        lv_dropped++;
+      }
+    }
+    for( int i = 0; i < 4 && (pMsg = lv_rcvQ.Peek()); i++ ) {
+      assertEqual(pMsg->getByte(), (uint8_t)(lv_out & 0xFF));
+      lv_rcvQ.Pop();
+      lv_out++;
+    }
+  }
+  while( (pMsg = lv_rcvQ.Peek()) ) {
+    lv_rcvQ.Pop();
+    lv_out++;
+  }
+  UL lv_elapsed = micros() - lv_start;
+
+  SERIAL_LN("rf_rcvqueue: %lu frames in %luus (%lu frames/s), dropped %lu (%lu%%), high-water %d",
+      lv_out, lv_elapsed, lv_elapsed > 0 ? lv_out * 1000000 / lv_elapsed : 0,
+      lv_dropped, lv_dropped * 100 / (lv_in + lv_dropped), lv_rcvQ.GetHighWater());
+  assertEqual(lv_in, lv_out);
+  assertEqual(lv_dropped, lv_rcvQ.GetOverflow());
+  assertEqual(lv_rcvQ.GetHighWater(), 8);
+
+  // Polling a full queue is not a drop
+  for( int i = 0; i < 8; i++ ) {
+    assertTrue(lv_rcvQ.GetWriteSlot() != NULL);
+    lv_rcvQ.Commit();
+  }
+  assertTrue(lv_rcvQ.GetWriteSlot() == NULL);
+  assertTrue(lv_rcvQ.GetWriteSlot() == NULL);
+  assertEqual(lv_rcvQ.GetOverflow(), lv_dropped);
+}
+
+// Enqueue cost of the send queue at given depth: fill with distinct flags,
+// then coalesce repeated updates of the last queued type
+template <uint8_t N>
+UL sendQueueEnqueueCost(CStaticMessageQ<N> &_queue)
+{
+  UC lv_data[MAX_MESSAGE_LENGTH];
+  memset(lv_data, 0x00, sizeof(lv_data));
+  for( UC i = 0; i < N; i++ ) {
+    _queue.AddMessage(lv_data, MAX_MESSAGE_LENGTH, i, ((uint32_t)S_DIMMER << 24) | ((uint32_t)C_SET << 16) | ((uint32_t)V_PERCENTAGE << 8) | i);
+  }
+  UL lv_start = micros();
+  for( US loop = 0; loop < 1000; loop++ ) {
+    lv_data[HEADER_SIZE] = loop & 0xFF;
+    _queue.AddMessage(lv_data, MAX_MESSAGE_LENGTH, 0, ((uint32_t)S_DIMMER << 24) | ((uint32_t)C_SET << 16) | ((uint32_t)V_PERCENTAGE << 8) | (N - 1));
+  }
+  return (micros() - lv_start);
+}
+
+// Same workload through the former duplicate check: walk the queued nodes and
+// compare each until the flag matches. The Serial print it made on every
+// coalesced message is left out, so the old cost is understated
+template <uint8_t N>
+UL sendQueueLinearCost()
+{
+  static CFastMessageNode lv_nodes[N];    // too large for the loop stack
+  UC lv_data[MAX_MESSAGE_LENGTH];
+  memset(lv_data, 0x00, sizeof(lv_data));
+  for( UC i = 0; i < N; i++ ) {
+    lv_nodes[i].WriteMessage(lv_data, MAX_MESSAGE_LENGTH, i, ((uint32_t)S_DIMMER << 24) | ((uint32_t)C_SET << 16) | ((uint32_t)V_PERCENTAGE << 8) | i);
+  }
+  UL lv_start = micros();
+  for( US loop = 0; loop < 1000; loop++ ) {
+    lv_data[HEADER_SIZE] = loop & 0xFF;
+    uint32_t lv_flag = ((uint32_t)S_DIMMER << 24) | ((uint32_t)C_SET << 16) | ((uint32_t)V_PERCENTAGE << 8) | (N - 1);
+    for( UC i = 0; i < N; i++ ) {
+      UC cmpRet = lv_nodes[i].CompareMessage(lv_data, MAX_MESSAGE_LENGTH, lv_flag);
+      if( cmpRet > 0 ) {
+        if( cmpRet == 2 ) lv_nodes[i].WriteMessage(lv_data, MAX_MESSAGE_LENGTH, 0, lv_flag);
+        break;
+      }
+    }
+  }
+  return (micros() - lv_start);
+}
+
+test(rf_sendqueue)
+{
+  CStaticMessageQ<5> lv_q5;
+  CStaticMessageQ<12> lv_q12;
+  CStaticMessageQ<64> lv_q64;
+  UL lv_cost5 = sendQueueEnqueueCost(lv_q5);
+  UL lv_cost12 = sendQueueEnqueueCost(lv_q12);
+  UL lv_cost64 = sendQueueEnqueueCost(lv_q64);
+  UL lv_lin5 = sendQueueLinearCost<5>();
+  UL lv_lin12 = sendQueueLinearCost<12>();
+  UL lv_lin64 = sendQueueLinearCost<64>();
+  SERIAL_LN("rf_sendqueue: 1000 coalesced enqueues at depth 5/12/64 took %lu/%lu/%lu us, linear scan %lu/%lu/%lu us",
+      lv_cost5, lv_cost12, lv_cost64, lv_lin5, lv_lin12, lv_lin64);
+  // Flag index cost does not grow with depth, the scan does
+  assertLess(lv_cost64, lv_lin64);
+  assertLess(lv_cost64, 2 * lv_cost5 + 1000);
+  assertEqual(lv_q5.GetMQLength(), 5);
+  assertEqual(lv_q64.GetMQLength(), 64);
+  assertEqual(lv_q64.GetCoalescedCount(), 1000);
+
+  // Drain from the middle and head while full, then refill
+  CFastMessageNode *pNode = lv_q5.GetMessage();
+  assertTrue(lv_q5.RemoveMessage(pNode->m_pNext));
+  assertTrue(lv_q5.RemoveMessage());
+  assertEqual(lv_q5.GetMQLength(), 3);
+  UC lv_data[MAX_MESSAGE_LENGTH];
+  memset(lv_data, 0x00, sizeof(lv_data));
+  assertEqual(lv_q5.AddMessage(lv_data, MAX_MESSAGE_LENGTH, 0, 0x12345678), 4);
+
+  // Messages queued while duplicates are allowed still coalesce once switched back
+  lv_q12.RemoveAllMessage();
+  lv_q12.SetDuplicateMsg(true);
+  assertEqual(lv_q12.AddMessage(lv_data, MAX_MESSAGE_LENGTH, 0, 0x55), 1);
+  assertEqual(lv_q12.AddMessage(lv_data, MAX_MESSAGE_LENGTH, 0, 0x55), 2);
+  lv_q12.SetDuplicateMsg(false);
+  assertEqual(lv_q12.AddMessage(lv_data, MAX_MESSAGE_LENGTH, 0, 0x55), 2);
+  assertTrue(lv_q12.RemoveMessage());
+  assertTrue(lv_q12.RemoveMessage());
+  assertEqual(lv_q12.AddMessage(lv_data, MAX_MESSAGE_LENGTH, 0, 0x55), 1);
+}
+
+test(rf_sendscheduler)
+{
+  // Simulated radio: each send() costs 2ms and fails 20% of the time.
+  // Traffic mix of all classes, report first-attempt wait percentiles per class
+  const UC lv_classes = RF_PRIO_NUM;
+  const US lv_samples = 100;
+  US lv_wait[lv_classes][lv_samples];
+  US lv_count[lv_classes];
+  CStaticMessageQ<MQ_MAX_RF_SNDMSG> lv_queue;
+  CFastMessageNode *pNode;
+  UC lv_data[MAX_MESSAGE_LENGTH];
+  UC lv_repeat, lv_prio;
+  memset(lv_count, 0x00, sizeof(lv_count));
+  memset(lv_data, 0x00, sizeof(lv_data));
+
+  for( US loop = 0; loop < 600; loop++ ) {
+    lv_prio = random(lv_classes);
+    // Distinct flag per class and destination
+    lv_queue.AddMessage(lv_data, MAX_MESSAGE_LENGTH, 0, ((uint32_t)lv_prio << 8) | random(8), lv_prio);
+    if( (pNode = lv_queue.GetNextMessage(millis())) ) {
+      lv_prio = pNode->m_nPriority;
+      UL lv_wait1 = millis() - pNode->m_tickEnqueued;
+      pNode->ReadMessage(lv_data, &lv_repeat);
+      if( lv_repeat == 1 && lv_count[lv_prio] < lv_samples ) {
+        lv_wait[lv_prio][lv_count[lv_prio]++] = lv_wait1;
+      }
+      delay(2);
+      if( random(100) >= 20 || lv_repeat > 2 ) {
+        lv_queue.RemoveMessage(pNode);
+      } else {
+        pNode->SetNextTry(millis() + (RTE_RF_RETRY_BASE_MS << (lv_repeat - 1)));
+      }
+    }
+  }
+
+  for( UC lv_cls = 0; lv_cls < lv_classes; lv_cls++ ) {
+    US n = lv_count[lv_cls];
+    if( n == 0 ) continue;
+    // Insertion sort, samples are few
+    for( US i = 1; i < n; i++ ) {
+      US v = lv_wait[lv_cls][i];
+      int j = i - 1;
+      while( j >= 0 && lv_wait[lv_cls][j] > v ) { lv_wait[lv_cls][j + 1] = lv_wait[lv_cls][j]; j--; }
+      lv_wait[lv_cls][j + 1] = v;
+    }
+    SERIAL_LN("rf_sendscheduler: prio %d n=%d wait p50=%dms p99=%dms max=%dms", lv_cls, n,
+        lv_wait[lv_cls][n / 2], lv_wait[lv_cls][(n * 99) / 100], lv_wait[lv_cls][n - 1]);
+  }
+  // Interactive control must never queue behind probes
+  if( lv_count[RF_PRIO_CONTROL] > 0 && lv_count[RF_PRIO_PROBE] > 0 ) {
+    assertLessOrEqual(lv_wait[RF_PRIO_CONTROL][lv_count[RF_PRIO_CONTROL] / 2], lv_wait[RF_PRIO_PROBE][lv_count[RF_PRIO_PROBE] / 2]);
+  }
+
+  // Priority beats FIFO order
+  lv_queue.RemoveAllMessage();
+  lv_queue.AddMessage(lv_data, MAX_MESSAGE_LENGTH, 0, 0x0104FF08, RF_PRIO_PROBE);
+  lv_queue.AddMessage(lv_data, MAX_MESSAGE_LENGTH, 0, 0x0001FF28, RF_PRIO_SCENARIO);
+  lv_queue.AddMessage(lv_data, MAX_MESSAGE_LENGTH, 0, 0x00010201, RF_PRIO_CONTROL);
+  pNode = lv_queue.GetNextMessage(millis());
+  assertTrue(pNode != NULL);
+  assertEqual(pNode->m_nPriority, RF_PRIO_CONTROL);
+}
+
+test(rf_typedbuild)
+{
+  // Typed builders must produce the same frame as the text adapter
+  MyMessage lv_typed, lv_text;
+  String strCmd = "250:9:55";
+  theRadio.BuildBrightnessMsg(lv_typed, 250, 55, 0, 2);
+  theRadio.ProcessSend(strCmd, lv_text, 0, 2);
+  assertEqual(lv_typed.getDestination(), lv_text.getDestination());
+  assertEqual(lv_typed.getSensor(), lv_text.getSensor());
+  assertEqual(lv_typed.getCommand(), lv_text.getCommand());
+  assertEqual(lv_typed.getType(), lv_text.getType());
+  assertEqual(lv_typed.getLength(), lv_text.getLength());
+  assertEqual(memcmp(lv_typed.getCustom(), lv_text.getCustom(), lv_typed.getLength()), 0);
+
+  // Cost per fan-out message: typed build vs. format + text parse
+  const US lv_loops = 200;
+  UL lv_start = micros();
+  for( US i = 0; i < lv_loops; i++ ) {
+    theRadio.BuildBrCCTMsg(lv_typed, i % 250 + 1, 80, 3000, 0, 0);
+  }
+  UL lv_typedUs = micros() - lv_start;
+  lv_start = micros();
+  for( US i = 0; i < lv_loops; i++ ) {
+    strCmd = String::format("%d:13:%d:%d", i % 250 + 1, 80, 3000);
+    int nPos = strCmd.indexOf(':');
+    nPos = strCmd.indexOf(':', nPos + 1);
+    String strPayl = strCmd.substring(nPos + 1);
+    nPos = strPayl.indexOf(':');
+    lv_text.build(0, (UC)strCmd.toInt(), 0, C_SET, V_RGBW, false);
+    lv_text.set((unsigned int)strPayl.substring(nPos + 1).toInt());
+  }
+  UL lv_textUs = micros() - lv_start;
+  SERIAL_LN("rf_typedbuild: typed %dus, text %dus per %d messages", lv_typedUs, lv_textUs, lv_loops);
+  assertLessOrEqual(lv_typedUs, lv_textUs);
+}
+
+test(node_index)
+{
+  // Device status chain indexed by node_id
+  DevStatusChain_t lv_chain(MAX_DEVICE_PER_CONTROLLER, SmartControllerClass::DevStatusKey);
+  DevStatusRow_t lv_row;
+  memset(&lv_row, 0x00, sizeof(lv_row));
+  for( UC i = 0; i < MAX_DEVICE_PER_CONTROLLER; i++ ) {
+    lv_row.uid = i;
+    lv_row.node_id = NODEID_MIN_DEVCIE + i;
+    lv_chain.add(lv_row);
+  }
+  assertTrue(lv_chain.search_key(NODEID_MIN_DEVCIE) == lv_chain.getRoot());
+  assertTrue(lv_chain.search_key(NODEID_MIN_DEVCIE + MAX_DEVICE_PER_CONTROLLER - 1) == lv_chain.getLast());
+  lv_chain.remove(0);
+  assertTrue(lv_chain.search_key(NODEID_MIN_DEVCIE) == NULL);
+  assertEqual(lv_chain.search_key(NODEID_MIN_DEVCIE + 1)->data.uid, 1);
+
+  // Node list position index
+  NodeListClass lv_list(32);
+  NodeIdRow_t lv_Node;
+  memset(&lv_Node, 0x00, sizeof(lv_Node));
+  for( UC nid = 40; nid > 8; nid -= 4 ) {
+    lv_Node.nid = nid;
+    lv_Node.device = nid;
+    lv_list.add(&lv_Node);
+  }
+  lv_Node.nid = 20;
+  lv_list.remove(&lv_Node);
+  assertTrue(lv_list.get(&lv_Node) < 0);
+  lv_Node.nid = 24;
+  lv_Node.device = 0;
+  assertTrue(lv_list.get(&lv_Node) >= 0);
+  assertEqual(lv_Node.device, 24);
+}
+
+template <class Chain>
+UL ruleTableIterateCost(Chain &f_chain, UL &f_heapUsed)
+{
+  RuleRow_t lv_row;
+  memset(&lv_row, 0x00, sizeof(lv_row));
+  UL lv_free = System.freeMemory();
+  for( int i = 0; i < MAX_RULE_TABLE_SIZE; i++ ) {
+    lv_row.uid = i;
+    f_chain.add(lv_row);
+  }
+  f_heapUsed = lv_free - System.freeMemory();
+
+  // The same walk as ReadNewRules()
+  UL lv_sum = 0;
+  UL lv_start = micros();
+  for( int loop = 0; loop < 10; loop++ ) {
+    ListNode<RuleRow_t> *tmp = f_chain.getRoot();
+    while( tmp ) { lv_sum += tmp->data.uid; tmp = tmp->next; }
+  }
+  UL lv_cost = micros() - lv_start;
+  f_chain.clear();
+  return( lv_sum > 0 ? lv_cost : 0 );
+}
+
+test(chain_pool)
+{
+  // Full 256-row rule table: per-row heap nodes vs. static pool
+  UL lv_heapUsed, lv_poolUsed;
+  ChainClass<RuleRow_t> lv_heapChain(0);
+  UL lv_heapCost = ruleTableIterateCost(lv_heapChain, lv_heapUsed);
+  RuleChain_t *lv_pPoolChain = new RuleChain_t(0);
+  assertTrue(lv_pPoolChain != NULL);
+  UL lv_poolCost = ruleTableIterateCost(*lv_pPoolChain, lv_poolUsed);
+  SERIAL_LN("chain_pool: heap %d bytes %dus, pool %d bytes %dus (10 walks), pool peak %d rows",
+      lv_heapUsed, lv_heapCost, lv_poolUsed, lv_poolCost, lv_pPoolChain->pool().highWater());
+  assertLess(lv_poolUsed, lv_heapUsed);
+  assertEqual(lv_pPoolChain->pool().highWater(), MAX_RULE_TABLE_SIZE);
+
+  // Pool refuses rows beyond its capacity, freed rows are reused
+  RuleRow_t lv_row;
+  memset(&lv_row, 0x00, sizeof(lv_row));
+  for( int i = 0; i < MAX_RULE_TABLE_SIZE; i++ ) lv_pPoolChain->add(lv_row);
+  assertFalse(lv_pPoolChain->add(lv_row));
+  lv_pPoolChain->remove(10);
+  assertTrue(lv_pPoolChain->add(lv_row));
+  delete lv_pPoolChain;
+}
+
+test(rule_index)
+{
+  // 256 rules over 14 sensor types: full scan vs. sensor index
+  const UC lv_sensors = 14;
+  RuleChain_t *lv_pRules = new RuleChain_t(0);
+  RuleIndexClass *lv_pIndex = new RuleIndexClass();
+  assertTrue(lv_pRules != NULL && lv_pIndex != NULL);
+  RuleRow_t lv_row;
+  memset(&lv_row, 0x00, sizeof(lv_row));
+  for( int i = 0; i < MAX_RULE_TABLE_SIZE; i++ ) {
+    lv_row.uid = i;
+    lv_row.actCond[0].enabled = 1;
+    lv_row.actCond[0].sr_id = random(lv_sensors);
+    lv_row.actCond[1].enabled = random(2);
+    lv_row.actCond[1].sr_id = random(lv_sensors);
+    lv_pRules->add(lv_row);
+    lv_pIndex->update(lv_pRules->pool().slotOf(lv_pRules->getLast()), lv_row);
+  }
+
+  const US lv_updates = 200;
+  UL lv_scanHits = 0, lv_indexHits = 0;
+  UL lv_start = micros();
+  for( US i = 0; i < lv_updates; i++ ) {
+    UC lv_sr = i % lv_sensors;
+    for( ListNode<RuleRow_t> *tmp = lv_pRules->getRoot(); tmp; tmp = tmp->next ) {
+      for( UC c = 0; c < MAX_CONDITION_PER_RULE; c++ ) {
+        if( !tmp->data.actCond[c].enabled ) break;
+        if( tmp->data.actCond[c].sr_id == lv_sr ) { lv_scanHits++; break; }
+      }
+    }
+  }
+  UL lv_scanUs = micros() - lv_start;
+  lv_start = micros();
+  for( US i = 0; i < lv_updates; i++ ) {
+    UC lv_sr = i % lv_sensors;
+    for( int slot = lv_pIndex->next(lv_sr); slot >= 0; slot = lv_pIndex->next(lv_sr, slot + 1) ) {
+      if( lv_pRules->pool().nodeAt(slot)->data.uid < MAX_RULE_TABLE_SIZE ) lv_indexHits++;
+    }
+  }
+  UL lv_indexUs = micros() - lv_start;
+  SERIAL_LN("rule_index: %d updates, scan %dus (%d hits), index %dus (%d hits)",
+      lv_updates, lv_scanUs, lv_scanHits, lv_indexUs, lv_indexHits);
+  assertEqual(lv_scanHits, lv_indexHits);
+  assertEqual(lv_pIndex->count(lv_sensors), 0);
+
+  delete lv_pIndex;
+  delete lv_pRules;
+}
+
+test(rule_hysteresis)
+{
+  // ALS between 30 and 60, noisy readings around the lower edge
+  RuleIndexClass *lv_pIndex = new RuleIndexClass();
+  assertTrue(lv_pIndex != NULL);
+  RuleRow_t lv_row;
+  memset(&lv_row, 0x00, sizeof(lv_row));
+  lv_row.actCond[0].enabled = 1;
+  lv_row.actCond[0].sr_scope = SR_SCOPE_NODE;
+  lv_row.actCond[0].sr_id = sensorALS;
+  lv_row.actCond[0].symbol = SR_SYM_BW;
+  lv_row.actCond[0].sr_value1 = 30;
+  lv_row.actCond[0].sr_value2 = 60;
+  lv_pIndex->update(0, lv_row);
+  RulePredicate_t *pPred = lv_pIndex->predicate(0);
+  assertEqual(pPred->nConds, 1);
+
+  const UC lv_nd = 200;
+  RuleEdge_t *pEdge = lv_pIndex->edge(0, lv_nd);
+  assertTrue(pEdge != NULL);
+  const US lv_als[] = { 20, 31, 29, 30, 28, 31, 29, 32, 26, 27 };
+  UC lv_edges = 0;
+  bool lv_last = false;
+  for( UC i = 0; i < sizeof(lv_als) / sizeof(US); i++ ) {
+    theSys.m_sensorState.Update(lv_nd, SPF_ALS, lv_als[i], millis());
+    bool lv_result = theSys.Check_Predicate(pPred, lv_nd, pEdge);
+    if( lv_result != lv_last ) lv_edges++;
+    lv_last = lv_result;
+  }
+  theSys.m_sensorState.Remove(lv_nd);
+  // Entered at 31, left at 26 only
+  assertEqual(lv_edges, 2);
+  delete lv_pIndex;
+}
+
+test(rule_edge_per_node)
+{
+  // ALS between 30 and 60 AND temperature between 20 and 25
+  RuleIndexClass *lv_pIndex = new RuleIndexClass();
+  assertTrue(lv_pIndex != NULL);
+  RuleRow_t lv_row;
+  memset(&lv_row, 0x00, sizeof(lv_row));
+  lv_row.actCond[0].enabled = 1;
+  lv_row.actCond[0].sr_scope = SR_SCOPE_NODE;
+  lv_row.actCond[0].sr_id = sensorALS;
+  lv_row.actCond[0].symbol = SR_SYM_BW;
+  lv_row.actCond[0].sr_value1 = 30;
+  lv_row.actCond[0].sr_value2 = 60;
+  lv_row.actCond[0].connector = COND_SYM_AND;
+  lv_row.actCond[1].enabled = 1;
+  lv_row.actCond[1].sr_scope = SR_SCOPE_NODE;
+  lv_row.actCond[1].sr_id = sensorDHT;
+  lv_row.actCond[1].symbol = SR_SYM_BW;
+  lv_row.actCond[1].sr_value1 = 20;
+  lv_row.actCond[1].sr_value2 = 25;
+  lv_pIndex->update(0, lv_row);
+  RulePredicate_t *pPred = lv_pIndex->predicate(0);
+  assertEqual(pPred->nConds, 2);
+
+  // Each node has its own edge state
+  RuleEdge_t *pEdgeA = lv_pIndex->edge(0, 201);
+  RuleEdge_t *pEdgeB = lv_pIndex->edge(0, 202);
+  assertTrue(pEdgeA != NULL && pEdgeB != NULL && pEdgeA != pEdgeB);
+  assertTrue(lv_pIndex->edge(0, 201) == pEdgeA);
+
+  // Node A true, node B false
+  theSys.m_sensorState.Update(201, SPF_ALS, 40, millis());
+  theSys.m_sensorState.Update(201, SPF_DHT_T, 22, millis());
+  theSys.m_sensorState.Update(202, SPF_ALS, 10, millis());
+  theSys.m_sensorState.Update(202, SPF_DHT_T, 22, millis());
+  assertTrue(theSys.Check_Predicate(pPred, 201, pEdgeA));
+  assertFalse(theSys.Check_Predicate(pPred, 202, pEdgeB));
+
+  // The second condition keeps its hysteresis while the first one decides:
+  // temperature 19 is inside the band only when it was inside before
+  assertEqual(pEdgeB->condLast, 0x02);
+  theSys.m_sensorState.Update(202, SPF_DHT_T, 19, millis());
+  assertFalse(theSys.Check_Predicate(pPred, 202, pEdgeB));
+  assertEqual(pEdgeB->condLast, 0x02);
+  theSys.m_sensorState.Update(202, SPF_ALS, 40, millis());
+  assertTrue(theSys.Check_Predicate(pPred, 202, pEdgeB));
+
+  // Removing the rule frees its states
+  lv_pIndex->remove(0);
+  assertTrue(lv_pIndex->edge(1, 203) == pEdgeA);
+  theSys.m_sensorState.Remove(201);
+  theSys.m_sensorState.Remove(202);
+  delete lv_pIndex;
+}
+
+// RAM flash stand-in: counts erase-writes and charges a fixed cost for each
+#define FAKEFLASH_OP_MS     2
+class CountingFakeFlash : public Flashee::FakeFlashDevice
+{
+public:
+  UL m_nWrites;
+  bool m_bFail;
+
+  CountingFakeFlash(page_count_t f_pages) : Flashee::FakeFlashDevice(f_pages, 256, true), m_nWrites(0), m_bFail(false) { eraseAll(); }
+
+  virtual bool writeErasePage(const void* data, flash_addr_t address, page_size_t length) {
+    if( m_bFail ) return false;
+    m_nWrites++;
+    delay(FAKEFLASH_OP_MS);
+    return Flashee::FakeFlashDevice::writeErasePage(data, address, length);
+  }
+};
+
+test(flash_journal)
+{
+  // Edit burst of 16 adjacent scenario rows: direct row writes vs. journal
+  const UC lv_rows = 16;
+  CountingFakeFlash *pDirect = new CountingFakeFlash(64);
+  CountingFakeFlash *pHome = new CountingFakeFlash(64);
+  CountingFakeFlash *pLog = new CountingFakeFlash(16);
+  CFlashJournal *pJournal = new CFlashJournal();
+  assertTrue(pDirect != NULL && pHome != NULL && pLog != NULL && pJournal != NULL);
+  pJournal->SetTarget(JOURNAL_TARGET_P1FLASH, pHome);
+  pJournal->SetIdleWindow(JOURNAL_IDLE_WINDOW);
+  assertTrue(pJournal->Init(pLog, 0, MEM_JOURNAL_LEN));
+
+  ScenarioRow_t lv_row, lv_read;
+  memset(&lv_row, 0x00, sizeof(lv_row));
+  UL lv_start = millis();
+  for( UC i = 0; i < lv_rows; i++ ) {
+    lv_row.uid = i;
+    pDirect->write<ScenarioRow_t>(lv_row, i * SNT_ROW_SIZE);
+  }
+  UL lv_directMs = millis() - lv_start;
+
+  for( UC i = 0; i < lv_rows; i++ ) {
+    lv_row.uid = i;
+    assertTrue(pJournal->Stage(JOURNAL_TARGET_P1FLASH, i * SNT_ROW_SIZE, &lv_row, sizeof(lv_row)));
+  }
+  assertEqual(pHome->m_nWrites + pLog->m_nWrites, 0);
+
+  // Staged rows are visible through the overlay
+  pHome->read<ScenarioRow_t>(lv_read, 3 * SNT_ROW_SIZE);
+  pJournal->Overlay(JOURNAL_TARGET_P1FLASH, 3 * SNT_ROW_SIZE, &lv_read, sizeof(lv_read));
+  assertEqual(lv_read.uid, 3);
+
+  // No commit while edits are still coming in
+  assertTrue(pJournal->Flush(JOURNAL_FLUSH_BUDGET));
+  assertEqual(pJournal->GetCommitCount(), 0);
+  delay(JOURNAL_IDLE_WINDOW);
+  UC lv_flushes = 0;
+  while( pJournal->GetStagedCount() || pJournal->GetPendingCount() ) {
+    assertTrue(pJournal->Flush(JOURNAL_FLUSH_BUDGET));
+    lv_flushes++;
+  }
+  SERIAL_LN("flash_journal: %d rows, direct %d ops %dms, journal %d ops %dms in %d flushes (max %dms), %d merged",
+      lv_rows, pDirect->m_nWrites, lv_directMs, pJournal->GetFlashOps(), pJournal->GetBlockedMs(),
+      lv_flushes, pJournal->GetMaxBlockedMs(), pJournal->GetMergedCount());
+  assertLess(pJournal->GetFlashOps(), pDirect->m_nWrites);
+  assertLessOrEqual(pJournal->GetMaxBlockedMs(), JOURNAL_FLUSH_BUDGET + FAKEFLASH_OP_MS + 1);
+  for( UC i = 0; i < lv_rows; i++ ) {
+    pHome->read<ScenarioRow_t>(lv_read, i * SNT_ROW_SIZE);
+    assertEqual(lv_read.uid, i);
+  }
+
+  // Reset after the commit marker: the batch is replayed on next boot
+  lv_row.uid = 99;
+  assertTrue(pJournal->Stage(JOURNAL_TARGET_P1FLASH, 0, &lv_row, sizeof(lv_row)));
+  pHome->m_bFail = true;
+  assertFalse(pJournal->Flush(JOURNAL_FLUSH_BUDGET, true));
+  pHome->m_bFail = false;
+  delete pJournal;
+  pJournal = new CFlashJournal();
+  pJournal->SetTarget(JOURNAL_TARGET_P1FLASH, pHome);
+  assertTrue(pJournal->Init(pLog, 0, MEM_JOURNAL_LEN));
+  assertEqual(pJournal->Recover(), 1);
+  pHome->read<ScenarioRow_t>(lv_read, 0);
+  assertEqual(lv_read.uid, 99);
+  assertEqual(pJournal->Recover(), 0);
+
+  // A write overlapping two staged extents by more than one extent can hold
+  // still wins over both, whatever order the extents are applied in
+  static UC lv_bytes[200];
+  memset(lv_bytes, 1, 100);
+  assertTrue(pJournal->Stage(JOURNAL_TARGET_P1FLASH, 0, lv_bytes, 100));
+  memset(lv_bytes, 2, 100);
+  assertTrue(pJournal->Stage(JOURNAL_TARGET_P1FLASH, 100, lv_bytes, 100));
+  memset(lv_bytes, 3, 100);
+  assertTrue(pJournal->Stage(JOURNAL_TARGET_P1FLASH, 50, lv_bytes, 100));
+  memset(lv_bytes, 0, 200);
+  pJournal->Overlay(JOURNAL_TARGET_P1FLASH, 0, lv_bytes, 200);
+  assertEqual(lv_bytes[49], 1);
+  assertEqual(lv_bytes[50], 3);
+  assertEqual(lv_bytes[149], 3);
+  assertEqual(lv_bytes[150], 2);
+  assertTrue(pJournal->Flush(0, true));
+  pHome->read(lv_bytes, 0, 200);
+  for( UC i = 0; i < 200; i++ ) assertEqual(lv_bytes[i], (i < 50 ? 1 : (i < 150 ? 3 : 2)));
+
+  delete pJournal;
+  delete pLog;
+  delete pHome;
+  delete pDirect;
+}
+
+test(panel_stream)
+{
+  // Recorded fast knob spin and reverse: {ms since previous detent, delta}
+  const int16_t lv_spin[][2] = { {0, 1}, {30, 1}, {25, 2}, {20, 2}, {15, 3}, {15, 3}, {12, 4}, {12, 4},
+      {12, 4}, {15, 3}, {20, 2}, {25, 1}, {40, 1}, {60, 1}, {300, -1}, {25, -2}, {15, -3}, {15, -3},
+      {20, -2}, {30, -1} };
+  const UC lv_count = sizeof(lv_spin) / sizeof(lv_spin[0]);
+  const UL lv_loopMs = 5;
+  CPanelStream lv_stream;
+  lv_stream.SetRate(RTE_STREAM_FRAME_RATE, RTE_STREAM_SETTLE_MS);
+
+  // Replay in simulated time: legacy sends a frame on every value change
+  int16_t lv_value = 20;
+  UL lv_legacyFrames = 0;
+  UL lv_now = 1000, lv_next = lv_now, lv_lastChange = lv_now, lv_finalAt = 0;
+  uint16_t lv_lastSent = 0xFFFF;
+  UC i = 0;
+  while( i < lv_count || lv_now < lv_lastChange + 2000 ) {
+    if( i < lv_count && lv_now >= lv_next ) {
+      int16_t lv_new = constrain(lv_value + lv_spin[i][1], 0, 100);
+      if( lv_new != lv_value ) {
+        lv_value = lv_new;
+        lv_legacyFrames++;
+        lv_lastChange = lv_now;
+        lv_stream.Post(PANEL_STREAM_BR, NODEID_MAINDEVICE, 0, lv_value, lv_now);
+      }
+      if( ++i < lv_count ) lv_next += lv_spin[i][0];
+    }
+    PanelStreamSlot_t *pSlot;
+    while( (pSlot = lv_stream.Poll(lv_now)) != NULL ) {
+      if( pSlot->target != lv_lastSent ) lv_finalAt = lv_now;
+      lv_lastSent = pSlot->target;
+    }
+    lv_now += lv_loopMs;
+  }
+  SERIAL_LN("panel_stream: legacy %d frames, stream %d frames (%d stale dropped), final value after %dms",
+      lv_legacyFrames, lv_stream.GetFrameCount(), lv_stream.GetDroppedCount(), lv_finalAt - lv_lastChange);
+  assertEqual(lv_lastSent, lv_value);
+  assertLess(lv_stream.GetFrameCount(), lv_legacyFrames);
+  assertLessOrEqual(lv_finalAt - lv_lastChange, 1000 / RTE_STREAM_FRAME_RATE);
+
+  // Rate changed at runtime, e.g. by 'set stream'
+  lv_stream.SetRate(0, 0);
+  assertFalse(lv_stream.IsEnabled());
+  lv_stream.SetRate(20, 250);
+  assertTrue(lv_stream.IsEnabled());
+  assertEqual(lv_stream.GetFrameRate(), 20);
+  assertEqual(lv_stream.GetSettleMs(), 250);
+}
+
+test(btn_event_queue)
+{
+  // Timer ISR only records edges: bounded duration
+  theSys.m_isrMaxUs = 0;
+  for( US i = 0; i < 1000; i++ ) theSys.FastProcess();
+  SERIAL_LN("btn_event_queue: timer ISR max %dus over 1000 runs", theSys.m_isrMaxUs);
+  assertLess(theSys.m_isrMaxUs, 200);
+
+  // Burst of edges beyond capacity: overflow counted, main loop drains all queued
+  theSys.ProcessBtnEvents();
+  UL lv_overflow = theSys.m_btnEvents.GetOverflow();
+  for( UC i = 0; i < BTN_EVENT_QUEUE_SIZE + 2; i++ ) {
+    theSys.QueueBtnEvent(MAX_NUM_BUTTONS, (i % 2 ? 2 : 1));
+  }
+  assertEqual(theSys.m_btnEvents.Length(), BTN_EVENT_QUEUE_SIZE);
+  assertEqual(theSys.m_btnEvents.GetHighWater(), BTN_EVENT_QUEUE_SIZE);
+  assertEqual(theSys.m_btnEvents.GetOverflow(), lv_overflow + 2);
+  theSys.QueueBtnEvent(0, 0);
+  theSys.ProcessBtnEvents();
+  assertEqual(theSys.m_btnEvents.Length(), 0);
+}
+
+test(group_scene)
+{
+  // Simulated radio on a virtual clock: 16 lamps, each frame takes 1.1ms on air
+  // and is lost 10% of the time. Report controller frames and completion time
+  // of a scenario change, per-lamp unicast vs. one group frame plus ack window
+  const UC lv_lamps = 16;
+  const UL lv_frameUs = 1100;
+  UC lv_members[GROUP_MEMBER_BYTES];
+  UL lv_doneUs[lv_lamps];
+  memset(lv_members, 0x00, sizeof(lv_members));
+  for( UC i = 0; i < lv_lamps; i++ ) {
+    UC _nid = NODEID_MIN_DEVCIE + i;
+    lv_members[_nid / 8] |= (1 << (_nid % 8));
+  }
+
+  // Unicast: frames are sent back to back, a lost one is retried after backoff
+  randomSeed(13);
+  UL lv_uniFrames = 0, lv_uniUs = 0, lv_air = 0;
+  for( UC i = 0; i < lv_lamps; i++ ) {
+    UL _at = lv_air;
+    for( UC _repeat = 1; _repeat <= theConfig.GetNdMsgRptTimes() + 1; _repeat++ ) {
+      lv_uniFrames++;
+      lv_air += lv_frameUs;
+      _at += lv_frameUs;
+      if( random(100) >= 10 ) break;
+      // Scenario class backoff of the send scheduler
+      UL _delay = (RTE_RF_RETRY_BASE_MS * 4UL) << (_repeat - 1);
+      _at += (_delay < RTE_RF_RETRY_MAX_MS ? _delay : RTE_RF_RETRY_MAX_MS) * 1000;
+    }
+    if( _at > lv_uniUs ) lv_uniUs = _at;
+  }
+
+  // Group: broadcast burst, then unicast rounds to members that did not confirm
+  randomSeed(13);
+  GroupCmdClass lv_cmds;
+  GroupCmd_t *pCmd = lv_cmds.start(NODEID_MIN_GROUP, 1, lv_members, 0);
+  UL lv_grpFrames = 0, lv_now = 0;
+  memset(lv_doneUs, 0x00, sizeof(lv_doneUs));
+  for( UC _rpt = 0; _rpt <= theConfig.GetBcMsgRptTimes(); _rpt++ ) {
+    lv_grpFrames++;
+    lv_now += lv_frameUs;
+    for( UC i = 0; i < lv_lamps; i++ ) {
+      if( !lv_doneUs[i] && random(100) >= 10 ) lv_doneUs[i] = lv_now;
+    }
+  }
+  // Acks of reached lamps, each may be lost too
+  for( UC i = 0; i < lv_lamps; i++ ) {
+    if( lv_doneUs[i] && random(100) >= 10 ) lv_cmds.confirm(NODEID_MIN_DEVCIE + i);
+  }
+  while( (pCmd = lv_cmds.due(lv_now / 1000 + RTE_GROUP_ACK_TIMEOUT, RTE_GROUP_ACK_TIMEOUT)) != NULL ) {
+    if( pCmd->retries >= RTE_GROUP_MAX_RETRY ) { lv_cmds.finish(pCmd, false); break; }
+    pCmd->retries++;
+    lv_now += RTE_GROUP_ACK_TIMEOUT * 1000UL;
+    pCmd->tickSent = lv_now / 1000;
+    for( int _nid = lv_cmds.nextPending(pCmd); _nid >= 0; _nid = lv_cmds.nextPending(pCmd, _nid + 1) ) {
+      lv_grpFrames++;
+      lv_cmds.m_nRetried++;
+      lv_now += lv_frameUs;
+      UC i = _nid - NODEID_MIN_DEVCIE;
+      if( random(100) >= 10 ) {
+        if( !lv_doneUs[i] ) lv_doneUs[i] = lv_now;
+        lv_cmds.confirm(_nid);
+      }
+    }
+  }
+  UL lv_grpUs = 0;
+  for( UC i = 0; i < lv_lamps; i++ ) {
+    if( lv_doneUs[i] > lv_grpUs ) lv_grpUs = lv_doneUs[i];
+  }
+
+  SERIAL_LN("group_scene: unicast %lu frames %lu.%03lums, group %lu frames (%lu retries) %lu.%03lums",
+      lv_uniFrames, lv_uniUs / 1000, lv_uniUs % 1000, lv_grpFrames, lv_cmds.m_nRetried, lv_grpUs / 1000, lv_grpUs % 1000);
+  assertLess(lv_grpFrames, lv_uniFrames);
+  assertEqual(lv_cmds.m_nCompleted, 1);
+  assertEqual(lv_cmds.active(), 0);
+  for( UC i = 0; i < lv_lamps; i++ ) {
+    assertTrue(lv_doneUs[i] > 0);
+  }
+}
+
+test(rf_burst)
+{
+  // Frames on the broadcast pipe need no ack, so time is spent on turnarounds
+  // and airtime only. Header destination is an unused group, lamps ignore them.
+  // Compare per-frame send() with TX bursts of the same frames
+  const UC lv_rounds = 4;
+  MyMessage lv_msg[RF_BURST_MAX_FRAMES];
+  MyMessage *lv_pMsg[RF_BURST_MAX_FRAMES];
+  bool lv_ok[RF_BURST_MAX_FRAMES];
+  for( UC i = 0; i < RF_BURST_MAX_FRAMES; i++ ) {
+    lv_msg[i].build(NODEID_GATEWAY, NODEID_MAX_GROUP, i, C_INTERNAL, I_LOG_MESSAGE, false);
+    lv_msg[i].set((uint8_t)i);
+    lv_pMsg[i] = &lv_msg[i];
+  }
+
+  UL lv_us, lv_frameUs = 0, lv_frameMax = 0, lv_burstUs = 0, lv_burstMax = 0;
+  UL lv_sent = 0;
+  for( UC r = 0; r < lv_rounds; r++ ) {
+    for( UC i = 0; i < RF_BURST_MAX_FRAMES; i++ ) {
+      lv_us = micros();
+      theRadio.send(BROADCAST_ADDRESS, lv_msg[i], PRIVATE_NET_PIPE);
+      lv_us = micros() - lv_us;
+      lv_frameUs += lv_us;
+      if( lv_us > lv_frameMax ) lv_frameMax = lv_us;
+    }
+    lv_us = micros();
+    lv_sent += theRadio.sendBurst(BROADCAST_ADDRESS, lv_pMsg, RF_BURST_MAX_FRAMES, lv_ok, PRIVATE_NET_PIPE);
+    lv_us = micros() - lv_us;
+    lv_burstUs += lv_us;
+    if( lv_us > lv_burstMax ) lv_burstMax = lv_us;
+  }
+
+  UL lv_frames = (UL)lv_rounds * RF_BURST_MAX_FRAMES;
+  SERIAL_LN("rf_burst: per-frame %lu fps, max blocking %luus; burst %lu fps, max blocking %luus (%d frames)",
+      lv_frames * 1000000UL / lv_frameUs, lv_frameMax, lv_frames * 1000000UL / lv_burstUs, lv_burstMax, RF_BURST_MAX_FRAMES);
+  assertEqual(lv_sent, lv_frames);
+  assertLess(lv_burstUs, lv_frameUs);
+  // One burst blocks less than the same frames sent one by one
+  assertLess(lv_burstMax, lv_frameMax * RF_BURST_MAX_FRAMES);
+}
+
+// Stack painting: the probe frames overlay the area used by a call made
+// from the same caller, so untouched pattern bytes tell its peak depth
+#define JSON_STACK_PROBE            2048
+static __attribute__((noinline)) void jsonStackPaint()
+{
+  volatile UC lv_area[JSON_STACK_PROBE];
+  for( US i = 0; i < JSON_STACK_PROBE; i++ ) lv_area[i] = 0xA5;
+}
+
+static __attribute__((noinline)) US jsonStackUsed()
+{
+  volatile UC lv_area[JSON_STACK_PROBE];
+  US i = 0;
+  while( i < JSON_STACK_PROBE && lv_area[i] == 0xA5 ) i++;
+  return JSON_STACK_PROBE - i;
+}
+
+static volatile long json_sink;
+static JsonCmdParserClass json_parser;
+
+// Former path: copy, DOM parse, then lookups
+static __attribute__((noinline)) void jsonLegacyDecode(const char *f_cmd)
+{
+  String lv_str = f_cmd;
+  StaticJsonBuffer<COMMAND_JSON_SIZE * 8> lv_jBuf;
+  JsonObject& lv_obj = lv_jBuf.parseObject(const_cast<char*>(lv_str.c_str()));
+  if( lv_obj.containsKey("sid") ) json_sink += lv_obj["sid"].as<int>();
+  if( lv_obj.containsKey("cmd") ) json_sink += lv_obj["cmd"].as<int>();
+  if( lv_obj.containsKey("nd") && lv_obj.containsKey("ring") && lv_obj["ring"].size() > 6 ) {
+    for( UC i = 0; i < 7; i++ ) json_sink += lv_obj["ring"][i].as<uint8_t>();
+  }
+}
+
+static __attribute__((noinline)) void jsonStreamDecode(const char *f_cmd)
+{
+  json_parser.Feed(f_cmd, strlen(f_cmd));
+  json_sink += json_parser.Get(JCMD_KEY_SID) + json_parser.Get(JCMD_KEY_CMD);
+  if( json_parser.Has(JCMD_KEY_ND) && json_parser.GetCommand().ringLen > 6 ) {
+    for( UC i = 0; i < 7; i++ ) json_sink += json_parser.GetCommand().ring[i];
+  }
+}
+
+test(json_cmd_parser)
+{
+  // Chunks are decoded as they arrive, the last one completes the command
+  assertEqual(json_parser.Feed("{\"x0\":\"{'cmd':2, 'n\"}", 21), JCMD_RC_MORE);
+  assertEqual(json_parser.Feed("{'x1':'d\\':3, \\'ring\\':[1,1,'}", 30), JCMD_RC_MORE);
+  assertEqual(json_parser.Feed("60,0,255,0,8], 'x':{'y':[1]}}", 29), JCMD_RC_DONE);
+  assertEqual(json_parser.Get(JCMD_KEY_CMD), CMD_COLOR);
+  assertEqual(json_parser.Get(JCMD_KEY_ND), 3);
+  assertEqual(json_parser.Get(JCMD_KEY_SID, 0), 0);
+  assertEqual(json_parser.GetCommand().ringLen, JCMD_RING_SIZE);
+  assertEqual(json_parser.GetCommand().ring[2], 60);
+  assertEqual(json_parser.GetCommand().ring[4], 255);
+
+  const char *lv_ext = "{'cmd':8, 'nd':129, 'msg':1, 'ack':true, 'dt':[5,6], 'pl':'1;2'}";
+  assertEqual(json_parser.Feed(lv_ext, strlen(lv_ext)), JCMD_RC_DONE);
+  assertEqual(json_parser.Get(JCMD_KEY_ACK), 1);
+  assertEqual(json_parser.GetCommand().dtLen, 2);
+  assertEqual(strcmp(json_parser.GetText(), "1;2"), 0);
+
+  // Malformed input and orphan chunks are rejected
+  assertEqual(json_parser.Feed("{'cmd':1,", 9), JCMD_RC_ERROR);
+  assertEqual(json_parser.Feed("{'cmd':on}", 10), JCMD_RC_ERROR);
+  assertEqual(json_parser.Feed("{'x1':'}'}", 10), JCMD_RC_ERROR);
+
+  // Throughput and peak stack, former DOM parse vs streaming decode
+  const char *lv_cmd = "{'cmd':2, 'nd':1, 'sid':0, 'ring':[0,1,80,0,255,128,0]}";
+  const US lv_loops = 500;
+  UL lv_legacyUs = micros();
+  for( US i = 0; i < lv_loops; i++ ) jsonLegacyDecode(lv_cmd);
+  lv_legacyUs = micros() - lv_legacyUs;
+  UL lv_streamUs = micros();
+  for( US i = 0; i < lv_loops; i++ ) jsonStreamDecode(lv_cmd);
+  lv_streamUs = micros() - lv_streamUs;
+
+  jsonStackPaint();
+  jsonLegacyDecode(lv_cmd);
+  US lv_legacyStack = jsonStackUsed();
+  jsonStackPaint();
+  jsonStreamDecode(lv_cmd);
+  US lv_streamStack = jsonStackUsed();
+
+  SERIAL_LN("json_cmd_parser: legacy %lu cmd/s, stack %u; stream %lu cmd/s, stack %u",
+      (UL)lv_loops * 1000000UL / lv_legacyUs, lv_legacyStack, (UL)lv_loops * 1000000UL / lv_streamUs, lv_streamStack);
+  assertLess(lv_streamUs, lv_legacyUs);
+  assertLess(lv_streamStack, lv_legacyStack);
+  assertLess(lv_streamStack, 256);
+}
+
+// Largest block malloc() can still hand out, a measure of heap fragmentation
+static UL heapLargestBlock()
+{
+  UL lv_low = 0, lv_high = 65536;
+  while( lv_low < lv_high ) {
+    UL lv_mid = (lv_low + lv_high + 1) / 2;
+    void *lv_p = malloc(lv_mid);
+    if( lv_p ) {
+      free(lv_p);
+      lv_low = lv_mid;
+    } else {
+      lv_high = lv_mid - 1;
+    }
+  }
+  return lv_low;
+}
+
+test(cmd_ring)
+{
+  // Records wrap around the end and come out in order with their tags
+  CRecordQueue<64> lv_ring;
+  char lv_buf[40];
+  UC lv_tag;
+  int lv_len;
+  for( UC i = 0; i < 20; i++ ) {
+    sprintf(lv_buf, "{'cmd':6,'nd':%d}", i);
+    assertTrue(lv_ring.Push((const UC *)lv_buf, strlen(lv_buf), i));
+    assertTrue(lv_ring.Push((const UC *)lv_buf, strlen(lv_buf), i));
+    // Third one doesn't fit, and leaves the ring intact
+    assertTrue(!lv_ring.Push((const UC *)lv_buf, 40, i));
+    assertEqual(lv_ring.Count(), 2);
+    for( UC j = 0; j < 2; j++ ) {
+      lv_len = lv_ring.Pop((UC *)lv_buf, sizeof(lv_buf) - 1, &lv_tag);
+      assertTrue(lv_len > 0);
+      lv_buf[lv_len] = '\0';
+      assertEqual(lv_tag, i);
+      assertEqual(atoi(strrchr(lv_buf, ':') + 1), i);
+    }
+  }
+  assertEqual(lv_ring.Pop((UC *)lv_buf, sizeof(lv_buf), &lv_tag), -1);
+  assertEqual(lv_ring.GetOverflow(), 20);
+
+  // Oversized commands are rejected with a reason
+  char lv_long[MQ_CLOUD_MSG_MAX_LEN + 2];
+  memset(lv_long, ' ', sizeof(lv_long));
+  assertEqual(theSys.QueueCommand(CMD_SRC_SERIAL, CMD_REC_JSON, lv_long, sizeof(lv_long)), CMD_RC_TOO_LONG);
+
+  // Heap after 100k synthetic commands: record ring vs the former LinkedList<String>
+  const UL lv_cmds = 100000;
+  static CRecordQueue<MQ_CLOUD_RING_SIZE> lv_cmdRing;
+  LinkedList<String> lv_cmdList;
+  UL lv_free0 = System.freeMemory();
+  UL lv_block0 = heapLargestBlock();
+  for( UL i = 0; i < lv_cmds; i++ ) {
+    // Bursts of up to MQ_MAX_CLOUD_MSG commands of varying length
+    lv_len = sprintf(lv_buf, "{'cmd':%lu,'nd':%lu,'state':1}", i % 9, i % 251);
+    lv_cmdRing.Push((const UC *)lv_buf, lv_len, CMD_REC_JSON);
+    if( i % MQ_MAX_CLOUD_MSG == MQ_MAX_CLOUD_MSG - 1 ) {
+      while( lv_cmdRing.Pop((UC *)lv_buf, sizeof(lv_buf), &lv_tag) >= 0 );
+    }
+  }
+  UL lv_ringFree = System.freeMemory();
+  UL lv_ringBlock = heapLargestBlock();
+  for( UL i = 0; i < lv_cmds; i++ ) {
+    sprintf(lv_buf, "{'cmd':%lu,'nd':%lu,'state':1}", i % 9, i % 251);
+    lv_cmdList.add(String(lv_buf));
+    if( i % MQ_MAX_CLOUD_MSG == MQ_MAX_CLOUD_MSG - 1 ) {
+      while( lv_cmdList.size() ) lv_cmdList.shift();
+    }
+  }
+  UL lv_listFree = System.freeMemory();
+  UL lv_listBlock = heapLargestBlock();
+
+  SERIAL_LN("cmd_ring: start free %lu largest %lu; ring free %lu largest %lu; list free %lu largest %lu",
+      lv_free0, lv_block0, lv_ringFree, lv_ringBlock, lv_listFree, lv_listBlock);
+  assertEqual(lv_ringFree, lv_free0);
+  assertEqual(lv_ringBlock, lv_block0);
+  assertEqual(lv_cmdRing.GetOverflow(), 0);
+}
+
+test(sensor_aggregator)
+{
+  static SensorAggregatorClass lv_agg;
+  char lv_buf[CLT_MAX_PAYLOAD + 1];
+  lv_agg.Clear();
+  lv_agg.SetWindow(RTE_SENSOR_PUB_WINDOW);
+
+  // Deadband: small drift is held back, first value always goes out
+  assertTrue(lv_agg.Add(1, SPF_DHT_T, 22.0, 0));
+  assertTrue(lv_agg.IsDue(RTE_SENSOR_PUB_WINDOW));
+  assertTrue(!lv_agg.IsDue(RTE_SENSOR_PUB_WINDOW - 1));
+  assertTrue(lv_agg.Pack(lv_buf, sizeof(lv_buf), false) > 0);
+  assertEqual(strcmp(lv_buf, "{'nd':1,'DHTt':22.00}"), 0);
+  lv_agg.Complete(true);
+  lv_agg.Add(1, SPF_DHT_T, 22.1, 100);
+  assertEqual(lv_agg.GetDirtyCount(), 0);
+  lv_agg.Add(1, SPF_DHT_T, 22.5, 200);
+  assertEqual(lv_agg.GetDirtyCount(), 1);
+
+  // Priority lane bypasses the window and carries priority fields only
+  lv_agg.Add(2, SPF_PIR, 1, 300);
+  assertTrue(lv_agg.HasPriority());
+  assertTrue(lv_agg.Pack(lv_buf, sizeof(lv_buf), true) > 0);
+  assertEqual(strcmp(lv_buf, "{'nd':2,'PIR':1}"), 0);
+  lv_agg.Complete(true);
+  assertTrue(!lv_agg.HasPriority());
+  assertEqual(lv_agg.GetDirtyCount(), 1);
+
+  // Motion 1 then 0 before the 1 went out: the pending 1 must be flushed first
+  assertTrue(!lv_agg.IsPriorityChange(2, SPF_PIR, 0));
+  lv_agg.Add(2, SPF_PIR, 0, 350);
+  assertTrue(lv_agg.IsPriorityChange(2, SPF_PIR, 1));
+  assertTrue(!lv_agg.IsPriorityChange(2, SPF_PIR, 0));
+  assertTrue(!lv_agg.IsPriorityChange(1, SPF_DHT_T, 30.0));
+  assertTrue(lv_agg.Pack(lv_buf, sizeof(lv_buf), true) > 0);
+  assertEqual(strcmp(lv_buf, "{'nd':2,'PIR':0}"), 0);
+  lv_agg.Complete(true);
+
+  // A failed publish keeps the fields pending
+  assertTrue(lv_agg.Pack(lv_buf, sizeof(lv_buf), false) > 0);
+  lv_agg.Complete(false);
+  assertEqual(lv_agg.GetDirtyCount(), 1);
+
+  // 20 nodes for 2 minutes, events at most once per RTE_SENSOR_PUB_INTERVAL:
+  // count events against one per update as published before
+  lv_agg.Clear();
+  UL lv_legacy = 0, lv_events = 0;
+  for( UL lv_now = 0; lv_now < 120000; lv_now += RTE_SENSOR_PUB_INTERVAL ) {
+    for( UC n = 1; n <= 20; n++ ) {
+      lv_agg.Add(n, SPF_ALS, 40 + random(6), lv_now);
+      lv_agg.Add(n, SPF_DHT_T, 22 + random(10) / 10.0, lv_now);
+      lv_agg.Add(n, SPF_DHT_H, 50 + random(3), lv_now);
+      lv_legacy += 3;
+    }
+    if( lv_now % 7000 == 0 ) {
+      lv_agg.Add(5, SPF_PIR, (lv_now / 7000) % 2, lv_now);
+      lv_legacy++;
+    }
+    BOOL lv_priority = lv_agg.HasPriority();
+    if( lv_priority || lv_agg.IsDue(lv_now) ) {
+      US lv_len = lv_agg.Pack(lv_buf, sizeof(lv_buf), lv_priority);
+      assertTrue(lv_len > 0);
+      assertTrue(lv_len <= CLT_MAX_PAYLOAD);
+      assertEqual(strlen(lv_buf), lv_len);
+      lv_agg.Complete(true);
+      lv_events++;
+    }
+  }
+  lv_agg.showStatistics();
+  SERIAL_LN("sensor_aggregator: %lu updates -> %lu events, %lu fields", lv_legacy, lv_events, lv_agg.m_nFields);
+  assertEqual(lv_agg.m_nOverflow, 0);
+  assertLess(lv_events * 10, lv_legacy);
+}
+
+// Counts triggers per alarm tag
+static UL alarmFired[dtNBR_ALARMS];
+static void alarmCountTick(uint32_t tag)
+{
+  if( tag < dtNBR_ALARMS ) alarmFired[tag]++;
+}
+
+// Runs the scheduler on a simulated clock, local time = utc + zone
+static void alarmRunClock(TimeAlarmsClass &f_alarms, time_t &f_utc, time_t f_zone, UL f_secs, US f_step)
+{
+  for( UL lv_sec = 0; lv_sec < f_secs; lv_sec += f_step ) {
+    f_utc += f_step;
+    f_alarms.simulateClock(f_utc, f_zone);
+    f_alarms.tick();
+  }
+}
+
+test(alarm_scheduler)
+{
+  static TimeAlarmsClass lv_alarms;
+  AlarmID_t lv_id;
+  memset(alarmFired, 0x00, sizeof(alarmFired));
+  // Sunday 2023-01-01 01:00:00
+  time_t lv_utc = 1672534800;
+  lv_alarms.simulateClock(lv_utc, 0);
+
+  // Every schedule row gets its alarm, plus timers up to capacity
+  lv_id = lv_alarms.alarmRepeat(AlarmHMS(0, 0, 0), alarmCountTick);        // daily at midnight
+  lv_alarms.setAlarmTag(lv_id, 0);
+  lv_id = lv_alarms.alarmRepeat(dowMonday, 8, 30, 0, alarmCountTick);     // weekly
+  lv_alarms.setAlarmTag(lv_id, 1);
+  lv_id = lv_alarms.alarmOnce(dowWednesday, 12, 0, 0, alarmCountTick);    // once on a weekday
+  lv_alarms.setAlarmTag(lv_id, 2);
+  lv_id = lv_alarms.alarmOnce(2, 30, 0, alarmCountTick);                  // once at the next 02:30
+  lv_alarms.setAlarmTag(lv_id, 3);
+  lv_id = lv_alarms.timerRepeat(600, alarmCountTick);
+  lv_alarms.setAlarmTag(lv_id, 4);
+  assertEqual(lv_alarms.msUntilNextTrigger(), 600000UL);
+  for( UC i = 5; i < dtNBR_ALARMS; i++ ) {
+    lv_id = lv_alarms.alarmRepeat(AlarmHMS(random(24), 1 + random(59), 0), alarmCountTick);
+    assertTrue(lv_id != dtINVALID_ALARM_ID);
+    lv_alarms.setAlarmTag(lv_id, i);
+  }
+  assertTrue(dtNBR_ALARMS > MAX_SCT_ROWS);
+  assertEqual(lv_alarms.count(), dtNBR_ALARMS);
+  assertEqual(lv_alarms.timerOnce(10, alarmCountTick), dtINVALID_ALARM_ID);
+
+  // One week in 5 second steps
+  UL lv_start = micros();
+  alarmRunClock(lv_alarms, lv_utc, 0, SECS_PER_WEEK, 5);
+  UL lv_elapsed = micros() - lv_start;
+  SERIAL_LN("alarm_scheduler: %d alarms, %lu ticks, %lu us/tick", dtNBR_ALARMS, SECS_PER_WEEK / 5, lv_elapsed / (SECS_PER_WEEK / 5));
+  assertEqual(alarmFired[0], 7);
+  assertEqual(alarmFired[1], 1);
+  assertEqual(alarmFired[2], 1);
+  assertEqual(alarmFired[3], 1);
+  assertEqual(alarmFired[4], SECS_PER_WEEK / 600);
+  for( UC i = 5; i < dtNBR_ALARMS; i++ ) {
+    assertEqual(alarmFired[i], 7);
+  }
+  assertEqual(lv_alarms.count(), dtNBR_ALARMS - 2);
+
+  // DST: only the midnight alarm, a 02:30 alarm and the timer are left
+  for( AlarmID_t i = 0; i < dtNBR_ALARMS; i++ ) {
+    if( lv_alarms.isAllocated(i) && lv_alarms.read(i) != 0 && lv_alarms.read(i) != 600 ) lv_alarms.free(i);
+  }
+  lv_id = lv_alarms.alarmRepeat(AlarmHMS(2, 30, 0), alarmCountTick);
+  lv_alarms.setAlarmTag(lv_id, 5);
+  memset(alarmFired, 0x00, sizeof(alarmFired));
+  alarmRunClock(lv_alarms, lv_utc, 0, SECS_PER_HOUR, 5);                  // 01:00 -> 02:00
+  // Clocks go forward: 02:30 doesn't exist and the alarm triggers once
+  alarmRunClock(lv_alarms, lv_utc, SECS_PER_HOUR, SECS_PER_HOUR / 2, 5);  // 03:00 -> 03:30
+  assertEqual(alarmFired[5], 1);
+  // Clocks go back: 02:30 comes again, the alarm doesn't trigger again
+  alarmRunClock(lv_alarms, lv_utc, 0, SECS_PER_HOUR, 5);                  // 02:30 -> 03:30
+  assertEqual(alarmFired[5], 1);
+  assertEqual(alarmFired[0], 0);
+  // The timer keeps its elapsed time across both changes
+  assertEqual(alarmFired[4], (SECS_PER_HOUR * 5 / 2) / 600);
+
+  // Changing the value reschedules the pending trigger
+  lv_alarms.write(lv_id, AlarmHMS(5, 30, 0));
+  assertEqual(lv_alarms.testAlarm(lv_id), 2 * SECS_PER_HOUR);
+
+  for( AlarmID_t i = 0; i < dtNBR_ALARMS; i++ ) lv_alarms.free(i);
+  assertEqual(lv_alarms.count(), 0);
+  assertEqual(lv_alarms.msUntilNextTrigger(), dtNO_TRIGGER);
+  lv_alarms.simulateClock(0, 0);
+}
+
+// Re-arms itself at a time that is already due
+static TimeAlarmsClass *alarmRearmOwner = NULL;
+static time_t alarmRearmAt = 0;
+static void alarmRearmTick(uint32_t tag)
+{
+  alarmFired[tag]++;
+  AlarmID_t lv_id = alarmRearmOwner->triggerOnce(alarmRearmAt, alarmRearmTick);
+  alarmRearmOwner->setAlarmTag(lv_id, tag);
+}
+
+test(alarm_once_per_service)
+{
+  static TimeAlarmsClass lv_alarms;
+  memset(alarmFired, 0x00, sizeof(alarmFired));
+  time_t lv_utc = 1672534800;
+  lv_alarms.simulateClock(lv_utc, 0);
+  alarmRearmOwner = &lv_alarms;
+  alarmRearmAt = lv_utc;
+
+  // Due on entry and due again after its handler: one trigger per service call
+  AlarmID_t lv_id = lv_alarms.triggerOnce(lv_utc, alarmRearmTick);
+  lv_alarms.setAlarmTag(lv_id, 0);
+  lv_id = lv_alarms.timerRepeat(1, alarmCountTick);
+  lv_alarms.setAlarmTag(lv_id, 1);
+  lv_alarms.simulateClock(++lv_utc, 0);
+  lv_alarms.tick();
+  assertEqual(alarmFired[0], 1);
+  assertEqual(alarmFired[1], 1);
+  lv_alarms.tick();
+  assertEqual(alarmFired[0], 2);
+  assertEqual(alarmFired[1], 1);
+
+  for( AlarmID_t i = 0; i < dtNBR_ALARMS; i++ ) lv_alarms.free(i);
+  lv_alarms.simulateClock(0, 0);
+}
+
+// Raises an RF wakeup from the software timer thread
+static void loopWakeupCB()
+{
+  theSys.Wakeup(WAKE_RF);
+}
+
+test(loop_wakeup)
+{
+  UL lv_start;
+  UC lv_events;
+
+  // Queued command ends the wait at once
+  lv_start = millis();
+  assertEqual(theSys.QueueCommand(CMD_SRC_SERIAL, CMD_REC_CONSOLE, "show version", 12), 1);
+  lv_events = theSys.WaitForEvent(RTE_DELAY_SELFCHECK);
+  assertEqual(lv_events, WAKE_CLOUD);
+  assertLess(millis() - lv_start, RTE_DELAY_SELFCHECK);
+  theSys.ProcessCommands();
+
+  // Nothing to do: wait until self-check is due
+  theSys.m_tickSelfCheck = millis();
+  lv_start = millis();
+  lv_events = theSys.WaitForEvent(20);
+  assertEqual(lv_events, WAKE_TICK);
+  assertTrue(millis() - lv_start >= 20);
+
+  // Next alarm deadline ends a longer wait
+  AlarmID_t lv_id = Alarm.timerOnce(1, alarmCountTick);
+  assertTrue(lv_id != dtINVALID_ALARM_ID);
+  Alarm.setAlarmTag(lv_id, 0);
+  theSys.m_tickSelfCheck = millis();
+  lv_start = millis();
+  lv_events = theSys.WaitForEvent(5000);
+  assertEqual(lv_events, WAKE_ALARM);
+  assertLess(millis() - lv_start, 5000);
+  Alarm.free(lv_id);
+
+  // Event raised while idle ends the wait before self-check is due
+  Timer lv_timer(30, loopWakeupCB, true);
+  UL lv_samples = theSys.m_histDispatch.m_nSamples;
+  theSys.m_tickSelfCheck = millis();
+  lv_timer.start();
+  lv_events = theSys.WaitForEvent(RTE_DELAY_SELFCHECK);
+  assertEqual(lv_events, WAKE_RF);
+  assertTrue(theSys.m_tickIdle > 0);
+  theSys.ProcessCommands();
+  assertEqual(theSys.m_histDispatch.m_nSamples, lv_samples + 1);
+  theSys.showLoopStatistics();
+}
+
+test(perf_stat)
+{
+  static PerfStatClass lv_perf;     // too large for the loop stack
+  lv_perf.clear();
+
+  // Stage histogram: percentile is the bucket bound, capped by max
+  for( UC i = 0; i < 99; i++ ) lv_perf.addStage(PERF_STG_PANEL, 100);
+  lv_perf.addStage(PERF_STG_PANEL, 5000);
+  lv_perf.addStage(PERF_STG_NUM, 100);
+  assertTrue(lv_perf.stage(PERF_STG_NUM) == NULL);
+  assertEqual(lv_perf.stage(PERF_STG_PANEL)->m_nSamples, 100);
+  assertEqual(lv_perf.stage(PERF_STG_PANEL)->percentile(50), 128);
+  assertEqual(lv_perf.stage(PERF_STG_PANEL)->percentile(99), 128);
+  assertEqual(lv_perf.stage(PERF_STG_PANEL)->percentile(100), 5000);
+
+  // Message kinds: own slot while there is room, then the shared one
+  for( UC i = 0; i < PERF_MSG_SLOTS + 2; i++ ) lv_perf.addMessage(C_SET, i, 50);
+  lv_perf.addMessage(C_SET, 0, 70);
+  assertEqual(lv_perf.message(C_SET, 0)->hist.m_nSamples, 2);
+  assertEqual(lv_perf.message(C_SET, 0)->key, ((US)C_SET << 8));
+  assertEqual(lv_perf.message(C_SET, PERF_MSG_SLOTS)->key, PERF_MSG_OTHER);
+  assertEqual(lv_perf.message(C_SET, PERF_MSG_SLOTS)->hist.m_nSamples, 3);
+
+  // Watchdog margin follows the longest loop gap
+  lv_perf.addLoopGap(120);
+  lv_perf.addLoopGap(80);
+  assertEqual(lv_perf.watchdogMargin(), RTE_WATCHDOG_TIMEOUT - 120);
+
+  // Summary is truncated to the buffer
+  char lv_buf[256];
+  US lv_len = lv_perf.summary(lv_buf, sizeof(lv_buf));
+  assertEqual(lv_len, strlen(lv_buf));
+  assertTrue(strstr(lv_buf, ";panel:128/128/5000;") != NULL);
+  assertEqual(lv_perf.summary(lv_buf, 16), 15);
+  assertEqual(strlen(lv_buf), 15);
+
+  // Main loop stages are timed by IF_MAINLOOP_TIMER
+  assertTrue(theSys.m_perf.stage(PERF_STG_COMMANDS)->m_nSamples > 0);
+  assertTrue(theSys.m_perf.stage(PERF_STG_SELFCHECK)->m_nSamples > 0);
+  theSys.UpdatePerfVariable();
+  assertTrue(theSys.m_perfStat.startsWith("wd:"));
+  theSys.showPerformance();
+}
+
+test(sensor_state)
+{
+  static SensorStateClass lv_state;     // too large for the loop stack
+  float lv_value;
+  UL lv_tick;
+  UC lv_nid;
+  lv_state.Clear();
+
+  // Each node keeps its own reading, a repeated value is no change
+  assertTrue(lv_state.Update(10, SPF_PM25, 35, 1000));
+  assertTrue(lv_state.Update(11, SPF_PM25, 80, 2000));
+  assertTrue(!lv_state.Update(10, SPF_PM25, 35, 3000));
+  assertTrue(lv_state.Get(10, SPF_PM25, &lv_value, &lv_tick));
+  assertEqual((US)lv_value, 35);
+  assertEqual(lv_tick, 3000);
+  assertTrue(lv_state.Get(11, SPF_PM25, &lv_value));
+  assertEqual((US)lv_value, 80);
+  assertTrue(!lv_state.Get(11, SPF_ALS, &lv_value));
+  assertTrue(!lv_state.Get(12, SPF_PM25, &lv_value));
+  assertTrue(lv_state.GetLatest(SPF_PM25, &lv_value, &lv_nid));
+  assertEqual(lv_nid, 10);
+  assertEqual(SensorStateClass::FieldOfSensor(sensorDUST), SPF_PM25);
+  assertEqual(SensorStateClass::FieldOfSensor(sensorLEAK), SPF_NUM);
+
+  // Removing a node keeps the others reachable
+  lv_state.Remove(10);
+  assertEqual(lv_state.GetRowCount(), 1);
+  assertTrue(!lv_state.Get(10, SPF_PM25, &lv_value));
+  assertTrue(lv_state.Get(11, SPF_PM25, &lv_value));
+  assertEqual((US)lv_value, 80);
+
+  // A row per node up to the table size
+  lv_state.Clear();
+  for( UC n = 0; n < SENSOR_STATE_ROWS; n++ ) assertTrue(lv_state.Update(n + 8, SPF_ALS, n, n));
+  assertTrue(!lv_state.Update(250, SPF_ALS, 1, 0));
+  assertEqual(lv_state.m_nOverflow, 1);
+  assertTrue(lv_state.Get(SENSOR_STATE_ROWS + 7, SPF_ALS, &lv_value));
+  assertEqual((US)lv_value, SENSOR_STATE_ROWS - 1);
+
+  // Cells are shared: fields beyond the pool are dropped until a node is removed
+  lv_state.Clear();
+  UC lv_nodes = SENSOR_STATE_CELLS / SPF_NUM;
+  for( UC n = 0; n < lv_nodes; n++ ) {
+    for( UC f = 0; f < SPF_NUM; f++ ) assertTrue(lv_state.Update(n + 1, f, f, n));
+  }
+  assertEqual(lv_state.GetFreeCells(), SENSOR_STATE_CELLS - lv_nodes * SPF_NUM);
+  for( UC f = 0; f < SENSOR_STATE_CELLS - lv_nodes * SPF_NUM; f++ ) assertTrue(lv_state.Update(200, f, f, 0));
+  assertEqual(lv_state.GetFreeCells(), 0);
+  assertTrue(!lv_state.Update(201, SPF_ALS, 1, 0));
+  assertTrue(!lv_state.Get(201, SPF_ALS, &lv_value));
+  lv_state.Remove(1);
+  assertEqual(lv_state.GetFreeCells(), SPF_NUM);
+  assertTrue(lv_state.Update(201, SPF_ALS, 1, 0));
+  assertTrue(lv_state.Get(lv_nodes, SPF_CO2, &lv_value));
+  assertEqual((US)lv_value, SPF_CO2);
+
+  // Rules read the reporting node: ALS of node A is not hidden by node B reporting later
+  theSys.UpdateBrightness(201, 40);
+  theSys.UpdateBrightness(202, 90);
+  assertEqual(theSys.GetSensorData(SR_SCOPE_NODE, sensorALS, 201), 40);
+  assertEqual(theSys.GetSensorData(SR_SCOPE_NODE, sensorALS, 202), 90);
+  assertEqual(theSys.GetSensorData(SR_SCOPE_NODE, sensorALS, 203), 255);
+  assertEqual(theSys.GetSensorData(SR_SCOPE_ANY, sensorALS, 203), 90);
+  theSys.m_sensorState.showStatus();
+  theSys.m_sensorState.Remove(201);
+  theSys.m_sensorState.Remove(202);
+}
+
+// RAM NOR flash that loses power after m_budget more bytes (or erases) were written:
+// the write in progress stops part way and everything after it fails
+class PowerCutFlash : public Flashee::FakeFlashDevice
+{
+public:
+  long m_budget;
+
+  PowerCutFlash(page_count_t f_pages) : Flashee::FakeFlashDevice(f_pages, 256), m_budget(-1) { eraseAll(); }
+
+  virtual bool erasePage(flash_addr_t address) {
+    if( m_budget == 0 ) return false;
+    if( m_budget > 0 ) m_budget--;
+    return Flashee::FakeFlashDevice::erasePage(address);
+  }
+
+  virtual bool writePage(const void* data, flash_addr_t address, page_size_t length) {
+    if( m_budget < 0 ) return Flashee::FakeFlashDevice::writePage(data, address, length);
+    page_size_t lv_len = ((long)length < m_budget ? length : m_budget);
+    m_budget -= lv_len;
+    if( lv_len > 0 ) Flashee::FakeFlashDevice::writePage(data, address, lv_len);
+    return( lv_len == length );
+  }
+};
+
+test(flash_ring)
+{
+  const UL lv_base = 1500000000;
+  static SensorLogClass lv_log;         // too large for the loop stack
+  PowerCutFlash *pFlash = new PowerCutFlash(4);
+  assertTrue(pFlash != NULL);
+  UC lv_rec[SNSLOG_MAX_RECORD];
+  UC lv_len, lv_nid, lv_field;
+  float lv_value;
+  UL lv_delta;
+
+  // Records are a few bytes, values keep the field decimals
+  lv_len = SensorLogClass::EncodeRecord(lv_rec, 12, SPF_DHT_T, -5.25, 90);
+  assertLessOrEqual(lv_len, 6);
+  assertTrue(SensorLogClass::DecodeRecord(lv_rec, lv_len, &lv_nid, &lv_field, &lv_value, &lv_delta));
+  assertEqual(lv_nid, 12);
+  assertEqual(lv_field, SPF_DHT_T);
+  assertEqual(lv_delta, 90);
+  assertEqual((int)(lv_value * 100), -525);
+
+  // Cut the power at every few bytes of a run of appends and uploads: after
+  // restart no corrupt sample is read, samples not uploaded are all still there
+  // in order (uploaded ones may come again) and recording goes on
+  char lv_buf[CLT_MAX_PAYLOAD + 1];
+  for( long lv_cut = 0; lv_cut < 800; lv_cut += 3 ) {
+    pFlash->eraseAll();
+    pFlash->m_budget = -1;
+    assertTrue(lv_log.Init(pFlash, 0, 4 * 256));
+    pFlash->m_budget = lv_cut;
+    UL lv_appended = 0, lv_uploaded = 0;
+    for( UC i = 0; i < 60; i++ ) {
+      if( !lv_log.Append(i % 4 + 1, SPF_ALS, i, lv_base + i) ) break;
+      lv_appended = i + 1;
+      if( i % 20 == 19 && lv_log.PackBatch(lv_buf, sizeof(lv_buf)) > 0 ) {
+        lv_log.Complete(true);
+        lv_uploaded = lv_log.m_nSamples;
+      }
+    }
+
+    pFlash->m_budget = -1;
+    assertTrue(lv_log.Init(pFlash, 0, 4 * 256));
+    UL lv_expect = lv_uploaded;
+    bool lv_first = true;
+    while( lv_log.PackBatch(lv_buf, sizeof(lv_buf)) > 0 ) {
+      // [utc,nd,'ALS',value] where value is utc - base
+      for( char *p = strstr(lv_buf, "[["); p != NULL; p = strstr(p + 1, ",[") ) {
+        UL lv_sample = atol(p + 2) - lv_base;
+        assertEqual(atol(strstr(p, "'ALS',") + 6), lv_sample);
+        if( lv_first ) {
+          assertLessOrEqual(lv_sample, lv_expect);
+        } else {
+          assertEqual(lv_sample, lv_expect);
+        }
+        lv_expect = lv_sample + 1;
+        lv_first = false;
+      }
+      lv_log.Complete(true);
+    }
+    assertEqual(lv_expect, lv_appended);
+    assertTrue(lv_log.Append(1, SPF_ALS, 1, lv_base));
+    assertTrue(lv_log.IsPending());
+  }
+
+  // Samples taken before the clock was set are dated on upload,
+  // those left by an earlier boot are dropped
+  pFlash->eraseAll();
+  assertTrue(lv_log.Init(pFlash, 0, 4 * 256));
+  assertTrue(lv_log.Append(1, SPF_ALS, 7, SNSLOG_UPTIME | 5));
+  assertTrue(lv_log.Append(1, SPF_ALS, 8, lv_base));
+  if( Time.isValid() ) {
+    assertTrue(lv_log.PackBatch(lv_buf, sizeof(lv_buf)) > 0);
+    UL lv_dated = atol(strstr(lv_buf, "[[") + 2);
+    UL lv_expect = Time.now() - millis() / 1000 + 5;
+    assertTrue(lv_dated + 1 >= lv_expect && lv_dated <= lv_expect + 1);
+    lv_log.Complete(false);
+  }
+  assertTrue(lv_log.Append(1, SPF_ALS, 9, SNSLOG_UPTIME | 6));
+  assertTrue(lv_log.Init(pFlash, 0, 4 * 256));
+  assertTrue(lv_log.PackBatch(lv_buf, sizeof(lv_buf)) > 0);
+  assertEqual(strcmp(strstr(lv_buf, "'bf'"), "'bf':[[1500000000,1,'ALS',8]]}"), 0);
+  lv_log.Complete(true);
+  assertEqual(lv_log.PackBatch(lv_buf, sizeof(lv_buf)), 0);
+  assertTrue(!lv_log.IsPending());
+  assertEqual(lv_log.m_nUndated, 2);
+  lv_log.showStatus();
+  delete pFlash;
+}
+
+// Pack arguments the way the flash log does and format them back
+static String FlashLogLine(const char *fmt, ...)
+{
+  UC lv_args[LOGF_MAX_RECORD];
+  char lv_buf[MAX_MESSAGE_LEN];
+  va_list args;
+  va_start(args, fmt);
+  UC lv_len = LoggerClass::PackArgs(lv_args, sizeof(lv_args) - LOGF_HEADER_LEN, fmt, args);
+  va_end(args);
+  LoggerClass::FormatArgs(lv_buf, sizeof(lv_buf), fmt, lv_args, lv_len);
+  return String(lv_buf);
+}
+
+test(flash_log)
+{
+  assertTrue(FlashLogLine("node:%d %s ts:%lu", 12, "up", 4000000000UL).equals("node:12 up ts:4000000000"));
+  assertTrue(FlashLogLine("%.2f%% [%*d] [%-4s] %c", 3.14159, 5, 42, "ab", 'x').equals("3.14% [   42] [ab  ] x"));
+  assertTrue(FlashLogLine("%02X:%04x %lld", 10, 0xbeef, -9000000000LL).equals("0A:beef -9000000000"));
+
+  // Long strings are cut, arguments that don't fit the record show as <?>
+  char lv_long[MAX_MESSAGE_LEN];
+  memset(lv_long, 'a', sizeof(lv_long) - 1);
+  lv_long[sizeof(lv_long) - 1] = '\0';
+  assertEqual(FlashLogLine("%s", lv_long).length(), LOGF_MAX_STR);
+  String lv_line = FlashLogLine("%s%s%s", lv_long, lv_long, lv_long);
+  assertTrue(lv_line.endsWith("<?>"));
+  assertEqual(lv_line.length(), 2 * LOGF_MAX_STR + 3);
+
+  // Log calls at flash level reach the ring
+  UL lv_count = theLog.GetFlashLogCount();
+  LOGE("TST", "flash log test %d", 1);
+  assertEqual(theLog.GetFlashLogCount(), lv_count + 1);
+  theLog.showFlashLog(3);
+}
+
+static UC s_logArgCalls = 0;
+static int LogArg()
+{
+  return ++s_logArgCalls;
+}
+
+test(log_level)
+{
+  UC lv_level[LOGDEST_DUMMY];
+  for( UC i = 0; i < LOGDEST_DUMMY; i++ ) lv_level[i] = theLog.GetLevel(i);
+
+  // Arguments of a level no destination takes are not evaluated
+  theLog.SetLevel(LOGDEST_SERIAL, LEVEL_NOTICE);
+  theLog.SetLevel(LOGDEST_FLASH, LEVEL_WARNING);
+  theLog.SetLevel(LOGDEST_CLOUD, LEVEL_ERROR);
+  assertTrue(theLog.IsEnabled(LEVEL_NOTICE));
+  assertTrue(!theLog.IsEnabled(LEVEL_INFO));
+  s_logArgCalls = 0;
+  UL lv_start = micros();
+  for( UC i = 0; i < 100; i++ ) {
+    LOGD(LOGTAG_MSG, "from:%d to:%d cmd:%d type:%d", LogArg(), LogArg(), LogArg(), LogArg());
+    LOGI(LOGTAG_MSG, "arg:%d", LogArg());
+  }
+  UL lv_elapsed = micros() - lv_start;
+  assertEqual(s_logArgCalls, 0);
+  assertLess(lv_elapsed, 1000);
+
+  // Raising one destination enables the level, up to the build floor
+  theLog.SetLevel(LOGDEST_SERIAL, LEVEL_DEBUG);
+  LOGI(LOGTAG_MSG, "log_level test %d", LogArg());
+  assertEqual(s_logArgCalls, 1);
+  LOGD(LOGTAG_MSG, "log_level test %d", LogArg());
+  assertEqual(s_logArgCalls, (LOG_LEVEL_FLOOR >= LEVEL_DEBUG ? 2 : 1));
+
+  for( UC i = 0; i < LOGDEST_DUMMY; i++ ) theLog.SetLevel(i, lv_level[i]);
+}
+
+test(node_liveness)
+{
+  static NodeListClass lv_list(MAX_NODE_PER_CONTROLLER);     // too large for the loop stack
+  NodeIdRow_t lv_Node;
+  memset(&lv_Node, 0x00, sizeof(lv_Node));
+  lv_list.removeAll();
+  for( UC i = 0; i < MAX_NODE_PER_CONTROLLER; i++ ) {
+    lv_Node.nid = NODEID_MIN_DEVCIE + i;
+    assertTrue(lv_list.add(&lv_Node) >= 0);
+  }
+  assertEqual(lv_list.getDirtyCount(), MAX_NODE_PER_CONTROLLER);
+  lv_list.markClean();
+
+  // An hour of keep-alives from every node: liveness stays in RAM, rows are
+  // marked to be saved only once, by the checkpoint
+  const UL lv_start = 1500000000;
+  UL lv_rows = 0;
+  lv_list.checkpoint(lv_start, true);
+  for( UL t = RTE_TM_KEEP_ALIVE; t <= RTE_TM_NODE_CHECKPOINT; t += RTE_TM_KEEP_ALIVE ) {
+    for( UC i = 0; i < MAX_NODE_PER_CONTROLLER; i++ ) {
+      assertTrue(lv_list.touchNode(NODEID_MIN_DEVCIE + i, lv_start + t));
+    }
+    lv_list.checkpoint(lv_start + t);
+    lv_rows += lv_list.getDirtyCount();
+    lv_list.markClean();
+  }
+  assertEqual(lv_rows, MAX_NODE_PER_CONTROLLER);
+  SERIAL_LN("Node list bytes per hour: %lu", lv_rows * sizeof(NodeIdRow_t));
+  lv_Node.nid = NODEID_MIN_DEVCIE;
+  assertTrue(lv_list.get(&lv_Node) >= 0);
+  assertEqual(lv_Node.recentActive, lv_start + RTE_TM_NODE_CHECKPOINT);
+  assertTrue(!lv_list.touchNode(NODEID_DUMMY, lv_start));
+
+  // Identity changes mark the changed or shifted rows only
+  lv_Node.device = 1;
+  lv_list.update(&lv_Node);
+  assertEqual(lv_list.getDirtyCount(), 1);
+  lv_list.markClean();
+  lv_Node.nid = NODEID_MIN_DEVCIE + 10;
+  assertTrue(lv_list.remove(&lv_Node));
+  assertEqual(lv_list.getDirtyCount(), MAX_NODE_PER_CONTROLLER - 10);
+  lv_list.markClean();
+  assertTrue(lv_list.add(&lv_Node) >= 0);
+  assertEqual(lv_list.getDirtyCount(), MAX_NODE_PER_CONTROLLER - 10);
+  lv_list.removeAll();
+}
+
 //>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>
 // Call Start Func to Init Tests
 //>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>
@@ -341,13 +1868,15 @@ test(alarm_all_red)
     //TheSerial.print (".");
     static UC tick = 0;
 
-    IF_MAINLOOP_TIMER( theSys.ProcessCommands(), "ProcessCommands" );
+    IF_MAINLOOP_TIMER( theSys.ProcessCommands(), PERF_STG_COMMANDS );
+
+    IF_MAINLOOP_TIMER( theSys.CollectData(tick++), PERF_STG_COLLECT );
 
-    IF_MAINLOOP_TIMER( theSys.CollectData(tick++), "CollectData" );
+  	IF_MAINLOOP_TIMER( theSys.ReadNewRules(), PERF_STG_RULES );
 
-  	IF_MAINLOOP_TIMER( theSys.ReadNewRules(), "ReadNewRules" );
+    IF_MAINLOOP_TIMER( theSys.SelfCheck(RTE_DELAY_SELFCHECK), PERF_STG_SELFCHECK );
 
-    IF_MAINLOOP_TIMER( theSys.SelfCheck(RTE_DELAY_SELFCHECK), "SelfCheck" );
+    theSys.WaitForEvent(RTE_DELAY_SELFCHECK);
 
     if (flag)
       Test::run();
@@ -73,6 +73,14 @@ DHT senDHT(PIN_SEN_DHT, SEN_TYPE_DHT);
 #endif
 #endif
 
+#ifdef PIN_RF24_IRQ
+// RF24 IRQ: frame received (or send completed)
+void RF24IrqCB()
+{
+	theSys.Wakeup(WAKE_RF);
+}
+#endif
+
 //------------------------------------------------------------------
 // Alarm Triggered Actions
 //------------------------------------------------------------------
@@ -108,6 +116,17 @@ SmartControllerClass::SmartControllerClass()
 	memset(m_mac,0,sizeof(m_mac));
 	memset(m_action,0,sizeof(m_action));
   m_actionchanged = 0;
+	m_isrLastUs = 0;
+	m_isrMaxUs = 0;
+	m_isrCount = 0;
+	m_wakeEvents = 0;
+	memset(m_nWakes, 0x00, sizeof(m_nWakes));
+	m_idleMs = 0;
+	m_busyMs = 0;
+	m_loopBusyUs = 0;
+	m_tickIdle = 0;
+	m_tickSelfCheck = 0;
+	m_tickLoopStart = 0;
 }
 
 // Primitive initialization before loading configuration
@@ -131,7 +150,7 @@ void SmartControllerClass::Init()
 
 	// Initialize Logger
 	theLog.Init(m_SysID);
-	theLog.InitFlash(MEM_OFFLINE_DATA_OFFSET, MEM_OFFLINE_DATA_LEN);
+	theLog.InitFlash(MEM_REPORT_OFFSET, MEM_REPORT_LEN);
 
 #ifndef DISABLE_ASR
 	// Open ASR Interface
@@ -156,6 +175,12 @@ void SmartControllerClass::InitRadio()
   	}
   }
 
+#ifdef PIN_RF24_IRQ
+	// Wake up main loop on RF events instead of polling the RF FIFO
+	pinMode(PIN_RF24_IRQ, INPUT_PULLUP);
+	attachInterrupt(PIN_RF24_IRQ, RF24IrqCB, FALLING);
+#endif
+
 #ifndef DISABLE_BLE
 	// Open BLE Interface
   theBLE.Init(PIN_BLE_STATE, PIN_BLE_EN);
@@ -290,6 +315,15 @@ void SmartControllerClass::InitSensors()
 	}*/
 
 
+	// Sensor history recorded while offline, kept across resets
+	if( m_sensorLog.Init(theConfig.getP1Flash(), MEM_OFFLINE_DATA_OFFSET, MEM_OFFLINE_DATA_LEN) ) {
+		if( m_sensorLog.IsPending() ) {
+			LOGI(LOGTAG_MSG, "%lu sensor samples to upload.", m_sensorLog.GetPendingCount());
+		}
+	} else {
+		LOGE(LOGTAG_MSG, "Failed to init sensor history.");
+	}
+
 	// ToDo:
 	//...
 }
@@ -361,9 +395,17 @@ BOOL SmartControllerClass::Start()
 	return true;
 }
 
-void SmartControllerClass::Restart()
+// Write everything staged to flash before the application stops: reset, DFU or safe mode
+void SmartControllerClass::PrepareReset()
 {
+	theConfig.lstNodes.checkpoint(Time.now(), true);
 	theConfig.SaveConfig();
+	theConfig.FlushJournal(true);
+}
+
+void SmartControllerClass::Restart()
+{
+	PrepareReset();
 	SetStatus(STATUS_RST);
 	delay(1000);
 	System.reset();
@@ -520,7 +562,11 @@ BOOL SmartControllerClass::SelfCheck(US ms)
 	static UC tickWiFiOff = 0;
   PublishBtnAction();
 	// Check all alarms. This triggers them.
-	Alarm.delay(ms);
+	Alarm.tick();
+
+	// Checks below keep the pace of ms however often the loop runs
+	if( millis() - m_tickSelfCheck < ms ) return true;
+	m_tickSelfCheck = millis();
 
 	// Save config if it was changed
 	if (++tickSaveConfig > 30000 / ms) {	// once per 30 seconds
@@ -528,11 +574,25 @@ BOOL SmartControllerClass::SelfCheck(US ms)
 		theConfig.SaveConfig();
 	}
 
+	// Write back staged table rows within budget
+	theConfig.FlushJournal();
+
+	// Retry group commands on members that did not confirm
+	ProcessGroupCmds();
+
+	// Publish aggregated sensor data
+	FlushSensorData();
+
 	// Scan device list and check keepalive timeout
 	if( tickSaveConfig % (2000 / ms) == 0 ) { // every 2 second
 		CheckDevTimeout();
 	}
 
+	// Refresh performance summary for the cloud variable
+	if( tickSaveConfig % (10000 / ms) == 0 ) { // every 10 seconds
+		UpdatePerfVariable();
+	}
+
 	// Publish relay key status if changed
 	if( !theConfig.GetDisableWiFi() ) {
 		if( Particle.connected() ) PublishRelayKeyFlag();
@@ -552,8 +612,9 @@ BOOL SmartControllerClass::SelfCheck(US ms)
       }
     } else {
 			// Try to send testing message
-			String strCmd = String::format("255:8");
-			theRadio.ProcessSend(strCmd);
+			MyMessage lv_msg;
+			theRadio.BuildQueryMsg(lv_msg, BROADCAST_ADDRESS, V_PERCENTAGE);
+			theRadio.ProcessSend(&lv_msg);
 		}
 
 		// Check Network
@@ -624,6 +685,120 @@ BOOL SmartControllerClass::SelfCheck(US ms)
 	return true;
 }
 
+// Wait until an event source has work, an alarm is due or SelfCheck(ms) is due again.
+// This cannot block until an event: USB serial and the UARTs give no RX notification,
+// cloud callbacks only run in Particle.process() on this thread, and System.sleep()
+// would drop the cloud link. The sources are polled every RTE_IDLE_POLL_MS instead,
+// yielding to the system thread in between; only RF24IrqCB() sets its flag by interrupt.
+// Returns the WAKE_* events found
+UC SmartControllerClass::WaitForEvent(US ms)
+{
+	UL lv_start = millis();
+	UC lv_events;
+
+	static UL lv_busyUs = 0;					// must be static
+	m_histBusy.add(m_loopBusyUs);
+	lv_busyUs += m_loopBusyUs;
+	m_busyMs += lv_busyUs / 1000;
+	lv_busyUs %= 1000;
+	m_loopBusyUs = 0;
+
+	UL lv_timeout = millis() - m_tickSelfCheck;
+	lv_timeout = (lv_timeout < ms ? ms - lv_timeout : 0);
+	UL lv_alarm = Alarm.msUntilNextTrigger();
+	if( lv_alarm < lv_timeout ) lv_timeout = lv_alarm;
+
+	m_tickIdle = 0;
+	while( !(lv_events = PollEvents()) ) {
+		if( millis() - lv_start >= lv_timeout ) {
+			lv_events = (lv_alarm == lv_timeout ? WAKE_ALARM : WAKE_TICK);
+			m_tickIdle = 0;
+			break;
+		}
+		m_tickIdle = micros();
+		// Yield to the system thread; cloud callbacks queued for us run here
+		Particle.process();
+		delay(RTE_IDLE_POLL_MS);
+	}
+	m_idleMs += millis() - lv_start;
+
+	for( UC i = 0; i < WAKE_NUM; i++ ) {
+		if( lv_events & (1 << i) ) m_nWakes[i]++;
+	}
+
+	// The next pass starts now
+	lv_start = millis();
+	if( m_tickLoopStart ) m_perf.addLoopGap(lv_start - m_tickLoopStart);
+	m_tickLoopStart = lv_start;
+	return lv_events;
+}
+
+// Event sources with work for the main loop
+UC SmartControllerClass::PollEvents()
+{
+	noInterrupts();
+	UC lv_events = m_wakeEvents;
+	m_wakeEvents = 0;
+	interrupts();
+
+#ifdef PIN_RF24_IRQ
+	if( IsRFGood() && theRadio.IsPending(false) ) lv_events |= WAKE_RF;
+#else
+	if( IsRFGood() && theRadio.IsPending() ) lv_events |= WAKE_RF;
+#endif
+	if( TheSerial.available() > 0 ) lv_events |= WAKE_SERIAL;
+#ifndef DISABLE_BLE
+	if( BLEPort.available() > 0 ) lv_events |= WAKE_BLE;
+#endif
+#ifndef DISABLE_ASR
+	if( theASR.isPending() ) lv_events |= WAKE_ASR;
+#endif
+	if( m_cmdRing.Count() > 0 ) lv_events |= WAKE_CLOUD;
+	if( m_btnEvents.Length() > 0 ) lv_events |= WAKE_PANEL;
+	return lv_events;
+}
+
+void SmartControllerClass::showLoopStatistics()
+{
+	const char *lv_names[WAKE_NUM] = {"rf", "serial", "ble", "asr", "cloud", "panel", "alarm", "tick"};
+	UL lv_total = m_idleMs + m_busyMs;
+	SERIAL_LN("Main loop idle:%lums, busy:%lums (%lu%% idle)", m_idleMs, m_busyMs, (lv_total >= 100 ? m_idleMs / (lv_total / 100) : 0));
+	SERIAL("Wakeups:");
+	for( UC i = 0; i < WAKE_NUM; i++ ) SERIAL(" %s:%lu", lv_names[i], m_nWakes[i]);
+	SERIAL_LN("");
+	m_histDispatch.print("Event to dispatch");
+	m_histBusy.print("Loop busy time");
+	SERIAL_LN("");
+}
+
+void SmartControllerClass::showPerformance()
+{
+	m_perf.print();
+	SERIAL_LN("Queues (length/max, peak, dropped):");
+	SERIAL_LN("  RF receive:  %d/%d, %d, %lu", theRadio.GetRcvMQLength(), MQ_MAX_RF_RCVMSG,
+			theRadio.GetRcvMQHighWater(), theRadio.GetRcvMQOverflow());
+	SERIAL_LN("  RF send:     %d/%d, %d, %lu (coalesced %lu)", theRadio.GetMQLength(), theRadio.GetMQMaxLength(),
+			theRadio._sndHighWater, theRadio._sndDropped, theRadio.GetCoalescedCount());
+	SERIAL_LN("  Command:     %d/%d bytes, %d, %lu", m_cmdRing.Length(), m_cmdRing.GetMaxLength(),
+			m_cmdRing.GetHighWater(), m_cmdRing.GetOverflow());
+	SERIAL_LN("  Button:      %d/%d, %d, %lu", m_btnEvents.Length(), m_btnEvents.GetMaxLength(),
+			m_btnEvents.GetHighWater(), m_btnEvents.GetOverflow());
+	SERIAL_LN("  Sensor pub:  %d/%d, -, %lu", m_sensorAgg.GetDirtyCount(), SENSOR_PUB_SLOTS, m_sensorAgg.m_nOverflow);
+	SERIAL_LN("");
+}
+
+// Compact text for CLV_PerfStat: stage percentiles, then peak/dropped
+// of RF receive (rq), RF send (sq), command (cq) and button (bq) queues
+void SmartControllerClass::UpdatePerfVariable()
+{
+	char lv_buf[256];
+	US lv_len = m_perf.summary(lv_buf, sizeof(lv_buf));
+	snprintf(lv_buf + lv_len, sizeof(lv_buf) - lv_len, ";rq:%d/%lu;sq:%d/%lu;cq:%d/%lu;bq:%d/%lu",
+			theRadio.GetRcvMQHighWater(), theRadio.GetRcvMQOverflow(), theRadio._sndHighWater, theRadio._sndDropped,
+			m_cmdRing.GetHighWater(), m_cmdRing.GetOverflow(), m_btnEvents.GetHighWater(), m_btnEvents.GetOverflow());
+	m_perfStat = lv_buf;
+}
+
 BOOL SmartControllerClass::CheckRFBaseNetEnableDur()
 {
 	if( theConfig.GetMaxBaseNetworkDur() > 0 ) {
@@ -687,6 +862,12 @@ void SmartControllerClass::ProcessLocalCommands() {
 // Process all kinds of commands
 void SmartControllerClass::ProcessCommands()
 {
+	// Latency from the last idle check before the event
+	if( m_tickIdle ) {
+		m_histDispatch.add(micros() - m_tickIdle);
+		m_tickIdle = 0;
+	}
+
 	// Process Local Bridge Commands
 	ProcessLocalCommands();
 
@@ -705,14 +886,24 @@ void SmartControllerClass::ProcessCommands()
 // Process Cloud Commands
 void SmartControllerClass::ProcessCloudCommands()
 {
-	String _cmd;
-	while( m_cmdList.size() ) {
-		_cmd = m_cmdList.shift();
-		ExeJSONCommand(_cmd);
-	}
-	while( m_configList.size() ) {
-		_cmd = m_configList.shift();
-		ExeJSONConfig(_cmd);
+	char _cmd[MQ_CLOUD_MSG_MAX_LEN + 1];
+	UC _tag;
+	int _len;
+	// Records queued by these commands wait for the next loop
+	UC _count = m_cmdRing.Count();
+	while( _count-- > 0 && (_len = m_cmdRing.Pop((UC *)_cmd, MQ_CLOUD_MSG_MAX_LEN, &_tag)) >= 0 ) {
+		_cmd[_len] = '\0';
+		switch( _tag & 0x0F ) {
+		case CMD_REC_JSON:
+			ExeJSONCommand(_cmd);
+			break;
+		case CMD_REC_CONFIG:
+			ExeJSONConfig(_cmd);
+			break;
+		case CMD_REC_CONSOLE:
+			theConsole.ExecuteCloudCommand(_cmd);
+			break;
+		}
 	}
 }
 
@@ -795,6 +986,9 @@ bool SmartControllerClass::ProcessPanel()
 	// Process Panel Encoder
 	thePanel.ProcessEncoder();
 
+	// Act on ext. button events
+	ProcessBtnEvents();
+
 	return true;
 }
 
@@ -840,8 +1034,9 @@ int SmartControllerClass::DevSoftSwitch(UC sw, UC dev, const UC subID)
 	//ToDo: if dev = 0, go through list of devices
 	// ToDo:
 	//SetStatus();
-	String strCmd = String::format("%d:7:%d", dev, sw);
-	return theRadio.ProcessSend(strCmd, 0, subID);
+	MyMessage lv_msg;
+	theRadio.BuildSwitchMsg(lv_msg, dev, sw, 0, subID);
+	return theRadio.ProcessSend(&lv_msg);
 }
 
 int SmartControllerClass::DevHardSwitch(UC key, UC sw)
@@ -1035,78 +1230,73 @@ void SmartControllerClass::relay_restore_keystate()
 	}
 }
 
+// Poll ext. buttons, runs in ISR context: only debounced edges are recorded
 void SmartControllerClass::ExtButtonProcess()
 {
-	int func = 0;
-
 #ifdef EN_BTN_EXT_1
 	// Update button state
 	btnExt1.Update();
-	func = btnExt1.clicks;
-	switch( func ) {
-	case 1:			// click
-		theConfig.ExecuteBtnAction(0, 0);
-		break;
-	case -1:		// long-click
-		theConfig.ExecuteBtnAction(0, 1);
-		break;
-	case 2:			// double-click
-		break;
-	}
+	QueueBtnEvent(0, btnExt1.clicks);
 #endif
 
 #ifdef EN_BTN_EXT_2
 	// Update button state
 	btnExt2.Update();
-	func = btnExt2.clicks;
-	switch( func ) {
-	case 1:			// click
-		theConfig.ExecuteBtnAction(1, 0);
-		break;
-	case -1:		// long-click
-		theConfig.ExecuteBtnAction(1, 1);
-		break;
-	case 2:			// double-click
-		break;
-	}
+	QueueBtnEvent(1, btnExt2.clicks);
 #endif
 
 #ifdef EN_BTN_EXT_3
 	// Update button state
 	btnExt3.Update();
-	func = btnExt3.clicks;
-	switch( func ) {
-	case 1:			// click
-		theConfig.ExecuteBtnAction(2, 0);
-		break;
-	case -1:		// long-click
-		theConfig.ExecuteBtnAction(2, 1);
-		break;
-	case 2:			// double-click
-		break;
-	}
+	QueueBtnEvent(2, btnExt3.clicks);
 #endif
 
 #ifdef EN_BTN_EXT_4
 	// Update button state
 	btnExt4.Update();
-	func = btnExt4.clicks;
-	switch( func ) {
-	case 1:			// click
-		theConfig.ExecuteBtnAction(3, 0);
-		break;
-	case -1:		// long-click
-		theConfig.ExecuteBtnAction(3, 1);
-		break;
-	case 2:			// double-click
-		break;
-	}
+	QueueBtnEvent(3, btnExt4.clicks);
 #endif
 }
 
+// Record a button edge, ISR context
+void SmartControllerClass::QueueBtnEvent(UC _btn, int _clicks)
+{
+	if( _clicks == 0 ) return;
+	BtnEvent_t *pEvent = m_btnEvents.GetWriteSlot();
+	if( !pEvent ) {
+		m_btnEvents.Drop();
+		return;
+	}
+	pEvent->btn = _btn;
+	pEvent->clicks = _clicks;
+	pEvent->tick = millis();
+	m_btnEvents.Commit();
+}
+
+// Act on button events recorded by the system timer ISR
+void SmartControllerClass::ProcessBtnEvents()
+{
+	BtnEvent_t *pEvent;
+	while( (pEvent = m_btnEvents.Peek()) != NULL ) {
+		switch( pEvent->clicks ) {
+		case 1:			// click
+			theConfig.ExecuteBtnAction(pEvent->btn, 0);
+			break;
+		case -1:		// long-click
+			theConfig.ExecuteBtnAction(pEvent->btn, 1);
+			break;
+		case 2:			// double-click
+			break;
+		}
+		m_btnEvents.Pop();
+	}
+}
+
 // High speed system timer process
 void SmartControllerClass::FastProcess()
 {
+	UL lv_start = micros();
+
 	// Refresh Encoder
 	thePanel.EncoderAvailable();
 
@@ -1114,6 +1304,12 @@ void SmartControllerClass::FastProcess()
 	ExtButtonProcess();
 
 	// ToDo:
+
+	// ISR duration
+	UL lv_us = micros() - lv_start;
+	m_isrLastUs = lv_us;
+	if( lv_us > m_isrMaxUs ) m_isrMaxUs = lv_us;
+	m_isrCount++;
 }
 
 //------------------------------------------------------------------
@@ -1261,61 +1457,60 @@ int SmartControllerClass::CldPowerSwitch(String swStr)
 
 // Execute Operations, including SerialConsole commands
 /// Format: {cmd: '', data: ''}
-int SmartControllerClass::ExeJSONCommand(String jsonCmd)
+int SmartControllerClass::ExeJSONCommand(const char *jsonCmd)
 {
-	SERIAL_LN("Execute JSON cmd: %s", jsonCmd.c_str());
+	SERIAL_LN("Execute JSON cmd: %s", jsonCmd);
 
-	int rc = ProcessJSONString(jsonCmd);
+	int rc = m_cmdParser.Feed(jsonCmd, strlen(jsonCmd));
 	if (rc < 0) {
 		// Error input
-		LOGE(LOGTAG_MSG, "Error parsing json cmd: %s", jsonCmd.c_str());
+		LOGE(LOGTAG_MSG, "Error parsing json cmd: %s", jsonCmd);
 		return 0;
 	} else if (rc > 0) {
 		// Wait for more...
 		return 1;
 	}
 
-	int sub_id = 0;
-	if( (*m_jpCldCmd).containsKey("sid") ) sub_id = (*m_jpCldCmd)["sid"].as<int>();
+	const JsonCmd_t &lv_cmd = m_cmdParser.GetCommand();
+	int sub_id = m_cmdParser.Get(JCMD_KEY_SID, 0);
 
 	rc = 0;
-	if ((*m_jpCldCmd).containsKey("cmd"))
+	if (m_cmdParser.Has(JCMD_KEY_CMD))
   {
-		const COMMAND _cmd = (COMMAND)(*m_jpCldCmd)["cmd"].as<int>();
+		const COMMAND _cmd = (COMMAND)m_cmdParser.Get(JCMD_KEY_CMD);
 		//COMMAND 0: Use Serial Interface
 		if( _cmd == CMD_SERIAL) {
 			// Execute serial port command, and reflect results on cloud variable
-			if ((*m_jpCldCmd).containsKey("data")) {
+			if (m_cmdParser.Has(JCMD_KEY_DATA)) {
 				if( !theConfig.IsCloudSerialEnabled() ) {
 					LOGN(LOGTAG_MSG, "Cloud serial command is not allowed. Check system config.");
 					return 0;
 				}
-				const char* strData = (*m_jpCldCmd)["data"];
-				theConsole.ExecuteCloudCommand(strData);
+				theConsole.ExecuteCloudCommand(m_cmdParser.GetText());
 				return 1;
 			}
 		}
 		//COMMAND 1: Toggle light switch
 		else if (_cmd == CMD_POWER) {
-			if ((*m_jpCldCmd).containsKey("nd") && (*m_jpCldCmd).containsKey("state")) {
-				const int node_id = (*m_jpCldCmd)["nd"].as<int>();
-				const int state = (*m_jpCldCmd)["state"].as<int>();
-				const UC _hwsw = (UC)((*m_jpCldCmd).containsKey("hw") ? (*m_jpCldCmd)["hw"].as<int>() : 2);
+			if (m_cmdParser.Has(JCMD_KEY_ND) && m_cmdParser.Has(JCMD_KEY_STATE)) {
+				const int node_id = m_cmdParser.Get(JCMD_KEY_ND);
+				const int state = m_cmdParser.Get(JCMD_KEY_STATE);
+				const UC _hwsw = (UC)m_cmdParser.Get(JCMD_KEY_HW, 2);
 				return DeviceSwitch(state, _hwsw, node_id, sub_id);
 			}
 		}
 		//COMMAND 2: Change light color
 		else if (_cmd == CMD_COLOR) {
-			if ((*m_jpCldCmd).containsKey("nd") && (*m_jpCldCmd).containsKey("ring")) {
-				if( (*m_jpCldCmd)["ring"].size() > 6 ) {
-					const int node_id = (*m_jpCldCmd)["nd"].as<int>();
-					const uint8_t ring = (*m_jpCldCmd)["ring"][0].as<uint8_t>();
-					const uint8_t State = (*m_jpCldCmd)["ring"][1].as<uint8_t>();
-					const uint8_t BR = (*m_jpCldCmd)["ring"][2].as<uint8_t>();
-					const uint8_t W = (*m_jpCldCmd)["ring"][3].as<uint8_t>();
-					const uint8_t R = (*m_jpCldCmd)["ring"][4].as<uint8_t>();
-					const uint8_t G = (*m_jpCldCmd)["ring"][5].as<uint8_t>();
-					const uint8_t B = (*m_jpCldCmd)["ring"][6].as<uint8_t>();
+			if (m_cmdParser.Has(JCMD_KEY_ND) && m_cmdParser.Has(JCMD_KEY_RING)) {
+				if( lv_cmd.ringLen >= JCMD_RING_SIZE ) {
+					const int node_id = m_cmdParser.Get(JCMD_KEY_ND);
+					const uint8_t ring = lv_cmd.ring[0];
+					const uint8_t State = lv_cmd.ring[1];
+					const uint8_t BR = lv_cmd.ring[2];
+					const uint8_t W = lv_cmd.ring[3];
+					const uint8_t R = lv_cmd.ring[4];
+					const uint8_t G = lv_cmd.ring[5];
+					const uint8_t B = lv_cmd.ring[6];
 
 					MyMessage tmpMsg;
 					UC payl_buf[MAX_PAYLOAD];
@@ -1331,39 +1526,44 @@ int SmartControllerClass::ExeJSONCommand(String jsonCmd)
 		//COMMAND 3: Change brightness
 		//COMMAND 5: Change CCT
 		else if (_cmd == CMD_BRIGHTNESS || _cmd == CMD_CCT) {
-			if ((*m_jpCldCmd).containsKey("nd") && (*m_jpCldCmd).containsKey("value")) {
-				const int node_id = (*m_jpCldCmd)["nd"].as<int>();
-				const int value = (*m_jpCldCmd)["value"].as<int>();
+			if (m_cmdParser.Has(JCMD_KEY_ND) && m_cmdParser.Has(JCMD_KEY_VALUE)) {
+				const int node_id = m_cmdParser.Get(JCMD_KEY_ND);
+				const int value = m_cmdParser.Get(JCMD_KEY_VALUE);
 
 				//char buf[64];
 				//sprintf(buf, "%d;%d;%d;%d;%d;%d", node_id, S_DIMMER, C_SET, 1, V_DIMMER, value);
 				//String strCmd(buf);
 				//ExecuteLightCommand(strCmd);
 				// Use shortcut instead
-				String strCmd = String::format("%d:%d:%d", node_id, (_cmd == CMD_BRIGHTNESS ? 9 : 11), value);
-				return theRadio.ProcessSend(strCmd, 0, sub_id);
+				MyMessage lv_msg;
+				if( _cmd == CMD_BRIGHTNESS ) {
+					theRadio.BuildBrightnessMsg(lv_msg, node_id, constrain(value, 0, 100), 0, sub_id);
+				} else {
+					theRadio.BuildCCTMsg(lv_msg, node_id, constrain(value, CT_MIN_VALUE, CT_MAX_VALUE), 0, sub_id);
+				}
+				return theRadio.ProcessSend(&lv_msg);
 			}
 		}
 		//COMMAND 4: Change color with scenario input
 		else if (_cmd == CMD_SCENARIO) {
-			if ((*m_jpCldCmd).containsKey("nd") && (*m_jpCldCmd).containsKey("SNT_id")) {
-				const int node_id = (*m_jpCldCmd)["nd"].as<int>();
-				const int SNT_uid = (*m_jpCldCmd)["SNT_id"].as<int>();
+			if (m_cmdParser.Has(JCMD_KEY_ND) && m_cmdParser.Has(JCMD_KEY_SNT_ID)) {
+				const int node_id = m_cmdParser.Get(JCMD_KEY_ND);
+				const int SNT_uid = m_cmdParser.Get(JCMD_KEY_SNT_ID);
 				return ChangeLampScenario((UC)node_id, (UC)SNT_uid, sub_id);
 			}
 		}
 		//COMMAND 6: Query Device Status
 		else if (_cmd == CMD_QUERY) {
-			if ((*m_jpCldCmd).containsKey("nd")) {
-				const int node_id = (*m_jpCldCmd)["nd"].as<int>();
-				if( (*m_jpCldCmd).containsKey("reset") ) {
-					if( (*m_jpCldCmd)["reset"].as<int>() == 1 ) {
+			if (m_cmdParser.Has(JCMD_KEY_ND)) {
+				const int node_id = m_cmdParser.Get(JCMD_KEY_ND);
+				if( m_cmdParser.Has(JCMD_KEY_RESET) ) {
+					if( m_cmdParser.Get(JCMD_KEY_RESET) == 1 ) {
 						return RebootNode((uint8_t)node_id);
 					}
 				} else {
 					UC ring_id = RING_ID_ALL;
-					if( (*m_jpCldCmd).containsKey("Ring") ) {
-						ring_id = (UC)(*m_jpCldCmd)["Ring"].as<int>();
+					if( m_cmdParser.Has(JCMD_KEY_RING_ID) ) {
+						ring_id = (UC)m_cmdParser.Get(JCMD_KEY_RING_ID);
 						if( ring_id > MAX_RING_NUM ) ring_id = RING_ID_ALL;
 					}
 					return QueryDeviceStatus((UC)node_id, ring_id);
@@ -1372,35 +1572,30 @@ int SmartControllerClass::ExeJSONCommand(String jsonCmd)
 		}
 		//COMMAND 7: Special effect
 		else if (_cmd == CMD_EFFECT) {
-			if ((*m_jpCldCmd).containsKey("nd")) {
-				const int node_id = (*m_jpCldCmd)["nd"].as<int>();
-				const int filter_id = ((*m_jpCldCmd).containsKey("filter") ? (*m_jpCldCmd)["filter"].as<int>() : 0);
-				String strCmd = String::format("%d:17:%d", node_id, filter_id);
-				return theRadio.ProcessSend(strCmd, 0, sub_id);
+			if (m_cmdParser.Has(JCMD_KEY_ND)) {
+				const int node_id = m_cmdParser.Get(JCMD_KEY_ND);
+				const int filter_id = m_cmdParser.Get(JCMD_KEY_FILTER, 0);
+				MyMessage lv_msg;
+				theRadio.BuildEffectMsg(lv_msg, node_id, filter_id, 0, sub_id);
+				return theRadio.ProcessSend(&lv_msg);
 			}
 		}
 		//COMMAND 8: Extended funcions of special node, e.g. Key Simulator (nd=129)
 		else if (_cmd == CMD_EXT) {
-			if ((*m_jpCldCmd).containsKey("nd") && (*m_jpCldCmd).containsKey("msg")) {
-				const int node_id = (*m_jpCldCmd)["nd"].as<int>();
-				const int msg_id = (*m_jpCldCmd)["msg"].as<int>();
-				const int ack_flag = ((*m_jpCldCmd).containsKey("ack") ? (*m_jpCldCmd)["ack"].as<int>() : 0);
-				const int tag = ((*m_jpCldCmd).containsKey("tag") ? (*m_jpCldCmd)["tag"].as<int>() : 0);
+			if (m_cmdParser.Has(JCMD_KEY_ND) && m_cmdParser.Has(JCMD_KEY_MSG)) {
+				const int node_id = m_cmdParser.Get(JCMD_KEY_ND);
+				const int msg_id = m_cmdParser.Get(JCMD_KEY_MSG);
+				const int ack_flag = m_cmdParser.Get(JCMD_KEY_ACK, 0);
+				const int tag = m_cmdParser.Get(JCMD_KEY_TAG, 0);
 				String strCmd;
-				if( (*m_jpCldCmd).containsKey("pl") ) {
-					String payl = (*m_jpCldCmd)["pl"].asString();
+				if( m_cmdParser.Has(JCMD_KEY_PL) ) {
 					// nd;Remote-node-id(Orig=0);Msg;Ack;Type;Payload\n
-					strCmd = String::format("%d;0;%d;%d;%d;%s", node_id, msg_id, ack_flag, tag, payl.c_str());
+					strCmd = String::format("%d;0;%d;%d;%d;%s", node_id, msg_id, ack_flag, tag, m_cmdParser.GetText());
 					return theRadio.ProcessSend(strCmd, 0, sub_id);
-				} else if( (*m_jpCldCmd).containsKey("dt") ) {
+				} else if( m_cmdParser.Has(JCMD_KEY_DT) ) {
 					MyMessage tmpMsg;
-					UC payl_buf[MAX_PAYLOAD];
-					UC payl_len = min(MAX_PAYLOAD, (*m_jpCldCmd)["dt"].size());
-					for( UC i = 0; i < payl_len; i++ ) {
-						payl_buf[i] = (*m_jpCldCmd)["dt"][i].as<uint8_t>();
-					}
 					tmpMsg.build(theRadio.getAddress(), node_id, sub_id, msg_id, tag, (ack_flag == 1), (ack_flag == 2));
-					tmpMsg.set((void *)payl_buf, payl_len);
+					tmpMsg.set((void *)lv_cmd.dt, lv_cmd.dtLen);
 					return theRadio.ProcessSend(&tmpMsg);
 				} else {
 					strCmd = String::format("%d;0;%d;%d;%d", node_id, msg_id, ack_flag, tag);
@@ -1411,41 +1606,46 @@ int SmartControllerClass::ExeJSONCommand(String jsonCmd)
 	}
 
 	if( rc == 0 ) {
-		LOGE(LOGTAG_MSG, "Error json cmd format: %s", jsonCmd.c_str());
+		LOGE(LOGTAG_MSG, "Error json cmd format: %s", jsonCmd);
 		return 0;
 	}
 	return 1;
 }
 
-int SmartControllerClass::ExeJSONConfig(String jsonData) //future actions
+int SmartControllerClass::ExeJSONConfig(const char *jsonData) //future actions
 {
   //based on the input (ie whether it is a rule, scenario, or schedule), send the json string(s) to appropriate function.
   //These functions are responsible for adding the item to the respective, appropriate Chain. If multiple json strings coming through,
   //handle each for each respective Chain until end of incoming string
 
-	SERIAL_LN("Execute JSON config message: %s", jsonData.c_str());
+	SERIAL_LN("Execute JSON config message: %s", jsonData);
 
   int numRows = 0;
   bool bRowsKey = true;
 
-	int rc = ProcessJSONString(jsonData);
-	if (rc < 0) {
-		// Error input
-		LOGE(LOGTAG_MSG, "Error parsing json config message: %s", jsonData.c_str());
-		return 0;
-	} else if (rc > 0) {
+	String strJson;
+	if (ProcessJSONString(jsonData, strJson) > 0) {
 		// Wait for more...
 		return 1;
 	}
 
-  if (!(*m_jpCldCmd).containsKey("rows"))
+	// Parse the assembled message once, the object tree lives in this scope
+	StaticJsonBuffer<COMMAND_JSON_SIZE * 3 * 8> lv_jBuf;
+	JsonObject& root = lv_jBuf.parseObject(const_cast<char*>(strJson.c_str()));
+	if (!root.success()) {
+		// Error input
+		LOGE(LOGTAG_MSG, "Error parsing json config message: %s", jsonData);
+		return 0;
+	}
+
+  if (!root.containsKey("rows"))
   {
     numRows = 1;
     bRowsKey = false;
   }
   else
   {
-    numRows = (*m_jpCldCmd)["rows"].as<int>();
+    numRows = root["rows"].as<int>();
   }
 
   int successCount = 0;
@@ -1453,14 +1653,14 @@ int SmartControllerClass::ExeJSONConfig(String jsonData) //future actions
   {
 	  if (!bRowsKey)
 	  {
-		  if (ParseCmdRow(*m_jpCldCmd))
+		  if (ParseCmdRow(root))
 		  {
 			  successCount++;
 		  }
 	  }
 	  else
 	  {
-		  JsonObject& data = (*m_jpCldCmd)["data"][j];
+		  JsonObject& data = root["data"][j];
 		  if (ParseCmdRow(data))
 		  {
 			  successCount++;
@@ -1756,6 +1956,7 @@ bool SmartControllerClass::Change_Rule(RuleRow_t row)
 					LOGE(LOGTAG_MSG, "Error occured while adding Rule UID:%c%d", CLS_RULE, row.uid);
 					return false;
 				}
+				UpdateRuleIndex(Rule_table.getLast());
 			}
 			else //uid found
 			{
@@ -1765,6 +1966,7 @@ bool SmartControllerClass::Change_Rule(RuleRow_t row)
 					LOGE(LOGTAG_MSG, "Error occured while updating Rule UID:%c%d", CLS_RULE, row.uid);
 					return false;
 				}
+				UpdateRuleIndex(Rule_table.search(row.uid));
 			}
 			break;
 
@@ -1780,6 +1982,7 @@ bool SmartControllerClass::Change_Rule(RuleRow_t row)
 					LOGE(LOGTAG_MSG, "Error occured while adding Rule UID:%c%d", CLS_RULE, row.uid);
 					return false;
 				}
+				UpdateRuleIndex(Rule_table.getLast());
 
 				if (row.op_flag == PUT)
 				{
@@ -1794,6 +1997,7 @@ bool SmartControllerClass::Change_Rule(RuleRow_t row)
 					LOGE(LOGTAG_MSG, "Error occured while updating Rule UID:%c%d", CLS_RULE, row.uid);
 					return false;
 				}
+				UpdateRuleIndex(Rule_table.search(row.uid));
 
 				if (row.op_flag == POST)
 				{
@@ -2143,36 +2347,53 @@ bool SmartControllerClass::ExecuteLightCommand(String mySerialStr)
 }
 */
 
-// Match sensor data to condition
-bool SmartControllerClass::Check_SensorData(UC _thisNd, UC _scope, UC _sr, UC _nd, UC _symbol, US _val1, US _val2)
+//------------------------------------------------------------------
+// Rule operators, indexed by SR_SYM_*
+// _last is the previous result of the condition, used by hysteresis
+//------------------------------------------------------------------
+typedef bool (*RuleOp_t)(US _val, US _lo, US _hi, UC _hyst, bool _last);
+
+static bool RuleOpEQ(US _val, US _lo, US _hi, UC _hyst, bool _last) { return(_val == _lo); }
+static bool RuleOpNE(US _val, US _lo, US _hi, UC _hyst, bool _last) { return(_val != _lo); }
+static bool RuleOpGT(US _val, US _lo, US _hi, UC _hyst, bool _last) { return(_val > _lo); }
+static bool RuleOpGE(US _val, US _lo, US _hi, UC _hyst, bool _last) { return(_val >= _lo); }
+static bool RuleOpLT(US _val, US _lo, US _hi, UC _hyst, bool _last) { return(_val < _lo); }
+static bool RuleOpLE(US _val, US _lo, US _hi, UC _hyst, bool _last) { return(_val <= _lo); }
+
+// Enter the band at its edges, leave it only beyond the hysteresis
+static bool RuleOpBW(US _val, US _lo, US _hi, UC _hyst, bool _last)
 {
-	// Retrieve sensor data
-	US senData = 255;
+	if( _last ) return(_val + _hyst >= _lo && _val <= _hi + _hyst);
+	return(_val >= _lo && _val <= _hi);
+}
+
+// Leave the band at its edges, re-enter it only within the hysteresis
+static bool RuleOpNB(US _val, US _lo, US _hi, UC _hyst, bool _last)
+{
+	if( _last ) return(_val < _lo + _hyst || _val + _hyst > _hi);
+	return(_val < _lo || _val > _hi);
+}
+
+static const RuleOp_t ruleOps[] = {
+	RuleOpEQ, RuleOpNE, RuleOpGT, RuleOpGE, RuleOpLT, RuleOpLE, RuleOpBW, RuleOpNB
+};
+#define RULE_OP_NUM		(sizeof(ruleOps) / sizeof(RuleOp_t))
+
+// Retrieve sensor data, 255 if not available
+US SmartControllerClass::GetSensorData(UC _scope, UC _sr, UC _nd)
+{
+	float senValue;
+	BOOL bFound = false;
+	UC _field = SensorStateClass::FieldOfSensor(_sr);
 	switch( _scope ) {
 		case SR_SCOPE_CONTROLLER:
 		case SR_SCOPE_NODE:
-		// ToDo: should distinguish node and more sensors
-		if( _sr == sensorDHT ) {
-			if( _nd == 0 && m_sysTemp.IsDataReady() ) senData = (US)(m_sysTemp.GetValue() + 0.5);
-			else if( _nd == m_temperature.node_id ) senData = (US)(m_temperature.data + 0.5);
-		} else if( _sr == sensorDHT_h ) {
-			if( _nd == 0 && m_sysHumi.IsDataReady() ) senData = (US)(m_sysHumi.GetValue() + 0.5);
-			else if( _nd == m_humidity.node_id ) senData = (US)(m_humidity.data + 0.5);
-		} else if( _sr == sensorALS && _nd == m_brightness.node_id ) {
-			senData = m_brightness.data;
-		} else if( _sr == sensorPIR && _nd == m_motion.node_id ) {
-			senData = m_motion.data;
-		} else if( _sr == sensorSMOKE && _nd == m_smoke.node_id ) {
-			senData = m_smoke.data;
-		} else if( _sr == sensorGAS && _nd == m_gas.node_id ) {
-			senData = m_gas.data;
-		} else if( _sr == sensorDUST && _nd == m_pm25.node_id ) {
-			senData = m_pm25.data;
-		}
+		bFound = m_sensorState.Get(_nd, _field, &senValue);
 		break;
 
 		case SR_SCOPE_ANY:
-		// ToDo:
+		// The reporting node, otherwise the latest reading of any node
+		bFound = m_sensorState.Get(_nd, _field, &senValue) || m_sensorState.GetLatest(_field, &senValue);
 		break;
 
 		case SR_SCOPE_GROUP:
@@ -2180,55 +2401,71 @@ bool SmartControllerClass::Check_SensorData(UC _thisNd, UC _scope, UC _sr, UC _n
 		break;
 
 		default:
-		return false;
+		break;
 	}
+	if( !bFound || senValue < 0 ) return 255;
+	return( senValue >= 65535 ? 65535 : (US)(senValue + 0.5) );
+}
 
-	bool rc = false;
-	if( senData < 255 ) {
-		// Assert value
-		switch( _symbol ) {
-			case SR_SYM_EQ:
-			rc = (senData == _val1);
-			break;
-
-			case SR_SYM_NE:
-			rc = (senData != _val1);
-			break;
-
-			case SR_SYM_GT:
-			rc = (senData > _val1);
-			break;
-
-			case SR_SYM_GE:
-			rc = (senData >= _val1);
-			break;
-
-			case SR_SYM_LT:
-			rc = (senData < _val1);
-			break;
-
-			case SR_SYM_LE:
-			rc = (senData <= _val1);
-			break;
-
-			case SR_SYM_BW:
-			rc = (senData >= _val1 && senData <= _val2);
-			break;
+// Match sensor data to condition
+bool SmartControllerClass::Check_SensorData(UC _thisNd, UC _scope, UC _sr, UC _nd, UC _symbol, US _val1, US _val2)
+{
+	if( _symbol >= RULE_OP_NUM ) return false;
+	US senData = GetSensorData(_scope, _sr, _nd);
+	if( senData >= 255 ) return false;
+	return ruleOps[_symbol](senData, _val1, _val2, 0, false);
+}
 
-			case SR_SYM_NB:
-			rc = (senData < _val1 || senData > _val2);
-			break;
+// Evaluate compiled conditions of a rule on one node
+/// All conditions are tested first, so each keeps its hysteresis state even if
+/// the result is decided by an earlier one
+bool SmartControllerClass::Check_Predicate(const RulePredicate_t *pPred, const UC _nd, RuleEdge_t *pEdge)
+{
+	UC _results = 0;
+	UC _cond;
+	US senData;
+	for( _cond = 0; _cond < pPred->nConds; _cond++ ) {
+		const RuleCond_t &cond = pPred->cond[_cond];
+		senData = GetSensorData(cond.sr_scope, cond.sr_id, _nd);
+		if( senData < 255 && cond.op < RULE_OP_NUM ) {
+			if( ruleOps[cond.op](senData, cond.lo, cond.hi, cond.hyst, BITTEST(pEdge->condLast, _cond)) ) {
+				_results |= (1 << _cond);
+			}
+		}
+	}
+	pEdge->condLast = _results;
 
-			default:
-			return false;
+	bool bTrigger = true;
+	bool bTest;
+	UC _connector = COND_SYM_NOT;
+	for( _cond = 0; _cond < pPred->nConds; _cond++ ) {
+		bTest = BITTEST(_results, _cond);
+		if( _connector != COND_SYM_NOT ) {
+			if( _connector == COND_SYM_OR ) {
+				bTrigger |= bTest;
+			} else if( _connector == COND_SYM_AND ) {
+				bTrigger &= bTest;
+			}
+		} else {
+			bTrigger = bTest;
 		}
+		_connector = pPred->cond[_cond].connector;
+		// Exit earlier
+		if( bTrigger && _connector == COND_SYM_OR ) break;
+		if( !bTrigger && _connector == COND_SYM_AND ) break;
 	}
-	return rc;
+	return bTrigger;
 }
 
 // Execute Rule, called by Action_Rule(), AlarmTimerTriggered() and OnSensorDataChanged()
+/// Sensor changes act on edges only: scenario and notification are sent when the
+/// predicate turns true on a node, not again while it stays true there
 bool SmartControllerClass::Execute_Rule(ListNode<RuleRow_t> *rulePtr, bool _init, const UC _sr, const UC _nd)
 {
+	US _slot = Rule_table.pool().slotOf(rulePtr);
+	RulePredicate_t *pPred = Rule_index.predicate(_slot);
+	if( !pPred ) return false;
+
 	// Whether execute
 	if( _init ) {
 		// Start timer
@@ -2250,51 +2487,31 @@ bool SmartControllerClass::Execute_Rule(ListNode<RuleRow_t> *rulePtr, bool _init
 	}
 
 	UC _cond;
-	bool bTrigger = false;
 	// Whether conditions contain this sensor
 	if( _sr < 255 ) {
-		for(_cond = 0; _cond < MAX_CONDITION_PER_RULE; _cond++ ) {
-			if( !rulePtr->data.actCond[_cond].enabled ) return false;
-			if( rulePtr->data.actCond[_cond].sr_id == _sr ) {
-				// Go on check conditions
-				bTrigger = true;
-				break;
-			}
+		for(_cond = 0; _cond < pPred->nConds; _cond++ ) {
+			if( pPred->cond[_cond].sr_id == _sr ) break;
 		}
 		// no this sensor
-		if( !bTrigger ) return false;
-	} else {
-		bTrigger = true;
+		if( _cond >= pPred->nConds ) return false;
 	}
 
 	// Check conditions
-	bool bTest;
-	UC _connector = COND_SYM_NOT;
-	for(_cond = 0; _cond < MAX_CONDITION_PER_RULE; _cond++ ) {
-		if( !rulePtr->data.actCond[_cond].enabled ) break;
-
-		//if( _sr < 255 && _sr != rulePtr->data.actCond[_cond].sr_id ) continue;
-
-		bTest = Check_SensorData(rulePtr->data.node_id, rulePtr->data.actCond[_cond].sr_scope, rulePtr->data.actCond[_cond].sr_id, _nd,
-				rulePtr->data.actCond[_cond].symbol, rulePtr->data.actCond[_cond].sr_value1, rulePtr->data.actCond[_cond].sr_value2);
-
-		if( _connector != COND_SYM_NOT ) {
-			if( _connector == COND_SYM_OR ) {
-				bTrigger |= bTest;
-			} else if( _connector == COND_SYM_AND ) {
-				bTrigger &= bTest;
-			}
-		} else {
-			bTrigger = bTest;
-		}
-		_connector = rulePtr->data.actCond[_cond].connector;
-		// Exit earlier
-		if( bTrigger && _connector == COND_SYM_OR ) break;
-		if( !bTrigger && _connector == COND_SYM_AND ) break;
+	RuleEdge_t *pEdge = Rule_index.edge(_slot, _nd);
+	if( !pEdge ) return false;
+	bool bTrigger = Check_Predicate(pPred, _nd, pEdge);
+	bool bFire = bTrigger;
+	if( !_init && pEdge->valid && pEdge->last == bTrigger ) {
+		// No edge
+		bFire = false;
+	} else if( !bTrigger && pEdge->valid ) {
+		LOGI(LOGTAG_EVENT, "Rule %d released by sensor %d on node %d", rulePtr->data.uid, _sr, _nd);
 	}
+	pEdge->last = bTrigger;
+	pEdge->valid = 1;
 
 	// Switch to desired scenario
-	if( bTrigger ) {
+	if( bFire ) {
 		LOGI(LOGTAG_EVENT, "Rule %d triggered by sensor %d", rulePtr->data.uid, _sr);
 		ChangeLampScenario(rulePtr->data.node_id, rulePtr->data.SNT_uid);
 
@@ -2315,7 +2532,7 @@ bool SmartControllerClass::Execute_Rule(ListNode<RuleRow_t> *rulePtr, bool _init
 		}
 	}
 
-	return bTrigger;
+	return bFire;
 }
 
 //------------------------------------------------------------------
@@ -2335,16 +2552,349 @@ void SmartControllerClass::ReadNewRules(bool force)
 	}
 }
 
-// Scan rule list and check conditions in accordance with changed sensor
+// Check conditions of the rules referring to the changed sensor
 void SmartControllerClass::OnSensorDataChanged(const UC _sr, const UC _nd)
 {
+	// Sensors beyond sr_id range are never referred by rules
+	if( _sr >= RULE_INDEX_SENSORS ) return;
+
+	int _slot = Rule_index.next(_sr);
+	while( _slot >= 0 )
+	{
+		// Execute the rule with changed sensor
+		Execute_Rule(Rule_table.pool().nodeAt(_slot), false, _sr, _nd);
+		_slot = Rule_index.next(_sr, _slot + 1);
+	} //end of loop
+}
+
+// Refresh sensors referred by the rule
+void SmartControllerClass::UpdateRuleIndex(ListNode<RuleRow_t> *rulePtr)
+{
+	if( rulePtr ) Rule_index.update(Rule_table.pool().slotOf(rulePtr), rulePtr->data);
+}
+
+void SmartControllerClass::RebuildRuleIndex()
+{
+	Rule_index.clear();
 	ListNode<RuleRow_t> *ruleRowPtr = Rule_table.getRoot();
 	while (ruleRowPtr != NULL)
 	{
-		// Execute the rule with changed sensor
-		Execute_Rule(ruleRowPtr, false, _sr, _nd);
+		UpdateRuleIndex(ruleRowPtr);
 		ruleRowPtr = ruleRowPtr->next;
-	} //end of loop
+	}
+}
+
+//------------------------------------------------------------------
+// Rule Index Class
+//------------------------------------------------------------------
+void RuleIndexClass::clear()
+{
+	memset(m_bits, 0x00, sizeof(m_bits));
+	memset(m_pred, 0x00, sizeof(m_pred));
+	memset(m_edge, 0x00, sizeof(m_edge));
+	for( UC i = 0; i < RULE_EDGE_STATES; i++ ) m_edge[i].slot = RULE_EDGE_FREE;
+	m_edgeNext = 0;
+}
+
+// Compile conditions up to the first disabled one, and index their sensors
+void RuleIndexClass::update(US slot, const RuleRow_t &row)
+{
+	remove(slot);
+	if( slot >= MAX_RULE_TABLE_SIZE ) return;
+
+	RulePredicate_t &pred = m_pred[slot];
+	for( UC _cond = 0; _cond < MAX_CONDITION_PER_RULE; _cond++ ) {
+		const Condition_t &src = row.actCond[_cond];
+		if( !src.enabled ) break;
+		RuleCond_t &cond = pred.cond[pred.nConds++];
+		cond.sr_id = src.sr_id;
+		cond.sr_scope = src.sr_scope;
+		cond.op = src.symbol;
+		cond.connector = src.connector;
+		cond.lo = src.sr_value1;
+		cond.hi = src.sr_value2;
+		cond.hyst = 0;
+		if( (src.symbol == SR_SYM_BW || src.symbol == SR_SYM_NB) && src.sr_value2 > src.sr_value1 ) {
+			US _band = (src.sr_value2 - src.sr_value1) >> RULE_HYSTERESIS_SHIFT;
+			cond.hyst = (_band < 1 ? 1 : (_band > 255 ? 255 : _band));
+		}
+		m_bits[src.sr_id][slot / 8] |= (1 << (slot % 8));
+	}
+}
+
+void RuleIndexClass::remove(US slot)
+{
+	if( slot >= MAX_RULE_TABLE_SIZE ) return;
+	for( UC _sr = 0; _sr < RULE_INDEX_SENSORS; _sr++ ) {
+		m_bits[_sr][slot / 8] &= ~(1 << (slot % 8));
+	}
+	memset(&m_pred[slot], 0x00, sizeof(RulePredicate_t));
+	for( UC i = 0; i < RULE_EDGE_STATES; i++ ) {
+		if( m_edge[i].slot == slot ) m_edge[i].slot = RULE_EDGE_FREE;
+	}
+}
+
+// Find the edge state of (rule, node), or take a free one. When the table is full
+// the oldest allocation is reused and that pair starts over as unknown
+RuleEdge_t *RuleIndexClass::edge(US slot, UC nd)
+{
+	if( slot >= MAX_RULE_TABLE_SIZE ) return NULL;
+	RuleEdge_t *pFree = NULL;
+	for( UC i = 0; i < RULE_EDGE_STATES; i++ ) {
+		if( m_edge[i].slot == slot && m_edge[i].nd == nd ) return &m_edge[i];
+		if( !pFree && m_edge[i].slot == RULE_EDGE_FREE ) pFree = &m_edge[i];
+	}
+	if( !pFree ) {
+		pFree = &m_edge[m_edgeNext];
+		m_edgeNext = (m_edgeNext + 1) % RULE_EDGE_STATES;
+	}
+	memset(pFree, 0x00, sizeof(RuleEdge_t));
+	pFree->slot = slot;
+	pFree->nd = nd;
+	return pFree;
+}
+
+int RuleIndexClass::next(UC _sr, int from)
+{
+	if( _sr >= RULE_INDEX_SENSORS ) return -1;
+	const UC *pBits = m_bits[_sr];
+	while( from < MAX_RULE_TABLE_SIZE ) {
+		UC _byte = pBits[from / 8] >> (from % 8);
+		if( _byte ) {
+			// Lowest set bit in this byte
+			while( !(_byte & 0x01) ) { _byte >>= 1; from++; }
+			return from;
+		}
+		// Skip to next byte
+		from = (from / 8 + 1) * 8;
+	}
+	return -1;
+}
+
+US RuleIndexClass::count(UC _sr)
+{
+	US _num = 0;
+	for( int _slot = next(_sr); _slot >= 0; _slot = next(_sr, _slot + 1) ) _num++;
+	return _num;
+}
+
+//------------------------------------------------------------------
+// Group Command Class
+//------------------------------------------------------------------
+void GroupCmdClass::clear()
+{
+	memset(m_cmd, 0x00, sizeof(m_cmd));
+	m_nStarted = 0;
+	m_nCompleted = 0;
+	m_nRetried = 0;
+	m_nFailed = 0;
+}
+
+// Take the slot of the same group, else a free one, else the oldest one
+GroupCmd_t *GroupCmdClass::start(UC _gid, UC _scenario, const UC *_members, UL _now, UC _replyTo, UC _sensor)
+{
+	GroupCmd_t *pCmd = NULL;
+	GroupCmd_t *pFree = NULL;
+	GroupCmd_t *pOldest = &m_cmd[0];
+	for( UC i = 0; i < GROUP_CMD_SLOTS && !pCmd; i++ ) {
+		if( m_cmd[i].group == _gid ) pCmd = &m_cmd[i];
+		else if( m_cmd[i].group == 0 ) { if( !pFree ) pFree = &m_cmd[i]; }
+		else if( (long)(m_cmd[i].tickSent - pOldest->tickSent) < 0 ) pOldest = &m_cmd[i];
+	}
+	if( !pCmd ) pCmd = (pFree ? pFree : pOldest);
+	// Superseded before all members confirmed
+	if( pCmd->group > 0 ) m_nFailed++;
+
+	pCmd->group = _gid;
+	pCmd->scenario = _scenario;
+	pCmd->replyTo = _replyTo;
+	pCmd->sensor = _sensor;
+	pCmd->retries = 0;
+	pCmd->tickSent = _now;
+	memcpy(pCmd->pending, _members, GROUP_MEMBER_BYTES);
+	m_nStarted++;
+	return pCmd;
+}
+
+UC GroupCmdClass::confirm(UC _nid)
+{
+	if( _nid > NODEID_MAX_DEVCIE ) return 0;
+	UC _num = 0;
+	for( UC i = 0; i < GROUP_CMD_SLOTS; i++ ) {
+		if( m_cmd[i].group > 0 && (m_cmd[i].pending[_nid / 8] & (1 << (_nid % 8))) ) {
+			m_cmd[i].pending[_nid / 8] &= ~(1 << (_nid % 8));
+			_num++;
+		}
+	}
+	return _num;
+}
+
+// Completed commands are released on the way
+GroupCmd_t *GroupCmdClass::due(UL _now, UL _timeout)
+{
+	for( UC i = 0; i < GROUP_CMD_SLOTS; i++ ) {
+		if( m_cmd[i].group == 0 ) continue;
+		if( nextPending(&m_cmd[i]) < 0 ) {
+			finish(&m_cmd[i], true);
+		} else if( _now - m_cmd[i].tickSent >= _timeout ) {
+			return &m_cmd[i];
+		}
+	}
+	return NULL;
+}
+
+int GroupCmdClass::nextPending(const GroupCmd_t *pCmd, int from)
+{
+	for( ; from <= NODEID_MAX_DEVCIE; from++ ) {
+		if( pCmd->pending[from / 8] & (1 << (from % 8)) ) return from;
+	}
+	return -1;
+}
+
+UC GroupCmdClass::countPending(const GroupCmd_t *pCmd)
+{
+	UC _num = 0;
+	for( int _nid = nextPending(pCmd); _nid >= 0; _nid = nextPending(pCmd, _nid + 1) ) _num++;
+	return _num;
+}
+
+UC GroupCmdClass::active()
+{
+	UC _num = 0;
+	for( UC i = 0; i < GROUP_CMD_SLOTS; i++ ) {
+		if( m_cmd[i].group > 0 ) _num++;
+	}
+	return _num;
+}
+
+void GroupCmdClass::finish(GroupCmd_t *pCmd, bool _ok)
+{
+	if( _ok ) m_nCompleted++;
+	else m_nFailed++;
+	memset(pCmd, 0x00, sizeof(GroupCmd_t));
+}
+
+//------------------------------------------------------------------
+// Loop Latency Histogram
+//------------------------------------------------------------------
+void LoopHistClass::clear()
+{
+	memset(m_count, 0x00, sizeof(m_count));
+	m_nSamples = 0;
+	m_maxUs = 0;
+}
+
+void LoopHistClass::add(UL _us)
+{
+	UC _bucket = 0;
+	while( _bucket < LOOP_HIST_BUCKETS - 1 && (_us >> (_bucket + 1)) > 0 ) _bucket++;
+	m_count[_bucket]++;
+	m_nSamples++;
+	if( _us > m_maxUs ) m_maxUs = _us;
+}
+
+UL LoopHistClass::percentile(UC _pct)
+{
+	if( !m_nSamples ) return 0;
+	UL _rank = (UL)(((uint64_t)m_nSamples * _pct + 99) / 100);
+	UL _sum = 0;
+	for( UC _bucket = 0; _bucket < LOOP_HIST_BUCKETS - 1; _bucket++ ) {
+		_sum += m_count[_bucket];
+		if( _sum >= _rank ) {
+			UL _bound = 1UL << (_bucket + 1);
+			return( _bound < m_maxUs ? _bound : m_maxUs );
+		}
+	}
+	return m_maxUs;
+}
+
+void LoopHistClass::print(const char *_name)
+{
+	SERIAL_LN("%s samples:%lu, p50:<=%luus, p90:<=%luus, p99:<=%luus, max:%luus", _name, m_nSamples,
+			percentile(50), percentile(90), percentile(99), m_maxUs);
+	SERIAL("  buckets(us<2^n+1):");
+	for( UC _bucket = 0; _bucket < LOOP_HIST_BUCKETS; _bucket++ ) SERIAL(" %lu", m_count[_bucket]);
+	SERIAL_LN("");
+}
+
+//------------------------------------------------------------------
+// Performance Profile
+//------------------------------------------------------------------
+void PerfStatClass::clear()
+{
+	for( UC i = 0; i < PERF_STG_NUM; i++ ) m_stage[i].clear();
+	for( UC i = 0; i < PERF_MSG_SLOTS; i++ ) {
+		m_msg[i].key = PERF_MSG_OTHER;
+		m_msg[i].hist.clear();
+	}
+	m_nMsgSlots = 0;
+	m_maxGapMs = 0;
+}
+
+const char *PerfStatClass::stageName(UC _stage)
+{
+	static const char *lv_names[PERF_STG_NUM] = {"commands", "collect", "rules", "panel", "selfcheck", "cloud"};
+	return( _stage < PERF_STG_NUM ? lv_names[_stage] : "?" );
+}
+
+void PerfStatClass::addStage(UC _stage, UL _us)
+{
+	if( _stage < PERF_STG_NUM ) m_stage[_stage].add(_us);
+}
+
+// Pairs get a slot in order of first appearance, the last slot is shared by the rest
+PerfMsgSlot_t *PerfStatClass::message(UC _cmd, UC _type)
+{
+	US _key = ((US)_cmd << 8) | _type;
+	for( UC i = 0; i < m_nMsgSlots; i++ ) {
+		if( m_msg[i].key == _key ) return &m_msg[i];
+	}
+	if( m_nMsgSlots < PERF_MSG_SLOTS - 1 ) {
+		m_msg[m_nMsgSlots].key = _key;
+		return &m_msg[m_nMsgSlots++];
+	}
+	return &m_msg[PERF_MSG_SLOTS - 1];
+}
+
+void PerfStatClass::addMessage(UC _cmd, UC _type, UL _us)
+{
+	message(_cmd, _type)->hist.add(_us);
+}
+
+void PerfStatClass::addLoopGap(UL _ms)
+{
+	if( _ms > m_maxGapMs ) m_maxGapMs = _ms;
+}
+
+long PerfStatClass::watchdogMargin()
+{
+	return( (long)RTE_WATCHDOG_TIMEOUT - (long)m_maxGapMs );
+}
+
+US PerfStatClass::summary(char *_buf, US _size)
+{
+	int _len = snprintf(_buf, _size, "wd:%ld", watchdogMargin());
+	for( UC i = 0; i < PERF_STG_NUM && _len < _size; i++ ) {
+		_len += snprintf(_buf + _len, _size - _len, ";%s:%lu/%lu/%lu", stageName(i),
+				m_stage[i].percentile(50), m_stage[i].percentile(99), m_stage[i].m_maxUs);
+	}
+	return( _len < _size ? _len : _size - 1 );
+}
+
+void PerfStatClass::print()
+{
+	SERIAL_LN("Watchdog margin %ldms of %dms, longest loop gap %lums", watchdogMargin(), RTE_WATCHDOG_TIMEOUT, m_maxGapMs);
+	for( UC i = 0; i < PERF_STG_NUM; i++ ) m_stage[i].print(stageName(i));
+	char _name[24];
+	for( UC i = 0; i < PERF_MSG_SLOTS; i++ ) {
+		if( !m_msg[i].hist.m_nSamples ) continue;
+		if( m_msg[i].key == PERF_MSG_OTHER ) {
+			strcpy(_name, "rf other");
+		} else {
+			sprintf(_name, "rf cmd:%d type:%d", m_msg[i].key >> 8, m_msg[i].key & 0xFF);
+		}
+		m_msg[i].hist.print(_name);
+	}
 }
 
 bool SmartControllerClass::CreateAlarm(ListNode<ScheduleRow_t>* scheduleRow, uint32_t tag)
@@ -2380,13 +2930,23 @@ bool SmartControllerClass::CreateAlarm(ListNode<ScheduleRow_t>* scheduleRow, uin
 		}
 	}
 	else if (scheduleRow->data.isRepeat == 0) {
-		alarm_id = Alarm.alarmOnce((timeDayOfWeek_t)(int)scheduleRow->data.weekdays, (int)scheduleRow->data.hour, (int)scheduleRow->data.minute, 0, AlarmTimerTriggered);
+		if (scheduleRow->data.weekdays > 0 && scheduleRow->data.weekdays <= 7) {
+			alarm_id = Alarm.alarmOnce((timeDayOfWeek_t)(int)scheduleRow->data.weekdays, (int)scheduleRow->data.hour, (int)scheduleRow->data.minute, 0, AlarmTimerTriggered);
+		} else {
+			//weekdays == 0: next occurrence of the given time
+			alarm_id = Alarm.alarmOnce((int)scheduleRow->data.hour, (int)scheduleRow->data.minute, 0, AlarmTimerTriggered);
+		}
 		Alarm.setAlarmTag(alarm_id, tag);
 	}
 	else {
 		LOGN(LOGTAG_MSG, "Cannot create Alarm via UID:%c%d. Incorrect isRepeat value.", CLS_RULE, tag);
 		return false;
 	}
+	if (alarm_id == dtINVALID_ALARM_ID) {
+		LOGE(LOGTAG_MSG, "Cannot create Alarm via UID:%c%d. %d/%d alarms in use.", CLS_RULE, tag, Alarm.count(), dtNBR_ALARMS);
+		scheduleRow->data.alarm_id = dtINVALID_ALARM_ID;
+		return false;
+	}
 	//Update that schedule row's alarm_id field with the newly created alarm's alarm_id
 	scheduleRow->data.alarm_id = alarm_id;
 	LOGI(LOGTAG_MSG, "Alarm %u created via UID:%c%d", alarm_id, CLS_RULE, tag);
@@ -2519,7 +3079,7 @@ ListNode<ScheduleRow_t> *SmartControllerClass::SearchSchedule(UC uid)
 		if (uid < MAX_SCT_ROWS)
 		{
 			// Find it
-			EEPROM.get(MEM_SCHEDULE_OFFSET + uid*SCT_ROW_SIZE, row);
+			theConfig.MemReadScheduleRow(row, MEM_SCHEDULE_OFFSET + uid*SCT_ROW_SIZE);
 
 			// flags should be 111
 			if(row.uid == uid && row.op_flag == (OP_FLAG)1
@@ -2587,17 +3147,9 @@ ListNode<ScenarioRow_t>* SmartControllerClass::SearchScenario(UC uid)
 
 ListNode<DevStatusRow_t>* SmartControllerClass::SearchDevStatus(UC dest_id)
 {
-	ListNode<DevStatusRow_t> *tmp = DevStatus_table.getRoot();
-	while (tmp != NULL)
-	{
-		if (tmp->data.node_id == dest_id) {
-			return tmp;
-		}
-		tmp = tmp->next;
-	}
+	// Direct index by node_id, kept in sync by the chain
 	//do not need to search in flash because whole table is always loaded
-
-	return NULL;
+	return DevStatus_table.search_key(dest_id);
 }
 
 //------------------------------------------------------------------
@@ -2725,9 +3277,7 @@ US SmartControllerClass::VerifyDevicePresence(UC *_assoDev, UC _nodeID, UC _devT
 		return 0;
 	}
 	// Update timestamp
-	lv_Node.recentActive = Time.now();
-	theConfig.lstNodes.update(&lv_Node);
-	theConfig.SetNIDChanged(true);
+	theConfig.lstNodes.touchNode(_nodeID, Time.now());
 	*_assoDev = lv_Node.device;
 
 	US token = random(65535); // Random number
@@ -2796,8 +3346,9 @@ BOOL SmartControllerClass::ChangeLampBrightness(UC _nodeID, UC _percentage, cons
 	BOOL rc = false;
 	//ListNode<DevStatusRow_t> *DevStatusRowPtr = SearchDevStatus(_nodeID);
 	//if (!DevStatusRowPtr) {
-		String strCmd = String::format("%d:9:%d", _nodeID, _percentage);
-		rc = theRadio.ProcessSend(strCmd, 0, subID);
+		MyMessage lv_msg;
+		theRadio.BuildBrightnessMsg(lv_msg, _nodeID, _percentage, 0, subID);
+		rc = theRadio.ProcessSend(&lv_msg);
 	//}
 	return rc;
 }
@@ -2805,8 +3356,9 @@ BOOL SmartControllerClass::ChangeLampBrightness(UC _nodeID, UC _percentage, cons
 BOOL SmartControllerClass::ChangeLampCCT(UC _nodeID, US _cct, const UC subID)
 {
 	BOOL rc = false;
-	String strCmd = String::format("%d:11:%d", _nodeID, _cct);
-	rc = theRadio.ProcessSend(strCmd, 0, subID);
+	MyMessage lv_msg;
+	theRadio.BuildCCTMsg(lv_msg, _nodeID, _cct, 0, subID);
+	rc = theRadio.ProcessSend(&lv_msg);
 	return rc;
 }
 
@@ -2817,15 +3369,22 @@ BOOL SmartControllerClass::ChangeBR_RGB(UC _nodeID,UC _br,  US _rgb, const UC su
 	UC r = (rgb>>4);
 	UC g = ((rgb>>2) & 0x000000FF);
 	UC b = (rgb & 0x000000FF);
-	String strCmd = String::format("%d:13:%d:0:%d:%d:%d", _nodeID,_br, r,g,b);
-	rc = theRadio.ProcessSend(strCmd, 0, subID);
+	MyMessage lv_msg;
+	theRadio.BuildBrWRGBMsg(lv_msg, _nodeID, _br, 0, r, g, b, 0, subID);
+	rc = theRadio.ProcessSend(&lv_msg);
 	return rc;
 }
 
 BOOL SmartControllerClass::ChangeBR_CCT(UC _nodeID, UC _br, US _cct, const UC subID)
 {
-	String strCmd = String::format("%d:13:%d:%d", _nodeID, _br, _cct);
-	return theRadio.ProcessSend(strCmd, 0, subID);
+	MyMessage lv_msg;
+	if( _cct < 256 ) {
+		// Small value is taken as white channel
+		theRadio.BuildBrWRGBMsg(lv_msg, _nodeID, _br, _cct, 0, 0, 0, 0, subID);
+	} else {
+		theRadio.BuildBrCCTMsg(lv_msg, _nodeID, _br, _cct, 0, subID);
+	}
+	return theRadio.ProcessSend(&lv_msg);
 }
 
 BOOL SmartControllerClass::ChangeLampScenario(UC _nodeID, UC _scenarioID, UC _replyTo, const UC _sensor)
@@ -2833,10 +3392,20 @@ BOOL SmartControllerClass::ChangeLampScenario(UC _nodeID, UC _scenarioID, UC _re
 	BOOL _findIt = false;
 	if( _nodeID < 255 || _scenarioID < 64 ) {
 		// Find node object
-		ListNode<DevStatusRow_t> *DevStatusRowPtr = SearchDevStatus(_nodeID);
-		if (DevStatusRowPtr == NULL)
-		{
-			LOGW(LOGTAG_MSG, "Failed to execte CMD_SCENARIO, wrong node_id %d", _nodeID);
+		ListNode<DevStatusRow_t> *DevStatusRowPtr = NULL;
+		const UC *pMembers = NULL;
+		if( IS_GROUP_NODEID(_nodeID) && theConfig.GetGroupSize(_nodeID) > 0 ) {
+			pMembers = theConfig.GetGroupMembers(_nodeID);
+			// Group frame is built for the type of the first known member
+			for( UC _nid = 0; _nid <= NODEID_MAX_DEVCIE && !DevStatusRowPtr; _nid++ ) {
+				if( theConfig.IsGroupMember(_nodeID, _nid) ) DevStatusRowPtr = SearchDevStatus(_nid);
+			}
+		} else {
+			DevStatusRowPtr = SearchDevStatus(_nodeID);
+			if (DevStatusRowPtr == NULL)
+			{
+				LOGW(LOGTAG_MSG, "Failed to execte CMD_SCENARIO, wrong node_id %d", _nodeID);
+			}
 		}
 
 		// Find hue data of the 3 rings
@@ -2844,44 +3413,22 @@ BOOL SmartControllerClass::ChangeLampScenario(UC _nodeID, UC _scenarioID, UC _re
 		if (rowptr)
 		{
 			_findIt = true;
-			String strCmd;
-			if( rowptr->data.sw != DEVICE_SW_DUMMY ) {
-				strCmd = String::format("%d:7:%d", _nodeID, rowptr->data.sw);
-				theRadio.ProcessSend(strCmd, _replyTo, _sensor);
-			} else {
-				UC lv_type = devtypCRing3;
-				if( DevStatusRowPtr ) lv_type = DevStatusRowPtr->data.type;
-				if(IS_SUNNY(lv_type)) {
-					if( rowptr->data.ring[0].State == DEVICE_SW_OFF ) {
-						strCmd = String::format("%d:7:0", _nodeID);
-					} else {
-						strCmd = String::format("%d:13:%d:%d", _nodeID, rowptr->data.ring[0].BR, rowptr->data.ring[0].CCT);
-					}
-					theRadio.ProcessSend(strCmd, _replyTo, _sensor);
-				} else { // Rainbow and Migrage
-					MyMessage tmpMsg;
-					UC payl_buf[MAX_PAYLOAD];
-					UC payl_len;
-
-					// All rings same settings
-					bool bAllRings = (rowptr->data.ring[1].CCT == 256);
-
-					for( UC idx = 0; idx < MAX_RING_NUM; idx++ ) {
-						if( !bAllRings || idx == 0 ) {
-							payl_len = CreateColorPayload(payl_buf, bAllRings ? RING_ID_ALL : idx + 1, rowptr->data.ring[idx].State,
-													rowptr->data.ring[idx].BR, rowptr->data.ring[idx].CCT % 256, rowptr->data.ring[idx].R, rowptr->data.ring[idx].G, rowptr->data.ring[idx].B);
-							tmpMsg.build(_replyTo, _nodeID, _sensor, C_SET, V_RGBW, true);
-							tmpMsg.set((void *)payl_buf, payl_len);
-							theRadio.ProcessSend(&tmpMsg);
-						}
-						if( IS_MIRAGE(lv_type) ) {
-							// ToDo: construct mirage message
-							//tmpMsg.build(_replyTo, _nodeID, _sensor, C_SET, V_DISTANCE, true);
-							//tmpMsg.set((void *)payl_buf, payl_len);
-							//theRadio.ProcessSend(&tmpMsg);
+			UC lv_type = devtypCRing3;
+			if( DevStatusRowPtr ) lv_type = DevStatusRowPtr->data.type;
+			SendScenarioFrames(_nodeID, rowptr, lv_type, _replyTo, _sensor);
+			if( pMembers ) {
+				// Members of the other lamp family can't take the group frame
+				if( rowptr->data.sw == DEVICE_SW_DUMMY ) {
+					ListNode<DevStatusRow_t> *pMember;
+					for( UC _nid = 0; _nid <= NODEID_MAX_DEVCIE; _nid++ ) {
+						if( !theConfig.IsGroupMember(_nodeID, _nid) ) continue;
+						pMember = SearchDevStatus(_nid);
+						if( pMember && IS_SUNNY(pMember->data.type) != IS_SUNNY(lv_type) ) {
+							SendScenarioFrames(_nid, rowptr, pMember->data.type, _replyTo, _sensor);
 						}
 					}
 				}
+				Group_cmds.start(_nodeID, _scenarioID, pMembers, millis(), _replyTo, _sensor);
 			}
 			rowptr->data.run_flag = EXECUTED;
 			theConfig.SetSNTChanged(true);
@@ -2899,11 +3446,76 @@ BOOL SmartControllerClass::ChangeLampScenario(UC _nodeID, UC _scenarioID, UC _re
 	return _findIt;
 }
 
+// Build and queue the frames of a scenario to a lamp or lamp group
+void SmartControllerClass::SendScenarioFrames(UC _nodeID, ListNode<ScenarioRow_t> *rowptr, UC _lampType, UC _replyTo, const UC _sensor)
+{
+	MyMessage lv_msg;
+	if( rowptr->data.sw != DEVICE_SW_DUMMY ) {
+		theRadio.BuildSwitchMsg(lv_msg, _nodeID, rowptr->data.sw, _replyTo, _sensor);
+		theRadio.ProcessSend(&lv_msg);
+	} else if(IS_SUNNY(_lampType)) {
+		if( rowptr->data.ring[0].State == DEVICE_SW_OFF ) {
+			theRadio.BuildSwitchMsg(lv_msg, _nodeID, DEVICE_SW_OFF, _replyTo, _sensor);
+		} else if( rowptr->data.ring[0].CCT < 256 ) {
+			// Small value is taken as white channel
+			theRadio.BuildBrWRGBMsg(lv_msg, _nodeID, rowptr->data.ring[0].BR, rowptr->data.ring[0].CCT, 0, 0, 0, _replyTo, _sensor);
+		} else {
+			theRadio.BuildBrCCTMsg(lv_msg, _nodeID, rowptr->data.ring[0].BR, rowptr->data.ring[0].CCT, _replyTo, _sensor);
+		}
+		theRadio.ProcessSend(&lv_msg);
+	} else { // Rainbow and Migrage
+		UC payl_buf[MAX_PAYLOAD];
+		UC payl_len;
+
+		// All rings same settings
+		bool bAllRings = (rowptr->data.ring[1].CCT == 256);
+
+		for( UC idx = 0; idx < MAX_RING_NUM; idx++ ) {
+			if( !bAllRings || idx == 0 ) {
+				payl_len = CreateColorPayload(payl_buf, bAllRings ? RING_ID_ALL : idx + 1, rowptr->data.ring[idx].State,
+										rowptr->data.ring[idx].BR, rowptr->data.ring[idx].CCT % 256, rowptr->data.ring[idx].R, rowptr->data.ring[idx].G, rowptr->data.ring[idx].B);
+				lv_msg.build(_replyTo, _nodeID, _sensor, C_SET, V_RGBW, true);
+				lv_msg.set((void *)payl_buf, payl_len);
+				theRadio.ProcessSend(&lv_msg);
+			}
+			if( IS_MIRAGE(_lampType) ) {
+				// ToDo: construct mirage message
+				//lv_msg.build(_replyTo, _nodeID, _sensor, C_SET, V_DISTANCE, true);
+				//lv_msg.set((void *)payl_buf, payl_len);
+				//theRadio.ProcessSend(&lv_msg);
+			}
+		}
+	}
+}
+
+// Retry group scenario on members that did not confirm within the ack window
+void SmartControllerClass::ProcessGroupCmds()
+{
+	GroupCmd_t *pCmd;
+	while( (pCmd = Group_cmds.due(millis(), RTE_GROUP_ACK_TIMEOUT)) != NULL ) {
+		ListNode<ScenarioRow_t> *rowptr = SearchScenario(pCmd->scenario);
+		if( !rowptr || pCmd->retries >= RTE_GROUP_MAX_RETRY ) {
+			LOGW(LOGTAG_MSG, "Group %d scenario %d: %d members not confirmed", pCmd->group, pCmd->scenario, Group_cmds.countPending(pCmd));
+			Group_cmds.finish(pCmd, false);
+			continue;
+		}
+		pCmd->retries++;
+		pCmd->tickSent = millis();
+		ListNode<DevStatusRow_t> *pMember;
+		for( int _nid = Group_cmds.nextPending(pCmd); _nid >= 0; _nid = Group_cmds.nextPending(pCmd, _nid + 1) ) {
+			pMember = SearchDevStatus(_nid);
+			SendScenarioFrames(_nid, rowptr, pMember ? pMember->data.type : devtypCRing3, pCmd->replyTo, pCmd->sensor);
+			Group_cmds.m_nRetried++;
+		}
+	}
+}
+
 BOOL SmartControllerClass::RequestDeviceStatus(UC _nodeID, const UC subID)
 {
 	BOOL rc = false;
-	String strCmd = String::format("%d:12:%d", _nodeID);
-	rc = theRadio.ProcessSend(strCmd, 0, subID);
+	MyMessage lv_msg;
+	theRadio.BuildStatusReqMsg(lv_msg, _nodeID, 0, subID);
+	rc = theRadio.ProcessSend(&lv_msg);
 	return rc;
 }
 
@@ -3174,20 +3786,13 @@ BOOL SmartControllerClass::ConfirmLampPresent(ListNode<DevStatusRow_t> *pDev, bo
 	if( pDev ) {
 		if( _up ) {
 			// Update keepalive timer
-			NodeIdRow_t lv_Node;
-			lv_Node.nid = pDev->data.node_id;
-			if( theConfig.lstNodes.get(&lv_Node) >= 0 ) {
-				// Update timestamp
-				lv_Node.recentActive = Time.now();
-				theConfig.lstNodes.update(&lv_Node);
-			}
+			theConfig.lstNodes.touchNode(pDev->data.node_id, Time.now());
 		}
 		if( pDev->data.present != _up ) {
 			pDev->data.present = _up;
 			pDev->data.run_flag = EXECUTED;
 			pDev->data.flash_flag = UNSAVED;
 			pDev->data.op_flag = POST;
-			theConfig.SetNIDChanged(true);
 			theConfig.SetDSTChanged(true);
 
 			// Publish device status event
@@ -3254,8 +3859,9 @@ BOOL SmartControllerClass::QueryDeviceStatus(UC _nodeID, UC _ringID)
 
 BOOL SmartControllerClass::RebootNode(UC _nodeID, const UC subID)
 {
-	String strCmd = String::format("%d:1", _nodeID);
-	return theRadio.ProcessSend(strCmd, 0, subID);
+	MyMessage lv_msg;
+	if( !theRadio.BuildRebootMsg(lv_msg, _nodeID, 0, subID) ) return false;
+	return theRadio.ProcessSend(&lv_msg);
 }
 
 BOOL SmartControllerClass::IsAllRingHueSame(ListNode<DevStatusRow_t> *pDev)
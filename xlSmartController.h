@@ -8,6 +8,7 @@
 #include "xlxConfig.h"
 #include "xlxChain.h"
 #include "MyMessage.h"
+#include "DataQueue.h"
 
 //------------------------------------------------------------------
 // Xlight Command Queue Structures
@@ -15,6 +16,208 @@
 
 //ToDo: Create command queue
 
+//------------------------------------------------------------------
+// Xlight Working Memory Tables
+//------------------------------------------------------------------
+typedef ChainClass<DevStatusRow_t, ListStaticPool<DevStatusRow_t, MAX_DEVICE_PER_CONTROLLER>, true> DevStatusChain_t;
+typedef ChainClass<ScheduleRow_t, ListStaticPool<ScheduleRow_t, MAX_TABLE_SIZE> > ScheduleChain_t;
+typedef ChainClass<ScenarioRow_t, ListStaticPool<ScenarioRow_t, MAX_TABLE_SIZE> > ScenarioChain_t;
+typedef ChainClass<RuleRow_t, ListStaticPool<RuleRow_t, MAX_RULE_TABLE_SIZE> > RuleChain_t;
+
+//------------------------------------------------------------------
+// Rule Index: sensor id -> rules whose conditions refer to the sensor,
+// and the compiled predicate of each rule
+//------------------------------------------------------------------
+#define RULE_INDEX_SENSORS          16        // Condition_t.sr_id is 4 bits
+#define RULE_INDEX_BYTES            ((MAX_RULE_TABLE_SIZE + 7) / 8)
+
+#define RULE_EDGE_STATES            64        // (rule, node) pairs holding edge state
+#define RULE_EDGE_FREE              0xFFFF
+
+#if MAX_CONDITION_PER_RULE > 3
+#error "RulePredicate_t::nConds holds up to 3 conditions"
+#endif
+
+// Compiled condition, op is index of rule operator table (SR_SYM_*)
+typedef struct
+{
+  UC sr_id                 : 4;
+  UC sr_scope              : 3;
+  UC op                    : 4;
+  UC connector             : 2;
+  UC hyst;                         // Hysteresis of BW/NB band
+  US lo;
+  US hi;
+} RuleCond_t;
+
+// Compiled rule predicate
+typedef struct
+{
+  UC nConds                : 2;    // Conditions up to the first disabled one
+  RuleCond_t cond[MAX_CONDITION_PER_RULE];
+} RulePredicate_t;
+
+// Edge state of a rule for one node, slots are reused round-robin when full
+typedef struct
+{
+  US slot;                         // Rule pool slot, RULE_EDGE_FREE if unused
+  UC nd;
+  UC valid                 : 1;    // Whether last is known
+  UC last                  : 1;    // Result of last evaluation
+  UC condLast              : MAX_CONDITION_PER_RULE;  // Last result per condition, for hysteresis
+} RuleEdge_t;
+
+class RuleIndexClass
+{
+public:
+  RuleIndexClass() { clear(); }
+
+  void clear();
+  void update(US slot, const RuleRow_t &row);   // Recompile the rule at pool slot
+  void remove(US slot);
+  int next(UC _sr, int from = 0);               // First slot >= from referring to sensor, -1 if none
+  US count(UC _sr);
+  RulePredicate_t *predicate(US slot) { return(slot < MAX_RULE_TABLE_SIZE ? &m_pred[slot] : NULL); }
+  RuleEdge_t *edge(US slot, UC nd);             // Edge state of (rule, node), allocated on first use
+
+private:
+  // One bitmap of rule pool slots per sensor
+  UC m_bits[RULE_INDEX_SENSORS][RULE_INDEX_BYTES];
+  RulePredicate_t m_pred[MAX_RULE_TABLE_SIZE];
+  RuleEdge_t m_edge[RULE_EDGE_STATES];
+  UC m_edgeNext;                                // Next slot to reuse
+};
+
+
+//------------------------------------------------------------------
+// Button Events: recorded by the system timer ISR, acted on by the main loop
+//------------------------------------------------------------------
+typedef struct
+{
+  UC btn;                          // Ext. button index
+  int8_t clicks;                   // 1: click, 2: double-click, -1: long-click
+  UL tick;                         // When the edge was debounced
+} BtnEvent_t;
+
+typedef CFrameQueue<BtnEvent_t, BTN_EVENT_QUEUE_SIZE> BtnEventQueue_t;
+
+//------------------------------------------------------------------
+// Group Commands: one frame to the group address, members that did not
+// confirm within the ack window are retried by unicast
+//------------------------------------------------------------------
+typedef struct
+{
+  UC group;                        // Group NodeID, 0 if slot is free
+  UC scenario;
+  UC replyTo;
+  UC sensor;
+  UC retries;                      // Unicast rounds done
+  UL tickSent;                     // When the last round was sent
+  UC pending[GROUP_MEMBER_BYTES];  // Members yet to confirm
+} GroupCmd_t;
+
+class GroupCmdClass
+{
+public:
+  GroupCmdClass() { clear(); }
+
+  void clear();
+  GroupCmd_t *start(UC _gid, UC _scenario, const UC *_members, UL _now, UC _replyTo = 0, UC _sensor = 0);
+  UC confirm(UC _nid);                          // Clear member in all commands, return commands affected
+  GroupCmd_t *due(UL _now, UL _timeout);        // Next command whose ack window elapsed, or NULL
+  int nextPending(const GroupCmd_t *pCmd, int from = 0);
+  UC countPending(const GroupCmd_t *pCmd);
+  UC active();
+  void finish(GroupCmd_t *pCmd, bool _ok);
+
+  // Statistics
+  UL m_nStarted;
+  UL m_nCompleted;
+  UL m_nRetried;                   // Unicast retries sent
+  UL m_nFailed;
+
+private:
+  GroupCmd_t m_cmd[GROUP_CMD_SLOTS];
+};
+
+//------------------------------------------------------------------
+// Main Loop: waits until an event source has work, an alarm is due or
+// the next self-check, and keeps histograms of its latency
+//------------------------------------------------------------------
+#define WAKE_RF                     0x01
+#define WAKE_SERIAL                 0x02
+#define WAKE_BLE                    0x04
+#define WAKE_ASR                    0x08
+#define WAKE_CLOUD                  0x10
+#define WAKE_PANEL                  0x20
+#define WAKE_ALARM                  0x40
+#define WAKE_TICK                   0x80
+#define WAKE_NUM                    8
+
+// Log2 buckets: bucket n counts samples below 2^(n+1) us, the last one the rest
+#define LOOP_HIST_BUCKETS           20
+
+class LoopHistClass
+{
+public:
+  LoopHistClass() { clear(); }
+
+  void clear();
+  void add(UL _us);
+  UL percentile(UC _pct);                       // Upper bound in us of the bucket holding the percentile
+  void print(const char *_name);
+
+  UL m_nSamples;
+  UL m_maxUs;
+
+private:
+  UL m_count[LOOP_HIST_BUCKETS];
+};
+
+//------------------------------------------------------------------
+// Performance Profile: histograms of main loop stages and of RF message
+// handlers by command/type, in fixed memory
+//------------------------------------------------------------------
+#define PERF_STG_COMMANDS           0
+#define PERF_STG_COLLECT            1
+#define PERF_STG_RULES              2
+#define PERF_STG_PANEL              3
+#define PERF_STG_SELFCHECK          4
+#define PERF_STG_CLOUD              5
+#define PERF_STG_NUM                6
+
+#define PERF_MSG_SLOTS              10        // Command/type pairs, the last slot takes all others
+#define PERF_MSG_OTHER              0xFFFF
+
+typedef struct
+{
+  US key;                          // (command << 8) | type, PERF_MSG_OTHER for the shared slot
+  LoopHistClass hist;
+} PerfMsgSlot_t;
+
+class PerfStatClass
+{
+public:
+  PerfStatClass() { clear(); }
+
+  void clear();
+  void addStage(UC _stage, UL _us);
+  void addMessage(UC _cmd, UC _type, UL _us);
+  void addLoopGap(UL _ms);                      // Time between two loop starts
+  LoopHistClass *stage(UC _stage) { return(_stage < PERF_STG_NUM ? &m_stage[_stage] : NULL); }
+  PerfMsgSlot_t *message(UC _cmd, UC _type);    // Slot of the pair, or the shared slot
+  long watchdogMargin();                        // ms left of RTE_WATCHDOG_TIMEOUT in the longest loop gap
+  US summary(char *_buf, US _size);             // Compact text of stage percentiles
+  void print();
+  static const char *stageName(UC _stage);
+
+  UL m_maxGapMs;
+
+private:
+  LoopHistClass m_stage[PERF_STG_NUM];
+  PerfMsgSlot_t m_msg[PERF_MSG_SLOTS];
+  UC m_nMsgSlots;
+};
 
 //------------------------------------------------------------------
 // Smart Controller Class
@@ -25,6 +228,25 @@ public:
   // add for button action
   uint8_t m_action[5];
   uint8_t m_actionchanged;
+
+  // Button events and system timer ISR instrumentation
+  BtnEventQueue_t m_btnEvents;
+  volatile US m_isrLastUs;
+  volatile US m_isrMaxUs;
+  volatile UL m_isrCount;
+
+  // Main loop wakeups and latency
+  volatile UC m_wakeEvents;        // Set by ISRs, taken by PollEvents()
+  UL m_nWakes[WAKE_NUM];
+  UL m_idleMs;
+  UL m_busyMs;
+  UL m_loopBusyUs;                 // Stage time of the current pass
+  UL m_tickIdle;                   // micros() of the last idle check that found nothing, 0 if none
+  UL m_tickSelfCheck;
+  LoopHistClass m_histDispatch;    // From an event to its dispatch, upper bound
+  LoopHistClass m_histBusy;        // Busy time of a loop pass
+  PerfStatClass m_perf;
+  UL m_tickLoopStart;
 private:
   BOOL m_isRF;
   BOOL m_isLAN;
@@ -52,12 +274,20 @@ public:
   UC GetStatus();
   BOOL SetStatus(UC st);
   void ResetSerialPort();
+  void PrepareReset();
   void Restart();
 
   BOOL CheckRF();
   BOOL CheckWiFi();
   BOOL CheckNetwork();
   BOOL SelfCheck(US ms);
+  UC WaitForEvent(US ms);
+  UC PollEvents();
+  void Wakeup(UC _events) { m_wakeEvents |= _events; }
+  void AddStageTime(UC _stage, UL _us) { m_loopBusyUs += _us; m_perf.addStage(_stage, _us); }
+  void showLoopStatistics();
+  void showPerformance();
+  void UpdatePerfVariable();
   BOOL CheckRFBaseNetEnableDur();
   BOOL IsRFGood();
   BOOL IsBLEGood();
@@ -90,13 +320,15 @@ public:
   // High speed system timer process
   void FastProcess();
   void ExtButtonProcess();
+  void QueueBtnEvent(UC _btn, int _clicks);
+  void ProcessBtnEvents();
 
   // Cloud interface implementation
   int CldSetTimeZone(String tzStr);
   int CldPowerSwitch(String swStr);
   int CldSetCurrentTime(String tmStr = "");
-  int ExeJSONCommand(String jsonCmd);
-  int ExeJSONConfig(String jsonData);
+  int ExeJSONCommand(const char *jsonCmd);
+  int ExeJSONConfig(const char *jsonData);
 
   // Parsing Functions
   bool ParseCmdRow(JsonObject& data);
@@ -109,14 +341,18 @@ public:
   bool Action_Rule(ListNode<RuleRow_t> *rulePtr);
   bool Action_Schedule(OP_FLAG parentFlag, UC uid, UC rule_uid);
 
+  US GetSensorData(UC _scope, UC _sr, UC _nd);
   bool Check_SensorData(UC _thisNd, UC _scope, UC _sr, UC _nd, UC _symbol, US _val1, US _val2);
+  bool Check_Predicate(const RulePredicate_t *pPred, const UC _nd, RuleEdge_t *pEdge);
   bool Execute_Rule(ListNode<RuleRow_t> *rulePtr, bool _init = false, const UC _sr = 255, const UC _nd = 0);
 
-  //LinkedLists (Working memory tables)
-  ChainClass<DevStatusRow_t> DevStatus_table = ChainClass<DevStatusRow_t>(MAX_DEVICE_PER_CONTROLLER);
-  ChainClass<ScheduleRow_t> Schedule_table = ChainClass<ScheduleRow_t>(MAX_TABLE_SIZE);
-  ChainClass<ScenarioRow_t> Scenario_table = ChainClass<ScenarioRow_t>(MAX_TABLE_SIZE);
-  ChainClass<RuleRow_t> Rule_table = ChainClass<RuleRow_t>(256); // 65536/24 is too big = (int)(MEM_RULES_LEN / sizeof(RuleRow_t))
+  //LinkedLists (Working memory tables), rows are kept in fixed pools
+  DevStatusChain_t DevStatus_table = DevStatusChain_t(MAX_DEVICE_PER_CONTROLLER, DevStatusKey); // indexed by node_id
+  ScheduleChain_t Schedule_table = ScheduleChain_t(MAX_TABLE_SIZE);
+  ScenarioChain_t Scenario_table = ScenarioChain_t(MAX_TABLE_SIZE);
+  RuleChain_t Rule_table = RuleChain_t(0); // capacity is limited by pool, 65536/24 is too big = (int)(MEM_RULES_LEN / sizeof(RuleRow_t))
+  RuleIndexClass Rule_index;    // sensor -> rules, kept by Change_Rule() and RebuildRuleIndex()
+  GroupCmdClass Group_cmds;     // Group scenario commands awaiting member confirmation
 
   //Print LinkedLists (Working memory tables)
   String print_devStatus_table(int row);
@@ -129,6 +365,11 @@ public:
   bool CreateAlarm(ListNode<ScheduleRow_t>* scheduleRow, uint32_t tag = 0);
   bool DestoryAlarm(AlarmId alarmID, UC SCT_uid);
   void OnSensorDataChanged(const UC _sr, const UC _nd);
+  void UpdateRuleIndex(ListNode<RuleRow_t> *rulePtr);
+  void RebuildRuleIndex();
+
+  // Index key of DevStatus_table
+  static UC DevStatusKey(const DevStatusRow_t &row) { return row.node_id; }
 
   // UID search functions
   ListNode<ScheduleRow_t> *SearchSchedule(UC uid);
@@ -155,6 +396,8 @@ public:
   BOOL ChangeBR_RGB(UC _nodeID,UC _br,  US _rgb, const UC subID = 0);
   BOOL ChangeBR_CCT(UC _nodeID, UC _br, US _cct, const UC subID = 0);
   BOOL ChangeLampScenario(UC _nodeID, UC _scenarioID, UC _replyTo = 0, const UC _sensor = 0);
+  void SendScenarioFrames(UC _nodeID, ListNode<ScenarioRow_t> *rowptr, UC _lampType, UC _replyTo = 0, const UC _sensor = 0);
+  void ProcessGroupCmds();
   BOOL RequestDeviceStatus(UC _nodeID, const UC subID = 0);
   BOOL ConfirmLampOnOff(UC _nodeID, UC _st);
   BOOL ConfirmLampBrightness(UC _nodeID, UC _st, UC _percentage, UC _ringID = RING_ID_ALL);
@@ -46,10 +46,11 @@
   #define IF_SERIAL_DEBUG(x)
 #endif
 
+// Stage time goes to the loop busy time and stage (PERF_STG_*) histograms, see WaitForEvent()
 #ifdef MAINLOOP_TIMER
-  #define IF_MAINLOOP_TIMER(x, name) ({unsigned long ulStart = millis(); x; SERIAL_LN("%s spent %lu ms", (name), millis() - ulStart);})
+  #define IF_MAINLOOP_TIMER(x, stage) ({unsigned long ulStart = micros(); x; ulStart = micros() - ulStart; theSys.AddStageTime((stage), ulStart); SERIAL_LN("%s spent %lu us", PerfStatClass::stageName(stage), ulStart);})
 #else
-  #define IF_MAINLOOP_TIMER(x, name) ({x;})
+  #define IF_MAINLOOP_TIMER(x, stage) ({unsigned long ulStart = micros(); x; theSys.AddStageTime((stage), micros() - ulStart);})
 #endif
 
 // Main Version. Must change if Config_t structure is updated
@@ -67,7 +68,10 @@
 // Running Time Environment Parameters
 #define RTE_DELAY_PUBLISH         60          // Maximum publish data refresh time in seconds
 #define RTE_DELAY_SYSTIMER        500        // System Timer interval, can be very fast, e.g. 50 means 25ms
-#define RTE_DELAY_SELFCHECK       100         // Self-check interval
+#define RTE_DELAY_SELFCHECK       100         // Self-check interval, also the longest idle wait of main loop
+#define RTE_IDLE_POLL_MS          1           // Pace of polling event sources while main loop is idle (latency, not power)
+#define RTE_SENSOR_PUB_WINDOW     5000        // Sensor updates are collected for this long (ms) before publishing
+#define RTE_SENSOR_PUB_INTERVAL   1000        // Minimum interval between sensor events (ms)
 #define RTE_CLOUD_CONN_TIMEOUT    3500        // Timeout for connecting to the Cloud
 #define RTE_WIFI_CONN_TIMEOUT     30000       // Timeout for attempting to connect WIFI
 #define RTE_WATCHDOG_TIMEOUT      30000       // Maxium WD feed duration
@@ -79,6 +83,9 @@
 // Keep alive message timeout
 #define RTE_TM_KEEP_ALIVE         16
 
+// Node activity is kept in RAM and saved with the node list at most once per interval (seconds)
+#define RTE_TM_NODE_CHECKPOINT    3600
+
 // Panel Operarion Timers
 #define RTE_TM_MAX_CCT_IDLE       6           // Maximum idle time (seconds) in CCT control mode
 #define RTE_TM_HELD_TO_DFU        30          // Held duration threshold for DFU
@@ -87,9 +94,16 @@
 #define RTE_TM_HELD_TO_BASENW     5           // Held duration threshold to enable Base Network
 #define RTE_TM_LOOP_KEYCODE       3           // Max idle time of changing loop keycode
 
+// Panel encoder streaming: latest dimmer / CCT value is sent at most once per frame
+#define RTE_STREAM_FRAME_RATE     10          // Frames per second, 0 sends on every detent
+#define RTE_STREAM_SETTLE_MS      400         // Knob idle time before the final settle frame, 0 disables
+
 // Maximum number of rows for any working memory table implimented using ChainClass
 #define MAX_TABLE_SIZE              8
 
+// Maximum number of rows of rule table in working memory
+#define MAX_RULE_TABLE_SIZE         256
+
 // Maximum number of device associated to one controller
 #if XLIGHT_EDITION_ID == XLIGHT_HOME_EDITION
 #define MAX_DEVICE_PER_CONTROLLER   8
@@ -107,6 +121,15 @@
 // Maximum conditions within a rule
 #define MAX_CONDITION_PER_RULE      2
 
+// Hysteresis of between / not-between rule conditions: band width >> shift, at least 1
+#define RULE_HYSTERESIS_SHIFT       3
+
+// Flash write-back journal
+#define JOURNAL_TARGET_EEPROM       0           // Device status / schedule / node list rows
+#define JOURNAL_TARGET_P1FLASH      1           // Rule / scenario / group / node list backup rows
+#define JOURNAL_IDLE_WINDOW         2000        // Commit once table edits paused for (ms)
+#define JOURNAL_FLUSH_BUDGET        20          // Max loop time spent on flash per flush (ms)
+
 // Default value for maxBaseNetworkDuration (in seconds)
 #define MAX_BASE_NETWORK_DUR    180
 
@@ -123,13 +146,36 @@
 #define MQ_MAX_RF_SNDMSG        12
 #endif
 
-// Maximum Cloud Command messages buffered
+// External button events buffered between system timer ISR and main loop
+#define BTN_EVENT_QUEUE_SIZE    8
+
+// RF send retry: first retry delay in ms, doubled on each attempt up to the max
+#define RTE_RF_RETRY_BASE_MS    20
+#define RTE_RF_RETRY_MAX_MS     1000
+
+// Due frames to one destination sent per TX burst, bounds the time the radio is not listening
+#define RF_BURST_MAX_FRAMES     6
+
+// Maximum Cloud Command messages buffered, and bytes of the ring holding them
 #if XLIGHT_EDITION_ID == XLIGHT_HOME_EDITION
 #define MQ_MAX_CLOUD_MSG        5
+#define MQ_CLOUD_RING_SIZE      512
 #else
 #define MQ_MAX_CLOUD_MSG        12
+#define MQ_CLOUD_RING_SIZE      1024
 #endif
 
+// Pending sensor values held by the publish aggregator
+#define SENSOR_PUB_SLOTS        64
+
+// Node rows of the sensor state table, the controller itself takes one
+#define SENSOR_STATE_ROWS       (MAX_NODE_PER_CONTROLLER + 1)
+// Field values of the sensor state table, shared by all rows (4 per node on average)
+#define SENSOR_STATE_CELLS      (SENSOR_STATE_ROWS * 4)
+
+// Longest command accepted into the ring
+#define MQ_CLOUD_MSG_MAX_LEN    255
+
 // NodeID Convention
 #define NODEID_GATEWAY          0
 #define NODEID_MAINDEVICE       1
@@ -146,6 +192,13 @@
 #define NODEID_RF_SCANNER       250
 #define NODEID_DUMMY            255
 
+// Lamp groups: membership bitmap covers lamp NodeIDs
+#define MAX_GROUP_NUM           (NODEID_MAX_GROUP - NODEID_MIN_GROUP + 1)
+#define GROUP_MEMBER_BYTES      ((NODEID_MAX_DEVCIE + 8) / 8)
+#define GROUP_CMD_SLOTS         4           // Group commands awaiting member confirmation
+#define RTE_GROUP_ACK_TIMEOUT   150         // Time (ms) to wait for member confirmation
+#define RTE_GROUP_MAX_RETRY     2           // Unicast retry rounds for unconfirmed members
+
 #define BR_MIN_VALUE            1
 #define CT_MIN_VALUE            2700
 #define CT_MAX_VALUE            6500